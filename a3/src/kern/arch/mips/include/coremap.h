@@ -20,12 +20,20 @@ struct lpage;
 /* MMU control */
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
+void mmu_unmapall(struct addrspace *as);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+void mmu_setasids(int on);
+void mmu_setfastrefill(int on);
+void mmu_getstats(u_int32_t *refills, u_int32_t *fastrefills,
+		  u_int32_t *switches, u_int32_t *flushes);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
 void coremap_free(paddr_t page, int iskern);
 
+/* pageout daemon; started by swap_bootstrap */
+void coremap_start_pageout(void);
+
 /* physical page pinning */
 void coremap_pin(paddr_t paddr);
 int coremap_pageispinned(paddr_t paddr);
@@ -56,6 +64,7 @@ void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
  */
 void coremap_bootstrap(void);
 void coremap_print_short(void);
+void coremap_printstats(void);
 void coremap_print_long(void);
 
 #endif /* _MIPS_COREMAP_H_ */
@@ -0,0 +1,22 @@
+#ifndef _MIPS_HPT_H_
+#define _MIPS_HPT_H_
+
+/*
+ * Hashed page table layout, shared by coremap.c and the TLB refill
+ * handler in exception.S. (So no C in here.)
+ *
+ * The table is an array of HPT_SIZE two-word entries: the EntryHi
+ * value (page and ASID) being translated, and the EntryLo to load
+ * for it. An entry goes in the bucket HPT_HASH picks for its EntryHi.
+ */
+
+#define HPT_SIZE       1024		/* entries; must be a power of 2 */
+#define HPT_ENTRYSIZE  8		/* bytes per entry */
+
+/* EntryHi of an empty entry; no user page can miss with this */
+#define HPT_NOTAG      0x80000000
+
+/* Bucket for an EntryHi: the page number, with the ASID mixed in */
+#define HPT_HASH(ehi)  ((((ehi) >> 12) ^ ((ehi) >> 2)) & (HPT_SIZE-1))
+
+#endif /* _MIPS_HPT_H_ */
@@ -15,10 +15,14 @@
  *   TLB_Read: read a TLB entry out of the TLB into ENTRYHI and ENTRYLO.
  *        INDEX specifies which one to get.
  *
- *   TLB_Probe: look for an entry matching the virtual page in ENTRYHI.
- *        Returns the index, or a negative number if no matching entry
- *        was found. ENTRYLO is not actually used, but must be set; 0
- *        should be passed.
+ *   TLB_Probe: look for an entry matching the virtual page and
+ *        address space ID in ENTRYHI. Returns the index, or a negative
+ *        number if no matching entry was found. ENTRYLO is not actually
+ *        used, but must be set; 0 should be passed.
+ *
+ *   TLB_SetPID: set the address space ID that translations are looked
+ *        up with. ENTRYHI holds it in the TLBHI_PID field; the other
+ *        bits are ignored. The other functions leave it alone.
  *
  *        IMPORTANT NOTE: An entry may be matching even if the valid bit 
  *        is not set. To completely invalidate the TLB, load it with
@@ -30,13 +34,15 @@ void TLB_Random(u_int32_t entryhi, u_int32_t entrylo);
 void TLB_Write(u_int32_t entryhi, u_int32_t entrylo, u_int32_t index);
 void TLB_Read(u_int32_t *entryhi, u_int32_t *entrylo, u_int32_t index);
 int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
+void TLB_SetPID(u_int32_t entryhi);
 
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
+ * Note that the MIPS has support for a 6-bit address space ID. An
+ * entry only matches while the current ID (see TLB_SetPID) is the one
+ * in its TLBHI_PID field, unless TLBLO_GLOBAL is set. We don't use
+ * global entries; TLBLO_GLOBAL can be left always zero, as can the
  * bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
@@ -49,7 +55,8 @@ int TLB_Probe(u_int32_t entryhi, u_int32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
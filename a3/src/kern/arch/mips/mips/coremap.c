@@ -7,9 +7,11 @@
 #include <machine/coremap.h>
 #include <machine/spl.h>
 #include <machine/tlb.h>
+#include <machine/hpt.h>
 #include <array.h>
 #include <thread.h>
 #include <curthread.h>
+#include <clock.h>
 #include <vfs.h>
 #include <vnode.h>
 #include <kern/stat.h>
@@ -24,9 +26,9 @@
  * MIPS coremap/MMU-control implementation.
  *
  * The MIPS has a completely software-refilled TLB. It doesn't define
- * hardware-level pagetables. Thus, for simplicity, we won't use any.
- * (In real life, one might anyway, to allow faster TLB refill
- * handling.)
+ * hardware-level pagetables. We keep a hashed table of resident
+ * translations anyway, so that the refill handler can reload the TLB
+ * without going through vm_fault (see "Hashed page table" below).
  *
  * We have one coremap_entry per page of physical RAM. This is absolute
  * overhead, so it's important to keep it small - if it's overweight
@@ -40,6 +42,25 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * Free page watermarks for the pageout daemon. When an allocation
+ * leaves fewer than CM_FREE_LOW pages free, the daemon is kicked, and
+ * it evicts pages until CM_FREE_HIGH are free. Each time round it also
+ * writes out up to CM_CLEAN_BATCH dirty pages among the CM_CLEAN_SCAN
+ * the clock hand will reach next, so that the pages evicted next are
+ * mostly clean. Besides being kicked it runs once a second.
+ */
+#define CM_FREE_LOW		CM_MIN_SLACK
+#define CM_FREE_HIGH		(2*CM_MIN_SLACK)
+#define CM_CLEAN_BATCH		8
+#define CM_CLEAN_SCAN		32
+
+/*
+ * Largest block on the free lists is 2^CM_MAXORDER pages (4M). Bigger
+ * kernel allocations fall back to a search of the coremap.
+ */
+#define CM_MAXORDER		10
+
 
 /*
  * Coremap entry structure.
@@ -49,14 +70,17 @@ struct coremap_entry {
 	struct lpage *cm_lp;	/* logical page we hold, or NULL */
 
 	int cm_tlbix:7;		/* tlb index number, or -1 */
+	int cm_hptix:11;	/* hashed page table index, or -1 */
+				/* (both always -1 for kernel pages) */
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
 		cm_allocated:1;	/* true if page in use (user or kernel) */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
-
-	// might want to add something to support ASST2 LRU
+	unsigned cm_referenced:1; /* true if used since the clock hand passed */
+	unsigned cm_freehead:1,	/* true if first page of a free block */
+		cm_order:4;	/* if so, the block is 2^cm_order pages */
 };
 
 #define COREMAP_TO_PADDR(i)	(((paddr_t)PAGE_SIZE)*((i)+base_coremap_page))
@@ -74,11 +98,130 @@ static u_int32_t num_coremap_free;	/* pages not allocated at all */
 static u_int32_t base_coremap_page;
 static struct coremap_entry *coremap;
 
-// might want to add something to support ASST2 LRU
+/* next coremap entry the clock hand looks at */
+static u_int32_t clock_hand;
+
+/*
+ * Clock statistics.
+ *
+ * The MIPS TLB has no referenced bit, so we keep one in the coremap.
+ * It is set whenever a page is entered into the TLB. When the hand
+ * passes a referenced page it clears the bit and throws away the TLB
+ * entry, so if the page is still in use it faults straight back in
+ * (a minor fault) and gets the bit set again.
+ *
+ * The number of pages found referenced during the last full turn of
+ * the hand is an estimate of the combined working set of the running
+ * processes.
+ */
+static u_int32_t ct_clock_scanned;	/* entries the hand has looked at */
+static u_int32_t ct_clock_cleared;	/* referenced bits cleared */
+static u_int32_t ct_clock_sweeps;	/* full turns of the hand */
+static u_int32_t ct_clock_reffaults;	/* faults on pages it unmapped */
+static u_int32_t clock_sweep_refs;	/* referenced pages this turn */
+static u_int32_t clock_wss;		/* referenced pages last turn */
+
+/* pageout daemon state and statistics */
+static int pageout_running;		/* true once the daemon is started */
+static int pageout_kick;		/* true if woken for low memory; the
+				   daemon sleeps on its address */
+static u_int32_t ct_pageout_runs;	/* times the daemon went round */
+static u_int32_t ct_pageout_evictions;	/* pages evicted by the daemon */
+static u_int32_t ct_pageout_cleans;	/* pages cleaned by the daemon */
+static u_int32_t ct_sync_evictions;	/* pages evicted by an allocation */
+static u_int32_t ct_clustered;		/* neighbours written with a page */
+
+/*
+ * Free lists.
+ *
+ * Free pages are kept in blocks of 2^k pages, aligned on 2^k pages
+ * (counting from the first coremap entry), on a list for each k. A
+ * block that is freed goes back together with its buddy (the other
+ * half of the block of twice the size) if that is free too, and so on
+ * up; an allocation takes the smallest block big enough and splits it.
+ *
+ * A page is on the free lists if it is neither allocated nor pinned.
+ * A page freed while pinned goes on when it is unpinned, and a free
+ * page that is pinned comes off (buddy_take).
+ *
+ * The lists are doubly linked through the free pages themselves; each
+ * block's first page holds a struct buddy_link. Entries are coremap
+ * indexes, -1 for none.
+ */
+struct buddy_link {
+	int bl_next;
+	int bl_prev;
+};
+
+#define BUDDY_LINK(ix)	((struct buddy_link *) \
+			 PADDR_TO_KVADDR(COREMAP_TO_PADDR(ix)))
+
+static int buddy_lists[CM_MAXORDER+1];
+static u_int32_t buddy_nblocks[CM_MAXORDER+1];
+
+static u_int32_t ct_buddy_allocs;	/* allocations off the free lists */
+static u_int32_t ct_buddy_splits;	/* blocks split in two */
+static u_int32_t ct_buddy_merges;	/* blocks joined with their buddy */
+static u_int32_t ct_buddy_searches;	/* multipage allocations searched for */
 
 /* if < NUM_TLB, next TLB entry to use (when TLB not yet full) */
 static u_int32_t nexttlb;
 
+/*
+ * Address space IDs.
+ *
+ * TLB entries are tagged with the ASID of their address space, so
+ * switching address spaces does not have to flush the TLB. An address
+ * space is handed the next free ASID the first time it runs in each
+ * generation. When they run out, a new generation starts: the TLB is
+ * flushed and each address space gets a new ASID when it next runs.
+ * ASID 0 is never handed out; it goes with no address space.
+ *
+ * With mmu_useasids off, every switch starts a new generation, which
+ * is the same as flushing the TLB on every switch.
+ */
+#define NUM_ASID	64
+
+static int mmu_useasids = 1;
+static u_int32_t asid_generation = 1;
+static u_int32_t asid_next = 1;		/* next ASID to hand out */
+static u_int32_t curasid;		/* ASID of lastas */
+
+static u_int32_t ct_tlb_refills;	/* translations entered by mmu_map */
+static u_int32_t ct_tlb_switches;	/* address space switches */
+static u_int32_t ct_tlb_flushes;	/* whole-TLB flushes */
+
+/*
+ * Hashed page table.
+ *
+ * Translations of resident pages are kept in a table hashed on their
+ * EntryHi (page and ASID), and a TLB miss that finds its translation
+ * there is handled by the refill handler in exception.S without going
+ * through vm_fault. It is one table for all address spaces, tagged
+ * with ASIDs like the TLB and flushed along with it. Each bucket holds
+ * one entry; a collision throws out the older one.
+ *
+ * Entries are put in by mmu_map, so a page gets in after its first
+ * fault. A page is in at most one entry, whose index is in cm_hptix.
+ * Any TLB entry for the page is either that entry's, loaded by the
+ * refill handler, or the one in cm_tlbix, loaded by mmu_map; so both
+ * have to go when the page is unmapped (see page_unmap).
+ *
+ * The refill handler doesn't set cm_referenced, so the clock takes
+ * pages it clears out of the table as well as the TLB.
+ */
+struct hpt_entry {
+	u_int32_t hpt_tag;	/* EntryHi, or HPT_NOTAG if empty */
+	u_int32_t hpt_elo;	/* EntryLo */
+};
+
+/* these are used by the refill handler */
+struct hpt_entry hpt[HPT_SIZE];
+u_int32_t hpt_save[2];		/* handler's register save area */
+u_int32_t hpt_refills;		/* TLB entries it loaded */
+
+static int mmu_usehpt = 1;
+
 ////////////////////////////////////////////////////////////
 //
 // TLB handling
@@ -126,12 +269,12 @@ tlb_invalidate(int tlbix)
 		pa = elo & TLBLO_PPAGE;
 		cmix = PADDR_TO_COREMAP(pa);
 		assert(cmix < num_coremap_entries);
-		assert(coremap[cmix].cm_tlbix == tlbix);
-		coremap[cmix].cm_tlbix = -1;
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-			(unsigned long) COREMAP_TO_PADDR(cmix));
-
-		// might want to add something to support ASST2 LRU
+		/* not so if the refill handler loaded it */
+		if (coremap[cmix].cm_tlbix == tlbix) {
+			coremap[cmix].cm_tlbix = -1;
+			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+				(unsigned long) COREMAP_TO_PADDR(cmix));
+		}
 	}
 
 	TLB_Write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
@@ -156,14 +299,14 @@ tlb_clear(void)
 }
 
 /*
- * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
- * it if it exists.
+ * tlb_unmap: Searches the TLB for a vaddr translation in address space
+ * ASID and invalidates it if it exists.
  *
  * Synchronization: assumes spl already high. Does not block. 
  */
 static
 void
-tlb_unmap(vaddr_t va)
+tlb_unmap(vaddr_t va, u_int32_t asid)
 {
 	int i;
 	u_int32_t elo = 0, ehi = 0;
@@ -172,7 +315,7 @@ tlb_unmap(vaddr_t va)
 
 	assert(va < MIPS_KSEG0);
 
-	i = TLB_Probe(va & PAGE_FRAME,0);
+	i = TLB_Probe((va & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
 	if (i < 0) {
 		return;
 	}
@@ -186,6 +329,169 @@ tlb_unmap(vaddr_t va)
 	tlb_invalidate(i);
 }
 
+/*
+ * tlb_unmapasid: invalidates all the TLB entries of address space ASID.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+tlb_unmapasid(u_int32_t asid)
+{
+	int i;
+	u_int32_t elo, ehi;
+
+	assert(curspl > 0);
+
+	for (i=0; i<NUM_TLB; i++) {
+		TLB_Read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) &&
+		    (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+			tlb_invalidate(i);
+		}
+	}
+}
+
+/*
+ * hpt_remove: empty hashed page table entry IX, and take its
+ * translation out of the TLB too, in case the refill handler loaded
+ * it.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+hpt_remove(int ix)
+{
+	unsigned cmix;
+	int tlbix;
+
+	assert(curspl>0);
+	assert(hpt[ix].hpt_tag != HPT_NOTAG);
+
+	cmix = PADDR_TO_COREMAP(hpt[ix].hpt_elo & TLBLO_PPAGE);
+	assert(cmix < num_coremap_entries);
+	if (!coremap[cmix].cm_kernel) {
+		assert(coremap[cmix].cm_hptix == ix);
+		coremap[cmix].cm_hptix = -1;
+	}
+
+	tlbix = TLB_Probe(hpt[ix].hpt_tag, 0);
+	if (tlbix >= 0) {
+		tlb_invalidate(tlbix);
+	}
+
+	hpt[ix].hpt_tag = HPT_NOTAG;
+	hpt[ix].hpt_elo = 0;
+}
+
+/*
+ * hpt_insert: enter a translation for the page in coremap entry CMIX
+ * into the hashed page table, replacing whatever was in its bucket and
+ * any other entry for the page.
+ *
+ * The one kernel page mapped into user space is the zero page (see
+ * lpage_zeromap), which is in at many addresses at once. It is never
+ * evicted or freed, so its entries need not be found from the coremap
+ * and it isn't tracked.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+hpt_insert(u_int32_t ehi, u_int32_t elo, unsigned cmix)
+{
+	int ix;
+
+	assert(curspl>0);
+
+	if (coremap[cmix].cm_hptix >= 0) {
+		hpt_remove(coremap[cmix].cm_hptix);
+	}
+
+	ix = HPT_HASH(ehi);
+	if (hpt[ix].hpt_tag != HPT_NOTAG) {
+		hpt_remove(ix);
+	}
+
+	hpt[ix].hpt_tag = ehi;
+	hpt[ix].hpt_elo = elo;
+	if (!coremap[cmix].cm_kernel) {
+		coremap[cmix].cm_hptix = ix;
+	}
+}
+
+/*
+ * hpt_removeasid: take all the entries of address space ASID out of
+ * the hashed page table, and the TLB.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+hpt_removeasid(u_int32_t asid)
+{
+	int ix;
+
+	assert(curspl>0);
+
+	for (ix=0; ix<HPT_SIZE; ix++) {
+		if (hpt[ix].hpt_tag != HPT_NOTAG &&
+		    (hpt[ix].hpt_tag & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+			hpt_remove(ix);
+		}
+	}
+}
+
+/*
+ * hpt_clear: empty the hashed page table. Only the TLB entries loaded
+ * from it are left, so this goes with tlb_clear.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+hpt_clear(void)
+{
+	unsigned cmix;
+	int ix;
+
+	assert(curspl>0);
+
+	for (ix=0; ix<HPT_SIZE; ix++) {
+		if (hpt[ix].hpt_tag != HPT_NOTAG) {
+			cmix = PADDR_TO_COREMAP(hpt[ix].hpt_elo & TLBLO_PPAGE);
+			if (!coremap[cmix].cm_kernel) {
+				assert(coremap[cmix].cm_hptix == ix);
+				coremap[cmix].cm_hptix = -1;
+			}
+		}
+		hpt[ix].hpt_tag = HPT_NOTAG;
+		hpt[ix].hpt_elo = 0;
+	}
+}
+
+/*
+ * page_unmap: take the page in coremap entry IX out of the TLB and the
+ * hashed page table, so that the next access to it faults.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+page_unmap(u_int32_t ix)
+{
+	assert(curspl>0);
+
+	if (coremap[ix].cm_hptix >= 0) {
+		hpt_remove(coremap[ix].cm_hptix);
+	}
+	if (coremap[ix].cm_tlbix >= 0) {
+		tlb_invalidate(coremap[ix].cm_tlbix);
+		coremap[ix].cm_tlbix = -1;
+	}
+}
+
 /*
  * mipstlb_getslot: get a TLB slot for use, replacing an existing one if
  * necessary and peforming any at-replacement actions.
@@ -215,22 +521,43 @@ mipstlb_getslot(void)
  * To evict a page, it must be non-kernel and non-pinned.
  *
  * page_replace() takes no arguments and returns an index into the
- * coremap (for the selected victim page).
+ * coremap (for the selected victim page), or -1 if every page is
+ * pinned or belongs to the kernel.
  */
 
+static
+int
+page_evictable(u_int32_t ix)
+{
+	return coremap[ix].cm_allocated && !coremap[ix].cm_kernel &&
+		!coremap[ix].cm_pinned;
+}
+
 #if OPT_RANDPAGE
 
 /*
  * random page replacement
  *
+ * Pick a page at random; if it can't be evicted, take the next one
+ * after it that can.
  */
 
 static
-u_int32_t 
+int
 page_replace(void)
 {
-	// ADD CODE HERE FOR ASST2
-	return 0;	// dummy until code gets written
+	u_int32_t i, ix;
+
+	assert(curspl>0);
+
+	ix = random() % num_coremap_entries;
+	for (i=0; i<num_coremap_entries; i++) {
+		if (page_evictable(ix)) {
+			return ix;
+		}
+		ix = (ix + 1) % num_coremap_entries;
+	}
+	return -1;
 }
 
 #else /* not OPT_RANDPAGE */
@@ -238,18 +565,260 @@ page_replace(void)
 /*
  * Least-recently-used approximation, based on clock algorithm.
  *
+ * The hand goes round the coremap giving each referenced page a second
+ * chance: its referenced bit is cleared and its TLB entry dropped. The
+ * first evictable page found unreferenced is the victim. Two full
+ * turns are always enough unless nothing is evictable at all.
  */
 
 static
-u_int32_t 
+int
 page_replace(void)
 {
-	// ADD CODE HERE FOR ASST2
-	return 0;	// dummy until code gets written
+	u_int32_t i, ix;
+
+	assert(curspl>0);
+
+	for (i=0; i<2*num_coremap_entries; i++) {
+		ix = clock_hand;
+		clock_hand++;
+		if (clock_hand == num_coremap_entries) {
+			clock_hand = 0;
+			ct_clock_sweeps++;
+			clock_wss = clock_sweep_refs;
+			clock_sweep_refs = 0;
+		}
+
+		if (!page_evictable(ix)) {
+			continue;
+		}
+		ct_clock_scanned++;
+
+		if (!coremap[ix].cm_referenced) {
+			return ix;
+		}
+
+		coremap[ix].cm_referenced = 0;
+		ct_clock_cleared++;
+		clock_sweep_refs++;
+		page_unmap(ix);
+	}
+	return -1;
 }
 
 #endif /* OPT_RANDPAGE */
 
+////////////////////////////////////////////////////////////
+//
+// Free lists
+
+/*
+ * buddy_link: put the free block of 2^ORDER pages at IX on its list.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+buddy_link(int ix, unsigned order)
+{
+	struct buddy_link *bl;
+
+	assert(curspl>0);
+	assert(order <= CM_MAXORDER);
+	assert((ix & ((1<<order)-1)) == 0);
+
+	bl = BUDDY_LINK(ix);
+	bl->bl_prev = -1;
+	bl->bl_next = buddy_lists[order];
+	if (bl->bl_next >= 0) {
+		BUDDY_LINK(bl->bl_next)->bl_prev = ix;
+	}
+	buddy_lists[order] = ix;
+	buddy_nblocks[order]++;
+
+	coremap[ix].cm_freehead = 1;
+	coremap[ix].cm_order = order;
+}
+
+/*
+ * buddy_unlink: take the free block at IX off its list.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+buddy_unlink(int ix)
+{
+	struct buddy_link *bl;
+	unsigned order;
+
+	assert(curspl>0);
+	assert(coremap[ix].cm_freehead);
+
+	order = coremap[ix].cm_order;
+	bl = BUDDY_LINK(ix);
+	if (bl->bl_prev >= 0) {
+		BUDDY_LINK(bl->bl_prev)->bl_next = bl->bl_next;
+	}
+	else {
+		assert(buddy_lists[order] == ix);
+		buddy_lists[order] = bl->bl_next;
+	}
+	if (bl->bl_next >= 0) {
+		BUDDY_LINK(bl->bl_next)->bl_prev = bl->bl_prev;
+	}
+	buddy_nblocks[order]--;
+
+	coremap[ix].cm_freehead = 0;
+	coremap[ix].cm_order = 0;
+}
+
+/*
+ * buddy_free: put page IX, which has just become free and unpinned,
+ * on the free lists, joining it up with its buddies.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+buddy_free(int ix)
+{
+	unsigned order;
+	int buddy;
+
+	assert(curspl>0);
+	assert(!coremap[ix].cm_allocated && !coremap[ix].cm_pinned);
+	assert(!coremap[ix].cm_freehead);
+
+	for (order = 0; order < CM_MAXORDER; order++) {
+		buddy = ix ^ (1<<order);
+		if ((u_int32_t)buddy >= num_coremap_entries ||
+		    !coremap[buddy].cm_freehead ||
+		    coremap[buddy].cm_order != order) {
+			break;
+		}
+		buddy_unlink(buddy);
+		ct_buddy_merges++;
+		if (buddy < ix) {
+			ix = buddy;
+		}
+	}
+	buddy_link(ix, order);
+}
+
+/*
+ * buddy_alloc: take a block of 2^ORDER pages off the free lists,
+ * splitting a bigger one if need be. Returns its first page, or -1.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+int
+buddy_alloc(unsigned order)
+{
+	unsigned k;
+	int ix;
+
+	assert(curspl>0);
+
+	for (k = order; k <= CM_MAXORDER && buddy_lists[k] < 0; k++) {
+		/* nothing */
+	}
+	if (k > CM_MAXORDER) {
+		return -1;
+	}
+
+	ix = buddy_lists[k];
+	buddy_unlink(ix);
+
+	/* give back the top half until it's the right size */
+	while (k > order) {
+		k--;
+		buddy_link(ix + (1<<k), k);
+		ct_buddy_splits++;
+	}
+	return ix;
+}
+
+/*
+ * buddy_take: take the single free page IX off the free lists, as
+ * when it is about to be pinned or allocated where it stands. The rest
+ * of the block it was in goes back on in pieces.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+buddy_take(int ix)
+{
+	unsigned k, half;
+	int head;
+
+	assert(curspl>0);
+	assert(!coremap[ix].cm_allocated && !coremap[ix].cm_pinned);
+
+	/* Find the block it's in; its head is IX rounded down */
+	for (k = 0; k <= CM_MAXORDER; k++) {
+		head = ix & ~((1<<k)-1);
+		if (coremap[head].cm_freehead && coremap[head].cm_order == k) {
+			break;
+		}
+	}
+	assert(k <= CM_MAXORDER);
+
+	buddy_unlink(head);
+	while (k > 0) {
+		k--;
+		half = 1<<k;
+		if (ix < head + (int)half) {
+			buddy_link(head + half, k);
+		}
+		else {
+			buddy_link(head, k);
+			head += half;
+		}
+		ct_buddy_splits++;
+	}
+	assert(head == ix);
+}
+
+/*
+ * buddy_print: print the number of free blocks of each size, and the
+ * largest, for the coremap dumps. Free pages not in a block are
+ * pinned.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+buddy_print(void)
+{
+	u_int32_t npages;
+	unsigned k, largest;
+
+	assert(curspl>0);
+
+	npages = 0;
+	largest = 0;
+	kprintf("Free blocks (pages: count):");
+	for (k = 0; k <= CM_MAXORDER; k++) {
+		if (buddy_nblocks[k] > 0) {
+			kprintf(" %u:%lu", 1<<k,
+				(unsigned long) buddy_nblocks[k]);
+			largest = 1<<k;
+		}
+		npages += buddy_nblocks[k] << k;
+	}
+	kprintf("\n");
+	kprintf("Largest free block %u pages; %lu pages free but pinned\n",
+		largest, (unsigned long) (num_coremap_free - npages));
+	kprintf("Free lists: %lu allocations, %lu splits, %lu merges; "
+		"%lu searches\n", (unsigned long) ct_buddy_allocs,
+		(unsigned long) ct_buddy_splits,
+		(unsigned long) ct_buddy_merges,
+		(unsigned long) ct_buddy_searches);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Setup/initialization
@@ -278,6 +847,7 @@ coremap_bootstrap(void)
 	u_int32_t i;
 	paddr_t first, last;
 	u_int32_t npages, coremapsize;
+	int spl;
 
 	nexttlb = 0;
 
@@ -329,6 +899,7 @@ coremap_bootstrap(void)
 	num_coremap_kernel = 0;
 	num_coremap_user = 0;
 	num_coremap_free = num_coremap_entries;
+	clock_hand = 0;
 
 	assert(num_coremap_entries + (coremapsize/PAGE_SIZE) == npages);
 
@@ -341,15 +912,29 @@ coremap_bootstrap(void)
 		coremap[i].cm_allocated = 0;
 		coremap[i].cm_pinned = 0;
 		coremap[i].cm_tlbix = -1;
+		coremap[i].cm_hptix = -1;
 		coremap[i].cm_lp = NULL;
+		coremap[i].cm_referenced = 0;
+		coremap[i].cm_freehead = 0;
+		coremap[i].cm_order = 0;
+	}
 
-		// might want to add something to support ASST2 LRU
+	/* Put all the pages on the free lists */
+	for (i=0; i <= CM_MAXORDER; i++) {
+		buddy_lists[i] = -1;
+		buddy_nblocks[i] = 0;
+	}
+	spl = splhigh();
+	for (i=0; i < num_coremap_entries; i++) {
+		buddy_free(i);
 	}
+	splx(spl);
 
-	/* Suppress unused function warnings. Delete when
-	 * these functions are really used somewhere.
-	 */
-	(void)page_replace;
+	/* The hashed page table starts out empty */
+	for (i=0; i < HPT_SIZE; i++) {
+		hpt[i].hpt_tag = HPT_NOTAG;
+		hpt[i].hpt_elo = 0;
+	}
 }	
 
 ////////////////////////////////////////////////////////////
@@ -363,21 +948,147 @@ piggish_kernel(int proposed_kernel_pages)
 {
 	u_int32_t nkp;
 
-	assert(curspl>0);
+	assert(curspl>0);
+
+	nkp = num_coremap_kernel + proposed_kernel_pages ;
+	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * pageout_cluster: write out the dirty user page in coremap entry
+ * WHERE, along with any dirty neighbours: evictable pages whose swap
+ * pages run on from or into its own, up to SWAP_CLUSTER in all. The
+ * neighbours are left in memory, clean.
+ *
+ * Synchronization: called at splhigh holding global_paging_lock, with
+ * WHERE pinned. Pins the neighbours while they are written.
+ */
+static
+void
+pageout_cluster(int where)
+{
+	int slot[2*SWAP_CLUSTER-1];
+	struct lpage *lps[SWAP_CLUSTER];
+	off_t swa, diff;
+	u_int32_t i;
+	int lo, hi, j, n, ix;
+
+	assert(curspl>0);
+	assert(coremap[where].cm_pinned);
+
+	/* slot[SWAP_CLUSTER-1+k] is the page k pages after WHERE in swap */
+	for (j=0; j<2*SWAP_CLUSTER-1; j++) {
+		slot[j] = -1;
+	}
+	slot[SWAP_CLUSTER-1] = where;
+
+	swa = coremap[where].cm_lp->lp_swapaddr;
+	for (i=0; i<num_coremap_entries; i++) {
+		if (!page_evictable(i) || !LP_ISDIRTY(coremap[i].cm_lp)) {
+			continue;
+		}
+		diff = coremap[i].cm_lp->lp_swapaddr - swa;
+		if (diff != 0 && diff < SWAP_CLUSTER*PAGE_SIZE &&
+		    diff > -SWAP_CLUSTER*PAGE_SIZE) {
+			slot[SWAP_CLUSTER-1 + diff/PAGE_SIZE] = i;
+		}
+	}
+
+	/* Take the run around WHERE, preferring the pages after it */
+	lo = hi = SWAP_CLUSTER-1;
+	while (hi-lo+1 < SWAP_CLUSTER && hi+1 < 2*SWAP_CLUSTER-1 &&
+	       slot[hi+1] >= 0) {
+		hi++;
+	}
+	while (hi-lo+1 < SWAP_CLUSTER && lo > 0 && slot[lo-1] >= 0) {
+		lo--;
+	}
+
+	n = 0;
+	for (j=lo; j<=hi; j++) {
+		ix = slot[j];
+		if (ix != where) {
+			coremap[ix].cm_pinned = 1;
+			page_unmap(ix);
+		}
+		lps[n++] = coremap[ix].cm_lp;
+	}
 
-	nkp = num_coremap_kernel + proposed_kernel_pages ;
-	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
-		return 1;
+	lpage_clean(lps, n);
+	ct_clustered += n-1;
+
+	for (j=lo; j<=hi; j++) {
+		ix = slot[j];
+		if (ix != where) {
+			assert(coremap[ix].cm_pinned);
+			coremap[ix].cm_pinned = 0;
+			thread_wakeup(&coremap[ix]);
+		}
 	}
-	return 0;
 }
 
+/*
+ * do_evict: page out the user page in coremap entry WHERE and mark
+ * the entry free.
+ *
+ * Synchronization: called at splhigh holding global_paging_lock. The
+ * page is pinned while lpage_evict runs, which may block.
+ */
 static
 void
 do_evict(int where)
 {
-	// ADD CODE HERE FOR ASST2
-	(void)where;	// suppress compiler warning until code gets written
+	struct lpage *lp;
+
+	assert(curspl>0);
+	assert(!in_interrupt);
+	assert(lock_do_i_hold(global_paging_lock));
+	assert(coremap[where].cm_pinned==0);
+	assert(coremap[where].cm_allocated);
+	assert(coremap[where].cm_kernel==0);
+
+	lp = coremap[where].cm_lp;
+	assert(lp != NULL);
+
+	coremap[where].cm_pinned = 1;
+
+	/* flush any live mapping */
+	page_unmap(where);
+
+	DEBUG(DB_VM, "do_evict: evicting pa 0x%x\n",
+	      COREMAP_TO_PADDR(where));
+
+	/*
+	 * If it's dirty, write it out along with any dirty neighbours;
+	 * lpage_evict then finds it clean. (The dirty bit is only a
+	 * hint here; lpage_evict checks it again under the lock.)
+	 */
+	if (LP_ISDIRTY(lp)) {
+		pageout_cluster(where);
+	}
+
+	lpage_evict(lp);
+
+	assert(coremap[where].cm_pinned);
+	assert(coremap[where].cm_allocated);
+	assert(coremap[where].cm_lp == lp);
+	assert(coremap[where].cm_tlbix < 0);
+	assert(coremap[where].cm_hptix < 0);
+
+	coremap[where].cm_lp = NULL;
+	coremap[where].cm_allocated = 0;
+	coremap[where].cm_referenced = 0;
+	coremap[where].cm_pinned = 0;
+	num_coremap_user--;
+	num_coremap_free++;
+	assert(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+	buddy_free(where);
+
+	thread_wakeup(&coremap[where]);
 }
 
 static
@@ -390,6 +1101,10 @@ do_page_replace(void)
 	assert(lock_do_i_hold(global_paging_lock));
 
 	where = page_replace();
+	if (where < 0) {
+		return -1;
+	}
+	ct_sync_evictions++;
 
 	assert(coremap[where].cm_pinned==0);
 	assert(coremap[where].cm_kernel==0);
@@ -415,6 +1130,7 @@ mark_pages_allocated(int start, int npages, int pin, int iskern)
 		assert(coremap[i].cm_kernel==0);
 		assert(coremap[i].cm_lp==NULL);
 		assert(coremap[i].cm_tlbix<0);
+		assert(coremap[i].cm_hptix<0);
 
 		if (pin) {
 			coremap[i].cm_pinned = 1;
@@ -424,7 +1140,8 @@ mark_pages_allocated(int start, int npages, int pin, int iskern)
 			coremap[i].cm_kernel = 1;
 		}
 
-		// might want to add something to support ASST2 LRU
+		/* it is about to be used, so don't take it straight back */
+		coremap[i].cm_referenced = 1;
 
 		if (i < start+npages-1) {
 			coremap[i].cm_notlast = 1;
@@ -441,6 +1158,23 @@ mark_pages_allocated(int start, int npages, int pin, int iskern)
 	       == num_coremap_entries);
 }
 
+/*
+ * pageout_check: kick the pageout daemon if free pages are running low.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+pageout_check(void)
+{
+	assert(curspl>0);
+	if (pageout_running && !pageout_kick &&
+	    num_coremap_free < CM_FREE_LOW) {
+		pageout_kick = 1;
+		thread_wakeup(&pageout_kick);
+	}
+}
+
 /*
  * coremap_alloc_one_page
  *
@@ -452,7 +1186,7 @@ static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int spl, candidate, i, iskern;
+	int spl, candidate, iskern;
 
 	iskern = (lp == NULL);
 
@@ -481,31 +1215,25 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	}
 
 	/*
-	 * For single-page allocations, start at the top end of memory. We
-	 * will do multi-page allocations at the bottom end in the hope of
-	 * reducing long-term fragmentation. But it probably won't help
-	 * much if the system gets busy.
+	 * Take a page off the free lists; the smallest free block is
+	 * split if need be, which leaves the big ones for multi-page
+	 * allocations. Failing that, evict something.
 	 */
 
-	candidate = -1;
-
-	if (num_coremap_free > 0) {
-		/* There's a free page. Find it. */
-
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			assert(coremap[i].cm_kernel==0);
-			assert(coremap[i].cm_lp==NULL);
-			candidate = i;
-			break;
-		}
+	candidate = buddy_alloc(0);
+	if (candidate >= 0) {
+		assert(coremap[candidate].cm_kernel==0);
+		assert(coremap[candidate].cm_lp==NULL);
+		ct_buddy_allocs++;
 	}
 
 	if (candidate < 0 && !in_interrupt) {
-		assert(num_coremap_free==0);
+		/* (any free pages left are pinned) */
 		candidate = do_page_replace();
+		if (candidate >= 0) {
+			/* do_evict put it on the free lists */
+			buddy_take(candidate);
+		}
 	}
 
 	if (candidate < 0) {
@@ -524,6 +1252,8 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	// free pages should not be in the TLB
 	assert(coremap[candidate].cm_tlbix<0);
 
+	pageout_check();
+
 	splx(spl);
 	if (!in_interrupt && curthread!=NULL) {
 		lock_release(global_paging_lock);
@@ -540,7 +1270,7 @@ coremap_alloc_multipages(unsigned npages)
 	int badness, bestbadness;
 	int evicted;
 	int spl;
-	unsigned i;
+	unsigned i, order;
 
 	assert(npages>1);
 
@@ -568,11 +1298,31 @@ coremap_alloc_multipages(unsigned npages)
 	}
 
 	/*
-	 * Look for the best block of this length.
+	 * If there's a free block big enough, take it, and give back
+	 * the part of it we don't need.
+	 */
+	for (order = 0; (1U<<order) < npages; order++) {
+		/* nothing */
+	}
+	if (order <= CM_MAXORDER) {
+		base = buddy_alloc(order);
+		if (base >= 0) {
+			for (i=npages; i < (1U<<order); i++) {
+				buddy_free(base+i);
+			}
+			ct_buddy_allocs++;
+			bestbase = base;
+			goto found;
+		}
+	}
+
+	/*
+	 * Otherwise look for the best block of this length.
 	 * "badness" counts how many evictions we need to do.
 	 * Find the block where it's smallest.
 	 */
 
+	ct_buddy_searches++;
 	do {
 		bestbase = -1;
 		bestbadness = npages*2;
@@ -650,14 +1400,22 @@ coremap_alloc_multipages(unsigned npages)
 					return INVALID_PADDR;
 				}
 				do_evict(i);
+				ct_sync_evictions++;
 				evicted = 1;
 			}
 		}
 	} while (evicted);
 
+	/* The pages are all free now; take them off the free lists */
+	for (i=bestbase; i<bestbase+npages; i++) {
+		buddy_take(i);
+	}
+
+ found:
 	mark_pages_allocated(bestbase, npages, 
 			     0 /* pinned -- unnecessary */,
 			     1 /* kernel */);
+	pageout_check();
 				     
 	splx(spl);
 	if (!in_interrupt && curthread!=NULL) {
@@ -719,12 +1477,7 @@ coremap_free(paddr_t page, int iskern)
 		//}
 
 		/* flush any live mapping */
-		if (coremap[i].cm_tlbix >= 0) {
-			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-				(unsigned long) COREMAP_TO_PADDR(i));
-		}
+		page_unmap(i);
 
 		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
 		      COREMAP_TO_PADDR(i));
@@ -745,10 +1498,14 @@ coremap_free(paddr_t page, int iskern)
 		}
 		num_coremap_free++;
 
-		// might want to add something to support ASST2 LRU
-
+		coremap[i].cm_referenced = 0;
 		coremap[i].cm_lp = NULL;
 
+		/* if pinned, it goes on the free lists when unpinned */
+		if (!coremap[i].cm_pinned) {
+			buddy_free(i);
+		}
+
 		if (!coremap[i].cm_notlast) {
 			break;
 		}
@@ -759,6 +1516,124 @@ coremap_free(paddr_t page, int iskern)
 	splx(spl);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Pageout daemon
+//
+
+/*
+ * do_clean: write out the dirty user page in coremap entry WHERE,
+ * and any dirty neighbours, leaving them in memory.
+ *
+ * Synchronization: as for do_evict. The TLB entries are dropped so that
+ * the owner's next write faults and marks the page dirty again.
+ */
+static
+void
+do_clean(int where)
+{
+	struct lpage *lp;
+
+	assert(curspl>0);
+	assert(!in_interrupt);
+	assert(lock_do_i_hold(global_paging_lock));
+	assert(coremap[where].cm_pinned==0);
+	assert(coremap[where].cm_allocated);
+	assert(coremap[where].cm_kernel==0);
+
+	lp = coremap[where].cm_lp;
+	assert(lp != NULL);
+
+	coremap[where].cm_pinned = 1;
+	page_unmap(where);
+
+	pageout_cluster(where);
+
+	assert(coremap[where].cm_pinned);
+	assert(coremap[where].cm_lp == lp);
+	coremap[where].cm_pinned = 0;
+	thread_wakeup(&coremap[where]);
+}
+
+/*
+ * pageout_daemon: thread that keeps some pages free and some clean,
+ * so that faulting processes don't usually have to wait for a page
+ * to be written out before they can have one.
+ *
+ * The dirty bit is read without locking the lpage; it's only a hint,
+ * and lpage_clean checks it again.
+ */
+static
+void
+pageout_daemon(void *junk1, unsigned long junk2)
+{
+	struct clock_tick tick;
+	u_int32_t i, ix, ncleaned;
+	int spl, where;
+
+	(void)junk1;
+	(void)junk2;
+
+	/* Run once a second, and when kicked on pageout_kick */
+	clock_addtick(&tick, &pageout_kick);
+
+	for (;;) {
+		lock_acquire(global_paging_lock);
+		spl = splhigh();
+
+		ct_pageout_runs++;
+
+		while (num_coremap_free < CM_FREE_HIGH) {
+			where = page_replace();
+			if (where < 0) {
+				break;
+			}
+			do_evict(where);
+			ct_pageout_evictions++;
+		}
+
+		ncleaned = 0;
+		ix = clock_hand;
+		for (i=0; i<CM_CLEAN_SCAN && i<num_coremap_entries &&
+			     ncleaned<CM_CLEAN_BATCH; i++) {
+			if (page_evictable(ix) && !coremap[ix].cm_referenced &&
+			    LP_ISDIRTY(coremap[ix].cm_lp)) {
+				do_clean(ix);
+				ncleaned++;
+			}
+			ix = (ix + 1) % num_coremap_entries;
+		}
+		ct_pageout_cleans += ncleaned;
+
+		splx(spl);
+		lock_release(global_paging_lock);
+
+		spl = splhigh();
+		if (!pageout_kick) {
+			thread_sleep(&pageout_kick);
+		}
+		pageout_kick = 0;
+		splx(spl);
+	}
+}
+
+/*
+ * coremap_start_pageout: start the pageout daemon. Called once swap
+ * is available.
+ */
+void
+coremap_start_pageout(void)
+{
+	int result;
+
+	result = thread_fork("pageout", NULL, 0, pageout_daemon, NULL);
+	if (result) {
+		panic("coremap: Cannot start pageout daemon: %s\n",
+		      strerror(result));
+	}
+	pageout_running = 1;
+}
+
 /*
  * alloc_kpages
  *
@@ -844,16 +1719,58 @@ coremap_print_short(void)
 	if (!atbol) {
 		kprintf("\n");
 	}
+	buddy_print();
 	splx(spl);
 }
 #undef NCOLS
 
 /*
- * coremap_print_long: debugging dump of coremap to console.
+ * coremap_printstats: print page replacement counters, for
+ * vm_printstats. (The clock counters stay zero under random
+ * replacement.)
+ *
+ * synchronization: sets splhigh. Does not block.
+ */
+void
+coremap_printstats(void)
+{
+	int spl;
+
+	spl = splhigh();
+	kprintf("vm: clock: %lu pages scanned, %lu second chances, "
+		"%lu sweeps\n", (unsigned long) ct_clock_scanned,
+		(unsigned long) ct_clock_cleared,
+		(unsigned long) ct_clock_sweeps);
+	kprintf("vm: clock: %lu reference faults, working set %lu pages "
+		"(last sweep)\n", (unsigned long) ct_clock_reffaults,
+		(unsigned long) clock_wss);
+	kprintf("vm: pageout: %lu runs, %lu evictions, %lu pages cleaned; "
+		"%lu evictions by allocations\n",
+		(unsigned long) ct_pageout_runs,
+		(unsigned long) ct_pageout_evictions,
+		(unsigned long) ct_pageout_cleans,
+		(unsigned long) ct_sync_evictions);
+	kprintf("vm: %lu dirty neighbours written along with a page\n",
+		(unsigned long) ct_clustered);
+	kprintf("vm: tlb: %lu refills by vm_fault, %lu from the page "
+		"table (%s)\n", (unsigned long) ct_tlb_refills,
+		(unsigned long) hpt_refills, mmu_usehpt ? "on" : "off");
+	kprintf("vm: tlb: %lu switches, %lu flushes; asids %s, "
+		"generation %lu\n", (unsigned long) ct_tlb_switches,
+		(unsigned long) ct_tlb_flushes, mmu_useasids ? "on" : "off",
+		(unsigned long) asid_generation);
+	kprintf("vm: %lu user pages resident, %lu pages free\n",
+		(unsigned long) num_coremap_user,
+		(unsigned long) num_coremap_free);
+	splx(spl);
+}
+
+/*
+ * coremap_print_long: debugging dump of coremap to console. Free
+ * pages that start a free block show its size.
  * 
  * synchronization: sets splhigh. Does not block.
  */
-#if 0 /* not used, but potentially useful */
 #define NCOLS 5
 void					
 coremap_print_long(void)
@@ -887,6 +1804,11 @@ coremap_print_long(void)
 				kprintf("0x%lx\t",
 					(long) coremap[cn].cm_lp->lp_swapaddr);
 			}
+			else if (coremap[cn].cm_freehead) {
+				assert(coremap[cn].cm_lp == NULL);
+				assert(coremap[cn].cm_notlast==0);
+				kprintf("free/%u\t", 1<<coremap[cn].cm_order);
+			}
 			else {
 				assert(coremap[cn].cm_lp == NULL);
 				assert(coremap[cn].cm_notlast==0);
@@ -896,10 +1818,10 @@ coremap_print_long(void)
 		kprintf("\n");
 	}
 	kprintf("\n");
+	buddy_print();
 	splx(spl);
 }
 #undef NCOLS
-#endif /* 0 */
 
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
@@ -918,6 +1840,10 @@ coremap_pin(paddr_t paddr)
 	while (coremap[ix].cm_pinned) {
 		thread_sleep(&coremap[ix]);
 	}
+	if (!coremap[ix].cm_allocated) {
+		/* it was freed under us; keep it from being handed out */
+		buddy_take(ix);
+	}
 	coremap[ix].cm_pinned = 1;
 	splx(spl);
 }
@@ -959,6 +1885,9 @@ coremap_unpin(paddr_t paddr)
 	spl = splhigh();
 	assert(coremap[ix].cm_pinned);
 	coremap[ix].cm_pinned = 0;
+	if (!coremap[ix].cm_allocated) {
+		buddy_free(ix);
+	}
 	thread_wakeup(&coremap[ix]);
 	splx(spl);
 }
@@ -1008,9 +1937,50 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
 
 static struct addrspace *lastas = NULL;
 
+/*
+ * asid_newgen: start a new ASID generation. None of the ASIDs handed
+ * out so far are valid any more, so neither is anything in the TLB.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+asid_newgen(void)
+{
+	assert(curspl>0);
+
+	asid_generation++;
+	asid_next = 1;
+	tlb_clear();
+	hpt_clear();
+	ct_tlb_flushes++;
+}
+
+/*
+ * asid_get: returns the ASID of an address space, or -1 if it hasn't
+ * got one in the current generation (and so has nothing in the TLB).
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+int
+asid_get(struct addrspace *as)
+{
+	assert(curspl>0);
+
+	if (as->as_asidgen != asid_generation) {
+		return -1;
+	}
+	return as->as_asid;
+}
+
 /*
  * mmu_setas: Set current address space in MMU.
  *
+ * An address space that already has an ASID keeps whatever it left in
+ * the TLB. One that hasn't (new, or from an old generation) is given
+ * one here.
+ *
  * Synchronization: sets spl high. Does not block.
  */
 void
@@ -1019,9 +1989,27 @@ mmu_setas(struct addrspace *as)
 	int spl;
 
 	spl = splhigh();
-	if (as != lastas) {
+	if (as != lastas || (as != NULL && asid_get(as) < 0)) {
 		lastas = as;
-		tlb_clear();
+		ct_tlb_switches++;
+		if (!mmu_useasids) {
+			asid_newgen();
+		}
+
+		if (as == NULL) {
+			curasid = 0;
+		}
+		else {
+			if (asid_get(as) < 0) {
+				if (asid_next >= NUM_ASID) {
+					asid_newgen();
+				}
+				as->as_asid = asid_next++;
+				as->as_asidgen = asid_generation;
+			}
+			curasid = as->as_asid;
+		}
+		TLB_SetPID(curasid << TLBHI_PIDSHIFT);
 	}
 	splx(spl);
 }
@@ -1035,14 +2023,118 @@ void
 mmu_unmap(struct addrspace *as, vaddr_t va)
 {
 	int spl;
+	int asid, ix;
+	u_int32_t ehi;
+
+	spl = splhigh();
+	asid = asid_get(as);
+	if (asid >= 0) {
+		ehi = (va & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+		ix = HPT_HASH(ehi);
+		if (hpt[ix].hpt_tag == ehi) {
+			hpt_remove(ix);
+		}
+		tlb_unmap(va, asid);
+	}
+	splx(spl);
+}
+
+/*
+ * mmu_unmapall: Remove all translations for an address space from
+ * the MMU, as when its pages have become copy-on-write or it is being
+ * destroyed.
+ *
+ * Synchronization: sets splhigh. Does not block.
+ */
+void
+mmu_unmapall(struct addrspace *as)
+{
+	int spl;
+	int asid;
 
 	spl = splhigh();
-	if (as == lastas) {
-		tlb_unmap(va);
+	asid = asid_get(as);
+	if (asid >= 0) {
+		hpt_removeasid(asid);
+		tlb_unmapasid(asid);
 	}
 	splx(spl);
 }
 
+/*
+ * mmu_reset: start over with a new ASID generation. Not for use from
+ * a user process, as its ASID would be pulled out from under it.
+ *
+ * Synchronization: assumes spl already high. Does not block.
+ */
+static
+void
+mmu_reset(void)
+{
+	assert(curspl>0);
+	assert(curthread->t_vmspace == NULL);
+
+	asid_newgen();
+	lastas = NULL;
+	curasid = 0;
+	TLB_SetPID(0);
+}
+
+/*
+ * mmu_setasids: turn ASIDs on or off. With them off the TLB is flushed
+ * on every address space switch.
+ *
+ * Synchronization: sets splhigh. Does not block.
+ */
+void
+mmu_setasids(int on)
+{
+	int spl;
+
+	spl = splhigh();
+	mmu_useasids = on;
+	mmu_reset();
+	splx(spl);
+}
+
+/*
+ * mmu_setfastrefill: turn the hashed page table on or off. With it off
+ * every TLB miss goes through vm_fault.
+ *
+ * Synchronization: sets splhigh. Does not block.
+ */
+void
+mmu_setfastrefill(int on)
+{
+	int spl;
+
+	spl = splhigh();
+	mmu_usehpt = on;
+	mmu_reset();
+	splx(spl);
+}
+
+/*
+ * mmu_getstats: get the number of translations entered into the TLB
+ * by vm_fault and by the refill handler, address space switches, and
+ * whole-TLB flushes so far.
+ *
+ * Synchronization: sets splhigh. Does not block.
+ */
+void
+mmu_getstats(u_int32_t *refills, u_int32_t *fastrefills,
+	     u_int32_t *switches, u_int32_t *flushes)
+{
+	int spl;
+
+	spl = splhigh();
+	*refills = ct_tlb_refills;
+	*fastrefills = hpt_refills;
+	*switches = ct_tlb_switches;
+	*flushes = ct_tlb_flushes;
+	splx(spl);
+}
+
 /*
  * mmu_map: Enter a translation into the MMU. (This is the end result
  * of fault handling.)
@@ -1063,30 +2155,53 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 	
 	spl = splhigh();
 
-	tlbix = TLB_Probe(va, 0);
+	cmix = PADDR_TO_COREMAP(pa);
+	assert(cmix < num_coremap_entries);
+	assert(!writable || !coremap[cmix].cm_kernel);
+
+	ehi = (va & TLBHI_VPAGE) | (curasid << TLBHI_PIDSHIFT);
+	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
+	if (writable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/*
+	 * This throws out any other translation of the page and whatever
+	 * was in the bucket, TLB entries included; so do it first.
+	 */
+	if (mmu_usehpt) {
+		hpt_insert(ehi, elo, cmix);
+	}
+
+	tlbix = TLB_Probe(ehi, 0);
 	if (tlbix < 0) {
 		tlbix = mipstlb_getslot();
 	}
 	assert(tlbix>=0 && tlbix<NUM_TLB);
 
-	cmix = PADDR_TO_COREMAP(pa);
-	assert(cmix < num_coremap_entries);
-	if (coremap[cmix].cm_tlbix != tlbix) {
-		assert(coremap[cmix].cm_tlbix == -1);
+	if (!coremap[cmix].cm_kernel && coremap[cmix].cm_tlbix != tlbix) {
+		/*
+		 * cm_tlbix can only track one entry, so a page shared
+		 * copy-on-write is only in the TLB under one ASID at a
+		 * time. Take it away from the other address space.
+		 * (Not the zero page; see hpt_insert.)
+		 */
+		if (coremap[cmix].cm_tlbix >= 0) {
+			tlb_invalidate(coremap[cmix].cm_tlbix);
+		}
 		coremap[cmix].cm_tlbix = tlbix;
 		DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
 			(unsigned long) COREMAP_TO_PADDR(cmix), tlbix);
 	}
 
-	ehi = va & TLBHI_VPAGE;
-	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
-	if (writable) {
-		elo |= TLBLO_DIRTY;
-	}
-
 	TLB_Write(ehi, elo, tlbix);
+	ct_tlb_refills++;
 
-	// might want to add something to support ASST2 LRU
+	/* the page is in use; a fault after the hand cleared it counts */
+	if (!coremap[cmix].cm_referenced && !coremap[cmix].cm_kernel) {
+		coremap[cmix].cm_referenced = 1;
+		ct_clock_reffaults++;
+	}
 
 	splx(spl);
 }
@@ -103,6 +103,11 @@ mips_syscall(struct trapframe *tf)
 		err = sys__exit(tf->tf_a0);
 		break;
 
+	    case SYS___time:
+		err = sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+				 &retval);
+		break;
+
 	    // END A0 SOLUTION
 
 	    // BEGIN ASST1 SOLUTION
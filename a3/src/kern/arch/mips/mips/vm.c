@@ -31,7 +31,7 @@ vm_bootstrap(void)
 #if OPT_RANDPAGE
 	kprintf("vm: Page replacement: random\n");
 #else
-	kprintf("vm: Page replacement: LRU\n");
+	kprintf("vm: Page replacement: clock\n");
 #endif
 
 #if OPT_SEQTLB
@@ -44,6 +44,9 @@ vm_bootstrap(void)
 
 	global_paging_lock = lock_create("global_paging_lock");
 
+	vm_file_bootstrap();
+	lpage_bootstrap();
+
 	/* Return the total size of memory */
 	return mips_ramsize();
 }
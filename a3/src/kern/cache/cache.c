@@ -1,30 +1,51 @@
-
 #include <types.h>
 #include <lib.h>
 #include <kern/unistd.h>
 #include <kern/errno.h>
 #include <kern/stat.h>
+#include <machine/spl.h>
 #include <vfs.h>
 #include <vnode.h>
 #include <uio.h>
 #include <synch.h>
+#include <thread.h>
+#include <clock.h>
 #include <cache.h>
+#include <vm.h>
+#include "opt-cache2q.h"
+#include "opt-dumbvm.h"
 
+/* The cache over the raw disk, used by cache_read and cache_write */
 struct cache *the_cache;
 int max_block_id;
 
+/* Every cache that exists, for cache_printstats and cache_shutdown */
+static struct cache *all_caches;
+static struct lock *cache_list_lock;
 
-static 
-int 
-write_out_block(int id, void *data)
+/* Hash chain that block "id" lives on. */
+#define BUCKET_OF(c, id) (&(c)->buckets[(unsigned)(id) & (NBUCKETS-1)])
+
+/* cache_get flag used by the read-ahead thread: read the block in if
+ * it is not cached, but don't hold it or count it as a miss.
+ */
+#define CACHE_PREFETCH 0x100
+
+/* Where the flusher sleeps */
+#define FLUSHER_CHAN(c) ((const void *)&(c)->flush_kick)
+
+
+static
+int
+write_out_blocks(struct cache *c, int id, int count, void *data)
 {
   struct uio buf_uio;
   int result;
-  
 
-  mk_kuio(&buf_uio, data, BUFSIZE, BUFSIZE*id, UIO_WRITE);
 
-  result = VOP_WRITE(the_cache->backing_store, &buf_uio);
+  mk_kuio(&buf_uio, data, count*BUFSIZE, BUFSIZE*id, UIO_WRITE);
+
+  result = c->backing_io(c->backing_store, &buf_uio);
 
   if (result) {
     return result;
@@ -37,7 +58,7 @@ write_out_block(int id, void *data)
 
 static 
 int 
-read_in_block(int id, void *data)
+read_in_block(struct cache *c, int id, void *data)
 {
   struct uio buf_uio;
   int result;
@@ -45,7 +66,7 @@ read_in_block(int id, void *data)
 
   mk_kuio(&buf_uio, data, BUFSIZE, BUFSIZE*id, UIO_READ);
 
-  result = VOP_READ(the_cache->backing_store, &buf_uio);
+  result = c->backing_io(c->backing_store, &buf_uio);
 
   if (result) {
     return result;
@@ -55,316 +76,1492 @@ read_in_block(int id, void *data)
 }
 
 
-int cache_read(int id, void *blk)
+/* Find the buffer holding (or being filled with) block "id" on
+ * hash chain "bb".  Caller must hold the chain lock.
+ */
+
+static
+struct buf_hdr *
+lookup_buf(struct buf_bucket *bb, int id)
 {
+  struct buf_hdr *buf;
 
-  int i = 0;
-  int old_id;
-  int result;
-  struct buf_hdr *victim = NULL;
+  assert(lock_do_i_hold(bb->bb_lock));
 
-  lock_acquire(the_cache->c_lock);
+  for (buf = bb->bb_head; buf != NULL; buf = buf->hash_next) {
+    if (buf->id == id || (buf->id == -1 && buf->replacing_id == id)) {
+      return buf;
+    }
+  }
 
-  /* Is the block we want already in the cache? */
-  
-  while (i < NBUFS) {
-    for (i=0; i < NBUFS; i++) {
-      
-      if (the_cache->bufs[i].id == id) {
-	/* Found in cache! Copy and return. */
-	memcpy(blk, the_cache->bufs[i].data, BUFSIZE);
-	lock_release(the_cache->c_lock);
-	return 0;
-      }
-      
-      if ( the_cache->bufs[i].replacing_id == id 
-	   && the_cache->bufs[i].doing_io ) {
-	DEBUG(DB_CACHE,"have to wait, reading block %d\n",id);
-	cv_wait(the_cache->bufs[i].busy_cv, the_cache->c_lock);
-	/* While we were waiting to get the lock again, the block we
-	 * wanted could have been evicted, and read into a different 
-	 * buffer.  Best start over from the top.
-	 */
-	break;
-      }
+  return NULL;
+}
+
+static
+void
+unhash_buf(struct buf_bucket *bb, struct buf_hdr *buf)
+{
+  struct buf_hdr **pp;
+
+  assert(lock_do_i_hold(bb->bb_lock));
+
+  for (pp = &bb->bb_head; *pp != NULL; pp = &(*pp)->hash_next) {
+    if (*pp == buf) {
+      *pp = buf->hash_next;
+      buf->hash_next = NULL;
+      return;
     }
   }
 
-  /* Not found in cache.  Select victim */
+  panic("cache: buffer for block %d not on its hash chain\n", buf->id);
+}
 
-  /* A buffer that is being read in or written out should not be 
-   * chosen as a victim.  If all buffers are being read/written,
-   * we wait.  On return from wait, we need to rescan to find a
-   * non-busy victim, if any.
-   */
-  int have_victim = FALSE;
-  int first_idx = the_cache->next_idx;
-
-  while (!have_victim) {
-    victim = &the_cache->bufs[the_cache->next_idx];
-    the_cache->next_idx = (the_cache->next_idx+1) % NBUFS;
-
-    if (!victim->doing_io) {
-      have_victim = TRUE;
-    } else {
-      if (the_cache->next_idx == first_idx) {
-	/* We checked all the buffers, and they were ALL busy */
-	DEBUG(DB_CACHE,"Have to wait to get a non-busy victim for block %d\n",id);
-	cv_wait(the_cache->all_busy_cv,the_cache->c_lock);
-	first_idx = the_cache->next_idx;
+
+/* Dirty bookkeeping.  Called with the buffer's chain lock held.
+ * Pushing the cache over its dirty_high mark wakes the flusher early.
+ * Whoever dirties a buffer last becomes its owner.
+ */
+
+static
+void
+mark_dirty(struct cache *c, struct buf_hdr *buf, int owner)
+{
+  int s;
+
+  buf->owner = owner;
+  if (buf->dirty) {
+    return;
+  }
+
+  buf->dirty = TRUE;
+  buf->dirty_since = lbolt;
+
+  s = splhigh();
+  buf->dirty_seq = ++c->dirty_seq;
+  c->ndirty++;
+  if (c->ndirty > c->dirty_high && !c->flush_kick) {
+    c->flush_kick = TRUE;
+    thread_wakeup(FLUSHER_CHAN(c));
+  }
+  splx(s);
+}
+
+static
+void
+mark_clean(struct cache *c, struct buf_hdr *buf)
+{
+  int s;
+
+  if (!buf->dirty) {
+    return;
+  }
+
+  buf->dirty = FALSE;
+
+  s = splhigh();
+  assert(c->ndirty > 0);
+  c->ndirty--;
+  splx(s);
+}
+
+
+/* A buffer that was taken for a new block has stopped doing io, and
+ * holds a valid block.  Hand it (back) to the replacement policy, and
+ * let one thread waiting for a non-busy victim know about it.  Must
+ * not be called with a chain lock held, since c_lock comes first in
+ * the lock order.
+ */
+
+static
+void
+io_done(struct cache *c, struct buf_hdr *buf)
+{
+  lock_acquire(c->c_lock);
+  if (buf->readahead) {
+    c->ra_reads++;
+  }
+  c->policy->cp_fill(c, buf);
+  if (c->all_busy_waiters > 0) {
+    cv_signal(c->all_busy_cv, c->c_lock);
+  }
+  lock_release(c->c_lock);
+}
+
+/* A buffer has been put back, or finished flushing, so it may now be
+ * usable as a victim.  Only takes c_lock if someone is waiting for a
+ * victim; unbusy_gen lets a thread that is just about to wait see
+ * that it should look again instead.  No chain lock may be held.
+ */
+
+static
+void
+buf_unbusied(struct cache *c)
+{
+  int s;
+
+  s = splhigh();
+  c->unbusy_gen++;
+  splx(s);
+
+  if (c->all_busy_waiters > 0) {
+    lock_acquire(c->c_lock);
+    cv_signal(c->all_busy_cv, c->c_lock);
+    lock_release(c->c_lock);
+  }
+}
+
+/* Give an empty, unhashed buffer back to the free list. */
+
+static
+void
+put_free_buf(struct cache *c, struct buf_hdr *buf)
+{
+  lock_acquire(c->c_lock);
+
+  assert(buf->hash_next == NULL);
+  assert(!buf->dirty);
+  buf->id = -1;
+  buf->replacing_id = -1;
+  buf->doing_io = FALSE;
+  buf->held = FALSE;
+  buf->flushing = FALSE;
+  buf->readahead = FALSE;
+  buf->free_next = c->free_list;
+  c->free_list = buf;
+
+  if (c->all_busy_waiters > 0) {
+    cv_signal(c->all_busy_cv, c->c_lock);
+  }
+
+  lock_release(c->c_lock);
+}
+
+
+/* Select a buffer to hold a new block and claim it by marking it
+ * as doing io, so that no other thread will pick it too.
+ *
+ * Buffers on the free list are used first.  Otherwise the replacement
+ * policy offers candidates until one is found that is not busy; the
+ * victim is taken away from the policy, but is left on its hash
+ * chain, still holding its old block.
+ *
+ * A buffer that is being read in or written out, is held, or is being
+ * flushed should not be chosen as a victim.  If all buffers are busy,
+ * we wait.  On return from wait, we need to rescan to find a
+ * non-busy victim, if any.
+ */
+
+#define BUF_BUSY(buf) ((buf)->doing_io || (buf)->held || (buf)->flushing)
+
+static
+struct buf_hdr *
+get_victim(struct cache *c, int id, int flags)
+{
+  const struct cache_policy *policy = c->policy;
+  struct buf_hdr *victim;
+  struct buf_bucket *bb;
+  unsigned gen;
+  int old_id;
+
+  (void)id;
+
+  lock_acquire(c->c_lock);
+
+  if (!(flags & CACHE_PREFETCH)) {
+    c->misses++;
+  }
+
+  while (1) {
+    if (c->free_list != NULL) {
+      victim = c->free_list;
+      c->free_list = victim->free_next;
+      victim->free_next = NULL;
+      victim->doing_io = TRUE;
+      lock_release(c->c_lock);
+      return victim;
+    }
+
+    gen = c->unbusy_gen;
+
+    for (victim = policy->cp_candidate(c, TRUE);
+	 victim != NULL;
+	 victim = policy->cp_candidate(c, FALSE)) {
+
+      /* Cheap check without the chain lock first; anything that
+       * looks usable is checked again once we hold the lock for
+       * the chain it is on.
+       */
+      old_id = victim->id;
+      if (old_id == -1 || BUF_BUSY(victim)) {
+	continue;
+      }
+
+      bb = BUCKET_OF(c, old_id);
+      lock_acquire(bb->bb_lock);
+      if (victim->id == old_id && !BUF_BUSY(victim)) {
+	victim->doing_io = TRUE;
+	policy->cp_evict(c, victim, old_id);
+	c->evictions++;
+	if (victim->dirty) {
+	  c->dirty_evictions++;
+	}
+	if (victim->readahead) {
+	  c->ra_wasted++;
+	  victim->readahead = FALSE;
+	}
+	lock_release(bb->bb_lock);
+	lock_release(c->c_lock);
+	return victim;
       }
+      lock_release(bb->bb_lock);
     }
+
+    /* We checked all the buffers, and they were ALL busy.  Unless
+     * one stopped being busy while we looked, wait.
+     */
+    DEBUG(DB_CACHE,"Have to wait to get a non-busy victim for block %d\n",id);
+    c->all_busy_waiters++;
+    if (c->unbusy_gen == gen) {
+      cv_wait(c->all_busy_cv, c->c_lock);
+    }
+    c->all_busy_waiters--;
   }
+}
 
-  old_id = victim->id;
-  victim->replacing_id = id; /* Record new id to hold off other readers */
-  victim->doing_io = TRUE;
-      
-  if (victim->dirty) {
 
-    assert(lock_do_i_hold(the_cache->c_lock));
-    lock_release(the_cache->c_lock);
-    result = write_out_block(old_id, victim->data);
-    lock_acquire(the_cache->c_lock);
+/* Empty out a victim returned by get_victim().  If it holds a dirty
+ * block, the block is written back first; readers of the old block
+ * can keep copying from the buffer in the meantime, since the data
+ * is still valid.  On success the victim is off its hash chain and
+ * holds nothing, but is still marked as doing io.
+ *
+ * With the flusher keeping most buffers clean, this write should be
+ * rare: it only happens when blocks are being dirtied faster than
+ * the flusher can write them out.
+ */
+
+static
+int
+clean_victim(struct cache *c, struct buf_hdr *victim)
+{
+  struct buf_bucket *bb;
+  int old_id;
+  int result;
+
+  assert(victim->doing_io);
+
+  old_id = victim->id;
+  if (old_id == -1) {
+    /* Came off the free list */
+    return 0;
+  }
 
-    assert(victim->id == old_id);
-    assert(victim->doing_io);
-    assert(victim->dirty);
-    assert(victim->replacing_id == id);
+  bb = BUCKET_OF(c, old_id);
 
+  if (victim->dirty) {
+    result = write_out_blocks(c, old_id, 1, victim->data);
     if (result) {
-      /* Failed write shouldn't destroy buffer content.  
-       * Keep original id, clear replacing_id, and return error.
+      /* Failed write shouldn't destroy buffer content.
+       * Keep original id, give the buffer back to the
+       * replacement policy, and return error.
        */
+      lock_acquire(bb->bb_lock);
       victim->doing_io = FALSE;
-      victim->replacing_id = -1;
-      lock_release(the_cache->c_lock);
+      cv_broadcast(victim->busy_cv, bb->bb_lock);
+      lock_release(bb->bb_lock);
+      io_done(c, victim);
       return result;
     }
-
-    victim->dirty = FALSE;
   }
 
-  /* Now that buffer is clean, read the block we want into the cache. 
-   * During the read, neither the old id (block being replaced) or
-   * the new id (block being read in) is valid, so we set victim->id
-   * to -1 during the read.
-   */
+  lock_acquire(bb->bb_lock);
 
+  assert(victim->id == old_id);
+  assert(victim->doing_io);
+
+  mark_clean(c, victim);
+  unhash_buf(bb, victim);
   victim->id = -1;
 
-  assert(lock_do_i_hold(the_cache->c_lock));
-  lock_release(the_cache->c_lock);
-  result = read_in_block(victim->replacing_id, victim->data);
-  lock_acquire(the_cache->c_lock);
+  /* Threads wanting the old block were waiting for the write-out.
+   * They will now find the block is no longer cached.
+   */
+  cv_broadcast(victim->busy_cv, bb->bb_lock);
+
+  lock_release(bb->bb_lock);
+
+  return 0;
+}
+
+
+/* Account for a hit on "buf", which is on chain "bb".  The first use
+ * of a block that was read ahead is really its first reference, so
+ * the replacement policy isn't told about it: otherwise every block
+ * of a sequential scan would look like it had been used twice.
+ */
+
+static
+void
+count_hit(struct cache *c, struct buf_bucket *bb, struct buf_hdr *buf)
+{
+  assert(lock_do_i_hold(bb->bb_lock));
+
+  bb->bb_hits++;
+  if (buf->readahead) {
+    buf->readahead = FALSE;
+    bb->bb_ra_hits++;
+  }
+  else {
+    c->policy->cp_hit(c, buf);
+  }
+}
+
+
+int
+cache_get(struct cache *c, int id, int flags, struct buf_hdr **ret)
+{
+  struct buf_bucket *bb = BUCKET_OF(c, id);
+  struct buf_hdr *buf;
+  struct buf_hdr *victim;
+  int result;
+
+  assert(id >= 0 && id < c->nblocks);
+
+  while (1) {
+    lock_acquire(bb->bb_lock);
+
+    /* Is the block we want already in the cache? */
+
+    buf = lookup_buf(bb, id);
+    if (buf != NULL && (flags & CACHE_PREFETCH)) {
+      /* Already there, or on its way */
+      lock_release(bb->bb_lock);
+      *ret = NULL;
+      return 0;
+    }
+    while (buf != NULL && (buf->id != id || buf->held || buf->doing_io)) {
+      /* Someone else is reading it in, writing it out to evict it,
+       * or using it.  Wait for them.
+       */
+      DEBUG(DB_CACHE,"have to wait, getting block %d\n",id);
+      cv_wait(buf->busy_cv, bb->bb_lock);
+      /* The read could have failed, or the block could have been
+       * evicted again while we were waiting.  Look it up again.
+       */
+      buf = lookup_buf(bb, id);
+    }
+
+    if (buf != NULL) {
+      /* Found in cache! */
+      buf->held = TRUE;
+      count_hit(c, bb, buf);
+      lock_release(bb->bb_lock);
+      *ret = buf;
+      return 0;
+    }
+
+    lock_release(bb->bb_lock);
+
+    /* Not found in cache.  Select victim and empty it out. */
+
+    victim = get_victim(c, id, flags);
+    result = clean_victim(c, victim);
+    if (result) {
+      return result;
+    }
+
+    /* While we were finding a victim, another thread could have
+     * started reading the same block.  If so, give the victim back
+     * and use theirs.
+     */
+
+    lock_acquire(bb->bb_lock);
+    if (lookup_buf(bb, id) == NULL) {
+      break;
+    }
+    lock_release(bb->bb_lock);
+    put_free_buf(c, victim);
+  }
+
+  /* Put the victim on the chain for the new block before reading it,
+   * to hold off other readers.  During the read, neither the old id
+   * (block being replaced) or the new id (block being read in) is
+   * valid, so victim->id stays -1.
+   */
 
   assert(victim->id == -1);
-  assert(victim->doing_io);
   assert(!victim->dirty);
+  victim->replacing_id = id;
+  victim->hash_next = bb->bb_head;
+  bb->bb_head = victim;
+  lock_release(bb->bb_lock);
+
+  if (flags & CACHE_NOREAD) {
+    /* Whatever was in the buffer before must not leak out if the
+     * caller ends up not overwriting all of it.
+     */
+    bzero(victim->data, BUFSIZE);
+    result = 0;
+  }
+  else {
+    result = read_in_block(c, id, victim->data);
+  }
 
-  victim->doing_io = FALSE;
-  victim->replacing_id = -1;
+  lock_acquire(bb->bb_lock);
+
+  assert(victim->id == -1);
+  assert(victim->doing_io);
+  assert(victim->replacing_id == id);
 
   if (result) {
-    lock_release(the_cache->c_lock);
+    unhash_buf(bb, victim);
+    cv_broadcast(victim->busy_cv, bb->bb_lock);
+    lock_release(bb->bb_lock);
+    put_free_buf(c, victim);
     return result;
   }
 
   victim->id = id;
+  victim->replacing_id = -1;
+  victim->doing_io = FALSE;
+  if (flags & CACHE_PREFETCH) {
+    victim->readahead = TRUE;
+    *ret = NULL;
+  }
+  else {
+    victim->held = TRUE;
+    *ret = victim;
+  }
 
-  /* Copy from cache buffer to block provided */
-
-  memcpy(blk, victim->data, BUFSIZE);
-
-  /* Broadcast to waiters that wanted the same block, if any.
-   * All of them can use the block now, so wake them all up. 
+  /* Broadcast to waiters that wanted the same block, if any.  Unless
+   * it was read ahead they will find it held, and wait again until it
+   * is put back.
    */
 
-  cv_broadcast(victim->busy_cv, the_cache->c_lock);
+  cv_broadcast(victim->busy_cv, bb->bb_lock);
 
-  /* Signal waiters that wanted a non-busy buffer, if any 
+  lock_release(bb->bb_lock);
+
+  /* Signal waiters that wanted a non-busy buffer, if any
    * At most one buffer became non-busy, so no point waking up
    * more than one waiter of this type.
    */
-  cv_signal(the_cache->all_busy_cv, the_cache->c_lock);
-
-  lock_release(the_cache->c_lock);
+  io_done(c, victim);
 
   return 0;
 }
 
 
+/* Give back a held buffer, dirty on behalf of "owner" if "dirty". */
 
-int cache_write(int id, void *blk)
+static
+void
+put_buf(struct cache *c, struct buf_hdr *buf, int dirty, int owner)
 {
+  struct buf_bucket *bb = BUCKET_OF(c, buf->id);
 
-  /* If block "id" is already in cache, copy "blk" 
-   * into cache buffer, otherwise just write it out 
-   * to disk.
-   */
+  lock_acquire(bb->bb_lock);
 
-  int i = 0;
-  
-  lock_acquire(the_cache->c_lock);
-
-  while (i < NBUFS) {
-    for (i=0; i < NBUFS; i++) {
-      if (the_cache->bufs[i].id == id && !the_cache->bufs[i].doing_io) {
-	/* Found it! */
-	memcpy(the_cache->bufs[i].data, blk, BUFSIZE);
-	the_cache->bufs[i].dirty = TRUE;
-	lock_release(the_cache->c_lock);
-	return 0;
-      }
+  assert(buf->held);
 
-      if ( (the_cache->bufs[i].id == id || 
-	    the_cache->bufs[i].replacing_id == id)
-	   && the_cache->bufs[i].doing_io) {
-	/* Wait for I/O to finish */
-	DEBUG(DB_CACHE,"Have to wait on write for block %d\n",id);
-	cv_wait(the_cache->bufs[i].busy_cv, the_cache->c_lock);
-	/* Much could have changed while we were waiting.  Best
-	 * start over from the top.
-	 */
-	break;
-      }
-    }
+  if (dirty) {
+    mark_dirty(c, buf, owner);
   }
+  buf->held = FALSE;
+  cv_broadcast(buf->busy_cv, bb->bb_lock);
 
-  /* Not in cache.  Write straight to disk. */
-  lock_release(the_cache->c_lock);
-
-  return write_out_block(id, blk);
+  lock_release(bb->bb_lock);
 
-  
+  buf_unbusied(c);
 }
 
 
+void
+cache_put(struct cache *c, struct buf_hdr *buf, int dirty)
+{
+  put_buf(c, buf, dirty, CACHE_NOOWNER);
+}
+
 
-static void free_cache_mem(int lastalloc)
+void
+cache_put_owned(struct cache *c, struct buf_hdr *buf, int owner)
 {
-  int i;
-  for (i=0; i < lastalloc; i++) {
-    kfree(the_cache->bufs[i].data);
-    if (the_cache->bufs[i].busy_cv) {
-      cv_destroy(the_cache->bufs[i].busy_cv);
-    }
-  }
+  assert(owner != CACHE_NOOWNER);
+  put_buf(c, buf, TRUE, owner);
+}
 
-  if (the_cache->c_lock) {
-    lock_destroy(the_cache->c_lock);
-  }
 
-  if (the_cache->all_busy_cv) {
-    cv_destroy(the_cache->all_busy_cv);
+void
+cache_invalidate(struct cache *c, struct buf_hdr *buf)
+{
+  struct buf_bucket *bb = BUCKET_OF(c, buf->id);
+  int newer, result;
+
+  /* Only the flusher can change "dirty" while we hold the buffer */
+  lock_acquire(bb->bb_lock);
+  assert(buf->held);
+  newer = buf->dirty || buf->flushing;
+  lock_release(bb->bb_lock);
+
+  if (newer) {
+    cache_put(c, buf, TRUE);
+    return;
   }
 
-  kfree(the_cache);
-  the_cache = NULL;
-
+  /* Nobody else can look at the data while we hold the buffer, so
+   * it can be filled in again in place.
+   */
+  result = read_in_block(c, buf->id, buf->data);
+  if (result) {
+    kprintf("cache %s: block %d: cannot read back: %s\n", c->name,
+	    buf->id, strerror(result));
+  }
+  cache_put(c, buf, FALSE);
 }
 
 
-void check_cache_integrity()
+int
+cache_incore(struct cache *c, int id)
 {
-  int i;
-  int j;
+  struct buf_bucket *bb = BUCKET_OF(c, id);
+  int found;
 
-  lock_acquire(the_cache->c_lock);
-  DEBUG(DB_CACHE,"Checking cache...\n");
-  for (i = 0; i < NBUFS; i++) {
-    if (the_cache->bufs[i].id != -1) {
-      for (j = i+1; j < NBUFS; j++) {
-	if (the_cache->bufs[i].id == the_cache->bufs[j].id) {
-	  kprintf("ERROR: cache integrity check fails. Buffer %d and buffer %d both have id %d\n",i,j,the_cache->bufs[i].id);
-	}
-      }
-    }
-  }
+  assert(id >= 0 && id < c->nblocks);
+
+  lock_acquire(bb->bb_lock);
+  found = lookup_buf(bb, id) != NULL;
+  lock_release(bb->bb_lock);
 
-  lock_release(the_cache->c_lock);
+  return found;
 }
 
 
-int cache_init()
+int
+cache_bread(struct cache *c, int id, void *blk)
 {
-  int i;
+  struct buf_bucket *bb = BUCKET_OF(c, id);
+  struct buf_hdr *buf;
   int result;
-  char path[20];
-  struct vnode *diskvn;
-  struct stat diskstat;
-  int sz;
-  int diskbufs;
-  struct buf_hdr *bufs;
 
-  the_cache = (struct cache *)kmalloc(sizeof(struct cache));
-  if (!the_cache) {
-    return ENOMEM;
-  }
+  /* A hit only needs the chain lock: the data cannot change while we
+   * copy it, since nobody holds the buffer.
+   */
 
-  the_cache->c_lock = lock_create("Cache lock");
-  if (!the_cache->c_lock) {
-    kfree(the_cache);
-    return ENOMEM;
-  }
+  lock_acquire(bb->bb_lock);
 
-  the_cache->all_busy_cv = cv_create("Cache cv");
-  if (!the_cache->all_busy_cv) {
-    lock_destroy(the_cache->c_lock);
-    kfree(the_cache);
-    return ENOMEM;
+  buf = lookup_buf(bb, id);
+  while (buf != NULL && (buf->id != id || buf->held)) {
+    DEBUG(DB_CACHE,"have to wait, reading block %d\n",id);
+    cv_wait(buf->busy_cv, bb->bb_lock);
+    buf = lookup_buf(bb, id);
   }
 
- 
-  bufs = the_cache->bufs;
-
-  for (i=0; i< NBUFS; i++) {
-    bufs[i].id = -1;
-    bufs[i].dirty = FALSE;
-    bufs[i].doing_io = FALSE;
-    bufs[i].replacing_id = -1;
-    bufs[i].busy_cv = cv_create("Buffer cv");
-    if (!bufs[i].busy_cv) {
-      free_cache_mem(i);
-      return ENOMEM;
-    }
-    bufs[i].data = (char *)kmalloc(BUFSIZE);
-    if (!bufs[i].data) {
-      free_cache_mem(i);
-      return ENOMEM;
-    }
+  if (buf != NULL) {
+    /* Found in cache! Copy and return. */
+    memcpy(blk, buf->data, BUFSIZE);
+    count_hit(c, bb, buf);
+    lock_release(bb->bb_lock);
+    return 0;
   }
 
+  lock_release(bb->bb_lock);
 
-  /* Initialize disk device to use for backing storage of buffers */
-
-  /* Open raw disk device */
-  strcpy(path,"lhd0raw:");
-  result = vfs_open(path, O_RDWR, &diskvn);
+  result = cache_get(c, id, 0, &buf);
   if (result) {
-    free_cache_mem(NBUFS);
     return result;
   }
 
-  /* Get size of disk to calculate how many buffers disk can store */
+  /* Copy from cache buffer to block provided */
+  memcpy(blk, buf->data, BUFSIZE);
 
-  result = VOP_STAT(diskvn, &diskstat);
+  cache_put(c, buf, FALSE);
+
+  return 0;
+}
+
+
+int
+cache_bwrite(struct cache *c, int id, const void *blk)
+{
+  return cache_bwrite_owned(c, id, blk, CACHE_NOOWNER);
+}
+
+
+int
+cache_bwrite_owned(struct cache *c, int id, const void *blk, int owner)
+{
+  struct buf_hdr *buf;
+  int result;
+
+  /* The whole block is overwritten, so there's no need to read
+   * it in if it's not cached.  The flusher writes it out later.
+   */
+
+  result = cache_get(c, id, CACHE_NOREAD, &buf);
   if (result) {
-    vfs_close(diskvn);
-    free_cache_mem(NBUFS);
     return result;
   }
 
-  sz = diskstat.st_size;
+  memcpy(buf->data, blk, BUFSIZE);
 
-  /* How many data buffers can we store on disk? */
-  diskbufs = sz / BUFSIZE;
+  put_buf(c, buf, TRUE, owner);
 
-  max_block_id = diskbufs - 1;
-  the_cache->backing_store = diskvn;
+  return 0;
+}
 
 
-  return 0;
+int cache_read(int id, void *blk)
+{
+  return cache_bread(the_cache, id, blk);
+}
 
+
+
+int cache_write(int id, void *blk)
+{
+  return cache_bwrite(the_cache, id, blk);
 }
 
+
+////////////////////////////////////////////////////////////
+//
+// Write-back
+
+/* Take a copy of dirty block "id" for the flusher to write out, and
+ * mark the buffer clean and flushing.  Returns NULL if the block is
+ * no longer dirty, or is busy.
+ */
+
+static
+struct buf_hdr *
+claim_for_flush(struct cache *c, int id, char *copy)
+{
+  struct buf_bucket *bb = BUCKET_OF(c, id);
+  struct buf_hdr *buf;
+
+  lock_acquire(bb->bb_lock);
+
+  buf = lookup_buf(bb, id);
+  if (buf == NULL || buf->id != id || !buf->dirty ||
+      buf->held || buf->doing_io) {
+    lock_release(bb->bb_lock);
+    return NULL;
+  }
+
+  assert(!buf->flushing);
+
+  /* If the block is dirtied again while the copy is being written,
+   * it just becomes dirty again and gets written another time.
+   */
+  memcpy(copy, buf->data, BUFSIZE);
+  mark_clean(c, buf);
+  buf->flushing = TRUE;
+
+  lock_release(bb->bb_lock);
+
+  return buf;
+}
+
+/* The flusher's write of "buf" finished with error code "result".
+ * If it failed the block is dirty again.
+ */
+
+static
+void
+finish_flush(struct cache *c, struct buf_hdr *buf, int result)
+{
+  struct buf_bucket *bb = BUCKET_OF(c, buf->id);
+
+  lock_acquire(bb->bb_lock);
+  assert(buf->flushing);
+  buf->flushing = FALSE;
+  if (result) {
+    mark_dirty(c, buf, buf->owner);
+  }
+  lock_release(bb->bb_lock);
+
+  buf_unbusied(c);
+}
+
+/* Write out a run of adjacent blocks, starting from ids[0], with a
+ * single request to the backing store.  Stops early at a block that
+ * cannot be claimed; that one and the rest of the run are left for
+ * a later pass.
+ */
+
+static
+int
+flush_run(struct cache *c, const int *ids, int count, int *nwritten)
+{
+  struct buf_hdr *claimed[CACHE_FLUSH_RUN];
+  int n, i;
+  int result;
+
+  assert(count <= CACHE_FLUSH_RUN);
+
+  for (n = 0; n < count; n++) {
+    claimed[n] = claim_for_flush(c, ids[n], c->flush_buf + n*BUFSIZE);
+    if (claimed[n] == NULL) {
+      break;
+    }
+  }
+
+  if (n == 0) {
+    return 0;
+  }
+
+  result = write_out_blocks(c, ids[0], n, c->flush_buf);
+
+  for (i = 0; i < n; i++) {
+    finish_flush(c, claimed[i], result);
+  }
+
+  if (result) {
+    return result;
+  }
+
+  c->flush_writes++;
+  c->flush_blocks += n;
+  *nwritten += n;
+  return 0;
+}
+
+/* Write out up to CACHE_FLUSH_BATCH dirty blocks that became dirty at
+ * or before lbolt time "before", and no later than dirty_seq "maxseq";
+ * only those of "owner", unless that is CACHE_NOOWNER.  The blocks are written in order of block id, and adjacent blocks
+ * are written together.  *nwritten is set to the number of blocks
+ * written; *busy is set to a buffer that should have been written
+ * but is held or being evicted, or NULL if there was none.
+ *
+ * Caller must hold flush_lock, which keeps flush_buf and the flush
+ * counters to itself.
+ */
+
+static
+int
+flush_batch(struct cache *c, unsigned maxseq, int before, int owner,
+	    int *nwritten, struct buf_hdr **busy)
+{
+  int ids[CACHE_FLUSH_BATCH];
+  struct buf_hdr *buf;
+  int n, i, j, id;
+  int result, err = 0;
+
+  assert(lock_do_i_hold(c->flush_lock));
+
+  *nwritten = 0;
+  *busy = NULL;
+
+  /* Collect candidates without any locks.  Each one is checked
+   * properly when it is claimed.
+   */
+  n = 0;
+  for (i = 0; i < c->nbufs && n < CACHE_FLUSH_BATCH; i++) {
+    buf = &c->bufs[i];
+    id = buf->id;
+    if (id == -1 || !buf->dirty) {
+      continue;
+    }
+    if ((int)(buf->dirty_seq - maxseq) > 0 || buf->dirty_since > before) {
+      continue;
+    }
+    if (owner != CACHE_NOOWNER && buf->owner != owner) {
+      continue;
+    }
+    if (buf->held || buf->doing_io) {
+      *busy = buf;
+      continue;
+    }
+
+    /* Insertion sort by block id */
+    for (j = n; j > 0 && ids[j-1] > id; j--) {
+      ids[j] = ids[j-1];
+    }
+    ids[j] = id;
+    n++;
+  }
+
+  for (i = 0; i < n; i = j) {
+    for (j = i+1; j < n && j-i < CACHE_FLUSH_RUN; j++) {
+      if (ids[j] != ids[j-1] + 1) {
+	break;
+      }
+    }
+    result = flush_run(c, &ids[i], j-i, nwritten);
+    if (result) {
+      err = result;
+    }
+  }
+
+  return err;
+}
+
+/* A cache thread is exiting.  After this it must not touch the cache. */
+
+static
+void
+thread_done(struct cache *c)
+{
+  lock_acquire(c->c_lock);
+  c->threads_running--;
+  cv_signal(c->exit_cv, c->c_lock);
+  lock_release(c->c_lock);
+}
+
+/* Body of each cache's flusher thread.  Wakes up once a second (see
+ * clock_addtick), or early when a writer pushes the cache over
+ * dirty_high.
+ */
+
+static
+void
+cache_flusher(void *p, unsigned long junk)
+{
+  struct cache *c = p;
+  struct buf_hdr *busy;
+  struct clock_tick tick;
+  int nwritten;
+  int result;
+  int s;
+
+  (void)junk;
+
+  clock_addtick(&tick, FLUSHER_CHAN(c));
+
+  while (!c->exiting) {
+    lock_acquire(c->flush_lock);
+
+    /* Blocks that have been dirty for too long */
+    do {
+      result = flush_batch(c, c->dirty_seq, lbolt - CACHE_MAXAGE,
+			   CACHE_NOOWNER, &nwritten, &busy);
+    } while (result == 0 && nwritten > 0);
+
+    /* Too much of the cache dirty: write back whatever we can */
+    if (result == 0 && c->ndirty > c->dirty_high) {
+      do {
+	result = flush_batch(c, c->dirty_seq, lbolt, CACHE_NOOWNER,
+			     &nwritten, &busy);
+      } while (result == 0 && nwritten > 0 && c->ndirty > c->dirty_low);
+    }
+
+    lock_release(c->flush_lock);
+
+    if (result) {
+      kprintf("cache %s: flusher: %s\n", c->name, strerror(result));
+    }
+
+    s = splhigh();
+    if (!c->flush_kick && !c->exiting) {
+      thread_sleep(FLUSHER_CHAN(c));
+    }
+    c->flush_kick = FALSE;
+    splx(s);
+  }
+
+  clock_removetick(&tick);
+
+  thread_done(c);
+}
+
+
+/* Write out every block of "owner" (any block, if CACHE_NOOWNER) that
+ * is dirty now, and wait for them all.  For cache_sync and
+ * cache_syncowner.
+ */
+
+static
+int
+sync_owner(struct cache *c, int owner)
+{
+  struct buf_bucket *bb;
+  struct buf_hdr *busy;
+  unsigned maxseq;
+  int nwritten;
+  int result, err = 0;
+  int id;
+
+  /* Taking flush_lock also waits for a flush already in progress */
+  lock_acquire(c->flush_lock);
+
+  c->syncs++;
+  maxseq = c->dirty_seq;
+
+  while (1) {
+    result = flush_batch(c, maxseq, lbolt, owner, &nwritten, &busy);
+    if (result) {
+      /* The blocks are dirty again, with a later dirty_seq, so we
+       * won't keep retrying them.
+       */
+      err = result;
+    }
+    if (nwritten > 0) {
+      continue;
+    }
+    if (busy == NULL) {
+      break;
+    }
+
+    /* Only a busy block is left.  Wait for it, then look again. */
+    id = busy->id;
+    if (id == -1) {
+      continue;
+    }
+    bb = BUCKET_OF(c, id);
+    lock_acquire(bb->bb_lock);
+    if (busy->id == id && (busy->held || busy->doing_io)) {
+      cv_wait(busy->busy_cv, bb->bb_lock);
+    }
+    lock_release(bb->bb_lock);
+  }
+
+  lock_release(c->flush_lock);
+
+  return err;
+}
+
+
+int
+cache_sync(struct cache *c)
+{
+  return sync_owner(c, CACHE_NOOWNER);
+}
+
+
+int
+cache_syncowner(struct cache *c, int owner)
+{
+  assert(owner != CACHE_NOOWNER);
+  return sync_owner(c, owner);
+}
+
+
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+void
+cache_readahead(struct cache *c, int id)
+{
+  struct buf_bucket *bb = BUCKET_OF(c, id);
+  int cached;
+
+  if (id < 0 || id >= c->nblocks) {
+    return;
+  }
+
+  /* Don't bother the read-ahead thread with blocks we already have */
+  lock_acquire(bb->bb_lock);
+  cached = (lookup_buf(bb, id) != NULL);
+  lock_release(bb->bb_lock);
+  if (cached) {
+    return;
+  }
+
+  lock_acquire(c->c_lock);
+  c->ra_requests++;
+  if (c->ra_count == CACHE_RA_QUEUE) {
+    c->ra_dropped++;
+  }
+  else {
+    c->ra_queue[(c->ra_head + c->ra_count) % CACHE_RA_QUEUE] = id;
+    c->ra_count++;
+    cv_signal(c->ra_cv, c->c_lock);
+  }
+  lock_release(c->c_lock);
+}
+
+/* Body of each cache's read-ahead thread.  Reads in the queued blocks
+ * in the order they were asked for, so that whoever asked can go on
+ * with the blocks it already has.
+ */
+
+static
+void
+cache_reader(void *p, unsigned long junk)
+{
+  struct cache *c = p;
+  struct buf_hdr *buf;
+  int id;
+  int result;
+
+  (void)junk;
+
+  lock_acquire(c->c_lock);
+  while (!c->exiting) {
+    if (c->ra_count == 0) {
+      cv_wait(c->ra_cv, c->c_lock);
+      continue;
+    }
+    id = c->ra_queue[c->ra_head];
+    c->ra_head = (c->ra_head + 1) % CACHE_RA_QUEUE;
+    c->ra_count--;
+    lock_release(c->c_lock);
+
+    /* Nothing is waiting for this block, so an error is no loss */
+    result = cache_get(c, id, CACHE_PREFETCH, &buf);
+    if (result) {
+      DEBUG(DB_CACHE, "cache %s: read-ahead of block %d: %s\n",
+	    c->name, id, strerror(result));
+    }
+
+    lock_acquire(c->c_lock);
+  }
+  lock_release(c->c_lock);
+
+  thread_done(c);
+}
+
+
+static void free_cache_mem(struct cache *c)
+{
+  int i;
+
+  if (c->policy_data) {
+    c->policy->cp_cleanup(c);
+  }
+
+  if (c->bufs) {
+    for (i=0; i < c->nbufs; i++) {
+      if (c->bufs[i].data) {
+	kfree(c->bufs[i].data);
+      }
+      if (c->bufs[i].busy_cv) {
+	cv_destroy(c->bufs[i].busy_cv);
+      }
+    }
+    kfree(c->bufs);
+  }
+
+  for (i=0; i < NBUCKETS; i++) {
+    if (c->buckets[i].bb_lock) {
+      lock_destroy(c->buckets[i].bb_lock);
+    }
+  }
+
+  if (c->c_lock) {
+    lock_destroy(c->c_lock);
+  }
+
+  if (c->all_busy_cv) {
+    cv_destroy(c->all_busy_cv);
+  }
+
+  if (c->flush_lock) {
+    lock_destroy(c->flush_lock);
+  }
+
+  if (c->ra_cv) {
+    cv_destroy(c->ra_cv);
+  }
+
+  if (c->exit_cv) {
+    cv_destroy(c->exit_cv);
+  }
+
+  if (c->flush_buf) {
+    kfree(c->flush_buf);
+  }
+
+  if (c->name) {
+    kfree((char *)c->name);
+  }
+
+  kfree(c);
+
+}
+
+
+/* Stop the cache's threads, and wait until they are done with it. */
+
+static
+void
+stop_threads(struct cache *c)
+{
+  int s;
+
+  lock_acquire(c->c_lock);
+  s = splhigh();
+  c->exiting = TRUE;
+  thread_wakeup(FLUSHER_CHAN(c));
+  splx(s);
+  cv_broadcast(c->ra_cv, c->c_lock);
+  while (c->threads_running > 0) {
+    cv_wait(c->exit_cv, c->c_lock);
+  }
+  lock_release(c->c_lock);
+}
+
+
+int
+cache_create(const char *name, int nbufs, int nblocks,
+	     cache_io_func io, void *backing_store, struct cache **ret)
+{
+  struct cache *c;
+  struct buf_hdr *bufs;
+  int i;
+  int result;
+
+  assert(nbufs > 0);
+
+  c = (struct cache *)kmalloc(sizeof(struct cache));
+  if (!c) {
+    return ENOMEM;
+  }
+  bzero(c, sizeof(struct cache));
+
+  c->backing_store = backing_store;
+  c->backing_io = io;
+  c->nblocks = nblocks;
+  c->nbufs = nbufs;
+
+#if OPT_CACHE2Q
+  c->policy = &cache_policy_2q;
+#else
+  c->policy = &cache_policy_rr;
+#endif
+
+  c->name = kstrdup(name);
+  if (!c->name) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  c->c_lock = lock_create("Cache lock");
+  if (!c->c_lock) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  c->all_busy_cv = cv_create("Cache cv");
+  if (!c->all_busy_cv) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  c->flush_lock = lock_create("Cache flush lock");
+  if (!c->flush_lock) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  c->ra_cv = cv_create("Cache read-ahead cv");
+  if (!c->ra_cv) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  c->exit_cv = cv_create("Cache exit cv");
+  if (!c->exit_cv) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  c->flush_buf = kmalloc(CACHE_FLUSH_RUN * BUFSIZE);
+  if (!c->flush_buf) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+
+  for (i=0; i < NBUCKETS; i++) {
+    c->buckets[i].bb_lock = lock_create("Cache chain lock");
+    if (!c->buckets[i].bb_lock) {
+      free_cache_mem(c);
+      return ENOMEM;
+    }
+    c->buckets[i].bb_head = NULL;
+  }
+
+  bufs = kmalloc(nbufs * sizeof(struct buf_hdr));
+  if (!bufs) {
+    free_cache_mem(c);
+    return ENOMEM;
+  }
+  bzero(bufs, nbufs * sizeof(struct buf_hdr));
+  c->bufs = bufs;
+
+  /* Every buffer starts out empty, on the free list */
+
+  for (i=0; i< nbufs; i++) {
+    bufs[i].id = -1;
+    bufs[i].dirty = FALSE;
+    bufs[i].owner = CACHE_NOOWNER;
+    bufs[i].doing_io = FALSE;
+    bufs[i].held = FALSE;
+    bufs[i].flushing = FALSE;
+    bufs[i].replacing_id = -1;
+    bufs[i].hash_next = NULL;
+    bufs[i].free_next = (i+1 < nbufs) ? &bufs[i+1] : NULL;
+    bufs[i].lru_queue = 0;
+    bufs[i].lru_next = bufs[i].lru_prev = NULL;
+    bufs[i].referenced = FALSE;
+    bufs[i].busy_cv = cv_create("Buffer cv");
+    if (!bufs[i].busy_cv) {
+      free_cache_mem(c);
+      return ENOMEM;
+    }
+    bufs[i].data = (char *)kmalloc(BUFSIZE);
+    if (!bufs[i].data) {
+      free_cache_mem(c);
+      return ENOMEM;
+    }
+  }
+
+  c->free_list = &bufs[0];
+  c->next_idx = 0;
+  c->all_busy_waiters = 0;
+
+  c->dirty_high = nbufs * CACHE_DIRTY_HIGH / 100;
+  c->dirty_low = nbufs * CACHE_DIRTY_LOW / 100;
+
+  result = c->policy->cp_init(c);
+  if (result) {
+    free_cache_mem(c);
+    return result;
+  }
+
+  c->threads_running = 1;
+  result = thread_fork("cache flusher", c, 0, cache_flusher, NULL);
+  if (result) {
+    free_cache_mem(c);
+    return result;
+  }
+
+  lock_acquire(c->c_lock);
+  c->threads_running++;
+  lock_release(c->c_lock);
+  result = thread_fork("cache read-ahead", c, 0, cache_reader, NULL);
+  if (result) {
+    lock_acquire(c->c_lock);
+    c->threads_running--;
+    lock_release(c->c_lock);
+    stop_threads(c);
+    free_cache_mem(c);
+    return result;
+  }
+
+  lock_acquire(cache_list_lock);
+  c->next_cache = all_caches;
+  all_caches = c;
+  lock_release(cache_list_lock);
+
+  *ret = c;
+  return 0;
+}
+
+
+void
+cache_destroy(struct cache *c)
+{
+  struct cache **pp;
+  int result;
+
+  result = cache_sync(c);
+  if (result) {
+    kprintf("cache %s: warning: dirty blocks lost: %s\n", c->name,
+	    strerror(result));
+  }
+
+  lock_acquire(cache_list_lock);
+  for (pp = &all_caches; *pp != c; pp = &(*pp)->next_cache) {
+    assert(*pp != NULL);
+  }
+  *pp = c->next_cache;
+  lock_release(cache_list_lock);
+
+  stop_threads(c);
+
+  assert(c->ndirty == 0 || result);
+
+  free_cache_mem(c);
+}
+
+
+static
+void
+cache_stats(struct cache *c)
+{
+  unsigned hits = 0;
+  unsigned ra_hits = 0;
+  unsigned misses;
+  int i;
+
+  lock_acquire(c->c_lock);
+
+  /* Chain hit counters are only ever incremented, so reading them
+   * without the chain locks can at worst miss a hit or two.
+   */
+  for (i = 0; i < NBUCKETS; i++) {
+    hits += c->buckets[i].bb_hits;
+    ra_hits += c->buckets[i].bb_ra_hits;
+  }
+  misses = c->misses;
+
+  kprintf("Buffer cache %s: %d buffers, %s replacement\n",
+	  c->name, c->nbufs, c->policy->cp_name);
+  kprintf("  lookups: %u hits, %u misses (%u%% hits)\n", hits, misses,
+	  (hits + misses) ? hits * 100 / (hits + misses) : 0);
+  kprintf("  evictions: %u (%u dirty)\n", c->evictions,
+	  c->dirty_evictions);
+  kprintf("  write-back: %d dirty now, %u blocks flushed in %u writes, %u syncs\n",
+	  c->ndirty, c->flush_blocks, c->flush_writes, c->syncs);
+  kprintf("  read-ahead: %u requests (%u dropped), %u blocks read, %u used, %u wasted\n",
+	  c->ra_requests, c->ra_dropped, c->ra_reads, ra_hits, c->ra_wasted);
+  c->policy->cp_printstats(c);
+
+  lock_release(c->c_lock);
+}
+
+
+void cache_printstats(void)
+{
+  struct cache *c;
+
+  lock_acquire(cache_list_lock);
+
+  if (all_caches == NULL) {
+    kprintf("No buffer caches\n");
+  }
+
+  for (c = all_caches; c != NULL; c = c->next_cache) {
+    cache_stats(c);
+  }
+
+  lock_release(cache_list_lock);
+}
+
+
+void check_cache_integrity()
+{
+  int i;
+  int key;
+  struct buf_bucket *bb;
+  struct buf_hdr *buf;
+  struct buf_hdr *other;
+
+  DEBUG(DB_CACHE,"Checking cache...\n");
+
+  /* A block can only be on the chain its id hashes to, so duplicates
+   * can only be found within a single chain.  Checking one chain at a
+   * time means we never hold up the rest of the cache.
+   */
+  for (i = 0; i < NBUCKETS; i++) {
+    bb = &the_cache->buckets[i];
+    lock_acquire(bb->bb_lock);
+    for (buf = bb->bb_head; buf != NULL; buf = buf->hash_next) {
+      key = (buf->id != -1) ? buf->id : buf->replacing_id;
+      if (BUCKET_OF(the_cache, key) != bb) {
+	kprintf("ERROR: cache integrity check fails. Buffer %d has id %d but is on hash chain %d\n",buf - the_cache->bufs, key, i);
+      }
+      if (buf->id == -1) {
+	continue;
+      }
+      for (other = buf->hash_next; other != NULL; other = other->hash_next) {
+	if (buf->id == other->id) {
+	  kprintf("ERROR: cache integrity check fails. Buffer %d and buffer %d both have id %d\n",buf - the_cache->bufs, other - the_cache->bufs, buf->id);
+	}
+      }
+    }
+    lock_release(bb->bb_lock);
+  }
+}
+
+
+/* Backing store io for the raw disk cache */
+
+static
+int
+vnode_io(void *vn, struct uio *uio)
+{
+  if (uio->uio_rw == UIO_READ) {
+    return VOP_READ((struct vnode *)vn, uio);
+  }
+  return VOP_WRITE((struct vnode *)vn, uio);
+}
+
+
+int cache_init()
+{
+  int result;
+  char path[20];
+  struct vnode *diskvn;
+  struct stat diskstat;
+  int sz;
+  int diskbufs;
+
+  if (the_cache != NULL) {
+    /* Already set up */
+    return 0;
+  }
+
+  /* Initialize disk device to use for backing storage of buffers */
+
+  /* Open raw disk device */
+  strcpy(path,"lhd0raw:");
+  result = vfs_open(path, O_RDWR, &diskvn);
+  if (result) {
+    return result;
+  }
+
+#if !OPT_DUMBVM
+  /* The buffer tests scribble on this disk; don't let them on swap */
+  if (swap_usesvnode(diskvn)) {
+    kprintf("cache: %s is the swap disk\n", path);
+    vfs_close(diskvn);
+    return EBUSY;
+  }
+#endif
+
+  /* Get size of disk to calculate how many buffers disk can store */
+
+  result = VOP_STAT(diskvn, &diskstat);
+  if (result) {
+    vfs_close(diskvn);
+    return result;
+  }
+
+  sz = diskstat.st_size;
+
+  /* How many data buffers can we store on disk? */
+  diskbufs = sz / BUFSIZE;
+
+  result = cache_create("lhd0raw", NBUFS, diskbufs, vnode_io, diskvn,
+			&the_cache);
+  if (result) {
+    vfs_close(diskvn);
+    return result;
+  }
+
+  max_block_id = diskbufs - 1;
+
+  return 0;
+
+}
+
+
+void
+cache_bootstrap(void)
+{
+  cache_list_lock = lock_create("cache list lock");
+  if (cache_list_lock == NULL) {
+    panic("cache_bootstrap: Out of memory\n");
+  }
+}
+
+
+void
+cache_shutdown(void)
+{
+  struct cache *c;
+  int result;
+
+  lock_acquire(cache_list_lock);
+  for (c = all_caches; c != NULL; c = c->next_cache) {
+    result = cache_sync(c);
+    if (result) {
+      kprintf("cache %s: sync failed: %s\n", c->name, strerror(result));
+    }
+  }
+  lock_release(cache_list_lock);
+}
@@ -0,0 +1,429 @@
+/*
+ * 2Q replacement for the buffer cache (Johnson and Shasha, VLDB 1994).
+ *
+ * This is the paper's full 2Q, with its suggested sizes, except for
+ * how hits on A1in are treated.  A block read for the first time goes
+ * on A1in, a FIFO kept to about a quarter of the buffers.  When a block
+ * falls off the end of A1in its id, but not its data, is remembered on
+ * A1out, a FIFO of ids for half as many blocks as there are buffers.
+ * If a block misses while its id is still on A1out, it has been used
+ * again after a while, and it goes on Am, which holds the hot set.  A
+ * sequential scan touches each block once, so it only ever cycles
+ * through A1in and A1out and cannot push the hot set out.
+ *
+ * Full 2Q leaves a block that is hit again while still on A1in where
+ * it is, taking the hit as a correlated reference.  Here it is moved
+ * to Am instead: file system metadata (inodes, bitmap, indirect
+ * blocks) is usually hit again within a short time and belongs in the
+ * hot set.  A scan that reads the same block twice in a row (a partial
+ * block read a piece at a time) can therefore promote it.
+ *
+ * Moving buffers between queues on a hit would mean taking c_lock on
+ * every hit, so instead a hit just sets the buffer's referenced flag,
+ * and the queues are fixed up when a victim is being looked for.  A
+ * referenced buffer found on A1in is moved to Am then.  Am is run as a
+ * clock rather than as a true LRU list: the hand passes over referenced
+ * buffers (clearing the flag) and evicts the first one that has not
+ * been used since the hand last came round.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <synch.h>
+#include <cache.h>
+
+/* Values of lru_queue */
+#define Q_NONE  0
+#define Q_A1IN  1
+#define Q_AM    2
+
+/* Order in which cp_candidate offers buffers */
+#define SCAN_A1IN_FIRST  0   /* A1in is over its target: use it first */
+#define SCAN_AM          1   /* clock over Am */
+#define SCAN_A1IN_LAST   2   /* nothing usable in Am: fall back to A1in */
+#define SCAN_DONE        3
+
+struct bufq {
+  struct buf_hdr *q_head;   /* oldest */
+  struct buf_hdr *q_tail;   /* newest */
+  int q_len;
+};
+
+struct twoq_state {
+  struct bufq a1in;
+  struct bufq am;
+  struct buf_hdr *hand;     /* clock hand for Am */
+  int kin;                  /* target size of A1in */
+
+  /* A1out is a ring of kout block ids, oldest first, with a small
+   * hash table over it so a miss can check it quickly.  Ids that are
+   * taken off early are set to -1 and left to age out of the ring.
+   */
+  int kout;
+  int *ghost_id;
+  int *ghost_next;          /* hash chain, as index into ghost_id */
+  int *ghost_hash;
+  int ghost_hashsize;
+  int ghost_oldest;
+  int ghost_count;
+
+  /* Where cp_candidate is in the current search */
+  int scan_phase;
+  struct buf_hdr *scan_pos;
+  int scan_left;
+
+  unsigned ghost_hits;      /* misses that found their id on A1out */
+  unsigned promotions;      /* buffers moved from A1in to Am after a hit */
+};
+
+////////////////////////////////////////////////////////////
+//
+// Queues
+
+static
+void
+bufq_append(struct bufq *q, struct buf_hdr *buf)
+{
+  buf->lru_next = NULL;
+  buf->lru_prev = q->q_tail;
+  if (q->q_tail) {
+    q->q_tail->lru_next = buf;
+  }
+  else {
+    q->q_head = buf;
+  }
+  q->q_tail = buf;
+  q->q_len++;
+}
+
+static
+void
+bufq_insert_before(struct bufq *q, struct buf_hdr *pos, struct buf_hdr *buf)
+{
+  if (pos == NULL) {
+    bufq_append(q, buf);
+    return;
+  }
+  buf->lru_next = pos;
+  buf->lru_prev = pos->lru_prev;
+  if (pos->lru_prev) {
+    pos->lru_prev->lru_next = buf;
+  }
+  else {
+    q->q_head = buf;
+  }
+  pos->lru_prev = buf;
+  q->q_len++;
+}
+
+static
+void
+bufq_remove(struct bufq *q, struct buf_hdr *buf)
+{
+  if (buf->lru_prev) {
+    buf->lru_prev->lru_next = buf->lru_next;
+  }
+  else {
+    q->q_head = buf->lru_next;
+  }
+  if (buf->lru_next) {
+    buf->lru_next->lru_prev = buf->lru_prev;
+  }
+  else {
+    q->q_tail = buf->lru_prev;
+  }
+  buf->lru_next = buf->lru_prev = NULL;
+  assert(q->q_len > 0);
+  q->q_len--;
+}
+
+////////////////////////////////////////////////////////////
+//
+// A1out
+
+static
+int
+ghost_hashfn(struct twoq_state *tq, int id)
+{
+  return (unsigned)id & (tq->ghost_hashsize-1);
+}
+
+static
+int
+ghost_find(struct twoq_state *tq, int id)
+{
+  int ix;
+
+  for (ix = tq->ghost_hash[ghost_hashfn(tq, id)]; ix >= 0;
+       ix = tq->ghost_next[ix]) {
+    if (tq->ghost_id[ix] == id) {
+      return ix;
+    }
+  }
+  return -1;
+}
+
+static
+void
+ghost_forget(struct twoq_state *tq, int ix)
+{
+  int *pp;
+
+  assert(tq->ghost_id[ix] != -1);
+
+  for (pp = &tq->ghost_hash[ghost_hashfn(tq, tq->ghost_id[ix])];
+       *pp != ix; pp = &tq->ghost_next[*pp]) {
+    assert(*pp >= 0);
+  }
+  *pp = tq->ghost_next[ix];
+  tq->ghost_id[ix] = -1;
+}
+
+static
+void
+ghost_add(struct twoq_state *tq, int id)
+{
+  int ix, h;
+
+  if (tq->ghost_count == tq->kout) {
+    ix = tq->ghost_oldest;
+    if (tq->ghost_id[ix] != -1) {
+      ghost_forget(tq, ix);
+    }
+    tq->ghost_oldest = (tq->ghost_oldest+1) % tq->kout;
+    tq->ghost_count--;
+  }
+
+  ix = (tq->ghost_oldest + tq->ghost_count) % tq->kout;
+  h = ghost_hashfn(tq, id);
+  tq->ghost_id[ix] = id;
+  tq->ghost_next[ix] = tq->ghost_hash[h];
+  tq->ghost_hash[h] = ix;
+  tq->ghost_count++;
+}
+
+/* Put a buffer on Am just behind the clock hand, so that it gets a
+ * full lap of the clock before it can be evicted.
+ */
+static
+void
+am_insert(struct twoq_state *tq, struct buf_hdr *buf)
+{
+  buf->lru_queue = Q_AM;
+  bufq_insert_before(&tq->am, tq->hand, buf);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Policy operations
+
+static
+void
+twoq_cleanup(struct cache *c)
+{
+  struct twoq_state *tq = c->policy_data;
+
+  kfree(tq->ghost_id);
+  kfree(tq->ghost_next);
+  kfree(tq->ghost_hash);
+  kfree(tq);
+  c->policy_data = NULL;
+}
+
+static
+int
+twoq_init(struct cache *c)
+{
+  struct twoq_state *tq;
+  int i;
+
+  tq = kmalloc(sizeof(struct twoq_state));
+  if (tq == NULL) {
+    return ENOMEM;
+  }
+  bzero(tq, sizeof(struct twoq_state));
+  c->policy_data = tq;
+
+  /* The sizes suggested in the paper */
+  tq->kin = c->nbufs/4 > 0 ? c->nbufs/4 : 1;
+  tq->kout = c->nbufs/2 > 0 ? c->nbufs/2 : 1;
+
+  tq->ghost_hashsize = 1;
+  while (tq->ghost_hashsize < tq->kout) {
+    tq->ghost_hashsize *= 2;
+  }
+
+  tq->ghost_id = kmalloc(tq->kout * sizeof(int));
+  tq->ghost_next = kmalloc(tq->kout * sizeof(int));
+  tq->ghost_hash = kmalloc(tq->ghost_hashsize * sizeof(int));
+  if (!tq->ghost_id || !tq->ghost_next || !tq->ghost_hash) {
+    twoq_cleanup(c);
+    return ENOMEM;
+  }
+
+  for (i = 0; i < tq->ghost_hashsize; i++) {
+    tq->ghost_hash[i] = -1;
+  }
+
+  tq->scan_phase = SCAN_DONE;
+  return 0;
+}
+
+static
+void
+twoq_hit(struct cache *c, struct buf_hdr *buf)
+{
+  (void)c;
+
+  if (buf->lru_queue != Q_NONE) {
+    buf->referenced = TRUE;
+  }
+}
+
+static
+void
+twoq_fill(struct cache *c, struct buf_hdr *buf)
+{
+  struct twoq_state *tq = c->policy_data;
+  int ix;
+
+  assert(buf->lru_queue == Q_NONE);
+  assert(buf->id != -1);
+
+  buf->referenced = FALSE;
+
+  ix = ghost_find(tq, buf->id);
+  if (ix >= 0) {
+    ghost_forget(tq, ix);
+    tq->ghost_hits++;
+    am_insert(tq, buf);
+  }
+  else {
+    buf->lru_queue = Q_A1IN;
+    bufq_append(&tq->a1in, buf);
+  }
+}
+
+static
+struct buf_hdr *
+twoq_candidate(struct cache *c, int restart)
+{
+  struct twoq_state *tq = c->policy_data;
+  struct buf_hdr *buf;
+
+  if (restart) {
+    if (tq->a1in.q_len > tq->kin || tq->am.q_len == 0) {
+      tq->scan_phase = SCAN_A1IN_FIRST;
+      tq->scan_pos = tq->a1in.q_head;
+    }
+    else {
+      tq->scan_phase = SCAN_AM;
+      tq->scan_left = 2 * tq->am.q_len;
+    }
+  }
+
+  while (1) {
+    switch (tq->scan_phase) {
+    case SCAN_A1IN_FIRST:
+    case SCAN_A1IN_LAST:
+      while (tq->scan_pos != NULL) {
+	buf = tq->scan_pos;
+	tq->scan_pos = buf->lru_next;
+	if (buf->referenced) {
+	  /* Used again since it came in: promote it */
+	  buf->referenced = FALSE;
+	  bufq_remove(&tq->a1in, buf);
+	  am_insert(tq, buf);
+	  tq->promotions++;
+	  continue;
+	}
+	return buf;
+      }
+      if (tq->scan_phase == SCAN_A1IN_FIRST) {
+	tq->scan_phase = SCAN_AM;
+	tq->scan_left = 2 * tq->am.q_len;
+      }
+      else {
+	tq->scan_phase = SCAN_DONE;
+      }
+      break;
+
+    case SCAN_AM:
+      /* Two laps of the clock: the first may only clear flags */
+      while (tq->scan_left > 0) {
+	tq->scan_left--;
+	if (tq->hand == NULL) {
+	  tq->hand = tq->am.q_head;
+	}
+	buf = tq->hand;
+	tq->hand = buf->lru_next;
+	if (buf->referenced) {
+	  buf->referenced = FALSE;
+	  continue;
+	}
+	return buf;
+      }
+      if (tq->a1in.q_len > tq->kin || tq->am.q_len == 0) {
+	/* Already went through A1in */
+	tq->scan_phase = SCAN_DONE;
+      }
+      else {
+	tq->scan_phase = SCAN_A1IN_LAST;
+	tq->scan_pos = tq->a1in.q_head;
+      }
+      break;
+
+    default:
+      return NULL;
+    }
+  }
+}
+
+static
+void
+twoq_evict(struct cache *c, struct buf_hdr *buf, int old_id)
+{
+  struct twoq_state *tq = c->policy_data;
+
+  /* Don't leave our cursors pointing at a buffer that's leaving */
+  if (tq->hand == buf) {
+    tq->hand = buf->lru_next;
+  }
+  if (tq->scan_pos == buf) {
+    tq->scan_pos = buf->lru_next;
+  }
+
+  if (buf->lru_queue == Q_A1IN) {
+    bufq_remove(&tq->a1in, buf);
+    ghost_add(tq, old_id);
+  }
+  else {
+    assert(buf->lru_queue == Q_AM);
+    bufq_remove(&tq->am, buf);
+  }
+  buf->lru_queue = Q_NONE;
+}
+
+static
+void
+twoq_printstats(struct cache *c)
+{
+  struct twoq_state *tq = c->policy_data;
+
+  kprintf("  2Q: A1in %d (target %d), Am %d, A1out %d of %d ids\n",
+	  tq->a1in.q_len, tq->kin, tq->am.q_len, tq->ghost_count, tq->kout);
+  kprintf("  2Q: %u promoted to Am on a hit, %u on a miss found on A1out\n",
+	  tq->promotions, tq->ghost_hits);
+}
+
+const struct cache_policy cache_policy_2q = {
+  "2Q",
+  twoq_init,
+  twoq_cleanup,
+  twoq_hit,
+  twoq_fill,
+  twoq_candidate,
+  twoq_evict,
+  twoq_printstats,
+};
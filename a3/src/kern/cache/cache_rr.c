@@ -0,0 +1,109 @@
+/*
+ * Round-robin replacement for the buffer cache.
+ *
+ * The hand (the cache's next_idx) simply walks around the buffer array;
+ * the first buffer it reaches that is not doing io is the victim.  Hits
+ * and fills are ignored.  This is cheap, but it has no idea which
+ * blocks are hot: a long enough sequential scan flushes the entire
+ * cache.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <synch.h>
+#include <cache.h>
+
+struct rr_state {
+  int scanned;   /* buffers offered so far in this search */
+};
+
+static
+int
+rr_init(struct cache *c)
+{
+  struct rr_state *rr;
+
+  rr = kmalloc(sizeof(struct rr_state));
+  if (rr == NULL) {
+    return ENOMEM;
+  }
+  rr->scanned = 0;
+
+  c->next_idx = 0;
+  c->policy_data = rr;
+  return 0;
+}
+
+static
+void
+rr_cleanup(struct cache *c)
+{
+  kfree(c->policy_data);
+  c->policy_data = NULL;
+}
+
+static
+void
+rr_hit(struct cache *c, struct buf_hdr *buf)
+{
+  (void)c;
+  (void)buf;
+}
+
+static
+void
+rr_fill(struct cache *c, struct buf_hdr *buf)
+{
+  (void)c;
+  (void)buf;
+}
+
+static
+struct buf_hdr *
+rr_candidate(struct cache *c, int restart)
+{
+  struct rr_state *rr = c->policy_data;
+  struct buf_hdr *buf;
+
+  if (restart) {
+    rr->scanned = 0;
+  }
+
+  /* One lap of the hand is enough to see every buffer once */
+  if (rr->scanned >= c->nbufs) {
+    return NULL;
+  }
+  rr->scanned++;
+
+  buf = &c->bufs[c->next_idx];
+  c->next_idx = (c->next_idx+1) % c->nbufs;
+  return buf;
+}
+
+static
+void
+rr_evict(struct cache *c, struct buf_hdr *buf, int old_id)
+{
+  (void)c;
+  (void)buf;
+  (void)old_id;
+}
+
+static
+void
+rr_printstats(struct cache *c)
+{
+  kprintf("  round-robin hand at buffer %d\n", c->next_idx);
+}
+
+const struct cache_policy cache_policy_rr = {
+  "round-robin",
+  rr_init,
+  rr_cleanup,
+  rr_hit,
+  rr_fill,
+  rr_candidate,
+  rr_evict,
+  rr_printstats,
+};
@@ -6,9 +6,14 @@
 #include <lib.h>
 #include <synch.h>
 #include <kern/errno.h>
+#include <kern/ioctl.h>
 #include <machine/bus.h>
+#include <machine/spl.h>
 #include <uio.h>
+#include <thread.h>
 #include <vfs.h>
+#include <addrspace.h>
+#include <machine/vm.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -30,6 +35,22 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/*
+ * Request queue tuning.
+ *
+ * A request that has waited LHD_DEADLINE seconds goes next, wherever
+ * the head is. A run of merged requests is not allowed to grow past
+ * LHD_MAXRUN sectors, so that a steady sequential stream can't hold
+ * the disk forever. I/O to or from a user buffer that can't be done
+ * directly goes through a bounce buffer of LHD_MAXBOUNCE sectors.
+ */
+#define LHD_DEADLINE    2
+#define LHD_MAXRUN      128
+#define LHD_MAXBOUNCE   8
+
+/* Result of a synchronous request that hasn't finished yet */
+#define LHD_PENDING     (-1)
+
 /*
  * Shortcut for reading a register.
  */
@@ -66,15 +87,155 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector of the active request. It is done when
+ * the interrupt handler sees the operation finish.
+ *
+ * Called at splhigh.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct devreq *req = lh->lh_active;
+	u_int32_t sector = req->dr_block + req->dr_pos;
+	u_int32_t statval = LHD_WORKING;
+
+	assert(curspl>0);
+	assert(req->dr_pos < req->dr_nblocks);
+
+	if (req->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->dr_data + req->dr_pos*LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	if (sector != lh->lh_headpos) {
+		lh->lh_nseeks++;
+	}
+
+	/* Tell it what sector we want, and start the operation. */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Take the next request to do off the queue.
+ *
+ * Without queueing, the queue is in the order requests came in. With
+ * it, the queue is sorted by sector and we use C-LOOK: the head sweeps
+ * up the disk taking the first request at or past where it is, then
+ * jumps back to the lowest one. A request that has been waiting past
+ * its deadline goes before anything else.
+ *
+ * Called at splhigh.
+ */
+static
+struct devreq *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct devreq **pp, **pick = NULL;
+	struct devreq *req;
+
+	assert(curspl>0);
+
+	if (lh->lh_queue == NULL) {
+		return NULL;
+	}
+
+	if (!lh->lh_queueing) {
+		pick = &lh->lh_queue;
+	}
+	else {
+		for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+			if (lbolt >= (*pp)->dr_deadline &&
+			    (pick == NULL ||
+			     (*pp)->dr_deadline < (*pick)->dr_deadline)) {
+				pick = pp;
+			}
+		}
+		if (pick != NULL) {
+			lh->lh_nlate++;
+		}
+		else {
+			for (pp = &lh->lh_queue; *pp != NULL &&
+				     (*pp)->dr_block < lh->lh_headpos;
+			     pp = &(*pp)->dr_next) {
+				/* nothing */
+			}
+			pick = (*pp != NULL) ? pp : &lh->lh_queue;
+		}
+	}
+
+	req = *pick;
+	*pick = req->dr_next;
+	req->dr_next = NULL;
+	lh->lh_queuelen--;
+	return req;
+}
+
+/*
+ * If the disk is idle, start on the next request.
+ *
+ * Called at splhigh.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	if (lh->lh_active == NULL) {
+		lh->lh_active = lhd_pick(lh);
+		if (lh->lh_active == NULL) {
+			return;
+		}
+		lhd_startsect(lh);
+	}
+}
+
+/*
+ * A sector of the active request has finished. Move on to the next
+ * sector, or finish the request and go on to whatever was merged
+ * with it, or to the next request in the queue.
+ *
+ * Called from the interrupt handler.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req = lh->lh_active;
+
+	if (req == NULL) {
+		kprintf("lhd%d: Completion with no request active\n",
+			lh->lh_unit);
+		return;
+	}
+
+	if (err == 0) {
+		if (!req->dr_write) {
+			memcpy((char *)req->dr_data + req->dr_pos*LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		lh->lh_headpos = req->dr_block + req->dr_pos + 1;
+		lh->lh_nsectors++;
+		req->dr_pos++;
+		if (req->dr_pos < req->dr_nblocks) {
+			lhd_startsect(lh);
+			return;
+		}
+	}
+
+	/* This request is done; carry on with the next one in its run */
+	lh->lh_active = req->dr_merged;
+	req->dr_merged = NULL;
+	req->dr_done(req, err);
+
+	if (lh->lh_active != NULL) {
+		lhd_startsect(lh);
+	}
+	else {
+		lhd_dispatch(lh);
+	}
 }
 
 /*
@@ -134,6 +295,35 @@ lhd_close(struct device *d)
 	return 0;
 }
 
+/*
+ * Put the requests on the queue in order by sector, after the queue
+ * has been run first come first served.
+ *
+ * Called at splhigh.
+ */
+static
+void
+lhd_sortqueue(struct lhd_softc *lh)
+{
+	struct devreq *req, *rest, **pp;
+
+	assert(curspl>0);
+
+	rest = lh->lh_queue;
+	lh->lh_queue = NULL;
+	while (rest != NULL) {
+		req = rest;
+		rest = req->dr_next;
+		for (pp = &lh->lh_queue;
+		     *pp != NULL && (*pp)->dr_block <= req->dr_block;
+		     pp = &(*pp)->dr_next) {
+			/* nothing */
+		}
+		req->dr_next = *pp;
+		*pp = req;
+	}
+}
+
 /*
  * Function for handling ioctls.
  */
@@ -141,15 +331,191 @@ static
 int
 lhd_ioctl(struct device *d, int op, userptr_t data)
 {
-	/*
-	 * We don't support any ioctls.
-	 */
-	(void)d;
-	(void)op;
+	struct lhd_softc *lh = d->d_data;
+	int s;
+
 	(void)data;
+
+	switch (op) {
+	    case DIOC_QUEUE_ON:
+	    case DIOC_QUEUE_OFF:
+		s = splhigh();
+		if (op == DIOC_QUEUE_ON && !lh->lh_queueing) {
+			lhd_sortqueue(lh);
+		}
+		lh->lh_queueing = (op == DIOC_QUEUE_ON);
+		lh->lh_nreqs = lh->lh_nmerged = 0;
+		lh->lh_nsectors = lh->lh_nseeks = lh->lh_nlate = 0;
+		lh->lh_nbounced = 0;
+		lh->lh_maxqueue = lh->lh_queuelen;
+		splx(s);
+		return 0;
+
+	    case DIOC_PRINTSTATS:
+		kprintf("lhd%d: queueing %s: %u requests (%u merged), "
+			"%u sectors (%u bounced), %u seeks, %u late, "
+			"max queue %u\n",
+			lh->lh_unit, lh->lh_queueing ? "on" : "off",
+			lh->lh_nreqs, lh->lh_nmerged, lh->lh_nsectors,
+			lh->lh_nbounced, lh->lh_nseeks, lh->lh_nlate,
+			lh->lh_maxqueue);
+		return 0;
+	}
+
 	return EIOCTL;
 }
 
+/*
+ * Try to merge REQ with a request that is already in, so that the
+ * two are done one after the other without a seek in between. REQ may
+ * follow on from the end of the active request's run or of a queued
+ * one, or lead into the start of a queued one.
+ *
+ * Called at splhigh. Returns nonzero if REQ was merged.
+ */
+static
+int
+lhd_merge(struct lhd_softc *lh, struct devreq *req)
+{
+	struct devreq **pp, *head, *last;
+	u_int32_t runlen;
+
+	assert(curspl>0);
+
+	/* Start with the active run, if any; PP is NULL for it */
+	pp = NULL;
+	head = lh->lh_active;
+	if (head == NULL) {
+		pp = &lh->lh_queue;
+		head = *pp;
+	}
+
+	while (head != NULL) {
+		if (head->dr_write == req->dr_write) {
+			runlen = req->dr_nblocks;
+			for (last = head; ; last = last->dr_merged) {
+				runlen += last->dr_nblocks - last->dr_pos;
+				if (last->dr_merged == NULL) {
+					break;
+				}
+			}
+
+			if (runlen <= LHD_MAXRUN &&
+			    last->dr_block + last->dr_nblocks == req->dr_block) {
+				last->dr_merged = req;
+				return 1;
+			}
+
+			if (runlen <= LHD_MAXRUN && pp != NULL &&
+			    req->dr_block + req->dr_nblocks == head->dr_block) {
+				/* Take HEAD's place in the queue */
+				req->dr_merged = head;
+				req->dr_next = head->dr_next;
+				req->dr_deadline = head->dr_deadline;
+				head->dr_next = NULL;
+				*pp = req;
+				return 1;
+			}
+		}
+
+		pp = (pp == NULL) ? &lh->lh_queue : &head->dr_next;
+		head = *pp;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue a request. Called for d_submit, and by lhd_io.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct devreq **pp;
+	int s;
+
+	/* Don't allow empty requests, or I/O past the end of the disk. */
+	if (req->dr_nblocks == 0 || req->dr_block >= d->d_blocks ||
+	    req->dr_nblocks > d->d_blocks - req->dr_block) {
+		return EINVAL;
+	}
+
+	req->dr_pos = 0;
+	req->dr_next = NULL;
+	req->dr_merged = NULL;
+
+	s = splhigh();
+
+	req->dr_deadline = lbolt + LHD_DEADLINE;
+	lh->lh_nreqs++;
+
+	if (lh->lh_queueing && lhd_merge(lh, req)) {
+		lh->lh_nmerged++;
+	}
+	else {
+		/* Sorted by sector if queueing, else at the end */
+		for (pp = &lh->lh_queue; *pp != NULL &&
+			     (!lh->lh_queueing ||
+			      (*pp)->dr_block <= req->dr_block);
+		     pp = &(*pp)->dr_next) {
+			/* nothing */
+		}
+		req->dr_next = *pp;
+		*pp = req;
+
+		lh->lh_queuelen++;
+		if (lh->lh_queuelen > lh->lh_maxqueue) {
+			lh->lh_maxqueue = lh->lh_queuelen;
+		}
+	}
+
+	lhd_dispatch(lh);
+
+	splx(s);
+	return 0;
+}
+
+/*
+ * Completion function for requests lhd_syncio is waiting for.
+ */
+static
+void
+lhd_wakeup(struct devreq *req, int err)
+{
+	volatile int *result = req->dr_arg;
+
+	*result = err;
+	thread_wakeup(req);
+}
+
+/*
+ * Queue a request and wait for it to finish.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, struct devreq *req)
+{
+	volatile int result = LHD_PENDING;
+	int err, s;
+
+	req->dr_done = lhd_wakeup;
+	req->dr_arg = (void *)&result;
+
+	s = splhigh();
+	err = lhd_submit(&lh->lh_dev, req);
+	if (err == 0) {
+		while (result == LHD_PENDING) {
+			thread_sleep(req);
+		}
+		err = result;
+	}
+	splx(s);
+
+	return err;
+}
+
 #if 0
 /*
  * Reset the device.
@@ -164,22 +530,109 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Transfer N sectors, starting at SECTOR, to or from DATA, a kernel
+ * address, and move the uio along past them as uiomove would have.
+ * With queueing off, every request is one sector.
+ */
+static
+int
+lhd_direct(struct lhd_softc *lh, struct devreq *req, u_int32_t sector,
+	   u_int32_t n, char *data, struct uio *uio)
+{
+	u_int32_t i, chunk;
+	int result;
+
+	chunk = lh->lh_queueing ? n : 1;
+
+	for (i=0; i<n; i+=chunk) {
+		req->dr_block = sector+i;
+		req->dr_nblocks = chunk;
+		req->dr_data = data + i*LHD_SECTSIZE;
+		result = lhd_syncio(lh, req);
+		if (result) {
+			return result;
+		}
+
+		uio->uio_iovec.iov_kbase = (char *)uio->uio_iovec.iov_kbase
+			+ chunk*LHD_SECTSIZE;
+		uio->uio_iovec.iov_len -= chunk*LHD_SECTSIZE;
+		uio->uio_offset += chunk*LHD_SECTSIZE;
+		uio->uio_resid -= chunk*LHD_SECTSIZE;
+	}
+	return 0;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Transfer straight to or from the pages of a sector-aligned user
+ * buffer, a page at a time. Each page is pinned while the device is
+ * at it, so it can't be paged out from under the transfer. Sets *DONE
+ * to the number of sectors transferred; if a page can't be pinned,
+ * stops there and leaves the rest to the caller.
+ *
+ * This is for user I/O straight to the device, where nobody has
+ * pinned anything. A caller that already holds a pin on the page must
+ * not come here - pinning it again would wait on its own pin - but
+ * pass the page with mk_physuio instead, as sfs_read does.
+ */
+static
+int
+lhd_userio(struct lhd_softc *lh, struct devreq *req, u_int32_t sector,
+	   u_int32_t len, struct uio *uio, u_int32_t *done)
+{
+	vaddr_t va;
+	paddr_t pa;
+	u_int32_t i, n;
+	int result = 0;
+
+	for (i=0; i<len; i+=n) {
+		va = (vaddr_t)uio->uio_iovec.iov_ubase;
+		if (as_pin(uio->uio_space, va, !req->dr_write, &pa)) {
+			break;
+		}
+
+		n = (PAGE_SIZE - (va & ~PAGE_FRAME)) / LHD_SECTSIZE;
+		if (n > len - i) {
+			n = len - i;
+		}
+
+		result = lhd_direct(lh, req, sector+i, n,
+				    (char *)PADDR_TO_KVADDR(pa), uio);
+		as_unpin(pa);
+		if (result) {
+			break;
+		}
+	}
+
+	*done = i;
+	return result;
+}
+#endif
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Kernel buffers, including pinned pages passed with mk_physuio, are
+ * transferred to and from directly. So are user buffers that start on
+ * a sector boundary, by pinning their pages.
+ * Anything else goes through a bounce buffer, a few sectors at a
+ * time.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct devreq req;
 
 	u_int32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	u_int32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	u_int32_t len = uio->uio_resid / LHD_SECTSIZE;
 	u_int32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	u_int32_t i;
-	u_int32_t statval = LHD_WORKING;
-	int result;
+	u_int32_t i, n, chunk;
+	char *bounce;
+	int result = 0, s;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -191,59 +644,83 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	req.dr_write = (uio->uio_rw == UIO_WRITE);
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		assert(uio->uio_iovec.iov_len >= uio->uio_resid);
+		return lhd_direct(lh, &req, sector, len,
+				  uio->uio_iovec.iov_kbase, uio);
+	}
+
+#if !OPT_DUMBVM
+	if (uio->uio_space != NULL &&
+	    uio->uio_iovec.iov_len >= uio->uio_resid &&
+	    (vaddr_t)uio->uio_iovec.iov_ubase % LHD_SECTSIZE == 0) {
+		result = lhd_userio(lh, &req, sector, len, uio, &n);
+		if (result || n == len) {
+			return result;
+		}
+		sector += n;
+		len -= n;
+	}
+#endif
+
+	chunk = lh->lh_queueing ? LHD_MAXBOUNCE : 1;
+	if (chunk > len) {
+		chunk = len;
+	}
+
+	bounce = kmalloc(chunk*LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<len; i+=n) {
+		n = len - i;
+		if (n > chunk) {
+			n = chunk;
+		}
 
 		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
+		 * Are we writing? If so, get the data from the caller
+		 * first.
 		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (req.dr_write) {
+			result = uiomove(bounce, n*LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+		req.dr_block = sector+i;
+		req.dr_nblocks = n;
+		req.dr_data = bounce;
+		result = lhd_syncio(lh, &req);
 
 		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
+		 * Are we reading? If so, and if we succeeded, give
+		 * the data to the caller.
 		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (result==0 && !req.dr_write) {
+			result = uiomove(bounce, n*LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
 		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
 		}
+
+		s = splhigh();
+		lh->lh_nbounced += n;
+		splx(s);
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -260,23 +737,22 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Start with an empty queue. */
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
+	lh->lh_queueing = 1;
+	lh->lh_nreqs = lh->lh_nmerged = 0;
+	lh->lh_nsectors = lh->lh_nseeks = lh->lh_nlate = 0;
+	lh->lh_nbounced = 0;
+	lh->lh_queuelen = lh->lh_maxqueue = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_submit;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
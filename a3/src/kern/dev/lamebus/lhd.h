@@ -22,9 +22,25 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/*
+	 * Request queue. Changed only at splhigh, since the interrupt
+	 * handler takes requests off it.
+	 */
+	struct devreq *lh_queue;	/* Waiting requests */
+	struct devreq *lh_active;	/* Request being transferred */
+	u_int32_t lh_headpos;		/* Sector after the last one done */
+	int lh_queueing;		/* Sort and merge requests? */
+
+	/* Statistics, since queueing was last turned on or off */
+	unsigned lh_nreqs;		/* Requests submitted */
+	unsigned lh_nmerged;		/* ...that were merged with another */
+	unsigned lh_nsectors;		/* Sectors transferred */
+	unsigned lh_nbounced;		/* ...that were copied via a bounce buffer */
+	unsigned lh_nseeks;		/* Sectors not after the previous one */
+	unsigned lh_nlate;		/* Requests started by deadline */
+	unsigned lh_queuelen;		/* Requests on lh_queue now */
+	unsigned lh_maxqueue;		/* ...and at most */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -0,0 +1,270 @@
+/*
+ * SFS filesystem
+ *
+ * Free space summary.
+ *
+ * The free block bitmap says which blocks are free, but finding one
+ * means scanning it from the start. This keeps a tree over the bitmap
+ * instead: each leaf covers SFS_FT_LEAFBITS blocks, and each node
+ * records, for the blocks it covers, how many free blocks there are
+ * in a row at the start, how many at the end, and the longest free
+ * run anywhere. That is enough to find the first run of a given
+ * length at or after any block in time logarithmic in the size of
+ * the disk, and to keep the tree up to date as bits change.
+ *
+ * The tree lives only in memory. It is built from the bitmap at mount
+ * time, and the caller must call sfs_freetree_update after changing
+ * any bit in the bitmap.
+ *
+ * Locking: the tree is protected by the same lock as the bitmap
+ * (sfs_bitlock).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <sfs.h>
+
+#define SFS_FT_LEAFBITS  32
+
+struct sfs_ftnode {
+	u_int32_t fn_pre;	/* free blocks in a row at the start */
+	u_int32_t fn_suf;	/* free blocks in a row at the end */
+	u_int32_t fn_max;	/* longest run of free blocks */
+};
+
+struct sfs_freetree {
+	struct bitmap *ft_map;		/* the bitmap we summarize */
+	u_int32_t ft_nblocks;		/* blocks on the filesystem */
+	u_int32_t ft_nleaves;		/* a power of two */
+	struct sfs_ftnode *ft_nodes;	/* nodes, heap order from 1 */
+};
+
+/*
+ * Blocks past the end of the filesystem count as in use.
+ */
+static
+int
+ft_isfree(struct sfs_freetree *ft, u_int32_t block)
+{
+	return block < ft->ft_nblocks && !bitmap_isset(ft->ft_map, block);
+}
+
+/* Recompute leaf LEAF from the bitmap. */
+static
+void
+ft_setleaf(struct sfs_freetree *ft, u_int32_t leaf)
+{
+	struct sfs_ftnode *fn = &ft->ft_nodes[ft->ft_nleaves + leaf];
+	u_int32_t base = leaf * SFS_FT_LEAFBITS;
+	u_int32_t i, run = 0;
+
+	fn->fn_pre = fn->fn_max = 0;
+	for (i=0; i<SFS_FT_LEAFBITS; i++) {
+		if (ft_isfree(ft, base+i)) {
+			run++;
+			if (run > fn->fn_max) {
+				fn->fn_max = run;
+			}
+		}
+		else {
+			if (run == i) {
+				fn->fn_pre = run;
+			}
+			run = 0;
+		}
+	}
+	if (run == SFS_FT_LEAFBITS) {
+		fn->fn_pre = run;
+	}
+	fn->fn_suf = run;
+}
+
+/* Recompute node N from its children, each of which covers HALF blocks. */
+static
+void
+ft_pull(struct sfs_freetree *ft, u_int32_t n, u_int32_t half)
+{
+	struct sfs_ftnode *fn = &ft->ft_nodes[n];
+	struct sfs_ftnode *l = &ft->ft_nodes[2*n];
+	struct sfs_ftnode *r = &ft->ft_nodes[2*n+1];
+
+	fn->fn_pre = l->fn_pre == half ? half + r->fn_pre : l->fn_pre;
+	fn->fn_suf = r->fn_suf == half ? half + l->fn_suf : r->fn_suf;
+	fn->fn_max = l->fn_max > r->fn_max ? l->fn_max : r->fn_max;
+	if (l->fn_suf + r->fn_pre > fn->fn_max) {
+		fn->fn_max = l->fn_suf + r->fn_pre;
+	}
+}
+
+/*
+ * Create the summary for bitmap MAP of a filesystem with NBLOCKS
+ * blocks.
+ */
+struct sfs_freetree *
+sfs_freetree_create(struct bitmap *map, u_int32_t nblocks)
+{
+	struct sfs_freetree *ft;
+	u_int32_t n, first, half;
+
+	ft = kmalloc(sizeof(struct sfs_freetree));
+	if (ft == NULL) {
+		return NULL;
+	}
+	ft->ft_map = map;
+	ft->ft_nblocks = nblocks;
+
+	ft->ft_nleaves = 1;
+	while (ft->ft_nleaves * SFS_FT_LEAFBITS < nblocks) {
+		ft->ft_nleaves *= 2;
+	}
+
+	ft->ft_nodes = kmalloc(2 * ft->ft_nleaves * sizeof(struct sfs_ftnode));
+	if (ft->ft_nodes == NULL) {
+		kfree(ft);
+		return NULL;
+	}
+
+	for (n=0; n<ft->ft_nleaves; n++) {
+		ft_setleaf(ft, n);
+	}
+
+	/* Fill in the levels above, from the bottom up */
+	half = SFS_FT_LEAFBITS;
+	for (first = ft->ft_nleaves/2; first >= 1; first /= 2) {
+		for (n=first; n<2*first; n++) {
+			ft_pull(ft, n, half);
+		}
+		half *= 2;
+	}
+
+	return ft;
+}
+
+void
+sfs_freetree_destroy(struct sfs_freetree *ft)
+{
+	kfree(ft->ft_nodes);
+	kfree(ft);
+}
+
+/*
+ * Bit BLOCK of the bitmap has changed.
+ */
+void
+sfs_freetree_update(struct sfs_freetree *ft, u_int32_t block)
+{
+	u_int32_t leaf = block / SFS_FT_LEAFBITS;
+	u_int32_t n, half;
+
+	assert(leaf < ft->ft_nleaves);
+	ft_setleaf(ft, leaf);
+
+	half = SFS_FT_LEAFBITS;
+	for (n = (ft->ft_nleaves + leaf)/2; n >= 1; n /= 2) {
+		ft_pull(ft, n, half);
+		half *= 2;
+	}
+}
+
+/*
+ * Find the first run of WANT free blocks that starts at or after
+ * GOAL, in the subtree of node N, which covers SIZE blocks starting
+ * at LO. Runs that cross from one node into the next are found at
+ * the lowest node that covers both halves of them.
+ */
+static
+int
+ft_search(struct sfs_freetree *ft, u_int32_t n, u_int32_t lo, u_int32_t size,
+	  u_int32_t goal, u_int32_t want, u_int32_t *ret)
+{
+	struct sfs_ftnode *l, *r;
+	u_int32_t half, mid, start, i, run;
+
+	if (lo + size <= goal || ft->ft_nodes[n].fn_max < want) {
+		return 0;
+	}
+
+	if (n >= ft->ft_nleaves) {
+		/* A leaf; look at the bits */
+		start = lo > goal ? lo : goal;
+		run = 0;
+		for (i=start; i<lo+size; i++) {
+			if (!ft_isfree(ft, i)) {
+				run = 0;
+				continue;
+			}
+			if (++run == want) {
+				*ret = i + 1 - want;
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	half = size/2;
+	mid = lo + half;
+
+	if (ft_search(ft, 2*n, lo, half, goal, want, ret)) {
+		return 1;
+	}
+
+	/* A run across the middle? */
+	l = &ft->ft_nodes[2*n];
+	r = &ft->ft_nodes[2*n+1];
+	if (mid > goal) {
+		start = mid - l->fn_suf;
+		if (start < goal) {
+			start = goal;
+		}
+		if (start < mid && mid - start + r->fn_pre >= want) {
+			*ret = start;
+			return 1;
+		}
+	}
+
+	return ft_search(ft, 2*n+1, mid, half, goal, want, ret);
+}
+
+/*
+ * Choose free blocks to allocate. Hands back in *START and *LEN a run
+ * of free blocks, which is at most WANT long, and tries, in order:
+ *
+ *    - the run that starts right at GOAL, however short;
+ *    - the first run of WANT blocks after GOAL;
+ *    - the first run of WANT blocks anywhere;
+ *    - the first free block after GOAL, or anywhere.
+ *
+ * Does not change the bitmap. Returns ENOSPC if the disk is full.
+ */
+int
+sfs_freetree_find(struct sfs_freetree *ft, u_int32_t goal, u_int32_t want,
+		  u_int32_t *start, u_int32_t *len)
+{
+	u_int32_t size = ft->ft_nleaves * SFS_FT_LEAFBITS;
+	u_int32_t s, n;
+
+	assert(want > 0);
+
+	if (goal >= ft->ft_nblocks) {
+		goal = 0;
+	}
+
+	if (ft_isfree(ft, goal)) {
+		s = goal;
+	}
+	else if (!ft_search(ft, 1, 0, size, goal, want, &s) &&
+		 !ft_search(ft, 1, 0, size, 0, want, &s) &&
+		 !ft_search(ft, 1, 0, size, goal, 1, &s) &&
+		 !ft_search(ft, 1, 0, size, 0, 1, &s)) {
+		return ENOSPC;
+	}
+
+	for (n=1; n<want && ft_isfree(ft, s+n); n++);
+
+	*start = s;
+	*len = n;
+	return 0;
+}
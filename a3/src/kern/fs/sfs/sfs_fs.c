@@ -8,12 +8,12 @@
 #include <lib.h>
 #include <synch.h>
 #include <kern/errno.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <dev.h>
 #include <sfs.h>
 #include <vfs.h>
+#include <cache.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
@@ -77,12 +77,65 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Find the next vnode to sync after SV (or the first, if SV is NULL)
+ * in the vnode table, and get a reference to it. Vnodes on the LRU
+ * list are skipped: they were synced when they went on it, and
+ * nobody can have changed them since. The exception is one whose data
+ * couldn't be written when it went on; that is taken off the list,
+ * with the list's reference, so that dropping it afterwards reclaims
+ * it again. Vnodes still being read in are skipped too, as they have
+ * nothing to sync yet.
+ *
+ * Locking: call with sfs_vnlock held.
+ */
+static
+struct sfs_vnode *
+sfs_sync_next(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned b;
+
+	assert(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sv == NULL) {
+		b = 0;
+		sv = sfs->sfs_vnhash[0];
+	}
+	else {
+		b = SFS_VNHASH(sv->sv_ino);
+		sv = sv->sv_hashnext;
+	}
+
+	for (;;) {
+		for (; sv != NULL; sv = sv->sv_hashnext) {
+			if (sv->sv_loading) {
+				continue;
+			}
+			if (!sv->sv_onlru) {
+				VOP_INCREF(&sv->sv_v);
+				return sv;
+			}
+			if (SFS_UNWRITTEN(sv)) {
+				sfs_lru_remove(sfs, sv);
+				return sv;
+			}
+		}
+		if (++b >= SFS_VNHASH_SIZE) {
+			return NULL;
+		}
+		sv = sfs->sfs_vnhash[b];
+	}
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
  *
  * Locking: gets sfs_vnlock, sfs_bitlock, and (via VOP_FSYNC), vnode locks,
  * but none at the same time.
+ *
+ * Everything above only gets the blocks as far as the buffer cache;
+ * the last step is to write out the cache.
  */
 
 static
@@ -90,8 +143,8 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	int i, num, result;
-	struct array *tmp;
+	struct sfs_vnode *sv, *next;
+	int result;
 
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
@@ -127,43 +180,32 @@ sfs_sync(struct fs *fs)
 
 
 	/*
-	 * This is kind of a hack. We can't acquire vnode locks while
-	 * holding sfs_vnlock, because that violates the ordering
-	 * constraints (see sfs_vnode.c) - so we *copy* the array of
-	 * loaded vnodes into a temporary array and sync those.
+	 * We can't acquire vnode locks while holding sfs_vnlock, because
+	 * that violates the ordering constraints (see sfs_vnode.c). So
+	 * we walk the vnode table a vnode at a time, letting go of
+	 * sfs_vnlock to sync each one. The reference we hold on a vnode
+	 * keeps it in the table while we do that, so we can carry on
+	 * from it afterwards.
 	 */
-
-	tmp = array_create();
-	if (tmp == NULL) {
-		return ENOMEM;
-	}
 	lock_acquire(sfs->sfs_vnlock);
-
-	/* Go over the array of loaded vnodes. */
-	num = array_getnum(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct sfs_vnode *sv = array_getguy(sfs->sfs_vnodes, i);
-		VOP_INCREF(&sv->sv_v);
-		if (array_add(tmp, sv) != 0) {
-			// XXX
-			panic("sfs_sync: array_add failed\n");
-		}
-	}
-
+	sv = sfs_sync_next(sfs, NULL);
 	lock_release(sfs->sfs_vnlock);
 
-	/* Now sync. */
-	num = array_getnum(tmp);
-	for (i=0; i<num; i++) {
-		struct sfs_vnode *sv = array_getguy(tmp, i);
+	while (sv != NULL) {
 		result = VOP_FSYNC(&sv->sv_v);
 		if (result) {
 			kprintf("SFS: Warning: syncing inode %d: %s\n",
 				sv->sv_ino, strerror(result));
 		}
+
+		/* Get the next one before dropping this one */
+		lock_acquire(sfs->sfs_vnlock);
+		next = sfs_sync_next(sfs, sv);
+		lock_release(sfs->sfs_vnlock);
+
 		VOP_DECREF(&sv->sv_v);
+		sv = next;
 	}
-	array_destroy(tmp);
 
 	lock_acquire(sfs->sfs_bitlock);
 
@@ -195,6 +237,12 @@ sfs_sync(struct fs *fs)
 
 	lock_release(sfs->sfs_bitlock);
 
+	result = cache_sync(sfs->sfs_cache);
+	if (result) {
+		kprintf("SFS: Warning: writing buffer cache: %s\n",
+			strerror(result));
+	}
+
 	return 0;
 }
 
@@ -237,8 +285,23 @@ sfs_unmount(struct fs *fs)
 	lock_acquire(sfs->sfs_vnlock);
 	lock_acquire(sfs->sfs_bitlock);
 	
-	/* Do we have any files open? If so, can't unmount. */
-	if (array_getnum(sfs->sfs_vnodes)>0) {
+	/*
+	 * Do we have any files open? If so, can't unmount. Vnodes
+	 * that are only still loaded because they're on the LRU list
+	 * don't count.
+	 */
+	if (sfs->sfs_nvnodes > sfs->sfs_nlru) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_bitlock);
+		return EBUSY;
+	}
+
+	/*
+	 * Unload the vnodes on the LRU list. Any whose data still
+	 * couldn't be written by the sync stay, and so does the volume.
+	 */
+	sfs_lru_flush(sfs);
+	if (sfs->sfs_nvnodes > 0) {
 		lock_release(sfs->sfs_vnlock);
 		lock_release(sfs->sfs_bitlock);
 		return EBUSY;
@@ -255,8 +318,11 @@ sfs_unmount(struct fs *fs)
 	assert(sfs->sfs_freemapdirty==0);
 
 	/* Once we start nuking stuff we can't fail. */
-	array_destroy(sfs->sfs_vnodes);
+	sfs_freetree_destroy(sfs->sfs_freetree);
 	bitmap_destroy(sfs->sfs_freemap);
+
+	/* Everything was written out by the sync; this just frees it */
+	cache_destroy(sfs->sfs_cache);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -296,7 +362,8 @@ static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
-	int result;
+	int i, result;
+	u_int32_t block;
 	struct sfs_fs *sfs;
 
 	/* We don't pass any options through mount */
@@ -321,18 +388,28 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	/* The buffer cache must use the same block size. */
+	assert(BUFSIZE == SFS_BLOCKSIZE);
+
+	/* The first mount sets up the vnode allocator */
+	result = sfs_vnode_cacheinit();
+	if (result) {
+		return result;
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = array_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		return ENOMEM;
+	/* Empty vnode table */
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_nlru = 0;
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -340,7 +417,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Create and acquire the locks so various stuff works right */
 	sfs->sfs_vnlock = lock_create("sfs_vnlock");
 	if (sfs->sfs_vnlock == NULL) {
-		array_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		return ENOMEM;
 	}
@@ -348,11 +424,20 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_bitlock = lock_create("sfs_bitlock");
 	if (sfs->sfs_bitlock == NULL) {
 		lock_destroy(sfs->sfs_vnlock);
-		array_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		return ENOMEM;
 	}
 
+	/* Set up the buffer cache, which sfs_rblock() reads through */
+	result = cache_create("sfs", SFS_NBUFS, dev->d_blocks,
+			      sfs_cacheio, sfs, &sfs->sfs_cache);
+	if (result) {
+		lock_destroy(sfs->sfs_vnlock);
+		lock_destroy(sfs->sfs_bitlock);
+		kfree(sfs);
+		return result;
+	}
+
 	lock_acquire(sfs->sfs_vnlock);
 	lock_acquire(sfs->sfs_bitlock);
 
@@ -363,7 +448,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		lock_release(sfs->sfs_bitlock);
 		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
-		array_destroy(sfs->sfs_vnodes);
+		cache_destroy(sfs->sfs_cache);
 		kfree(sfs);
 		return result;
 	}
@@ -379,7 +464,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		lock_release(sfs->sfs_bitlock);
 		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
-		array_destroy(sfs->sfs_vnodes);
+		cache_destroy(sfs->sfs_cache);
 		kfree(sfs);
 		return EINVAL;
 	}
@@ -395,7 +480,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		array_destroy(sfs->sfs_vnodes);
+		cache_destroy(sfs->sfs_cache);
 		kfree(sfs);
 		return ENOMEM;
 	}
@@ -406,10 +491,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		lock_destroy(sfs->sfs_vnlock);
 		lock_destroy(sfs->sfs_bitlock);
 		bitmap_destroy(sfs->sfs_freemap);
-		array_destroy(sfs->sfs_vnodes);
+		cache_destroy(sfs->sfs_cache);
 		kfree(sfs);
 		return result;
 	}
+	sfs->sfs_freetree = sfs_freetree_create(sfs->sfs_freemap,
+						sfs->sfs_super.sp_nblocks);
+	if (sfs->sfs_freetree == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sfs->sfs_bitlock);
+		lock_destroy(sfs->sfs_vnlock);
+		lock_destroy(sfs->sfs_bitlock);
+		bitmap_destroy(sfs->sfs_freemap);
+		cache_destroy(sfs->sfs_cache);
+		kfree(sfs);
+		return ENOMEM;
+	}
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
@@ -422,6 +519,13 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* the other fields */
 	sfs->sfs_superdirty = 0;
 	sfs->sfs_freemapdirty = 0;
+	sfs->sfs_nfree = 0;
+	for (block=0; block<sfs->sfs_super.sp_nblocks; block++) {
+		if (!bitmap_isset(sfs->sfs_freemap, block)) {
+			sfs->sfs_nfree++;
+		}
+	}
+	sfs->sfs_nreserved = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
@@ -4,6 +4,7 @@
 #include <uio.h>
 #include <sfs.h>
 #include <dev.h>
+#include <cache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -12,7 +13,10 @@
 // Note: sfs_rblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
-// except sfs_device.
+// except sfs_device and sfs_cache.
+//
+// sfs_rblock and sfs_wblock go through the buffer cache, which
+// calls sfs_cacheio to do the actual I/O.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -54,18 +58,24 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+/*
+ * I/O function for the buffer cache. The uio may cover several
+ * consecutive blocks.
+ */
+int
+sfs_cacheio(void *sfs, struct uio *uio)
+{
+	return sfs_rwblock(sfs, uio);
+}
+
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, u_int32_t block)
 {
-	struct uio ku;
-	SFSUIO(&ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	return cache_bread(sfs->sfs_cache, block, data);
 }
 
 int
 sfs_wblock(struct sfs_fs *sfs, void *data, u_int32_t block)
 {
-	struct uio ku;
-	SFSUIO(&ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	return cache_bwrite(sfs->sfs_cache, block, data);
 }
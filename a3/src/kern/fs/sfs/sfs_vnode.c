@@ -6,7 +6,6 @@
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
-#include <array.h>
 #include <bitmap.h>
 #include <kern/stat.h>
 #include <kern/errno.h>
@@ -14,6 +13,10 @@
 #include <uio.h>
 #include <dev.h>
 #include <sfs.h>
+#include <cache.h>
+#include <addrspace.h>
+#include <machine/vm.h>
+#include <machine/spl.h>
 
 /* A3 - This file has been changed throughout to provide
  *      file system locking according to the protocol 
@@ -43,7 +46,301 @@
  *
  *    Ordering among directory locks:
  *       Parent first, then child.
+ *
+ *    Vnode locks are readers-writer locks. Operations that only look
+ *    at a vnode (read, stat, getdirentry and lookup) take it shared,
+ *    so that they can run at the same time on the same file; anything
+ *    that changes the vnode or what it refers to takes it exclusive.
+ *    Functions below that only look at the vnode assert that its lock
+ *    is held in some mode; the ones that can change it assert that it
+ *    is held exclusive.
+ *
+ *    The buffer cache's own locks come after all of these. A buffer
+ *    held with cache_get is not a lock as such, but nobody holds more
+ *    than one at a time, and nobody takes any of the locks above
+ *    while holding one.
+ */
+
+/*
+ * In-core directory index. The first time a directory is searched,
+ * all its slots are read once, and the hash of each name goes in a
+ * hash table hung off the vnode, along with its slot number; the
+ * empty slots go on a list. After that, a search reads only the slots
+ * whose names hash the same (normally just the one it's looking for)
+ * and creating a name finds an empty slot without reading any. The
+ * index is kept up to date by sfs_dir_link and sfs_dir_unlink, and is
+ * thrown away when the vnode is unloaded.
+ *
+ * If there isn't memory for the index, directories are searched the
+ * old way, by reading every slot.
  */
+#define SFS_DIRINDEX_MINBUCKETS 16
+
+struct sfs_dirslot {
+  struct sfs_dirslot *ds_next;
+  u_int32_t ds_hash;            /* name hash; unused for empty slots */
+  int ds_slot;
+};
+
+struct sfs_dirindex {
+  struct sfs_dirslot **di_buckets;
+  unsigned di_nbuckets;         /* power of two */
+  unsigned di_nnames;
+  struct sfs_dirslot *di_empty; /* empty slots */
+};
+
+/*
+ * Delayed allocation. Writing to a part of a file that has no block
+ * yet doesn't allocate one; the data goes in a delayed block hung off
+ * the vnode instead, and reads and further writes of that part of
+ * the file use it. sfs_dflush gives the delayed blocks disk blocks,
+ * all in one go so that a run of them can be placed together, and
+ * moves the data into the buffer cache. A new block is overwritten
+ * in full, so it doesn't have to be cleared on disk first.
+ *
+ * This happens when the file is synced or released, and when it has
+ * SFS_DELAY_MAX delayed blocks. Each delayed block holds free blocks
+ * in reserve (sfs_nreserved) for itself and for the most indirect
+ * blocks it could need, so that writes that would not fit fail at
+ * once rather than at flush time. Only a flush may dip into the
+ * reserve, and only into the vnode's own part of it (sv_nresv).
+ */
+struct sfs_dblock {
+  struct sfs_dblock *db_next;   /* in order of db_fileblock */
+  u_int32_t db_fileblock;
+  u_int32_t db_nresv;           /* blocks held in reserve for it */
+  char db_data[SFS_BLOCKSIZE];
+};
+
+/*
+ * File data statistics, for every mounted SFS. Changed at splhigh.
+ */
+static u_int32_t sfs_ct_bytes;	/* file data read or written */
+static u_int32_t sfs_ct_copied;	/* ... copied through a kernel buffer */
+static u_int32_t sfs_ct_direct;	/* ... read straight from the device */
+
+/* Caches that sfs_vnodes, directory index entries and delayed blocks
+ * come from */
+static struct kmcache *sfs_vnode_cache;
+static struct kmcache *sfs_dirslot_cache;
+static struct kmcache *sfs_dblock_cache;
+
+/* Where sfs_loadvnode waits for a vnode someone else is reading in */
+static struct cv *sfs_vnload_cv;
+
+/*
+ * Create the caches and sfs_vnload_cv. Called from sfs_domount, which
+ * vfs_mount runs with its lock held, so there is no race over who
+ * creates them.
+ */
+int
+sfs_vnode_cacheinit(void)
+{
+  if (sfs_vnode_cache == NULL) {
+    sfs_vnode_cache = kmcache_create("sfs_vnode", sizeof(struct sfs_vnode),
+        NULL, NULL);
+    if (sfs_vnode_cache == NULL) {
+      return ENOMEM;
+    }
+  }
+  if (sfs_dirslot_cache == NULL) {
+    sfs_dirslot_cache = kmcache_create("sfs_dirslot",
+        sizeof(struct sfs_dirslot), NULL, NULL);
+    if (sfs_dirslot_cache == NULL) {
+      return ENOMEM;
+    }
+  }
+  if (sfs_dblock_cache == NULL) {
+    sfs_dblock_cache = kmcache_create("sfs_dblock",
+        sizeof(struct sfs_dblock), NULL, NULL);
+    if (sfs_dblock_cache == NULL) {
+      return ENOMEM;
+    }
+  }
+  if (sfs_vnload_cv == NULL) {
+    sfs_vnload_cv = cv_create("sfs_vnload");
+    if (sfs_vnload_cv == NULL) {
+      return ENOMEM;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Free a directory index.
+ */
+static
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+  struct sfs_dirslot *ds;
+  unsigned i;
+
+  for (i=0; i<di->di_nbuckets; i++) {
+    while ((ds = di->di_buckets[i]) != NULL) {
+      di->di_buckets[i] = ds->ds_next;
+      kmcache_free(sfs_dirslot_cache, ds);
+    }
+  }
+  while ((ds = di->di_empty) != NULL) {
+    di->di_empty = ds->ds_next;
+    kmcache_free(sfs_dirslot_cache, ds);
+  }
+  kfree(di->di_buckets);
+  kfree(di);
+}
+
+/*
+ * Vnode table. Loaded vnodes are hashed by inode number; the ones
+ * nobody holds a reference to are also on the LRU list, oldest first,
+ * with the reference count of 1 that sfs_reclaim declined to give up.
+ * Those are normally clean; one whose data sfs_reclaim couldn't write
+ * goes on the LRU list anyway, so that it has an owner, and stays
+ * there until a sync takes it back off to try again (see
+ * SFS_UNWRITTEN). Vnodes still being read in by sfs_loadvnode are hashed too, marked
+ * sv_loading, and must not be touched until that is cleared.
+ * All of this is protected by sfs_vnlock.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, u_int32_t ino)
+{
+  struct sfs_vnode *sv;
+
+  assert(lock_do_i_hold(sfs->sfs_vnlock));
+
+  for (sv = sfs->sfs_vnhash[SFS_VNHASH(ino)]; sv != NULL;
+       sv = sv->sv_hashnext) {
+    if (sv->sv_ino == ino) {
+      return sv;
+    }
+  }
+  return NULL;
+}
+
+static
+void
+sfs_vnhash_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+  struct sfs_vnode **head = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)];
+
+  assert(lock_do_i_hold(sfs->sfs_vnlock));
+
+  sv->sv_hashnext = *head;
+  *head = sv;
+  sfs->sfs_nvnodes++;
+}
+
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+  struct sfs_vnode **svp;
+
+  assert(lock_do_i_hold(sfs->sfs_vnlock));
+
+  for (svp = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)]; *svp != NULL;
+       svp = &(*svp)->sv_hashnext) {
+    if (*svp == sv) {
+      *svp = sv->sv_hashnext;
+      sv->sv_hashnext = NULL;
+      sfs->sfs_nvnodes--;
+      return;
+    }
+  }
+  panic("sfs: vnode %u not in vnode table\n", sv->sv_ino);
+}
+
+static
+void
+sfs_lru_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+  assert(lock_do_i_hold(sfs->sfs_vnlock));
+  assert(!sv->sv_onlru);
+
+  sv->sv_onlru = 1;
+  sv->sv_lrunext = NULL;
+  sv->sv_lruprev = sfs->sfs_lrutail;
+  if (sfs->sfs_lrutail != NULL) {
+    sfs->sfs_lrutail->sv_lrunext = sv;
+  }
+  else {
+    sfs->sfs_lruhead = sv;
+  }
+  sfs->sfs_lrutail = sv;
+  sfs->sfs_nlru++;
+}
+
+void
+sfs_lru_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+  assert(lock_do_i_hold(sfs->sfs_vnlock));
+  assert(sv->sv_onlru);
+
+  if (sv->sv_lruprev != NULL) {
+    sv->sv_lruprev->sv_lrunext = sv->sv_lrunext;
+  }
+  else {
+    sfs->sfs_lruhead = sv->sv_lrunext;
+  }
+  if (sv->sv_lrunext != NULL) {
+    sv->sv_lrunext->sv_lruprev = sv->sv_lruprev;
+  }
+  else {
+    sfs->sfs_lrutail = sv->sv_lruprev;
+  }
+  sv->sv_lrunext = sv->sv_lruprev = NULL;
+  sv->sv_onlru = 0;
+  sfs->sfs_nlru--;
+}
+
+/*
+ * Take a vnode out of the table and free it. Nobody may have a
+ * reference to it besides the one that's being dropped, and its
+ * inode must already have been written back.
+ */
+static
+void
+sfs_vnode_unload(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+  assert(!sv->sv_dirty);
+  assert(sv->sv_delayed == NULL);
+
+  sfs_vnhash_remove(sfs, sv);
+  if (sv->sv_dirindex != NULL) {
+    sfs_dirindex_destroy(sv->sv_dirindex);
+  }
+  rwlock_destroy(sv->sv_lock);
+  VOP_KILL(&sv->sv_v);
+  kmcache_free(sfs_vnode_cache, sv);
+}
+
+/*
+ * Unload the least recently used unreferenced vnodes until there are
+ * at most MAX of them. Ones that still have data to write are passed
+ * over.
+ */
+static
+void
+sfs_lru_trim(struct sfs_fs *sfs, unsigned max)
+{
+  struct sfs_vnode *sv, *next;
+
+  for (sv = sfs->sfs_lruhead; sv != NULL && sfs->sfs_nlru > max;
+       sv = next) {
+    next = sv->sv_lrunext;
+    if (!SFS_UNWRITTEN(sv)) {
+      sfs_lru_remove(sfs, sv);
+      sfs_vnode_unload(sfs, sv);
+    }
+  }
+}
+
+void
+sfs_lru_flush(struct sfs_fs *sfs)
+{
+  sfs_lru_trim(sfs, 0);
+}
 
 /* At bottom of file */
 static int 
@@ -64,16 +361,36 @@ sfs_clearblock(struct sfs_fs *sfs, u_int32_t block)
   return sfs_wblock(sfs, zeros, block);
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Give back a buffer holding one of SV's blocks, changed if DIRTY.
+ * Blocks a file changes are marked as its own in the cache, by inode
+ * number, so that fsync can write out just those.
+ */
+static
+  void
+sfs_bput(struct sfs_vnode *sv, struct buf_hdr *buf, int dirty)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+  if (dirty) {
+    cache_put_owned(sfs->sfs_cache, buf, sv->sv_ino);
+  }
+  else {
+    cache_put(sfs->sfs_cache, buf, 0);
+  }
+}
+
+/* Write an on-disk inode structure back out (to the buffer cache). */
 static
   int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_do_i_hold(sv->sv_lock));
 
   if (sv->sv_dirty) {
     struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-    int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+    int result = cache_bwrite_owned(sfs->sfs_cache, sv->sv_ino,
+        &sv->sv_i, sv->sv_ino);
     if (result) {
       return result;
     }
@@ -87,28 +404,80 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Mark a run of free blocks in use: at most WANT of them, as near
+ * GOAL as can be found (see sfs_freetree_find). The blocks are not
+ * cleared.
+ *
+ * Blocks held in reserve for delayed blocks (sfs_nreserved) are not
+ * handed out, unless RESV is not NULL: it then points at the count of
+ * reserved blocks the caller is owed, and one of those may be used
+ * if nothing else is free.
+ *
  * Locking: gets sfs_bitlock
  */
 static
   int
-sfs_balloc(struct sfs_fs *sfs, u_int32_t *diskblock)
+sfs_bgrab(struct sfs_fs *sfs, u_int32_t goal, u_int32_t want,
+    u_int32_t *resv, u_int32_t *start, u_int32_t *len)
 {
-  int result;
+  u_int32_t i, avail;
+  int result, dipped;
 
   lock_acquire(sfs->sfs_bitlock);
 
-  result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+  assert(sfs->sfs_nfree >= sfs->sfs_nreserved);
+  avail = sfs->sfs_nfree - sfs->sfs_nreserved;
+  dipped = 0;
+  if (avail == 0 && resv != NULL && *resv > 0) {
+    avail = 1;
+    dipped = 1;
+  }
+  if (avail == 0) {
+    lock_release(sfs->sfs_bitlock);
+    return ENOSPC;
+  }
+  if (want > avail) {
+    want = avail;
+  }
+
+  result = sfs_freetree_find(sfs->sfs_freetree, goal, want, start, len);
   if (result) {
     lock_release(sfs->sfs_bitlock);
     return result;
   }
+  for (i=0; i<*len; i++) {
+    bitmap_mark(sfs->sfs_freemap, *start+i);
+    sfs_freetree_update(sfs->sfs_freetree, *start+i);
+  }
+  sfs->sfs_nfree -= *len;
+  if (dipped) {
+    (*resv)--;
+    sfs->sfs_nreserved--;
+  }
   sfs->sfs_freemapdirty = 1;
 
   lock_release(sfs->sfs_bitlock);
 
-  if (*diskblock >= sfs->sfs_super.sp_nblocks) {
-    panic("sfs: balloc: invalid block %u\n", *diskblock);
+  if (*start + *len > sfs->sfs_super.sp_nblocks) {
+    panic("sfs: balloc: invalid block %u\n", *start + *len - 1);
+  }
+  return 0;
+}
+
+/*
+ * Allocate a block, as near GOAL as possible.
+ * Locking: gets sfs_bitlock
+ */
+static
+  int
+sfs_balloc(struct sfs_fs *sfs, u_int32_t goal, u_int32_t *diskblock)
+{
+  u_int32_t len;
+  int result;
+
+  result = sfs_bgrab(sfs, goal, 1, NULL, diskblock, &len);
+  if (result) {
+    return result;
   }
 
   /* Clear block before returning it */
@@ -126,11 +495,126 @@ sfs_bfree(struct sfs_fs *sfs, u_int32_t diskblock)
   lock_acquire(sfs->sfs_bitlock);
 
   bitmap_unmark(sfs->sfs_freemap, diskblock);
+  sfs_freetree_update(sfs->sfs_freetree, diskblock);
+  sfs->sfs_nfree++;
   sfs->sfs_freemapdirty = 1;
 
   lock_release(sfs->sfs_bitlock);
 }
 
+/*
+ * Allocate a block for a file: the next one of the run it was given
+ * last time, or else the first of a new run, as close as possible
+ * after the last block it got. The block is cleared unless CLEAR is
+ * false, which means the caller will overwrite all of it.
+ *
+ * This is only called while flushing delayed blocks, so when nothing
+ * else is free it may use the blocks held in reserve for them. A new
+ * run is then only as long as there is space outside the reserve.
+ *
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  int
+sfs_vballoc(struct sfs_vnode *sv, int clear, u_int32_t *diskblock)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  u_int32_t start, len;
+  int result;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
+
+  if (sv->sv_palen == 0) {
+    result = sfs_bgrab(sfs, sv->sv_goal, sv->sv_pawant, &sv->sv_nresv,
+        &start, &len);
+    if (result) {
+      return result;
+    }
+    sv->sv_pastart = start;
+    sv->sv_palen = len;
+    if (sv->sv_pawant < SFS_PREALLOC_MAX) {
+      sv->sv_pawant *= 2;
+    }
+  }
+
+  *diskblock = sv->sv_pastart++;
+  sv->sv_palen--;
+  sv->sv_goal = *diskblock + 1;
+
+  if (!clear) {
+    return 0;
+  }
+
+  /* Clear block before returning it */
+  return sfs_clearblock(sfs, *diskblock);
+}
+
+/*
+ * Make the run of blocks the file has been given ahead of need at
+ * least WANT blocks long, if there is such a run free where it would
+ * go, so that the next WANT blocks allocated are contiguous. The run
+ * only comes out of space nobody has reserved; if there is none,
+ * this does nothing, and sfs_vballoc uses the reserve a block at a
+ * time.
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  int
+sfs_vbreserve(struct sfs_vnode *sv, u_int32_t want)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  u_int32_t start, len;
+  int result;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
+
+  if (sv->sv_palen >= want) {
+    return 0;
+  }
+  if (want < sv->sv_pawant) {
+    want = sv->sv_pawant;
+  }
+
+  /* Give back what's left of the old run; the new one starts there */
+  while (sv->sv_palen > 0) {
+    sfs_bfree(sfs, sv->sv_pastart++);
+    sv->sv_palen--;
+  }
+
+  result = sfs_bgrab(sfs, sv->sv_goal, want, NULL, &start, &len);
+  if (result == ENOSPC) {
+    return 0;
+  }
+  if (result) {
+    return result;
+  }
+  sv->sv_pastart = start;
+  sv->sv_palen = len;
+  if (sv->sv_pawant < SFS_PREALLOC_MAX) {
+    sv->sv_pawant *= 2;
+  }
+  return 0;
+}
+
+/*
+ * Give back the blocks a file was given ahead of need.
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  void
+sfs_vbrelease(struct sfs_vnode *sv)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
+
+  while (sv->sv_palen > 0) {
+    sfs_bfree(sfs, sv->sv_pastart++);
+    sv->sv_palen--;
+  }
+  sv->sv_pawant = SFS_PREALLOC_MIN;
+}
+
 /*
  * Check if a block is in use.
  */
@@ -156,13 +640,239 @@ sfs_bused(struct sfs_fs *sfs, u_int32_t diskblock)
 //
 // Block mapping/inode maintenance
 
+/* Values for the DOALLOC argument of sfs_bmap */
+#define SFS_BMAP_ALLOC    1     /* allocate the block if it's missing */
+#define SFS_BMAP_NOCLEAR  2     /* with ALLOC: don't clear it on disk */
+
+/*
+ * Number of file blocks under one entry of an indirect block that is
+ * LEVELS levels above the data blocks.
+ */
+static
+  u_int32_t
+sfs_idspan(int levels)
+{
+  u_int32_t span = 1;
+
+  while (--levels > 0) {
+    span *= SFS_DBPERIDB;
+  }
+  return span;
+}
+
+/*
+ * Get or set entry SLOT of indirect block IDBLOCK. Indirect blocks
+ * are used in place in the buffer cache; the buffer is only held for
+ * the copy, since nobody may hold two buffers at once and sfs_balloc
+ * goes through the cache too.
+ *
+ * Locking: must hold vnode lock, which covers the file's indirect
+ * blocks.
+ */
+static
+  int
+sfs_idget(struct sfs_fs *sfs, u_int32_t idblock, unsigned slot,
+    u_int32_t *ret)
+{
+  struct buf_hdr *buf;
+  int result;
+
+  result = cache_get(sfs->sfs_cache, idblock, 0, &buf);
+  if (result) {
+    return result;
+  }
+  *ret = ((u_int32_t *)buf->data)[slot];
+  cache_put(sfs->sfs_cache, buf, 0);
+  return 0;
+}
+
+static
+  int
+sfs_idset(struct sfs_vnode *sv, u_int32_t idblock, unsigned slot,
+    u_int32_t val)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  struct buf_hdr *buf;
+  int result;
+
+  result = cache_get(sfs->sfs_cache, idblock, 0, &buf);
+  if (result) {
+    return result;
+  }
+  ((u_int32_t *)buf->data)[slot] = val;
+  sfs_bput(sv, buf, 1);
+  return 0;
+}
+
+/*
+ * Count the blocks mapped by the inode's extents, and the extents in
+ * use.
+ */
+static
+  u_int32_t
+sfs_extblocks(struct sfs_inode *sfi, int *nextents)
+{
+  u_int32_t total = 0;
+  int i;
+
+  for (i=0; i<SFS_NEXTENTS && sfi->sfi_extents[i].se_len > 0; i++) {
+    total += sfi->sfi_extents[i].se_len;
+  }
+  if (nextents != NULL) {
+    *nextents = i;
+  }
+  return total;
+}
+
+/*
+ * Where to put the next block of a file that has no recent
+ * allocations to go on from: after the end of its extents, or, if it
+ * has none, right after its inode.
+ */
+static
+  u_int32_t
+sfs_vgoal(struct sfs_vnode *sv)
+{
+  struct sfs_extent *ext;
+  int n;
+
+  sfs_extblocks(&sv->sv_i, &n);
+  if (n == 0) {
+    return sv->sv_ino + 1;
+  }
+  ext = &sv->sv_i.sfi_extents[n-1];
+  return ext->se_start + ext->se_len;
+}
+
+/*
+ * Try to add file block FILEBLOCK, which is the first block past the
+ * extents, to the extents. Sets *diskblock to the block allocated, or
+ * to 0 if the block does not fit: that happens when all the extents
+ * are in use and the new block does not carry on from the last one.
+ * The block is cleared if CLEAR is set.
+ *
+ * Locking: must hold vnode lock. Gets/releases (via sfs_vballoc)
+ * sfs_bitlock.
+ */
+static
+  int
+sfs_extappend(struct sfs_vnode *sv, int nextents, int clear,
+    u_int32_t *diskblock)
+{
+  struct sfs_extent *last = NULL;
+  u_int32_t block;
+  int result;
+
+  result = sfs_vballoc(sv, clear, &block);
+  if (result) {
+    return result;
+  }
+
+  if (nextents > 0) {
+    last = &sv->sv_i.sfi_extents[nextents-1];
+  }
+
+  if (last != NULL && last->se_start + last->se_len == block) {
+    last->se_len++;
+  }
+  else if (nextents < SFS_NEXTENTS) {
+    sv->sv_i.sfi_extents[nextents].se_start = block;
+    sv->sv_i.sfi_extents[nextents].se_len = 1;
+  }
+  else {
+    /* Put it back at the front of the file's run for next time */
+    sv->sv_pastart = block;
+    sv->sv_palen++;
+    sv->sv_goal = block;
+    *diskblock = 0;
+    return 0;
+  }
+
+  sv->sv_dirty = 1;
+  *diskblock = block;
+  return 0;
+}
+
+/*
+ * Look up block IDX of the indirect tree rooted at *ROOTP, which has
+ * LEVELS levels of indirect blocks. If DOALLOC is set, missing
+ * indirect blocks and the data block are allocated on the way down
+ * (see sfs_bmap).
+ *
+ * Locking: must hold vnode lock. May get/release (via sfs_vballoc)
+ * sfs_bitlock.
+ */
+static
+  int
+sfs_bmap_tree(struct sfs_vnode *sv, u_int32_t *rootp, int levels,
+    u_int32_t idx, int doalloc, u_int32_t *diskblock)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  u_int32_t block, next, span;
+  unsigned slot;
+  int result;
+
+  block = *rootp;
+  if (block == 0) {
+    if (!doalloc) {
+      *diskblock = 0;
+      return 0;
+    }
+    result = sfs_vballoc(sv, 1, &block);
+    if (result) {
+      return result;
+    }
+    *rootp = block;
+    sv->sv_dirty = 1;
+  }
+
+  for (; levels > 0; levels--) {
+    span = sfs_idspan(levels);
+    slot = idx / span;
+    idx %= span;
+
+    result = sfs_idget(sfs, block, slot, &next);
+    if (result) {
+      return result;
+    }
+    if (next == 0) {
+      if (!doalloc) {
+        *diskblock = 0;
+        return 0;
+      }
+      /* Freshly allocated indirect blocks come back zeroed */
+      result = sfs_vballoc(sv,
+          levels > 1 || !(doalloc & SFS_BMAP_NOCLEAR), &next);
+      if (result) {
+        return result;
+      }
+      result = sfs_idset(sv, block, slot, next);
+      if (result) {
+        sfs_bfree(sfs, next);
+        return result;
+      }
+    }
+    block = next;
+  }
+
+  *diskblock = block;
+  return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated. It is cleared, unless DOALLOC includes SFS_BMAP_NOCLEAR,
+ * which means the caller is going to overwrite all of it.
+ *
+ * A block just past the extents goes into them if it can, either by
+ * growing the last extent or by starting a new one; a file written
+ * out in order onto free space thus maps with a few extents. Other
+ * blocks go through the single, double, and triple indirect blocks
+ * in turn.
  *
- * Locking: must hold vnode lock. May get/release (via sfs_balloc)
+ * Locking: must hold vnode lock. May get/release (via sfs_vballoc)
  * sfs_bitlock.
  *
  */
@@ -171,167 +881,354 @@ static
 sfs_bmap(struct sfs_vnode *sv, u_int32_t fileblock, int doalloc,
     u_int32_t *diskblock)
 {
-  /*
-   * I/O buffer for handling indirect blocks.
-   *
-   * Note: in real life
-   * you would get space from the disk buffer cache for this,
-   * not kmalloc a new buffer each time.
-   */
-  u_int32_t *idbuf;
-
   struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-  u_int32_t block;
-  u_int32_t idblock;
-  u_int32_t idnum, idoff;
-  int result;
+  struct sfs_inode *sfi = &sv->sv_i;
+  struct sfs_extent *ext;
+  u_int32_t block, base, idx, span;
+  int i, levels, result;
+  u_int32_t *roots[3];
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_is_held(sv->sv_lock));
+  assert(!doalloc || rwlock_do_i_hold(sv->sv_lock));
 
   assert((SFS_DBPERIDB*sizeof(u_int32_t))==SFS_BLOCKSIZE);
 
   /*
-   * If the block we want is one of the direct blocks...
+   * Is the block in one of the extents?
    */
-  if (fileblock < SFS_NDIRECT) {
-    /*
-     * Get the block number
-     */
-    block = sv->sv_i.sfi_direct[fileblock];
-
-    /*
-     * Do we need to allocate?
-     */
-    if (block==0 && doalloc) {
-      result = sfs_balloc(sfs, &block);
-      if (result) {
-        return result;
-      }
-
-      /* Remember what we allocated; mark inode dirty */
-      sv->sv_i.sfi_direct[fileblock] = block;
-      sv->sv_dirty = 1;
+  base = 0;
+  for (i=0; i<SFS_NEXTENTS && sfi->sfi_extents[i].se_len > 0; i++) {
+    ext = &sfi->sfi_extents[i];
+    if (fileblock < base + ext->se_len) {
+      block = ext->se_start + (fileblock - base);
+      goto done;
     }
+    base += ext->se_len;
+  }
 
-    /*
-     * Hand back the block
-     */
-    if (block != 0 && !sfs_bused(sfs, block)) {
-      panic("sfs: Data block %u (block %u of file %u) "
-          "marked free\n", block, fileblock, sv->sv_ino);
+  /*
+   * If it's the next block after them, and no indirect block is in
+   * use yet, see if the extents can take it.
+   */
+  if (fileblock == base && doalloc && sfi->sfi_indirect == 0 &&
+      sfi->sfi_dindirect == 0 && sfi->sfi_tindirect == 0) {
+    result = sfs_extappend(sv, i, !(doalloc & SFS_BMAP_NOCLEAR), &block);
+    if (result) {
+      return result;
+    }
+    if (block != 0) {
+      goto done;
     }
-    *diskblock = block;
-    return 0;
   }
 
   /*
-   * It's not a direct block; it must be in the indirect block.
-   * Subtract off the number of direct blocks, so FILEBLOCK is
-   * now the offset into the indirect block space.
+   * Otherwise it's in the indirect blocks; find which tree.
    */
+  roots[0] = &sfi->sfi_indirect;
+  roots[1] = &sfi->sfi_dindirect;
+  roots[2] = &sfi->sfi_tindirect;
+
+  idx = fileblock - base;
+  for (levels=1; levels<=3; levels++) {
+    span = sfs_idspan(levels) * SFS_DBPERIDB;
+    if (idx < span) {
+      break;
+    }
+    idx -= span;
+  }
+  if (levels > 3) {
+    /* Too big */
+    return EINVAL;
+  }
 
-  fileblock -= SFS_NDIRECT;
+  result = sfs_bmap_tree(sv, roots[levels-1], levels, idx, doalloc, &block);
+  if (result) {
+    return result;
+  }
 
-  /* Get the indirect block number and offset w/i that indirect block */
-  idnum = fileblock / SFS_DBPERIDB;
-  idoff = fileblock % SFS_DBPERIDB;
+ done:
+  /* Hand back the result and return. */
+  if (block != 0 && !sfs_bused(sfs, block)) {
+    panic("sfs: Data block %u (block %u of file %u) marked free\n",
+        block, fileblock, sv->sv_ino);
+  }
+  *diskblock = block;
+  return 0;
+}
 
-  /*
-   * We only have one indirect block. If the offset we were asked for
-   * is too large, we can't handle it, so fail.
-   */
-  if (idnum > 0) {
-    return EINVAL;
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+
+/*
+ * Find the delayed block for file block FILEBLOCK, if there is one.
+ * Locking: must hold vnode lock.
+ */
+static
+  struct sfs_dblock *
+sfs_dfind(struct sfs_vnode *sv, u_int32_t fileblock)
+{
+  struct sfs_dblock *db;
+
+  for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+    if (db->db_fileblock >= fileblock) {
+      return db->db_fileblock == fileblock ? db : NULL;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * The most blocks that giving file block FILEBLOCK, which is past
+ * the extents, a disk block could take: the block itself and one
+ * indirect block for each level of the tree it falls in. The extents
+ * only grow, and only by blocks that would otherwise go in the
+ * trees, so this never goes up for a given block.
+ */
+static
+  u_int32_t
+sfs_dneed(struct sfs_vnode *sv, u_int32_t fileblock)
+{
+  u_int32_t base, idx, span;
+  int levels;
+
+  base = sfs_extblocks(&sv->sv_i, NULL);
+  assert(fileblock >= base);
+  idx = fileblock - base;
+
+  for (levels=1; levels<3; levels++) {
+    span = sfs_idspan(levels) * SFS_DBPERIDB;
+    if (idx < span) {
+      break;
+    }
+    idx -= span;
+  }
+  return 1 + levels;
+}
+
+/*
+ * Give back N of the blocks the file holds in reserve, or all of
+ * them if it holds fewer.
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  void
+sfs_dunreserve(struct sfs_vnode *sv, u_int32_t n)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+  if (n > sv->sv_nresv) {
+    n = sv->sv_nresv;
   }
 
-  /* Get the disk block number of the indirect block. */
-  idblock = sv->sv_i.sfi_indirect;
+  lock_acquire(sfs->sfs_bitlock);
+  assert(sfs->sfs_nreserved >= n);
+  sfs->sfs_nreserved -= n;
+  lock_release(sfs->sfs_bitlock);
+
+  sv->sv_nresv -= n;
+}
+
+/*
+ * Make a (zeroed) delayed block for file block FILEBLOCK.
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  int
+sfs_dcreate(struct sfs_vnode *sv, u_int32_t fileblock,
+    struct sfs_dblock **ret)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  struct sfs_dblock *db, **pp;
+  u_int32_t need;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
+
+  need = sfs_dneed(sv, fileblock);
 
-  /* Allocate indirect block buffer */
-  idbuf = (u_int32_t *)kmalloc(SFS_BLOCKSIZE);
-  if (idbuf == NULL) {
+  lock_acquire(sfs->sfs_bitlock);
+  if (sfs->sfs_nfree - sfs->sfs_nreserved < need) {
+    lock_release(sfs->sfs_bitlock);
+    return ENOSPC;
+  }
+  sfs->sfs_nreserved += need;
+  lock_release(sfs->sfs_bitlock);
+  sv->sv_nresv += need;
+
+  db = kmcache_alloc(sfs_dblock_cache);
+  if (db == NULL) {
+    sfs_dunreserve(sv, need);
     return ENOMEM;
   }
+  db->db_fileblock = fileblock;
+  db->db_nresv = need;
+  bzero(db->db_data, SFS_BLOCKSIZE);
+
+  for (pp = &sv->sv_delayed; *pp != NULL; pp = &(*pp)->db_next) {
+    assert((*pp)->db_fileblock != fileblock);
+    if ((*pp)->db_fileblock > fileblock) {
+      break;
+    }
+  }
+  db->db_next = *pp;
+  *pp = db;
+  sv->sv_ndelayed++;
+
+  *ret = db;
+  return 0;
+}
+
+/*
+ * Throw away the delayed block *PP points to. What it held in reserve
+ * is left to the caller.
+ * Locking: must hold vnode lock.
+ */
+static
+  void
+sfs_ddestroy(struct sfs_vnode *sv, struct sfs_dblock **pp)
+{
+  struct sfs_dblock *db = *pp;
+
+  *pp = db->db_next;
+  sv->sv_ndelayed--;
+  kmcache_free(sfs_dblock_cache, db);
+}
+
+/*
+ * Throw away the delayed blocks from file block FILEBLOCK on, and
+ * give back what they held in reserve. For truncate.
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  void
+sfs_ddiscard(struct sfs_vnode *sv, u_int32_t fileblock)
+{
+  struct sfs_dblock **pp;
+  u_int32_t n = 0;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
+
+  pp = &sv->sv_delayed;
+  while (*pp != NULL && (*pp)->db_fileblock < fileblock) {
+    pp = &(*pp)->db_next;
+  }
+  while (*pp != NULL) {
+    n += (*pp)->db_nresv;
+    sfs_ddestroy(sv, pp);
+  }
+  sfs_dunreserve(sv, sv->sv_delayed == NULL ? sv->sv_nresv : n);
+}
+
+/*
+ * Give all the file's delayed blocks disk blocks, and move their data
+ * into the buffer cache. Each run of consecutive file blocks asks for
+ * a run of disk blocks as long as itself.
+ *
+ * The blocks allocated may come out of the file's reserve, which is
+ * given back once all of them are moved. If something fails part
+ * way, the blocks not yet moved stay delayed, and keep what is left
+ * of the reserve.
+ *
+ * Locking: must hold vnode lock. Gets sfs_bitlock.
+ */
+static
+  int
+sfs_dflush(struct sfs_vnode *sv)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  struct sfs_dblock *db;
+  struct buf_hdr *buf;
+  u_int32_t run, diskblock;
+  int result;
 
-  if (idblock==0 && !doalloc) {
-    /*
-     * There's no indirect block allocated. We weren't
-     * asked to allocate anything, so pretend the indirect
-     * block was filled with all zeros.
-     */
-    *diskblock = 0;
-    kfree(idbuf);
-    return 0;
-  }
-  else if (idblock==0) {
-    /*
-     * There's no indirect block allocated, but we need to
-     * allocate a block whose number needs to be stored in
-     * the indirect block. Thus, we need to allocate an
-     * indirect block.
-     */
-    result = sfs_balloc(sfs, &idblock);
+  assert(rwlock_do_i_hold(sv->sv_lock));
+
+  while (sv->sv_delayed != NULL) {
+    run = 1;
+    for (db = sv->sv_delayed; db->db_next != NULL &&
+        db->db_next->db_fileblock == db->db_fileblock+1; db = db->db_next) {
+      run++;
+    }
+    result = sfs_vbreserve(sv, run);
     if (result) {
-      kfree(idbuf);
       return result;
     }
 
-    /* Remember the block we just allocated */
-    sv->sv_i.sfi_indirect = idblock;
+    for (; run > 0; run--) {
+      db = sv->sv_delayed;
+      result = sfs_bmap(sv, db->db_fileblock,
+          SFS_BMAP_ALLOC|SFS_BMAP_NOCLEAR, &diskblock);
+      if (result) {
+        return result;
+      }
 
-    /* Mark the inode dirty */
-    sv->sv_dirty = 1;
+      result = cache_get(sfs->sfs_cache, diskblock, CACHE_NOREAD, &buf);
+      if (result) {
+        return result;
+      }
+      memcpy(buf->data, db->db_data, SFS_BLOCKSIZE);
+      sfs_bput(sv, buf, 1);
 
-    /* Clear the indirect block buffer */
-    bzero(idbuf, SFS_BLOCKSIZE);
-  }
-  else {
-    /*
-     * We already have an indirect block allocated; load it.
-     */
-    result = sfs_rblock(sfs, idbuf, idblock);
-    if (result) {
-      kfree(idbuf);
-      return result;
+      sfs_ddestroy(sv, &sv->sv_delayed);
     }
   }
 
-  /* Get the block out of the indirect block buffer */
-  block = idbuf[idoff];
+  sfs_dunreserve(sv, sv->sv_nresv);
+  return 0;
+}
 
-  /* If there's no block there, allocate one */
-  if (block==0 && doalloc) {
-    result = sfs_balloc(sfs, &block);
-    if (result) {
-      kfree(idbuf);
-      return result;
-    }
+/*
+ * Find file block FILEBLOCK for I/O: hand back its delayed block in
+ * *DBRET, or else its disk block (0 if it has none) in *DISKBLOCK.
+ * A write to a block that has neither gets a new delayed block, after
+ * flushing the old ones if there are SFS_DELAY_MAX of them already.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_bitlock.
+ */
+static
+  int
+sfs_dmap(struct sfs_vnode *sv, u_int32_t fileblock, int writing,
+    struct sfs_dblock **dbret, u_int32_t *diskblock)
+{
+  int result;
+
+  *dbret = sfs_dfind(sv, fileblock);
+  if (*dbret != NULL) {
+    return 0;
+  }
 
-    /* Remember the block we allocated */
-    idbuf[idoff] = block;
+  result = sfs_bmap(sv, fileblock, 0, diskblock);
+  if (result || *diskblock != 0 || !writing) {
+    return result;
+  }
 
-    /* The indirect block is now dirty; write it back */
-    result = sfs_wblock(sfs, idbuf, idblock);
+  if (sv->sv_ndelayed >= SFS_DELAY_MAX) {
+    result = sfs_dflush(sv);
     if (result) {
-      kfree(idbuf);
       return result;
     }
   }
-
-  /* Hand back the result and return. */
-  if (block != 0 && !sfs_bused(sfs, block)) {
-    panic("sfs: Data block %u (block %u of file %u) marked free\n",
-        block, fileblock, sv->sv_ino);
-  }
-  *diskblock = block;
-  kfree(idbuf);
-  return 0;
+  return sfs_dcreate(sv, fileblock, dbret);
 }
 
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/*
+ * Count LEN bytes of file data copied through a kernel buffer.
+ */
+static
+  void
+sfs_countcopy(u_int32_t len)
+{
+  int spl;
+
+  spl = splhigh();
+  sfs_ct_copied += len;
+  splx(spl);
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -342,7 +1239,7 @@ sfs_bmap(struct sfs_vnode *sv, u_int32_t fileblock, int doalloc,
  * the sector; len is the number of bytes to actually read or write.
  * uio is the area to do the I/O into.
  *
- * Locking: must hold vnode lock. May get/release (via sfs_balloc)
+ * Locking: must hold vnode lock. May get/release (via sfs_vballoc)
  * sfs_bitlock.
  */
 static
@@ -350,78 +1247,57 @@ static
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
     u_int32_t skipstart, u_int32_t len)
 {
-  /*
-   * I/O buffer for handling partial sectors.
-   *
-   * Note: in real life
-   * you would get space from the disk buffer cache for this,
-   * not kmalloc a new buffer each time.
-   */
-  char *iobuf = (char *)kmalloc(SFS_BLOCKSIZE);
-
   struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  struct buf_hdr *buf;
+  struct sfs_dblock *db;
   u_int32_t diskblock;
   u_int32_t fileblock;
   int result;
 
-  assert(lock_do_i_hold(sv->sv_lock));
-
-  /* Allocate missing blocks if and only if we're writing */
-  int doalloc = (uio->uio_rw==UIO_WRITE);
+  assert(rwlock_is_held(sv->sv_lock));
 
   assert(skipstart + len <= SFS_BLOCKSIZE);
 
   /* Compute the block offset of this block in the file */
   fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-  /* Get the disk block number */
-  result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+  /* Find the block; writing to a new one makes it a delayed block */
+  result = sfs_dmap(sv, fileblock, uio->uio_rw == UIO_WRITE, &db,
+      &diskblock);
   if (result) {
-    kfree(iobuf);
     return result;
   }
 
+  if (db != NULL) {
+    sfs_countcopy(len);
+    return uiomove(db->db_data+skipstart, len, uio);
+  }
+
   if (diskblock == 0) {
     /*
      * There was no block mapped at this point in the file.
-     * Zero the buffer.
+     * Read zeros.
      */
     assert(uio->uio_rw == UIO_READ);
-    bzero(iobuf, SFS_BLOCKSIZE);
-  }
-  else {
-    /*
-     * Read the block.
-     */
-    result = sfs_rblock(sfs, iobuf, diskblock);
-    if (result) {
-      kfree(iobuf);
-      return result;
-    }
+    return uiomovezeros(len, uio);
   }
 
   /*
-   * Now perform the requested operation into/out of the buffer.
+   * Get the block from the buffer cache and do the requested
+   * operation into/out of it. If it was a write, the cache writes
+   * the modified block back later.
    */
-  result = uiomove(iobuf+skipstart, len, uio);
+  result = cache_get(sfs->sfs_cache, diskblock, 0, &buf);
   if (result) {
-    kfree(iobuf);
     return result;
   }
 
-  /*
-   * If it was a write, write back the modified block.
-   */
-  if (uio->uio_rw == UIO_WRITE) {
-    result = sfs_wblock(sfs, iobuf, diskblock);
-    if (result) {
-      kfree(iobuf);
-      return result;
-    }
-  }
+  sfs_countcopy(len);
+  result = uiomove(buf->data+skipstart, len, uio);
 
-  kfree(iobuf);
-  return 0;
+  sfs_bput(sv, buf, uio->uio_rw == UIO_WRITE);
+
+  return result;
 }
 
 /*
@@ -436,63 +1312,143 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
   struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
   u_int32_t diskblock;
   u_int32_t fileblock;
-  int result;
-  int doalloc = (uio->uio_rw==UIO_WRITE);
-  off_t saveoff;
-  off_t diskoff;
-  off_t saveres;
-  off_t diskres;
+  struct buf_hdr *buf;
+  struct sfs_dblock *db;
+  int noread, result;
 
   /* Get the block number within the file */
   fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-  /* Look up the disk block number */
-  result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+  /* Find the block; writing to a new one makes it a delayed block */
+  result = sfs_dmap(sv, fileblock, uio->uio_rw == UIO_WRITE, &db,
+      &diskblock);
   if (result) {
     return result;
   }
 
+  if (db != NULL) {
+    sfs_countcopy(SFS_BLOCKSIZE);
+    return uiomove(db->db_data, SFS_BLOCKSIZE, uio);
+  }
+
   if (diskblock == 0) {
     /*
      * No block - fill with zeros.
      *
-     * We must be reading, or sfs_bmap would have
-     * allocated a block for us.
+     * We must be reading, or sfs_dmap would have
+     * made a delayed block for us.
      */
     assert(uio->uio_rw == UIO_READ);
     return uiomovezeros(SFS_BLOCKSIZE, uio);
   }
 
-  /* This should be much simpler when reads/write go 
-   * through the buffer cache. Just get a buffer, do 
-   * the uiomove into the buffer's data area, and put
-   * the buffer back.
-   */
-
   /*
-   * Do the I/O directly to the uio region. Save the uio_offset,
-   * and substitute one that makes sense to the device.
+   * Get a buffer, do the uiomove into the buffer's data area, and
+   * put the buffer back. A write that replaces the whole block
+   * doesn't need the old contents read in first.
    */
-  saveoff = uio->uio_offset;
-  diskoff = diskblock * SFS_BLOCKSIZE;
-  uio->uio_offset = diskoff;
+  noread = uio->uio_rw == UIO_WRITE && uio->uio_resid >= SFS_BLOCKSIZE;
+  result = cache_get(sfs->sfs_cache, diskblock,
+      noread ? CACHE_NOREAD : 0, &buf);
+  if (result) {
+    return result;
+  }
 
-  /*
-   * Temporarily set the residue to be one block size.
-   */
-  assert(uio->uio_resid >= SFS_BLOCKSIZE);
-  saveres = uio->uio_resid;
-  diskres = SFS_BLOCKSIZE;
-  uio->uio_resid = diskres;
+  sfs_countcopy(SFS_BLOCKSIZE);
+  result = uiomove(buf->data, SFS_BLOCKSIZE, uio);
 
-  result = sfs_rwblock(sfs, uio);
+  if (result && noread) {
+    /*
+     * The copy failed part way (a bad user pointer), and the rest
+     * of the buffer may be zeros rather than the old data. Don't
+     * let that reach the disk.
+     */
+    cache_invalidate(sfs->sfs_cache, buf);
+    return result;
+  }
 
   /*
-   * Now, restore the original uio_offset and uio_resid and update 
-   * them by the amount of I/O done.
+   * If a write that read the block in failed part way, the buffer
+   * holds the old data with what was copied on top, like a short
+   * write, so it goes out anyway.
    */
-  uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-  uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+  sfs_bput(sv, buf, uio->uio_rw == UIO_WRITE);
+
+  return result;
+}
+
+/*
+ * Read whole blocks straight from the device into the caller's
+ * buffer, for up to NBLOCKS blocks from where the uio is. This only
+ * does blocks that are on disk and not in the buffer cache, since
+ * otherwise the disk may be out of date, and that are next to each
+ * other on disk, so they go in one request; it stops at the first
+ * one that isn't. Sets *DONE to the number of blocks read.
+ *
+ * The buffer is always a kernel one: a user buffer comes here as the
+ * kernel address of a page sfs_read has pinned (see mk_physuio), so
+ * the device reads into it as it is, without pinning it again.
+ *
+ * Holding the vnode lock keeps anyone from writing the blocks while
+ * we read them; if one gets read into the cache meanwhile, say by
+ * read-ahead, that copy is the same as what's on disk.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_bitlock.
+ */
+static
+  int
+sfs_directread(struct sfs_vnode *sv, struct uio *uio, u_int32_t nblocks,
+    u_int32_t *done)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  u_int32_t fileblock, diskblock, start = 0;
+  u_int32_t n, moved;
+  struct uio du;
+  int result, spl;
+
+  assert(rwlock_is_held(sv->sv_lock));
+  assert(uio->uio_rw == UIO_READ);
+  assert(uio->uio_segflg == UIO_SYSSPACE);
+
+  *done = 0;
+  fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+
+  for (n=0; n<nblocks; n++) {
+    if (sfs_dfind(sv, fileblock+n) != NULL) {
+      break;
+    }
+    result = sfs_bmap(sv, fileblock+n, 0, &diskblock);
+    if (result) {
+      return result;
+    }
+    if (diskblock == 0 || (n > 0 && diskblock != start+n) ||
+        cache_incore(sfs->sfs_cache, diskblock)) {
+      break;
+    }
+    if (n == 0) {
+      start = diskblock;
+    }
+  }
+
+  if (n == 0) {
+    return 0;
+  }
+
+  /* Same buffer as the caller's uio, different place on the disk */
+  du = *uio;
+  du.uio_offset = (off_t)start * SFS_BLOCKSIZE;
+  du.uio_resid = n * SFS_BLOCKSIZE;
+  result = sfs_rwblock(sfs, &du);
+
+  moved = n * SFS_BLOCKSIZE - du.uio_resid;
+  uio->uio_iovec = du.uio_iovec;
+  uio->uio_offset += moved;
+  uio->uio_resid -= moved;
+  *done = moved / SFS_BLOCKSIZE;
+
+  spl = splhigh();
+  sfs_ct_direct += moved;
+  splx(spl);
 
   return result;
 }
@@ -507,11 +1463,13 @@ static
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
   u_int32_t blkoff;
-  u_int32_t nblocks, i;
-  int result = 0;
+  u_int32_t nblocks, i, n;
+  int result = 0, direct, spl;
   u_int32_t extraresid = 0;
+  size_t startresid;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_is_held(sv->sv_lock));
+  assert(uio->uio_rw == UIO_READ || rwlock_do_i_hold(sv->sv_lock));
 
   /*
    * If reading, check for EOF. If we can read a partial area,
@@ -533,6 +1491,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
       uio->uio_resid -= extraresid;
     }
   }
+  startresid = uio->uio_resid;
 
   /*
    * First, do any leading partial block.
@@ -563,14 +1522,28 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
   }
 
   /*
-   * Now we should be block-aligned. Do the remaining whole blocks.
+   * Now we should be block-aligned. Do the remaining whole blocks,
+   * reading them straight from the device into a kernel buffer if
+   * there are enough of them.
    */
   assert(uio->uio_offset % SFS_BLOCKSIZE == 0);
   nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-  for (i=0; i<nblocks; i++) {
-    result = sfs_blockio(sv, uio);
-    if (result) {
-      goto out;
+  direct = uio->uio_rw == UIO_READ && uio->uio_segflg == UIO_SYSSPACE &&
+    nblocks >= SFS_DIRECT_MIN;
+  for (i=0; i<nblocks; i+=n) {
+    n = 0;
+    if (direct) {
+      result = sfs_directread(sv, uio, nblocks-i, &n);
+      if (result) {
+        goto out;
+      }
+    }
+    if (n == 0) {
+      result = sfs_blockio(sv, uio);
+      if (result) {
+        goto out;
+      }
+      n = 1;
     }
   }
 
@@ -588,6 +1561,10 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
 out:
 
+  spl = splhigh();
+  sfs_ct_bytes += startresid - uio->uio_resid;
+  splx(spl);
+
   /* If writing, adjust file length */
   if (uio->uio_rw == UIO_WRITE && 
       uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
@@ -602,6 +1579,29 @@ out:
   return result;
 }
 
+/*
+ * Print the file data statistics. Every byte of file data crosses
+ * the device's own buffer once on its way to or from the disk; this
+ * counts the copies on top of that.
+ */
+void
+sfs_printstats(void)
+{
+  u_int32_t bytes, copied, direct;
+  int spl;
+
+  spl = splhigh();
+  bytes = sfs_ct_bytes;
+  copied = sfs_ct_copied;
+  direct = sfs_ct_direct;
+  splx(spl);
+
+  kprintf("SFS file data: %u bytes, %u read directly\n", bytes, direct);
+  kprintf("  %u bytes copied through kernel buffers "
+      "(%u copies per 100 bytes)\n", copied,
+      bytes >= 100 ? copied / (bytes / 100) : 0);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
@@ -620,7 +1620,7 @@ sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
   off_t actualpos;
   int result;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_is_held(sv->sv_lock));
 
   /* Compute the actual position in the directory to read. */
   actualpos = slot * sizeof(struct sfs_dir);
@@ -657,7 +1657,7 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
   off_t actualpos;
   int result;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_do_i_hold(sv->sv_lock));
 
   /* Compute the actual position in the directory. */
   assert(slot>=0);
@@ -694,7 +1694,7 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 {
   off_t size;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_is_held(sv->sv_lock));
 
   assert(sv->sv_i.sfi_type == SFS_TYPE_DIR);
 
@@ -708,16 +1708,174 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Hash function for directory entry names.
+ */
+static
+u_int32_t
+sfs_namehash(const char *name)
+{
+  u_int32_t h = 0;
+
+  while (*name) {
+    h = h*31 + (unsigned char)*name++;
+  }
+  return h;
+}
+
+/*
+ * Put slot SLOT in directory index DI, under HASH if it's a name, or
+ * on the empty list if it's not. Returns an error code.
+ */
+static
+int
+sfs_dirindex_add(struct sfs_dirindex *di, int slot, int isname,
+    u_int32_t hash)
+{
+  struct sfs_dirslot *ds, **newbuckets;
+  unsigned i, n;
+
+  ds = kmcache_alloc(sfs_dirslot_cache);
+  if (ds == NULL) {
+    return ENOMEM;
+  }
+  ds->ds_slot = slot;
+  ds->ds_hash = hash;
+
+  if (!isname) {
+    ds->ds_next = di->di_empty;
+    di->di_empty = ds;
+    return 0;
+  }
+
+  /*
+   * Keep the chains short by doubling the table when there are
+   * twice as many names as buckets. If that fails, carry on with
+   * longer chains.
+   */
+  if (di->di_nnames >= 2*di->di_nbuckets) {
+    n = 2*di->di_nbuckets;
+    newbuckets = kmalloc(n*sizeof(struct sfs_dirslot *));
+    if (newbuckets != NULL) {
+      bzero(newbuckets, n*sizeof(struct sfs_dirslot *));
+      for (i=0; i<di->di_nbuckets; i++) {
+        struct sfs_dirslot *move;
+        while ((move = di->di_buckets[i]) != NULL) {
+          di->di_buckets[i] = move->ds_next;
+          move->ds_next = newbuckets[move->ds_hash & (n-1)];
+          newbuckets[move->ds_hash & (n-1)] = move;
+        }
+      }
+      kfree(di->di_buckets);
+      di->di_buckets = newbuckets;
+      di->di_nbuckets = n;
+    }
+  }
+
+  ds->ds_next = di->di_buckets[hash & (di->di_nbuckets-1)];
+  di->di_buckets[hash & (di->di_nbuckets-1)] = ds;
+  di->di_nnames++;
+  return 0;
+}
+
+/*
+ * Take slot SLOT out of directory index DI: out of the chain for
+ * HASH if it's a name, or off the empty list. It's not an error if
+ * an empty slot isn't there; new slots at the end of the directory
+ * aren't on the list.
+ */
+static
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, int slot, int isname,
+    u_int32_t hash)
+{
+  struct sfs_dirslot *ds, **dsp;
+
+  dsp = isname ? &di->di_buckets[hash & (di->di_nbuckets-1)] : &di->di_empty;
+  for (; *dsp != NULL; dsp = &(*dsp)->ds_next) {
+    ds = *dsp;
+    if (ds->ds_slot == slot) {
+      *dsp = ds->ds_next;
+      kmcache_free(sfs_dirslot_cache, ds);
+      if (isname) {
+        di->di_nnames--;
+      }
+      return;
+    }
+  }
+  if (isname) {
+    panic("sfs: directory index has no slot %d\n", slot);
+  }
+}
+
+/*
+ * Build the index for a directory by reading all its slots.
  *
- * Locking: must hold vnode lock. May get/release sfs_bitlock.
+ * Locking: must hold vnode lock, exclusive. May get/release sfs_bitlock.
+ */
+static
+int
+sfs_dirindex_build(struct sfs_vnode *sv)
+{
+  struct sfs_dirindex *di;
+  struct sfs_dir tsd;
+  int nentries = sfs_dir_nentries(sv);
+  int i, result;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
+  assert(sv->sv_dirindex == NULL);
+
+  di = kmalloc(sizeof(struct sfs_dirindex));
+  if (di == NULL) {
+    return ENOMEM;
+  }
+  di->di_nbuckets = SFS_DIRINDEX_MINBUCKETS;
+  di->di_nnames = 0;
+  di->di_empty = NULL;
+  di->di_buckets = kmalloc(di->di_nbuckets*sizeof(struct sfs_dirslot *));
+  if (di->di_buckets == NULL) {
+    kfree(di);
+    return ENOMEM;
+  }
+  bzero(di->di_buckets, di->di_nbuckets*sizeof(struct sfs_dirslot *));
+
+  for (i=0; i<nentries; i++) {
+    result = sfs_readdir(sv, &tsd, i);
+    if (result == 0) {
+      tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+      result = sfs_dirindex_add(di, i, tsd.sfd_ino != SFS_NOINO,
+          sfs_namehash(tsd.sfd_name));
+    }
+    if (result) {
+      sfs_dirindex_destroy(di);
+      return result;
+    }
+  }
+
+  sv->sv_dirindex = di;
+  return 0;
+}
+
+/*
+ * Throw away a directory's index because it couldn't be updated. It
+ * will be built again next time it's wanted.
  */
+static
+void
+sfs_dirindex_drop(struct sfs_vnode *sv)
+{
+  sfs_dirindex_destroy(sv->sv_dirindex);
+  sv->sv_dirindex = NULL;
+}
 
+/*
+ * Search a directory for a particular filename in a directory, by
+ * reading every slot.
+ *
+ * Locking: must hold vnode lock. May get/release sfs_bitlock.
+ */
 static
   int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
     u_int32_t *ino, int *slot, int *emptyslot)
 {
   struct sfs_dir tsd;
@@ -725,7 +1883,7 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
   int nentries = sfs_dir_nentries(sv);
   int i, result;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_is_held(sv->sv_lock));
 
   /* For each slot... */
   for (i=0; i<nentries; i++) {
@@ -746,21 +1904,87 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
       tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
       if (!strcmp(tsd.sfd_name, name)) {
 
-        /* Each name may legally appear only once... */
-        assert(found==0);
+        /* Each name may legally appear only once... */
+        assert(found==0);
+
+        found = 1;
+        if (slot != NULL) {
+          *slot = i;
+        }
+        if (ino != NULL) {
+          *ino = tsd.sfd_ino;
+        }
+      }
+    }
+  }
+
+  return found ? 0 : ENOENT;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found. Uses the directory's index,
+ * making it first if need be.
+ *
+ * Locking: must hold vnode lock, exclusive unless the index is
+ * already there. May get/release sfs_bitlock.
+ */
+
+static
+  int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+    u_int32_t *ino, int *slot, int *emptyslot)
+{
+  struct sfs_dirindex *di;
+  struct sfs_dirslot *ds;
+  struct sfs_dir tsd;
+  u_int32_t hash;
+  int result;
+
+  assert(rwlock_is_held(sv->sv_lock));
+
+  if (sv->sv_dirindex == NULL) {
+    result = sfs_dirindex_build(sv);
+    if (result == ENOMEM) {
+      return sfs_dir_scan(sv, name, ino, slot, emptyslot);
+    }
+    if (result) {
+      return result;
+    }
+  }
+  di = sv->sv_dirindex;
+
+  if (emptyslot != NULL && di->di_empty != NULL) {
+    *emptyslot = di->di_empty->ds_slot;
+  }
+
+  hash = sfs_namehash(name);
+  for (ds = di->di_buckets[hash & (di->di_nbuckets-1)]; ds != NULL;
+       ds = ds->ds_next) {
+    if (ds->ds_hash != hash) {
+      continue;
+    }
 
-        found = 1;
-        if (slot != NULL) {
-          *slot = i;
-        }
-        if (ino != NULL) {
-          *ino = tsd.sfd_ino;
-        }
+    result = sfs_readdir(sv, &tsd, ds->ds_slot);
+    if (result) {
+      return result;
+    }
+    assert(tsd.sfd_ino != SFS_NOINO);
+
+    tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+    if (!strcmp(tsd.sfd_name, name)) {
+      if (slot != NULL) {
+        *slot = ds->ds_slot;
       }
+      if (ino != NULL) {
+        *ino = tsd.sfd_ino;
+      }
+      return 0;
     }
   }
 
-  return found ? 0 : ENOENT;
+  return ENOENT;
 }
 
 /*
@@ -777,7 +2001,7 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, u_int32_t ino, int *slot)
   int result;
   struct sfs_dir sd;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_do_i_hold(sv->sv_lock));
 
   /* Look up the name. We want to make sure it *doesn't* exist. */
   result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -808,8 +2032,21 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, u_int32_t ino, int *slot)
   }
 
   /* Write the entry. */
-  return sfs_writedir(sv, &sd, emptyslot);
+  result = sfs_writedir(sv, &sd, emptyslot);
+  if (result) {
+    return result;
+  }
 
+  /* The slot is no longer empty */
+  if (sv->sv_dirindex != NULL) {
+    sfs_dirindex_remove(sv->sv_dirindex, emptyslot, 0, 0);
+    if (sfs_dirindex_add(sv->sv_dirindex, emptyslot, 1,
+            sfs_namehash(name))) {
+      sfs_dirindex_drop(sv);
+    }
+  }
+
+  return 0;
 }
 
 /*
@@ -822,15 +2059,40 @@ static
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
   struct sfs_dir sd;
+  u_int32_t hash = 0;
+  int result;
+
+  assert(rwlock_do_i_hold(sv->sv_lock));
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  /* The index needs the name that's going away */
+  if (sv->sv_dirindex != NULL) {
+    result = sfs_readdir(sv, &sd, slot);
+    if (result) {
+      return result;
+    }
+    assert(sd.sfd_ino != SFS_NOINO);
+    sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+    hash = sfs_namehash(sd.sfd_name);
+  }
 
   /* Initialize a suitable directory entry... */ 
   bzero(&sd, sizeof(sd));
   sd.sfd_ino = SFS_NOINO;
 
   /* ... and write it */
-  return sfs_writedir(sv, &sd, slot);
+  result = sfs_writedir(sv, &sd, slot);
+  if (result) {
+    return result;
+  }
+
+  if (sv->sv_dirindex != NULL) {
+    sfs_dirindex_remove(sv->sv_dirindex, slot, 1, hash);
+    if (sfs_dirindex_add(sv->sv_dirindex, slot, 0, 0)) {
+      sfs_dirindex_drop(sv);
+    }
+  }
+
+  return 0;
 }
 
 /*
@@ -851,7 +2113,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
   u_int32_t ino;
   int result;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_is_held(sv->sv_lock));
 
   result = sfs_dir_findname(sv, name, &ino, slot, NULL);
   if (result) {
@@ -876,7 +2138,9 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. The inode
+ * goes as near block GOAL as possible; callers pass the directory
+ * it is being created in, so files stay close to their directories.
  *
  * Locking: Gets/release sfs_bitlock.
  *    Also gets/releases sfs_vnlock, but does not hold them together.
@@ -884,7 +2148,8 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
  */
 static
   int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, u_int32_t goal,
+    struct sfs_vnode **ret)
 {
   u_int32_t ino;
   int result;
@@ -894,7 +2159,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
    * number is the block number, so just get a block.)
    */
 
-  result = sfs_balloc(sfs, &ino);
+  result = sfs_balloc(sfs, goal, &ino);
   if (result) {
     return result;
   }
@@ -968,14 +2233,20 @@ sfs_opendir(struct vnode *v, int openflags)
  * This function should attempt to avoid returning errors, as handling
  * them usefully is often not possible.
  *
+ * Nothing is written here: the file's data is already in the buffer
+ * cache, or held as delayed blocks that sfs_reclaim allocates when
+ * the last reference goes, and the cache's flusher writes it out in
+ * the background from there. Waiting for the disk is what fsync is
+ * for.
+ *
  * Locking: not needed
  */
 static
   int
 sfs_close(struct vnode *v)
 {
-  /* Sync it. */
-  return VOP_FSYNC(v);
+  (void)v;
+  return 0;
 }
 
 
@@ -986,6 +2257,8 @@ static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
 
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
+ * Unless the file has been deleted, the vnode isn't actually freed:
+ * it goes on the LRU list with the last reference (see above).
  *
  * This function should try to avoid returning errors other than EBUSY.
  *
@@ -998,9 +2271,9 @@ sfs_reclaim(struct vnode *v)
 {
   struct sfs_vnode *sv = v->vn_data;
   struct sfs_fs *sfs = v->vn_fs->fs_data;
-  int ix, i, num, result;
+  int result;
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
   lock_acquire(sfs->sfs_vnlock);
 
   /*
@@ -1017,101 +2290,292 @@ sfs_reclaim(struct vnode *v)
 
     lock_release(v->vn_countlock);
     lock_release(sfs->sfs_vnlock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return EBUSY;
   }
   lock_release(v->vn_countlock);
 
-
   /* If there are no on-disk references to the file either, erase it. */
   if (sv->sv_i.sfi_linkcount==0) {
     result = sfs_dotruncate(sv, 0);
     if (result) {
       lock_release(sfs->sfs_vnlock);
-      lock_release(sv->sv_lock);
+      rwlock_release_write(sv->sv_lock);
       return result;
     }
   }
 
-  /* Sync the inode to disk */
-  result = sfs_sync_inode(sv);
+  /* Allocate the delayed blocks, and give back what's left over */
+  result = sfs_dflush(sv);
+  sfs_vbrelease(sv);
+  if (result) {
+    kprintf("sfs: inode %u: %u blocks of data not written yet: %s\n",
+        sv->sv_ino, sv->sv_ndelayed, strerror(result));
+  }
+  else {
+    /* Sync the inode to disk */
+    result = sfs_sync_inode(sv);
+  }
   if (result) {
+    /*
+     * The vnode keeps the data and its reserve, and goes on the LRU
+     * list with the last reference, so it isn't lost; the next sync
+     * takes it back off and tries again, and reclaims it after.
+     */
+    assert(SFS_UNWRITTEN(sv));
+    sfs_lru_add(sfs, sv);
     lock_release(sfs->sfs_vnlock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
-  /* If there are no on-disk references, discard the inode */
-  if (sv->sv_i.sfi_linkcount==0) {
-    sfs_bfree(sfs, sv->sv_ino);
+  /*
+   * If the file still exists, keep the vnode loaded on the LRU list,
+   * holding on to the last reference, in case it's wanted again soon.
+   * sfs_loadvnode takes it back off. Make room by unloading the one
+   * that has been unreferenced longest.
+   */
+  if (sv->sv_i.sfi_linkcount > 0) {
+    sfs_lru_add(sfs, sv);
+    sfs_lru_trim(sfs, SFS_VNLRU_MAX);
+    lock_release(sfs->sfs_vnlock);
+    rwlock_release_write(sv->sv_lock);
+    return 0;
   }
 
-  /* Remove the vnode structure from the table in the struct sfs_fs. */
-  ix = -1;
-  num = array_getnum(sfs->sfs_vnodes);
-  for (i=0; i<num; i++) {
-    struct sfs_vnode *sv2 = array_getguy(sfs->sfs_vnodes, i);
-    if (sv2==sv) {
-      ix = i;
-      break;
+  /* No on-disk references; discard the inode */
+  sfs_bfree(sfs, sv->sv_ino);
+
+  /* Remove the vnode from the table and free it. */
+  rwlock_release_write(sv->sv_lock);
+  sfs_vnode_unload(sfs, sv);
+  lock_release(sfs->sfs_vnlock);
+
+  /* Done */
+  return 0;
+}
+
+/*
+ * Read-ahead. Called after a read of file blocks FIRST through LAST.
+ * A read that starts where the last one left off (or in the block it
+ * left off in, for reads that aren't block-sized) is sequential, and
+ * grows the window; anything else drops it to nothing. Blocks in the
+ * window past what has already been asked for are handed to the
+ * cache's read-ahead thread, which reads them in the background.
+ *
+ * Locking: must hold vnode lock. sfs_bmap is called without
+ * allocation, so the bitmap lock is not needed.
+ */
+static
+  void
+sfs_readahead(struct sfs_vnode *sv, struct readahead *ra,
+    u_int32_t first, u_int32_t last)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  u_int32_t fileblocks, fb, end;
+  u_int32_t diskblock;
+
+  assert(rwlock_is_held(sv->sv_lock));
+
+  if (first == ra->ra_next || first+1 == ra->ra_next) {
+    /* Sequential; rereading the same block doesn't count as progress */
+    if (last >= ra->ra_next) {
+      if (ra->ra_window == 0) {
+        ra->ra_window = SFS_RA_MIN;
+      }
+      else if (ra->ra_window < SFS_RA_MAX) {
+        ra->ra_window *= 2;
+      }
     }
   }
-  if (ix<0) {
-    panic("sfs: reclaim vnode %u not in vnode pool\n",
-        sv->sv_ino);
+  else {
+    /* Random access: stop reading ahead */
+    ra->ra_window = 0;
+    ra->ra_issued = 0;
   }
-  array_remove(sfs->sfs_vnodes, ix);
+  ra->ra_next = last+1;
 
-  lock_release(sfs->sfs_vnlock);
-  lock_release(sv->sv_lock);
-  lock_destroy(sv->sv_lock);
+  if (ra->ra_window == 0) {
+    return;
+  }
 
-  VOP_KILL(&sv->sv_v);
+  fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+  end = last + 1 + ra->ra_window;
+  if (end > fileblocks) {
+    end = fileblocks;
+  }
 
-  /* Release the storage for the vnode structure itself. */
-  kfree(sv);
+  fb = ra->ra_issued > last+1 ? ra->ra_issued : last+1;
+  for (; fb < end; fb++) {
+    if (sfs_bmap(sv, fb, 0, &diskblock)) {
+      break;
+    }
+    if (diskblock != 0) {
+      cache_readahead(sfs->sfs_cache, diskblock);
+    }
+  }
+  ra->ra_issued = fb;
+}
 
-  /* Done */
+/*
+ * Pin the page under the start of a user buffer, and set up *KU as a
+ * uio on its kernel address for as much of the transfer as is in
+ * that page; *KUP is set to KU. Copying through the kernel address
+ * can be done with the vnode lock held, as it can't fault: a fault on
+ * the buffer itself could land on a page of a mapped file, and
+ * reading that in (see vm_file_read) takes a vnode lock - perhaps
+ * this one. Only one page is pinned at a time, as as_pin requires.
+ *
+ * Kernel buffers can't fault, and are used as they are: *KUP is set
+ * to UIO itself and nothing is pinned.
+ */
+static
+  int
+sfs_pinpage(struct uio *uio, struct uio *ku, struct uio **kup, paddr_t *pa)
+{
+#if OPT_DUMBVM
+  (void)ku;
+  (void)pa;
+  *kup = uio;
+  return 0;
+#else
+  vaddr_t va;
+  size_t len;
+  int result;
+
+  if (uio->uio_segflg == UIO_SYSSPACE || uio->uio_resid == 0) {
+    *kup = uio;
+    return 0;
+  }
+
+  va = (vaddr_t)uio->uio_iovec.iov_ubase;
+  result = as_pin(uio->uio_space, va, uio->uio_rw == UIO_READ, pa);
+  if (result) {
+    return result;
+  }
+
+  len = PAGE_SIZE - (va & ~PAGE_FRAME);
+  if (len > uio->uio_resid) {
+    len = uio->uio_resid;
+  }
+  mk_physuio(ku, *pa, len, uio->uio_offset, uio->uio_rw);
+  ku->uio_ra = uio->uio_ra;
+  *kup = ku;
   return 0;
+#endif
+}
+
+/*
+ * Undo sfs_pinpage, moving UIO along past what was transferred
+ * through KU.
+ */
+static
+  void
+sfs_unpinpage(struct uio *uio, struct uio *ku, paddr_t pa)
+{
+  size_t moved;
+
+  if (ku == uio) {
+    return;
+  }
+
+  moved = ku->uio_offset - uio->uio_offset;
+  uio->uio_iovec.iov_ubase =
+    (userptr_t)((vaddr_t)uio->uio_iovec.iov_ubase + moved);
+  uio->uio_iovec.iov_len -= moved;
+  uio->uio_offset += moved;
+  uio->uio_resid -= moved;
+
+#if OPT_DUMBVM
+  (void)pa;
+#else
+  as_unpin(pa);
+#endif
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Called for read(). sfs_io() does the work, on a user buffer one
+ * pinned page at a time (see sfs_pinpage).
  *
- * Locking: gets/releases vnode lock.
+ * Read-ahead state comes with the uio if the caller has an open file;
+ * otherwise the vnode's own is used. Other readers may be using the
+ * same state at the same time; it is only a guess at what will be
+ * read next, so nothing worse than a wasted read-ahead comes of it.
+ * Large reads go straight to the device, and reading ahead into the
+ * cache would only make the next one copy through it, so they don't
+ * read ahead.
+ *
+ * Locking: gets/releases vnode lock, shared, once for each page.
  */
 static
   int
 sfs_read(struct vnode *v, struct uio *uio)
 {
   struct sfs_vnode *sv = v->vn_data;
-  int result;
+  struct readahead *ra;
+  struct uio ku, *kup;
+  paddr_t pa = 0;
+  u_int32_t first, last;
+  int result, direct, eof;
 
   assert(uio->uio_rw==UIO_READ);
 
-  lock_acquire(sv->sv_lock);
-  result = sfs_io(sv, uio);
-  lock_release(sv->sv_lock);
+  ra = uio->uio_ra ? uio->uio_ra : &sv->sv_ra;
+  direct = uio->uio_resid >= SFS_DIRECT_MIN*SFS_BLOCKSIZE;
+
+  do {
+    result = sfs_pinpage(uio, &ku, &kup, &pa);
+    if (result) {
+      break;
+    }
+
+    first = kup->uio_offset / SFS_BLOCKSIZE;
+
+    rwlock_acquire_read(sv->sv_lock);
+    result = sfs_io(sv, kup);
+    if (result == 0 && !direct &&
+        kup->uio_offset > (off_t)first*SFS_BLOCKSIZE) {
+      last = (kup->uio_offset - 1) / SFS_BLOCKSIZE;
+      sfs_readahead(sv, ra, first, last);
+    }
+    rwlock_release_read(sv->sv_lock);
+
+    /* Anything left means EOF */
+    eof = kup->uio_resid > 0;
+    sfs_unpinpage(uio, kup, pa);
+  } while (result == 0 && uio->uio_resid > 0 && !eof);
 
   return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
- * Locking: gets/releases vnode lock.
+ * Called for write(). sfs_io() does the work, a pinned page of a user
+ * buffer at a time, like sfs_read.
+ * Locking: gets/releases vnode lock, once for each page.
  */
 static
   int
 sfs_write(struct vnode *v, struct uio *uio)
 {
   struct sfs_vnode *sv = v->vn_data;
+  struct uio ku, *kup;
+  paddr_t pa = 0;
   int result;
 
   assert(uio->uio_rw==UIO_WRITE);
 
-  lock_acquire(sv->sv_lock);
-  result = sfs_io(sv, uio);
-  lock_release(sv->sv_lock);
+  do {
+    result = sfs_pinpage(uio, &ku, &kup, &pa);
+    if (result) {
+      break;
+    }
+
+    rwlock_acquire_write(sv->sv_lock);
+    result = sfs_io(sv, kup);
+    rwlock_release_write(sv->sv_lock);
+
+    sfs_unpinpage(uio, kup, pa);
+  } while (result == 0 && uio->uio_resid > 0);
 
   return result;
 }
@@ -1122,7 +2586,7 @@ sfs_write(struct vnode *v, struct uio *uio)
  * A3: You will need to implement this function to support
  * the getdirentry() system call.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases vnode lock, shared.
  *
  * HINT: Use the uio_offset in the uio as the index of the
  * directory entry to read.
@@ -1136,11 +2600,11 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
   int result;
   struct sfs_dir dir;
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_read(sv->sv_lock);
 
   /* Make sure vnode is a directory */
   if(sv->sv_i.sfi_type != SFS_TYPE_DIR){
-    lock_release(sv->sv_lock);
+    rwlock_release_read(sv->sv_lock);
     return ENOTDIR;
   }
 
@@ -1148,13 +2612,13 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
   for(;; slot++){
     /* Check slot requested isn't out of range */
     if(slot >= sfs_dir_nentries(sv)){
-      lock_release(sv->sv_lock);
+      rwlock_release_read(sv->sv_lock);
       return 0;
     }
 
     result = sfs_readdir(sv, &dir, slot);
     if(result){
-      lock_release(sv->sv_lock);
+      rwlock_release_read(sv->sv_lock);
       return result;
     }
 
@@ -1166,7 +2630,7 @@ sfs_getdirentry(struct vnode *v, struct uio *uio)
   char name[SFS_NAMELEN];
   strcpy(name, dir.sfd_name);
 
-  lock_release(sv->sv_lock);
+  rwlock_release_read(sv->sv_lock);
   assert(uio->uio_rw == UIO_READ);
 
   result = uiomove(name, (size_t)strlen(name) * sizeof(char), uio);
@@ -1201,7 +2665,7 @@ sfs_ioctl(struct vnode *v, int op, userptr_t data)
 
 /*
  * Called for stat/fstat/lstat.
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases vnode lock, shared.
  */
 static
   int
@@ -1218,7 +2682,7 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
     return result;
   }
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_read(sv->sv_lock);
 
   statbuf->st_size = sv->sv_i.sfi_size;
 
@@ -1226,7 +2690,7 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
   statbuf->st_nlink = 0;
   statbuf->st_blocks = 0;
 
-  lock_release(sv->sv_lock);
+  rwlock_release_read(sv->sv_lock);
 
   return 0;
 }
@@ -1280,20 +2744,31 @@ sfs_tryseek(struct vnode *v, off_t pos)
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
  *
- * Locking: gets/releases vnode lock.
+ * Locking: gets/releases vnode lock, then writes out the buffer cache.
  */
 static
   int
 sfs_fsync(struct vnode *v)
 {
   struct sfs_vnode *sv = v->vn_data;
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
   int result;
 
-  lock_acquire(sv->sv_lock);
-  result = sfs_sync_inode(sv);
-  lock_release(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
+  result = sfs_dflush(sv);
+  if (result == 0) {
+    result = sfs_sync_inode(sv);
+  }
+  rwlock_release_write(sv->sv_lock);
+  if (result) {
+    return result;
+  }
 
-  return result;
+  /*
+   * The inode and the file's blocks are now in the buffer cache,
+   * marked as the file's (see sfs_bput); write out just those.
+   */
+  return cache_syncowner(sfs->sfs_cache, sv->sv_ino);
 }
 
 /*
@@ -1309,6 +2784,89 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 
+/*
+ * Free the blocks of the indirect tree under indirect block IDBLOCK,
+ * which is LEVELS levels above the data blocks, except for the first
+ * KEEP of them. Sets *emptied, and frees IDBLOCK too, if nothing is
+ * left under it.
+ *
+ * Each entry is looked at with its own trip to the buffer cache, since
+ * the buffer can't be held over the recursive call.
+ *
+ * Locking: must hold vnode lock. Gets/releases sfs_bitlock.
+ */
+static
+  int
+sfs_truncate_tree(struct sfs_vnode *sv, u_int32_t idblock, int levels,
+    u_int32_t keep, int *emptied)
+{
+  struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  u_int32_t span, child, childkeep;
+  unsigned j, first;
+  int result, childempty, left = 0;
+
+  *emptied = 0;
+
+  span = sfs_idspan(levels);
+  first = keep / span;
+  if (first >= SFS_DBPERIDB) {
+    /* Everything under here stays */
+    return 0;
+  }
+
+  for (j=first; j<SFS_DBPERIDB; j++) {
+    result = sfs_idget(sfs, idblock, j, &child);
+    if (result) {
+      return result;
+    }
+    if (child == 0) {
+      continue;
+    }
+
+    if (levels == 1) {
+      /* A data block, past KEEP */
+      sfs_bfree(sfs, child);
+      childempty = 1;
+    }
+    else {
+      childkeep = j*span >= keep ? 0 : keep - j*span;
+      result = sfs_truncate_tree(sv, child, levels-1, childkeep,
+          &childempty);
+      if (result) {
+        return result;
+      }
+    }
+
+    if (childempty) {
+      result = sfs_idset(sv, idblock, j, 0);
+      if (result) {
+        return result;
+      }
+    }
+    else {
+      left = 1;
+    }
+  }
+
+  /* Anything left before the first entry we looked at? */
+  for (j=0; j<first && !left; j++) {
+    result = sfs_idget(sfs, idblock, j, &child);
+    if (result) {
+      return result;
+    }
+    if (child != 0) {
+      left = 1;
+    }
+  }
+  if (left) {
+    return 0;
+  }
+
+  sfs_bfree(sfs, idblock);
+  *emptied = 1;
+  return 0;
+}
+
 /*
  * Called for ftruncate() and from sfs_reclaim.
  * Locking: must hold vnode lock. Acquires/releases buffer lock
@@ -1318,101 +2876,84 @@ static
   int
 sfs_dotruncate(struct sfs_vnode *sv, off_t len)
 {
-  /*
-   * I/O buffer for handling the indirect block.
-   *
-   * Note: in real life
-   * you would get space from the disk buffer cache for this,
-   * not kmalloc a new buffer each time.
-   */
-  u_int32_t *idbuf = (u_int32_t *)kmalloc(SFS_DBPERIDB*sizeof(u_int32_t));
-
   struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+  struct sfs_inode *sfi = &sv->sv_i;
+  struct sfs_extent *ext;
 
   /* Length in blocks (divide rounding up) */
   u_int32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-  u_int32_t i, j, block;
-  u_int32_t idblock, baseblock, highblock;
-  int result;
-  int hasnonzero, iddirty;
+  u_int32_t *roots[3];
+  u_int32_t base, treebase, keep, b;
+  int i, levels, result, emptied;
 
-  assert(lock_do_i_hold(sv->sv_lock));
+  assert(rwlock_do_i_hold(sv->sv_lock));
 
   assert( (SFS_DBPERIDB*sizeof(u_int32_t))==SFS_BLOCKSIZE);
 
-  /*
-   * Go through the direct blocks. Discard any that are
-   * past the limit we're truncating to.
-   */
-  for (i=0; i<SFS_NDIRECT; i++) {
-    block = sv->sv_i.sfi_direct[i];
-    if (i >= blocklen && block != 0) {
-      sfs_bfree(sfs, block);
-      sv->sv_i.sfi_direct[i] = 0;
-      sv->sv_dirty = 1;
-    }
-  }
-
-  /* Indirect block number */
-  idblock = sv->sv_i.sfi_indirect;
+  /* Give back blocks allocated ahead of need, and drop delayed ones */
+  sfs_vbrelease(sv);
+  sfs_ddiscard(sv, blocklen);
 
-  /* The lowest block in the indirect block */
-  baseblock = SFS_NDIRECT;
-
-  /* The highest block in the indirect block */
-  highblock = baseblock + SFS_DBPERIDB - 1;
-
-  if (blocklen < highblock && idblock != 0) {
-    /* We're past the proposed EOF; may need to free stuff */
-
-    /* Read the indirect block */
-    result = sfs_rblock(sfs, idbuf, idblock);
-    if (result) {
-      kfree(idbuf);
-      return result;
-    }
+  /* The indirect blocks start after the extents as they are now */
+  treebase = sfs_extblocks(sfi, NULL);
 
-    hasnonzero = 0;
-    iddirty = 0;
-    for (j=0; j<SFS_DBPERIDB; j++) {
-      /* Discard any blocks that are past the new EOF */
-      if (blocklen < baseblock+j && idbuf[j] != 0) {
-        sfs_bfree(sfs, idbuf[j]);
-        idbuf[j] = 0;
-        iddirty = 1;
+  /*
+   * Go through the indirect trees, freeing any blocks that are past
+   * the limit we're truncating to.
+   */
+  roots[0] = &sfi->sfi_indirect;
+  roots[1] = &sfi->sfi_dindirect;
+  roots[2] = &sfi->sfi_tindirect;
+
+  for (levels=1; levels<=3; levels++) {
+    if (*roots[levels-1] != 0) {
+      keep = blocklen > treebase ? blocklen - treebase : 0;
+      result = sfs_truncate_tree(sv, *roots[levels-1], levels, keep,
+          &emptied);
+      if (result) {
+        return result;
       }
-      /* Remember if we see any nonzero blocks in here */
-      if (idbuf[j]!=0) {
-        hasnonzero=1;
+      if (emptied) {
+        *roots[levels-1] = 0;
+        sv->sv_dirty = 1;
       }
     }
+    treebase += sfs_idspan(levels) * SFS_DBPERIDB;
+  }
 
-    if (!hasnonzero) {
-      /* The whole indirect block is empty now; free it */
-      sfs_bfree(sfs, idblock);
-      sv->sv_i.sfi_indirect = 0;
-      sv->sv_dirty = 1;
+  /*
+   * Go through the extents. Discard any blocks that are past the
+   * limit, shortening or emptying the extents they are in.
+   */
+  base = 0;
+  for (i=0; i<SFS_NEXTENTS && sfi->sfi_extents[i].se_len > 0; i++) {
+    ext = &sfi->sfi_extents[i];
+    keep = blocklen > base ? blocklen - base : 0;
+    base += ext->se_len;
+    if (keep >= ext->se_len) {
+      continue;
     }
-    else if (iddirty) {
-      /* The indirect block is dirty; write it back */
-      result = sfs_wblock(sfs, idbuf, idblock);
-      if (result) {
-        kfree(idbuf);
-        return result;
-      }
+    for (b = keep; b < ext->se_len; b++) {
+      sfs_bfree(sfs, ext->se_start + b);
     }
+    ext->se_len = keep;
+    if (keep == 0) {
+      ext->se_start = 0;
+    }
+    sv->sv_dirty = 1;
   }
 
+  /* Carry on from the new end of the file */
+  sv->sv_goal = sfs_vgoal(sv);
+
   /* Set the file size */
-  sv->sv_i.sfi_size = len;
+  sfi->sfi_size = len;
 
   /* Mark the inode dirty */
   sv->sv_dirty = 1;
 
-  kfree(idbuf);
   return 0;
-
 }
 
 /*
@@ -1427,9 +2968,9 @@ sfs_truncate(struct vnode *v, off_t len)
   struct sfs_vnode *sv = v->vn_data;
   int result;
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
   result = sfs_dotruncate(sv, len);
-  lock_release(sv->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   return result;
 }
@@ -1489,18 +3030,18 @@ sfs_creat(struct vnode *v, const char *name, int excl, struct vnode **ret)
   u_int32_t ino;
   int result;
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
 
   /* Look up the name */
   result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
   if (result!=0 && result!=ENOENT) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
   /* If it exists and we didn't want it to, fail */
   if (result==0 && excl) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return EEXIST;
   }
 
@@ -1508,18 +3049,18 @@ sfs_creat(struct vnode *v, const char *name, int excl, struct vnode **ret)
     /* We got a file; load its vnode and return */
     result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
     if (result) {
-      lock_release(sv->sv_lock);
+      rwlock_release_write(sv->sv_lock);
       return result;
     }
     *ret = &newguy->sv_v;
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return 0;
   }
 
   /* Didn't exist - create it */
-  result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+  result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
   if (result) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
@@ -1527,7 +3068,7 @@ sfs_creat(struct vnode *v, const char *name, int excl, struct vnode **ret)
   result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
   if (result) {
     VOP_DECREF(&newguy->sv_v);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
@@ -1539,7 +3080,7 @@ sfs_creat(struct vnode *v, const char *name, int excl, struct vnode **ret)
 
   *ret = &newguy->sv_v;
 
-  lock_release(sv->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   return 0;
 }
@@ -1564,19 +3105,19 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
   assert(file->vn_fs == dir->vn_fs);
 
   /* Just create a link */
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
   result = sfs_dir_link(sv, name, f->sv_ino, NULL);
-  lock_release(sv->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   if (result) {
     return result;
   }
 
   /* and update the link count, marking the inode dirty */
-  lock_acquire(f->sv_lock);
+  rwlock_acquire_write(f->sv_lock);
   f->sv_i.sfi_linkcount++;
   f->sv_dirty = 1;
-  lock_release(f->sv_lock);
+  rwlock_release_write(f->sv_lock);
 
   return 0;
 }
@@ -1596,18 +3137,18 @@ sfs_remove(struct vnode *dir, const char *name)
   int slot;
   int result;
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
 
   /* Look for the file and fetch a vnode for it. */
   result = sfs_lookonce(sv, name, &victim, &slot);
   if (result) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
   
   /* Check if the file to be removed is a directory */
   if (victim->sv_i.sfi_type == SFS_TYPE_DIR) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     VOP_DECREF(&victim->sv_v);
     return EISDIR;
   }
@@ -1616,17 +3157,17 @@ sfs_remove(struct vnode *dir, const char *name)
   result = sfs_dir_unlink(sv, slot);
   if (result==0) {
     /* If we succeeded, decrement the link count. */
-    lock_acquire(victim->sv_lock);
+    rwlock_acquire_write(victim->sv_lock);
     assert(victim->sv_i.sfi_linkcount > 0);
     victim->sv_i.sfi_linkcount--;
     victim->sv_dirty = 1;
-    lock_release(victim->sv_lock);
+    rwlock_release_write(victim->sv_lock);
   }
 
   /* Discard the reference that sfs_lookonce got us */
   VOP_DECREF(&victim->sv_v);
 
-  lock_release(sv->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   return result;
 }
@@ -1660,16 +3201,16 @@ sfs_rename(struct vnode *d1, const char *n1,
   assert(d1==d2);
   assert(sv->sv_ino == SFS_ROOT_LOCATION);
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
 
   /* Look up the old name of the file and get its inode and slot number*/
   result = sfs_lookonce(sv, n1, &g1, &slot1);
   if (result) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
-  lock_acquire(g1->sv_lock);
+  rwlock_acquire_write(g1->sv_lock);
   /* We don't support subdirectories */
   assert(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
@@ -1707,8 +3248,8 @@ sfs_rename(struct vnode *d1, const char *n1,
   /* Let go of the reference to g1 */
   VOP_DECREF(&g1->sv_v);
 
-  lock_release(g1->sv_lock);
-  lock_release(sv->sv_lock);
+  rwlock_release_write(g1->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   return 0;
 
@@ -1728,8 +3269,8 @@ puke:
   /* Let go of the reference to g1 */
   VOP_DECREF(&g1->sv_v);
 
-  lock_release(g1->sv_lock);
-  lock_release(sv->sv_lock);
+  rwlock_release_write(g1->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   return result;
 }
@@ -1748,45 +3289,45 @@ sfs_mkdir(struct vnode *v, const char *name)
   struct sfs_vnode *newguy;
   int result;
 
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
 
   /* Make sure vnode is a directory */
   if(sv->sv_i.sfi_type != SFS_TYPE_DIR){
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return ENOTDIR;
   }
 
   /* check if entry already exists */
   result = sfs_dir_findname(sv, name, NULL, NULL, NULL);
   if (result==0) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return EEXIST;
   }
 
   /* create new directory */
-  result = sfs_makeobj(sfs, SFS_TYPE_DIR, &newguy);
+  result = sfs_makeobj(sfs, SFS_TYPE_DIR, sv->sv_ino, &newguy);
   if (result) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
   /* lock newguy */
-  lock_acquire(newguy->sv_lock);
+  rwlock_acquire_write(newguy->sv_lock);
 
   /* add . and .. entries */
   result = sfs_dir_link(newguy, ".", newguy->sv_ino, NULL);
   if (result) {
     VOP_DECREF(&newguy->sv_v);
-    lock_release(newguy->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(newguy->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
   result = sfs_dir_link(newguy, "..", sv->sv_ino, NULL);
   if (result) {
     VOP_DECREF(&newguy->sv_v);
-    lock_release(newguy->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(newguy->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
@@ -1794,8 +3335,8 @@ sfs_mkdir(struct vnode *v, const char *name)
   result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
   if (result) {
     VOP_DECREF(&newguy->sv_v);
-    lock_release(newguy->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(newguy->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
@@ -1812,8 +3353,8 @@ sfs_mkdir(struct vnode *v, const char *name)
   sv->sv_dirty = 1;
 
   /* release locks */
-  lock_release(newguy->sv_lock);
-  lock_release(sv->sv_lock);
+  rwlock_release_write(newguy->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   /* decrease refcount of newguy */
   VOP_DECREF(&newguy->sv_v);
@@ -1840,22 +3381,22 @@ sfs_rmdir(struct vnode *v, const char *name)
   int slot;
   int result;
   
-  lock_acquire(sv->sv_lock);
+  rwlock_acquire_write(sv->sv_lock);
   
   /* Look for the file and fetch a vnode for it. */
   result = sfs_lookonce(sv, name, &victim, &slot);
   if (result) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return result;
   }
 
   /* check if the last object was a directory */
   if (victim->sv_i.sfi_type != SFS_TYPE_DIR) {
-    lock_release(sv->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     return ENOTDIR;
   }
 
-  lock_acquire(victim->sv_lock);
+  rwlock_acquire_write(victim->sv_lock);
 
   /* get number of directory entries and calculate size */
   int nentries = sfs_dir_nentries(victim);
@@ -1866,8 +3407,8 @@ sfs_rmdir(struct vnode *v, const char *name)
   for(i=2; i<nentries; i++){
     result = sfs_readdir(victim, &sfd, i);
     if(result){
-      lock_release(victim->sv_lock);
-      lock_release(sv->sv_lock);
+      rwlock_release_write(victim->sv_lock);
+      rwlock_release_write(sv->sv_lock);
       VOP_DECREF(&victim->sv_v);
       return result;
     }
@@ -1880,8 +3421,8 @@ sfs_rmdir(struct vnode *v, const char *name)
 
   /* check if the directory is empty */
   if (victim_size > 0) {
-    lock_release(victim->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(victim->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     VOP_DECREF(&victim->sv_v);
     return ENOTEMPTY;
   }
@@ -1889,16 +3430,16 @@ sfs_rmdir(struct vnode *v, const char *name)
   /* remove . and .. entries */
   result = sfs_dir_unlink(victim, 0);
   if(result){
-    lock_release(victim->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(victim->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     VOP_DECREF(&victim->sv_v);
     return result;
   }
 
   result = sfs_dir_unlink(victim, 1);
   if(result){
-    lock_release(victim->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(victim->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     VOP_DECREF(&victim->sv_v);
     return result;
   }
@@ -1910,14 +3451,14 @@ sfs_rmdir(struct vnode *v, const char *name)
   /* Erase its directory entry from parent */
   result = sfs_dir_unlink(sv, slot);
   if(result){
-    lock_release(victim->sv_lock);
-    lock_release(sv->sv_lock);
+    rwlock_release_write(victim->sv_lock);
+    rwlock_release_write(sv->sv_lock);
     VOP_DECREF(&victim->sv_v);
     return result;
   }
 
-  lock_release(victim->sv_lock);
-  lock_release(sv->sv_lock);
+  rwlock_release_write(victim->sv_lock);
+  rwlock_release_write(sv->sv_lock);
 
   VOP_DECREF(&victim->sv_v);
 
@@ -1967,7 +3508,8 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
  * Since we don't support subdirectories, it's easy - just look up the
  * name.
  *
- * Locking: gets the vnode lock while calling sfs_lookonce. Doesn't
+ * Locking: gets the vnode lock while calling sfs_lookonce, shared if
+ *   the directory's index is already there. Doesn't
  *   lock the new vnode, but does hand back a reference to it (so it
  *   won't evaporate).
  *
@@ -1989,9 +3531,22 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
     return ENOTDIR;
   }
 
-  lock_acquire(sv->sv_lock);
-  result = sfs_lookonce(sv, path, &final, NULL);
-  lock_release(sv->sv_lock);
+  /*
+   * Once the directory has its index, looking a name up doesn't
+   * change anything, so it can be done shared. Making the index
+   * needs the lock exclusive.
+   */
+  rwlock_acquire_read(sv->sv_lock);
+  if (sv->sv_dirindex != NULL) {
+    result = sfs_lookonce(sv, path, &final, NULL);
+    rwlock_release_read(sv->sv_lock);
+  }
+  else {
+    rwlock_release_read(sv->sv_lock);
+    rwlock_acquire_write(sv->sv_lock);
+    result = sfs_lookonce(sv, path, &final, NULL);
+    rwlock_release_write(sv->sv_lock);
+  }
   if (result) {
     return result;
   }
@@ -2108,6 +3663,12 @@ static const struct vnode_ops sfs_dirops = {
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
  *
+ * The inode is not read with sfs_vnlock held, so that a slow disk
+ * read doesn't hold up every other lookup on the volume. Instead a
+ * vnode marked sv_loading goes into the table first as a placeholder;
+ * anyone else who finds it there waits on sfs_vnload_cv until it is
+ * either filled in or taken back out again.
+ *
  * Locking: gets/releases sfs_vnlock.
  */
 static
@@ -2117,48 +3678,54 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
 {
   struct sfs_vnode *sv;
   const struct vnode_ops *ops = NULL;
-  int i, num;
   int result;
 
   /* sfs_vnlock protects the vnodes table */
   lock_acquire(sfs->sfs_vnlock);
 
   /* Look in the vnodes table */
-  num = array_getnum(sfs->sfs_vnodes);
-
-  /* Linear search. Is this too slow? You decide. */
-  for (i=0; i<num; i++) {
-    sv = array_getguy(sfs->sfs_vnodes, i);
-
-    /* Every inode in memory must be in an allocated block */
-    if (!sfs_bused(sfs, sv->sv_ino)) {
-      panic("sfs: Found inode %u in unallocated block\n",
-          sv->sv_ino);
+again:
+  sv = sfs_vnhash_find(sfs, ino);
+  if (sv != NULL) {
+    if (sv->sv_loading) {
+      /* Someone else is reading it in; see how that turns out */
+      cv_wait(sfs_vnload_cv, sfs->sfs_vnlock);
+      goto again;
     }
 
-    if (sv->sv_ino==ino) {
-      /* Found */
-
-      /* May only be set when creating new objects */
-      assert(forcetype==SFS_TYPE_INVAL);
+    /* May only be set when creating new objects */
+    assert(forcetype==SFS_TYPE_INVAL);
 
+    if (sv->sv_onlru) {
+      /* Unreferenced; the LRU's reference becomes ours */
+      sfs_lru_remove(sfs, sv);
+    }
+    else {
       VOP_INCREF(&sv->sv_v);
+    }
 
-      lock_release(sfs->sfs_vnlock);
+    lock_release(sfs->sfs_vnlock);
 
-      *ret = sv;
-      return 0;
-    }
+    *ret = sv;
+    return 0;
   }
 
-  /* Didn't have it loaded; load it */
+  /* Didn't have it loaded; put in a placeholder and load it */
 
-  sv = kmalloc(sizeof(struct sfs_vnode));
+  sv = kmcache_alloc(sfs_vnode_cache);
   if (sv==NULL) {
     lock_release(sfs->sfs_vnlock);
     return ENOMEM;
   }
 
+  sv->sv_ino = ino;
+  sv->sv_loading = 1;
+  sv->sv_onlru = 0;
+  sv->sv_lrunext = sv->sv_lruprev = NULL;
+  sfs_vnhash_add(sfs, sv);
+
+  lock_release(sfs->sfs_vnlock);
+
   /* Must be in an allocated block */
   if (!sfs_bused(sfs, ino)) {
     panic("sfs: Tried to load inode %u from unallocated block\n",
@@ -2168,9 +3735,7 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
   /* Read the block the inode is in */
   result = sfs_rblock(sfs, &sv->sv_i, ino);
   if (result) {
-    kfree(sv);
-    lock_release(sfs->sfs_vnlock);
-    return result;
+    goto fail;
   }
 
   /* Not dirty yet */
@@ -2206,38 +3771,45 @@ sfs_loadvnode(struct sfs_fs *sfs, u_int32_t ino, int forcetype,
   /* Call the common vnode initializer */
   result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
   if (result) {
-    kfree(sv);
-    lock_release(sfs->sfs_vnlock);
-    return result;
+    goto fail;
   }
 
   /* Set the other fields in our vnode structure */
-  sv->sv_ino = ino;
-  sv->sv_lock = lock_create("sfs_vnode_lock");
+  bzero(&sv->sv_ra, sizeof(sv->sv_ra));
+  sv->sv_dirindex = NULL;
+  sv->sv_goal = sfs_vgoal(sv);
+  sv->sv_palen = 0;
+  sv->sv_pawant = SFS_PREALLOC_MIN;
+  sv->sv_delayed = NULL;
+  sv->sv_ndelayed = 0;
+  sv->sv_nresv = 0;
+  sv->sv_lock = rwlock_create("sfs_vnode_lock");
   if (sv->sv_lock == NULL) {
     VOP_KILL(&sv->sv_v);
-    kfree(sv);
-    lock_release(sfs->sfs_vnlock);
-    return result;
-  }
-
-  /* Add it to our table */
-  result = array_add(sfs->sfs_vnodes, sv);
-  if (result) {
-    lock_destroy(sv->sv_lock);
-    VOP_KILL(&sv->sv_v);
-    kfree(sv);
-    lock_release(sfs->sfs_vnlock);
-    return result;
+    result = ENOMEM;
+    goto fail;
   }
 
-  /* Done with vnode table; unlock */
+  /* Ready; let anyone waiting for it have it */
+  lock_acquire(sfs->sfs_vnlock);
+  sv->sv_loading = 0;
+  cv_broadcast(sfs_vnload_cv, sfs->sfs_vnlock);
   lock_release(sfs->sfs_vnlock);
 
   /* Hand it back */
   *ret = sv;
 
   return 0;
+
+fail:
+  /* Take the placeholder back out; waiters will try for themselves */
+  lock_acquire(sfs->sfs_vnlock);
+  sfs_vnhash_remove(sfs, sv);
+  cv_broadcast(sfs_vnload_cv, sfs->sfs_vnlock);
+  lock_release(sfs->sfs_vnlock);
+
+  kmcache_free(sfs_vnode_cache, sv);
+  return result;
 }
 
 /*
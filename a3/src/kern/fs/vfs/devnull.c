@@ -83,6 +83,7 @@ devnull_create(void)
 	dev->d_close = nullclose;
 	dev->d_io = nullio;
 	dev->d_ioctl = nullioctl;
+	dev->d_submit = NULL;
 
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
@@ -14,6 +14,54 @@
 static struct vnode *bootfs_vnode = NULL;
 static struct lock *bootfs_lock = NULL;
 
+/*
+ * Name cache.
+ *
+ * vfs_lookup and vfs_lookparent walk a path one name at a time, and
+ * each lookup of a single name in a directory on a filesystem is
+ * remembered here, as (directory vnode, name) -> vnode, or -> NULL
+ * if there was no such name, so that looking the same name up again
+ * doesn't go to the filesystem. Each entry holds a reference to both
+ * vnodes. When the table is full the least recently used entry is
+ * reused.
+ *
+ * The operations in vfspath.c that change directories call
+ * vfs_dcache_invalidate for the names they change. Each invalidation
+ * bumps dcache_gen; a lookup only enters its answer if dcache_gen is
+ * the same as when it started, so that a lookup that raced with a
+ * change can't leave the old answer behind.
+ *
+ * VOP_DECREF can call into the filesystem to reclaim the vnode, which
+ * may sleep on the disk, so it is never called with dcache_lock held.
+ * Dropped entries are collected on a list instead and their references
+ * given up afterwards (see dcache_reap).
+ */
+#define DCACHE_SIZE     128	/* entries */
+#define DCACHE_BUCKETS  64	/* hash chains; a power of two */
+#define DCACHE_NAMELEN  60	/* longer names aren't cached */
+
+struct dcentry {
+	struct vnode *dc_dir;		/* NULL if entry not in use */
+	struct vnode *dc_vn;		/* NULL for "no such name" */
+	char dc_name[DCACHE_NAMELEN];
+	u_int32_t dc_hash;
+	struct dcentry *dc_hashnext;
+	struct dcentry *dc_lrunext;	/* toward most recently used */
+	struct dcentry *dc_lruprev;
+	int dc_dying;			/* dropped, on someone's reap list */
+};
+
+static struct dcentry dcache[DCACHE_SIZE];
+static struct dcentry *dcache_buckets[DCACHE_BUCKETS];
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;
+static struct lock *dcache_lock;
+static u_int32_t dcache_gen;
+
+static u_int32_t ct_dchits, ct_dcneghits, ct_dcmisses, ct_dcinvals;
+
+static void dcache_init(void);
+
 void
 vfs_initbootfs(void)
 {
@@ -21,6 +69,12 @@ vfs_initbootfs(void)
 	if (bootfs_lock == NULL) {
 		panic("vfs: Could not create bootfs lock\n");
 	}
+
+	dcache_lock = lock_create("dcache_lock");
+	if (dcache_lock == NULL) {
+		panic("vfs: Could not create name cache lock\n");
+	}
+	dcache_init();
 }
 
 /*
@@ -96,6 +150,398 @@ vfs_clearbootfs(void)
 }
 
 
+/*
+ * True if NAME in DIR is something the name cache can hold.
+ */
+static
+int
+dcache_cacheable(struct vnode *dir, const char *name)
+{
+	return dir->vn_fs != NULL && strlen(name) < DCACHE_NAMELEN &&
+		strchr(name, '/') == NULL &&
+		strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+static
+u_int32_t
+dcache_hash(struct vnode *dir, const char *name)
+{
+	u_int32_t h = (u_int32_t)dir;
+
+	while (*name) {
+		h = h*31 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+static
+void
+dcache_lru_unlink(struct dcentry *dc)
+{
+	if (dc->dc_lruprev != NULL) {
+		dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = dc->dc_lrunext;
+	}
+	if (dc->dc_lrunext != NULL) {
+		dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = dc->dc_lruprev;
+	}
+}
+
+/*
+ * Put DC on the LRU list: at the most recently used end if RECENT is
+ * set, or at the other end, to be reused first, if not.
+ */
+static
+void
+dcache_lru_link(struct dcentry *dc, int recent)
+{
+	if (recent) {
+		dc->dc_lrunext = NULL;
+		dc->dc_lruprev = dcache_lrutail;
+		if (dcache_lrutail != NULL) {
+			dcache_lrutail->dc_lrunext = dc;
+		}
+		else {
+			dcache_lruhead = dc;
+		}
+		dcache_lrutail = dc;
+	}
+	else {
+		dc->dc_lruprev = NULL;
+		dc->dc_lrunext = dcache_lruhead;
+		if (dcache_lruhead != NULL) {
+			dcache_lruhead->dc_lruprev = dc;
+		}
+		else {
+			dcache_lrutail = dc;
+		}
+		dcache_lruhead = dc;
+	}
+}
+
+/*
+ * Set up the name cache table, all entries free.
+ */
+static
+void
+dcache_init(void)
+{
+	int i;
+
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache[i].dc_dir = NULL;
+		dcache[i].dc_vn = NULL;
+		dcache[i].dc_hashnext = NULL;
+		dcache[i].dc_dying = 0;
+		dcache_lru_link(&dcache[i], 1);
+	}
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name, u_int32_t hash)
+{
+	struct dcentry *dc;
+
+	assert(lock_do_i_hold(dcache_lock));
+
+	for (dc = dcache_buckets[hash & (DCACHE_BUCKETS-1)]; dc != NULL;
+	     dc = dc->dc_hashnext) {
+		if (dc->dc_hash == hash && dc->dc_dir == dir &&
+		    !strcmp(dc->dc_name, name)) {
+			return dc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take an entry out of its hash chain.
+ */
+static
+void
+dcache_unhash(struct dcentry *dc)
+{
+	struct dcentry **dcp;
+
+	assert(lock_do_i_hold(dcache_lock));
+	assert(dc->dc_dir != NULL);
+
+	for (dcp = &dcache_buckets[dc->dc_hash & (DCACHE_BUCKETS-1)];
+	     *dcp != dc; dcp = &(*dcp)->dc_hashnext) {
+		assert(*dcp != NULL);
+	}
+	*dcp = dc->dc_hashnext;
+	dc->dc_hashnext = NULL;
+}
+
+/*
+ * Drop an entry: take it out of the table and put it on the list
+ * DEAD, still holding its references, for dcache_reap.
+ */
+static
+void
+dcache_drop(struct dcentry *dc, struct dcentry **dead)
+{
+	assert(!dc->dc_dying);
+
+	dcache_unhash(dc);
+	dcache_lru_unlink(dc);
+
+	dc->dc_dying = 1;
+	dc->dc_lrunext = *dead;
+	*dead = dc;
+}
+
+/*
+ * Give up the references held by the entries on the list DEAD, then
+ * empty them out and make them the next to be reused. Call without
+ * dcache_lock held.
+ */
+static
+void
+dcache_reap(struct dcentry *dead)
+{
+	struct dcentry *dc, *next;
+
+	if (dead == NULL) {
+		return;
+	}
+
+	for (dc = dead; dc != NULL; dc = dc->dc_lrunext) {
+		VOP_DECREF(dc->dc_dir);
+		if (dc->dc_vn != NULL) {
+			VOP_DECREF(dc->dc_vn);
+		}
+	}
+
+	lock_acquire(dcache_lock);
+	for (dc = dead; dc != NULL; dc = next) {
+		next = dc->dc_lrunext;
+		dc->dc_dir = dc->dc_vn = NULL;
+		dc->dc_dying = 0;
+		dcache_lru_link(dc, 0);
+	}
+	lock_release(dcache_lock);
+}
+
+/*
+ * Look up NAME in DIR in the name cache. Returns 0 and a new reference
+ * in RET if it's there, ENOENT if it's known not to be, or -1 if the
+ * name cache doesn't know; in that case GEN is set for dcache_enter.
+ */
+static
+int
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+	      u_int32_t *gen)
+{
+	struct dcentry *dc;
+	int result;
+
+	lock_acquire(dcache_lock);
+
+	dc = dcache_find(dir, name, dcache_hash(dir, name));
+	if (dc == NULL) {
+		ct_dcmisses++;
+		*gen = dcache_gen;
+		lock_release(dcache_lock);
+		return -1;
+	}
+
+	dcache_lru_unlink(dc);
+	dcache_lru_link(dc, 1);
+
+	if (dc->dc_vn == NULL) {
+		ct_dcneghits++;
+		result = ENOENT;
+	}
+	else {
+		ct_dchits++;
+		VOP_INCREF(dc->dc_vn);
+		*ret = dc->dc_vn;
+		result = 0;
+	}
+
+	lock_release(dcache_lock);
+	return result;
+}
+
+/*
+ * Remember that NAME in DIR is VN (or nothing, if VN is NULL), unless
+ * something has been invalidated since generation GEN.
+ */
+static
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     u_int32_t gen)
+{
+	struct dcentry *dc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	u_int32_t hash;
+
+	hash = dcache_hash(dir, name);
+
+	lock_acquire(dcache_lock);
+
+	if (gen != dcache_gen || dcache_find(dir, name, hash) != NULL) {
+		lock_release(dcache_lock);
+		return;
+	}
+
+	dc = dcache_lruhead;
+	if (dc == NULL) {
+		/* Everything is being dropped right now; don't bother */
+		lock_release(dcache_lock);
+		return;
+	}
+	if (dc->dc_dir != NULL) {
+		/* Reuse it; let go of what it held once unlocked */
+		olddir = dc->dc_dir;
+		oldvn = dc->dc_vn;
+		dcache_unhash(dc);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	dc->dc_dir = dir;
+	dc->dc_vn = vn;
+	strcpy(dc->dc_name, name);
+	dc->dc_hash = hash;
+	dc->dc_hashnext = dcache_buckets[hash & (DCACHE_BUCKETS-1)];
+	dcache_buckets[hash & (DCACHE_BUCKETS-1)] = dc;
+
+	dcache_lru_unlink(dc);
+	dcache_lru_link(dc, 1);
+
+	lock_release(dcache_lock);
+
+	if (olddir != NULL) {
+		VOP_DECREF(olddir);
+	}
+	if (oldvn != NULL) {
+		VOP_DECREF(oldvn);
+	}
+}
+
+/*
+ * Drop everything cached about names in directory DIR.
+ */
+static
+void
+dcache_dropdir(struct vnode *dir, struct dcentry **dead)
+{
+	int i;
+
+	assert(lock_do_i_hold(dcache_lock));
+
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache[i].dc_dir == dir && !dcache[i].dc_dying) {
+			dcache_drop(&dcache[i], dead);
+		}
+	}
+}
+
+/*
+ * Forget what NAME in DIR is; it is being changed. If it was a
+ * directory, forget what's in it too, in case it's being removed.
+ */
+void
+vfs_dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry *dc, *dead = NULL;
+
+	lock_acquire(dcache_lock);
+
+	dcache_gen++;
+	ct_dcinvals++;
+
+	dc = dcache_find(dir, name, dcache_hash(dir, name));
+	if (dc != NULL) {
+		if (dc->dc_vn != NULL) {
+			dcache_dropdir(dc->dc_vn, &dead);
+		}
+		dcache_drop(dc, &dead);
+	}
+
+	lock_release(dcache_lock);
+
+	dcache_reap(dead);
+}
+
+/*
+ * Forget everything cached in directory DIR, which has been removed.
+ * (vfs_dcache_invalidate only manages that if the removed name was
+ * itself in the cache.)
+ */
+void
+vfs_dcache_purgedir(struct vnode *dir)
+{
+	struct dcentry *dead = NULL;
+
+	lock_acquire(dcache_lock);
+
+	dcache_gen++;
+	dcache_dropdir(dir, &dead);
+
+	lock_release(dcache_lock);
+
+	dcache_reap(dead);
+}
+
+/*
+ * Forget everything on filesystem FS, so it can be unmounted.
+ */
+void
+vfs_dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *dead = NULL;
+	int i;
+
+	lock_acquire(dcache_lock);
+
+	dcache_gen++;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache[i].dc_dir != NULL && !dcache[i].dc_dying &&
+		    dcache[i].dc_dir->vn_fs == fs) {
+			dcache_drop(&dcache[i], &dead);
+		}
+	}
+
+	lock_release(dcache_lock);
+
+	dcache_reap(dead);
+}
+
+void
+vfs_dcache_printstats(void)
+{
+	int i, used = 0, neg = 0;
+
+	lock_acquire(dcache_lock);
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if (dcache[i].dc_dir != NULL && !dcache[i].dc_dying) {
+			used++;
+			if (dcache[i].dc_vn == NULL) {
+				neg++;
+			}
+		}
+	}
+	kprintf("vfs: name cache: %d/%d entries (%d negative)\n",
+		used, DCACHE_SIZE, neg);
+	kprintf("vfs: name cache: %lu hits, %lu negative hits, %lu misses, "
+		"%lu invalidations\n",
+		(unsigned long) ct_dchits, (unsigned long) ct_dcneghits,
+		(unsigned long) ct_dcmisses, (unsigned long) ct_dcinvals);
+	lock_release(dcache_lock);
+}
+
 /*
  * Common code to pull the device name, if any, off the front of a
  * path and choose the vnode to begin the name lookup relative to.
@@ -200,6 +646,91 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	return 0;
 }
 
+/*
+ * Look up the single name NAME in DIR, through the name cache.
+ */
+static
+int
+lookonce(struct vnode *dir, char *name, struct vnode **ret)
+{
+	char copy[DCACHE_NAMELEN];
+	u_int32_t gen;
+	int result;
+
+	if (!dcache_cacheable(dir, name)) {
+		return VOP_LOOKUP(dir, name, ret);
+	}
+
+	result = dcache_lookup(dir, name, ret, &gen);
+	if (result >= 0) {
+		return result;
+	}
+
+	/* VOP_LOOKUP may mangle the name; keep a copy */
+	strcpy(copy, name);
+
+	result = VOP_LOOKUP(dir, name, ret);
+	if (result == 0) {
+		dcache_enter(dir, copy, *ret, gen);
+	}
+	else if (result == ENOENT) {
+		dcache_enter(dir, copy, NULL, gen);
+	}
+	return result;
+}
+
+/*
+ * Walk PATH from DIR one name at a time, so that every directory on
+ * the way goes through the name cache. Stops at the last name and
+ * returns it in LAST, with the directory it is in in RET. Consumes the
+ * reference to DIR.
+ *
+ * A device (no fs) interprets its own subpath, so if the walk reaches
+ * one the rest of the path is handed back as LAST unsplit.
+ */
+static
+int
+walkparent(struct vnode *dir, char *path, struct vnode **ret, char **last)
+{
+	struct vnode *next;
+	char *s;
+	int result;
+
+	while (1) {
+		if (dir->vn_fs == NULL) {
+			break;
+		}
+
+		while (*path == '/') {
+			path++;
+		}
+		s = strchr(path, '/');
+		if (s == NULL) {
+			break;
+		}
+		*s++ = 0;
+		while (*s == '/') {
+			s++;
+		}
+		if (*s == 0) {
+			/* trailing slashes; PATH is the last name */
+			break;
+		}
+
+		result = lookonce(dir, path, &next);
+		VOP_DECREF(dir);
+		if (result) {
+			return result;
+		}
+		dir = next;
+		path = s;
+	}
+
+	*ret = dir;
+	*last = path;
+	return 0;
+}
+
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
@@ -209,10 +740,10 @@ int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
 {
-	struct vnode *startvn;
+	struct vnode *dir;
 	int result;
 
-	result = getdevice(path, &path, &startvn);
+	result = getdevice(path, &path, &dir);
 	if (result) {
 		return result;
 	}
@@ -223,34 +754,47 @@ vfs_lookparent(char *path, struct vnode **retval,
 		 * a context where "lookparent" is the desired
 		 * operation.
 		 */
-		result = EINVAL;
+		VOP_DECREF(dir);
+		return EINVAL;
 	}
-	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+
+	result = walkparent(dir, path, &dir, &path);
+	if (result) {
+		return result;
 	}
 
-	VOP_DECREF(startvn);
+	result = VOP_LOOKPARENT(dir, path, retval, buf, buflen);
+	VOP_DECREF(dir);
 	return result;
 }
 
 int
 vfs_lookup(char *path, struct vnode **retval)
 {
-	struct vnode *startvn;
+	struct vnode *dir;
 	int result;
 
-	result = getdevice(path, &path, &startvn);
+	result = getdevice(path, &path, &dir);
 	if (result) {
 		return result;
 	}
 
 	if (strlen(path)==0) {
-		*retval = startvn;
+		*retval = dir;
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = walkparent(dir, path, &dir, &path);
+	if (result) {
+		return result;
+	}
 
-	VOP_DECREF(startvn);
+	if (dir->vn_fs == NULL) {
+		result = VOP_LOOKUP(dir, path, retval);
+	}
+	else {
+		result = lookonce(dir, path, retval);
+	}
+	VOP_DECREF(dir);
 	return result;
 }
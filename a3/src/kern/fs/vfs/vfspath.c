@@ -45,6 +45,9 @@ vfs_open(char *path, int openflags, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, &vn);
+		if (result == 0) {
+			vfs_dcache_invalidate(dir, name);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -121,6 +124,9 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		vfs_dcache_invalidate(dir, name);
+	}
 	VOP_DECREF(dir);
 
 	return result;
@@ -154,6 +160,10 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		vfs_dcache_invalidate(olddir, oldname);
+		vfs_dcache_invalidate(newdir, newname);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -188,6 +198,9 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		vfs_dcache_invalidate(newdir, newname);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -215,6 +228,9 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		vfs_dcache_invalidate(newdir, newname);
+	}
 	VOP_DECREF(newdir);
 
 	return result;
@@ -261,6 +277,9 @@ vfs_mkdir(char *path)
 	}
 
 	result = VOP_MKDIR(parent, name);
+	if (result == 0) {
+		vfs_dcache_invalidate(parent, name);
+	}
 
 	VOP_DECREF(parent);
 
@@ -273,7 +292,7 @@ vfs_mkdir(char *path)
 int
 vfs_rmdir(char *path)
 {
-	struct vnode *parent;
+	struct vnode *parent, *dir;
 	char name[NAME_MAX+1];
 	int result;
 
@@ -282,8 +301,20 @@ vfs_rmdir(char *path)
 		return result;
 	}
 
+	/* Get the directory too, to purge what's cached in it */
+	result = VOP_LOOKUP(parent, name, &dir);
+	if (result) {
+		VOP_DECREF(parent);
+		return result;
+	}
+
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		vfs_dcache_invalidate(parent, name);
+		vfs_dcache_purgedir(dir);
+	}
 
+	VOP_DECREF(dir);
 	VOP_DECREF(parent);
 
 	return result;
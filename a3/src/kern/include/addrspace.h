@@ -5,14 +5,19 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct vm_object;
 
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * The address space contains an array of vm_objects. Normally
- * there will be one each for text, data/bss, stack, and heap. More
- * can be added if needed.
+ * The address space contains an array of vm_objects, sorted by base
+ * address. Normally there will be one each for text, data/bss, stack,
+ * and heap. More can be added if needed. as_lastobj is the one the
+ * last fault was in.
+ *
+ * as_asid is the address space ID its TLB entries are tagged with; it
+ * is only good while as_asidgen is the MMU's current generation.
  */
 
 struct addrspace {
@@ -26,6 +31,9 @@ struct addrspace {
 	paddr_t as_stackpbase;
 #else
 	struct array *as_objects;
+	struct vm_object *as_lastobj;
+	u_int32_t as_asid;
+	u_int32_t as_asidgen;
 #endif
 };
 
@@ -58,6 +66,9 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_define_file - set up a region whose contents come from a file,
+ *                read in as the pages are touched.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
@@ -81,6 +92,13 @@ int               as_define_region(struct addrspace *as,
 				   int readable, 
 				   int writeable,
 				   int executable);
+int               as_define_file(struct addrspace *as,
+				 vaddr_t vaddr, size_t sz,
+				 struct vnode *v, off_t offset,
+				 size_t filesize,
+				 int readable,
+				 int writeable,
+				 int executable);
 #endif
 int		  as_prepare_load(struct addrspace *as);
 int		  as_complete_load(struct addrspace *as);
@@ -88,17 +106,37 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 /*
  * as_fault - handle fault in (the current) address space.
+ * as_printstats - print fault path counters.
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
+void as_printstats(void);
+
+#if !OPT_DUMBVM
+/*
+ * as_pin - make the page holding a user address resident and pin it,
+ *          so a device can transfer to or from it directly. Hands back
+ *          the physical address. WRITING means the page's contents
+ *          are about to change; if not, a page that was never written
+ *          may come back as the shared zero page.
+ * as_unpin - unpin a page pinned with as_pin.
+ *
+ * Don't hold more than one page pinned this way at a time: paging
+ * anything else in may have to wait for it.
+ */
+int as_pin(struct addrspace *as, vaddr_t va, int writing, paddr_t *ret);
+void as_unpin(paddr_t pa);
+#endif
 
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
  *               address space. Returns the entry point (initial PC)
  *               in the space pointed to by ENTRYPOINT.
+ *    load_elf_printstats - print the number of execs and their latency.
  */
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
+void load_elf_printstats(void);
 
 
 #endif /* _ADDRSPACE_H_ */
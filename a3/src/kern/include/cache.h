@@ -1,58 +1,340 @@
 
-/* Number of buffers cache can hold in memory */
+struct uio;
+
+/* Number of buffers the raw disk cache (the one cache_read and
+ * cache_write use) holds in memory.  Other caches choose their own
+ * size in cache_create.
+ */
+/* Lookups go through a hash table, so this can be raised into the
+ * thousands without making cache hits any slower.
+ */
 #define NBUFS 10
 
+/* Number of hash chains used to find a buffer by block id.
+ * Must be a power of 2.  Keeping it at least as large as NBUFS keeps
+ * the chains short, and means two threads hitting on different
+ * blocks almost never need the same chain lock.
+ */
+#define NBUCKETS 64
+
 /* size of a single buffer's data area, in bytes */
 /* Must be a multiple of the disk block size. */
 #define BUFSIZE 512  
 
+/* Write-back tuning.  Dirty blocks stay in memory until the flusher
+ * thread writes them out: once a second it writes blocks that have
+ * been dirty for CACHE_MAXAGE seconds or more, and as soon as more
+ * than CACHE_DIRTY_HIGH percent of the buffers are dirty it is woken
+ * to write blocks out until no more than CACHE_DIRTY_LOW percent are.
+ */
+#define CACHE_MAXAGE      5
+#define CACHE_DIRTY_HIGH  50
+#define CACHE_DIRTY_LOW   25
+
+/* Most blocks the flusher looks at in one batch, and most adjacent
+ * blocks it writes with a single request to the backing store.
+ */
+#define CACHE_FLUSH_BATCH 32
+#define CACHE_FLUSH_RUN   16
+
+/* Most read-ahead requests waiting for the read-ahead thread.  More
+ * are dropped.
+ */
+#define CACHE_RA_QUEUE    64
+
 /* Each buffer is described by a "buffer header" which
  * includes a pointer to the data block for the buffer,
  * and an identifier that tells us where to write the 
  * block when it is moved out to disk (and where to 
  * read it back from!)
  *
- * You will want additional fields to manage the synchronization
- * requirements.
+ * A buffer that holds (or is being filled with) a block is linked
+ * into the hash chain for that block id.  Its "key" on the chain is
+ * "id" if the data is valid, or "replacing_id" (with id == -1) while
+ * the block is being read in.  Buffers on no chain hold nothing and
+ * sit on the cache's free list.
+ *
+ * A buffer is "held" between cache_get and cache_put.  Its holder
+ * may change the data without any lock; nobody else can get, evict
+ * or flush the buffer until it is put back.  A buffer that is
+ * "flushing" has had its data copied out by the flusher, which is
+ * now writing that copy; it can be read, held and even dirtied again
+ * meanwhile, but it cannot be evicted until the write is finished.
+ *
+ * id, dirty, doing_io, held, flushing, readahead, replacing_id,
+ * hash_next and the dirty_* fields are protected by the lock of the
+ * hash chain the buffer is on.  Buffers on the free list are
+ * protected by the cache-wide c_lock instead.
  */
 
 struct buf_hdr {
   int id;        /* identifier == disk block # cached in this buffer */
   char *data;    /* content of buffer */
   int dirty;     /* TRUE if buffer data modified since read from disk */
+  int owner;     /* who dirtied it last (see cache_put_owned) */
  
   /* Add any other per-buffer state you need here */
 
-  int doing_io;  /* TRUE if buf data is being read from or written to disk */
+  int doing_io;  /* TRUE if buf data is being read in, or written out for eviction */
+  int held;      /* TRUE between cache_get and cache_put */
+  int flushing;  /* TRUE while the flusher is writing a copy of the data */
   int replacing_id;   /* Id of block that will replace current one */
-  struct cv *busy_cv; /* wait for buffer io to complete */
+  struct cv *busy_cv; /* wait for buffer io to complete, or to be put back */
+
+  int dirty_since;        /* lbolt when the buffer last became dirty */
+  unsigned dirty_seq;     /* value of the cache's dirty_seq at that time */
+
+  int readahead;          /* read ahead, and not used since */
+
+  struct buf_hdr *hash_next; /* next buffer on the same hash chain */
+  struct buf_hdr *free_next; /* next buffer on the free list */
+
+  /* Replacement policy state.  Belongs to the policy, and is protected
+   * by c_lock, except for "referenced", which is set on a hit with only
+   * the chain lock held.
+   */
+  int lru_queue;             /* which of the policy's queues we are on */
+  struct buf_hdr *lru_next;  /* links on that queue */
+  struct buf_hdr *lru_prev;
+  volatile int referenced;   /* hit since the policy last looked */
+};
+
+/* One chain of the block id hash table. */
+
+struct buf_bucket {
+  struct lock *bb_lock;     /* protects the chain and the buffers on it */
+  struct buf_hdr *bb_head;  /* first buffer on the chain */
+  unsigned bb_hits;         /* cache_read hits on this chain */
+  unsigned bb_ra_hits;      /* ... on blocks that were read ahead */
+};
+
+struct cache;
+
+/* Replacement policy.  A policy decides which buffer to take when a
+ * block misses and there are no free buffers.  The policy in use is
+ * chosen when the kernel is configured: round-robin, unless "options
+ * cache2q" is selected.
+ *
+ *   cp_init       - set up policy state for a cache.  Returns an error code.
+ *   cp_cleanup    - free policy state.
+ *   cp_hit        - a cached block was read.  Called with only the
+ *                   buffer's chain lock held, so this must not block
+ *                   or touch anything but the buffer.
+ *   cp_fill       - buffer now holds a new block.  c_lock held.
+ *   cp_candidate  - return the next buffer to consider as a victim, or
+ *                   NULL if there are no more.  "restart" is TRUE for
+ *                   the first call of each search.  The caller skips
+ *                   candidates that are busy.  c_lock held.
+ *   cp_evict      - candidate is being evicted; "old_id" is the block
+ *                   it held.  c_lock held.
+ *   cp_printstats - print policy-specific statistics.
+ */
+
+struct cache_policy {
+  const char *cp_name;
+  int (*cp_init)(struct cache *c);
+  void (*cp_cleanup)(struct cache *c);
+  void (*cp_hit)(struct cache *c, struct buf_hdr *buf);
+  void (*cp_fill)(struct cache *c, struct buf_hdr *buf);
+  struct buf_hdr *(*cp_candidate)(struct cache *c, int restart);
+  void (*cp_evict)(struct cache *c, struct buf_hdr *buf, int old_id);
+  void (*cp_printstats)(struct cache *c);
 };
 
+extern const struct cache_policy cache_policy_rr;  /* round-robin */
+extern const struct cache_policy cache_policy_2q;  /* scan-resistant 2Q */
+
+/* Function a cache uses to read and write its backing store.  The
+ * uio covers one or more whole blocks, starting at block id
+ * uio_offset/BUFSIZE.
+ */
+typedef int (*cache_io_func)(void *backing_store, struct uio *uio);
+
 /* The cache data structure itself records information
- * about the backing storage area (specifically, a pointer
- * to its vnode), an array of buffer headers, and the
+ * about the backing storage area (an opaque pointer, and the
+ * function that does io on it), an array of buffer headers, and the
  * index of the next buffer to use when a new one is needed.
  *
- * We implement a simple round-robin replacement as an
- * example.  There is an obvious enhancement you should 
- * add when you provide support for concurrent access to
- * the cache.
- * 
- * You will want additional fields to manage the synchronization
- * requirements.
+ * next_idx is the hand used by the round-robin replacement policy.
+ *
+ * The cache-wide c_lock is only needed when a block misses and a
+ * buffer has to be found for it; it protects next_idx and the free
+ * list.  Finding a block that is already cached only takes the
+ * lock of its hash chain.  When both are needed, c_lock is always
+ * acquired first.
+ *
+ * ndirty and dirty_seq change at splhigh, so that they can be
+ * updated with a chain lock held.
  */
 
 struct cache {
-  struct vnode *backing_store;
-  struct buf_hdr bufs[NBUFS];
+  const char *name;
+  void *backing_store;
+  cache_io_func backing_io;
+  int nblocks;              /* valid ids are 0 .. nblocks-1 */
+  int nbufs;
+  struct buf_hdr *bufs;     /* array of nbufs buffer headers */
   int next_idx;
 
   /* Add any other cache-wide state you need here */
 
-  struct lock *c_lock;    /* cache-wide lock to synchronize access */
-  struct cv *all_busy_cv; /* wait for victim if all buffers are doing io */
+  struct buf_bucket buckets[NBUCKETS]; /* block id -> buffer */
+  struct buf_hdr *free_list;           /* buffers not holding any block */
+
+  struct lock *c_lock;    /* cache-wide lock to synchronize replacement */
+  struct cv *all_busy_cv; /* wait for victim if all buffers are busy */
+  int all_busy_waiters;   /* number of threads waiting on all_busy_cv */
+
+  const struct cache_policy *policy; /* replacement policy */
+  void *policy_data;                 /* private to the policy */
+
+  volatile unsigned unbusy_gen; /* bumped when a buffer stops being busy */
+
+  /* Write-back.  flush_lock is held while writing out dirty blocks,
+   * by the flusher or by cache_sync; it comes before c_lock.
+   */
+  struct lock *flush_lock;
+  volatile int ndirty;       /* buffers now dirty */
+  unsigned dirty_seq;        /* bumped each time a buffer becomes dirty */
+  int dirty_high;            /* CACHE_DIRTY_HIGH and _LOW, in buffers */
+  int dirty_low;
+  char *flush_buf;           /* flusher's copy of a run of blocks */
+  volatile int flush_kick;   /* flusher should run a pass now */
+
+  /* Read-ahead queue: block ids waiting to be read in by the
+   * read-ahead thread.  Protected by c_lock.
+   */
+  int ra_queue[CACHE_RA_QUEUE];
+  int ra_head;               /* oldest request */
+  int ra_count;
+  struct cv *ra_cv;          /* read-ahead thread waits here for work */
+
+  /* The cache's threads (flusher and read-ahead) */
+  volatile int exiting;      /* threads should stop */
+  int threads_running;       /* protected by c_lock */
+  struct cv *exit_cv;        /* cache_destroy waits here for them to stop */
+
+  struct cache *next_cache;  /* list of all caches */
+
+  /* Statistics, protected by c_lock.  Hits are counted per chain. */
+  unsigned misses;          /* cache_read misses */
+  unsigned evictions;       /* blocks pushed out to make room */
+  unsigned dirty_evictions; /* ... of which had to be written back */
+
+  /* Write-back statistics, protected by flush_lock */
+  unsigned flush_writes;    /* write requests issued by the flusher */
+  unsigned flush_blocks;    /* blocks written by the flusher */
+  unsigned syncs;           /* cache_sync calls */
+
+  /* Read-ahead statistics, protected by c_lock.  Hits on blocks that
+   * were read ahead are counted per chain.
+   */
+  unsigned ra_requests;     /* cache_readahead calls */
+  unsigned ra_dropped;      /* ... turned away because the queue was full */
+  unsigned ra_reads;        /* blocks read in by the read-ahead thread */
+  unsigned ra_wasted;       /* ... evicted without ever being used */
 };
 
+/* Set up the list of caches.  Called once, during boot. */
+
+extern void cache_bootstrap(void);
+
+/* Write out every cache.  Called during shutdown. */
+
+extern void cache_shutdown(void);
+
+/* Create a cache of "nbufs" buffers in front of a backing store with
+ * "nblocks" blocks, which is read and written with "io".  Starts the
+ * cache's flusher and read-ahead threads.  Returns an error code.
+ */
+
+extern int cache_create(const char *name, int nbufs, int nblocks,
+			cache_io_func io, void *backing_store,
+			struct cache **ret);
+
+/* Write out all dirty blocks, stop the cache's threads and free it.
+ * The caller must make sure no one else is using the cache.
+ */
+
+extern void cache_destroy(struct cache *c);
+
+/* Get the buffer holding block "id", reading the block in if it is
+ * not cached.  The buffer is held until it is given back with
+ * cache_put; the caller may read or change its data meanwhile.
+ * Nobody should hold more than one buffer at a time.
+ *
+ * With CACHE_NOREAD the caller is going to overwrite the whole
+ * block, so if it is not cached it is zero-filled instead of read.
+ */
+
+#define CACHE_NOREAD  1
+
+extern int cache_get(struct cache *c, int id, int flags,
+		     struct buf_hdr **ret);
+
+/* Give back a buffer from cache_get.  "dirty" is TRUE if the caller
+ * changed the data, in which case it will be written back later.
+ */
+
+extern void cache_put(struct cache *c, struct buf_hdr *buf, int dirty);
+
+/* Give back a buffer from cache_get that the caller changed on behalf
+ * of "owner", a number of the caller's choosing (a file system might
+ * use the inode number of the file the block belongs to), so that
+ * cache_syncowner can write out just that owner's blocks.  Buffers
+ * dirtied any other way belong to CACHE_NOOWNER.
+ */
+
+#define CACHE_NOOWNER  (-1)
+
+extern void cache_put_owned(struct cache *c, struct buf_hdr *buf, int owner);
+
+/* Give back a buffer from cache_get without keeping what the caller
+ * left in it: for a caller that got the block with CACHE_NOREAD and
+ * then failed to overwrite all of it.  The block is read back in
+ * from the backing store and the buffer put back clean.  A buffer
+ * that was already dirty, or being flushed, is newer than the
+ * backing store; it is put back dirty instead.
+ */
+
+extern void cache_invalidate(struct cache *c, struct buf_hdr *buf);
+
+/* Ask for block "id" to be read into the cache in the background,
+ * because it is likely to be wanted soon.  Never blocks on io; the
+ * request is dropped if the block is already cached or too many
+ * requests are already waiting.
+ */
+
+extern void cache_readahead(struct cache *c, int id);
+
+/* Returns TRUE if block "id" is in the cache, or on its way in or
+ * out.  A block that isn't is the same on the backing store, so it
+ * can be read from there directly, as long as the caller makes sure
+ * nobody writes it meanwhile.
+ */
+
+extern int cache_incore(struct cache *c, int id);
+
+/* Copy block "id" of cache "c" into "blk", or "blk" into it; the
+ * _owned version is to cache_bwrite what cache_put_owned is to
+ * cache_put.
+ */
+
+extern int cache_bread(struct cache *c, int id, void *blk);
+extern int cache_bwrite(struct cache *c, int id, const void *blk);
+extern int cache_bwrite_owned(struct cache *c, int id, const void *blk,
+			      int owner);
+
+/* Write out every block that is dirty when this is called, and wait
+ * for them to reach the backing store.  Returns an error code.
+ */
+
+extern int cache_sync(struct cache *c);
+
+/* Same, but only for the blocks of "owner" (see cache_put_owned). */
+
+extern int cache_syncowner(struct cache *c, int owner);
+
 /* Read a block (identified by "id"), from the cache
  * by copying the buffer's data area into "blk".
  * Do NOT return a pointer to a block in the cache!
@@ -61,12 +343,10 @@ struct cache {
 extern int cache_read(int id, void *blk);
 
 /* Write the contents of "blk" to the block
- * identified by "id".  If "id" is in the cache,
- * copy from "blk" to the data area of the buffer
- * that is caching "id".  Otherwise, write "blk"
- * to the backing store area for "id" (the entire
- * block is over-written so it does not need to 
- * be read in first in this case.)
+ * identified by "id".  The block is copied into a buffer, which
+ * is marked dirty and written back later.  If "id" is not in the
+ * cache it is not read in first, since the entire block is
+ * over-written.
  */
 
 extern int cache_write(int id, void *blk);
@@ -74,6 +354,9 @@ extern int cache_write(int id, void *blk);
 /* Initialize the cache data structure.
  * Be sure to add code to initialize any new
  * fields you add for synchronization.
+ *
+ * Does nothing if the cache has already been set up, so
+ * anything that uses the cache can simply call it first.
  */
   
 extern int cache_init();
@@ -88,8 +371,15 @@ extern int cache_init();
 
 extern int max_block_id;
 
+/* Print hit/miss counters and replacement policy state for every
+ * cache.
+ */
+
+extern void cache_printstats(void);
+
 /* For testing purposes...
- * Locks the cache, and checks for duplicate block ids
+ * Locks each hash chain in turn, and checks for duplicate
+ * block ids and buffers on the wrong chain.
  */
 
 extern void check_cache_integrity();
@@ -20,6 +20,22 @@
 
 void hardclock(void);
 
+/*
+ * Periodic wakeups. A thread that has to wake up once a second, and
+ * also whenever someone kicks it, sleeps on a channel of its own
+ * rather than on lbolt, so that kicking it doesn't wake everyone
+ * waiting for the clock; clock_addtick has hardclock wake that
+ * channel once a second too. The clock_tick belongs to the clock
+ * until clock_removetick.
+ */
+struct clock_tick {
+	const void *ct_chan;
+	struct clock_tick *ct_next;
+};
+
+void clock_addtick(struct clock_tick *ct, const void *chan);
+void clock_removetick(struct clock_tick *ct);
+
 void gettime(time_t *seconds, u_int32_t *nanoseconds);
 
 void getinterval(time_t secs1, u_int32_t nsecs,
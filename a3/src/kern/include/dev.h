@@ -3,15 +3,41 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * Asynchronous block request, for devices that queue requests.
+ *
+ * The caller fills in the first six fields and passes the request to
+ * d_submit, which returns at once. When the whole request is done,
+ * dr_done is called with the result. It may be called from an
+ * interrupt handler, so it must not sleep; it is the last time the
+ * driver touches the request.
+ */
+struct devreq {
+	u_int32_t dr_block;             /* first block */
+	u_int32_t dr_nblocks;           /* number of blocks */
+	int dr_write;                   /* true to write, false to read */
+	void *dr_data;                  /* kernel buffer, dr_nblocks long */
+	void (*dr_done)(struct devreq *, int err);
+	void *dr_arg;                   /* for dr_done's use */
+
+	/* For the driver's use */
+	u_int32_t dr_pos;               /* blocks transferred so far */
+	int dr_deadline;                /* lbolt value to be started by */
+	struct devreq *dr_next;         /* next in queue */
+	struct devreq *dr_merged;       /* requests that follow on from this */
+};
+
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates which should be done.
+ * d_submit is NULL for devices that cannot queue requests.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct devreq *);
 
 	u_int32_t d_blocks;
 	u_int32_t d_blocksize;
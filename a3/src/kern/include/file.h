@@ -7,6 +7,7 @@
 #define _FILE_H_
 
 #include <kern/limits.h>
+#include <uio.h>
 
 struct vnode;
 
@@ -27,6 +28,7 @@ struct openfile {
 	off_t of_offset;
 	int of_accmode;	/* from open: O_RDONLY, O_WRONLY, or O_RDWR */
 	int of_refcount;
+	struct readahead of_ra;	/* sequential read detection for reads */
         // ASST3: You can add additional fields here if you wish.
 };
 
@@ -36,6 +38,9 @@ int file_open(char *filename, int flags, int mode, int *retfd);
 /* closes a file */
 int file_close(int fd);
 
+/* sets up the openfile allocator; called once at boot */
+void file_bootstrap(void);
+
 
 /*** file table section ***/
 
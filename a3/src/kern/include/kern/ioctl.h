@@ -5,6 +5,12 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * Disk request queueing. With queueing off, each request is one
+ * sector, started in the order submitted. No argument.
+ */
+#define DIOC_QUEUE_ON     1    /* sort and merge requests (default) */
+#define DIOC_QUEUE_OFF    2    /* one sector at a time, first come first served */
+#define DIOC_PRINTSTATS   3    /* print request queue statistics */
 
 #endif /* _KERN_IOCTL_H_*/
@@ -1,10 +1,10 @@
 #ifndef _KERN_SFS_H_
 #define _KERN_SFS_H_
 
-#define SFS_MAGIC         0xabadf001    /* magic number identifying us */
+#define SFS_MAGIC         0xabadf002    /* magic number identifying us */
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
-#define SFS_NDIRECT       15            /* # of direct blocks in inode */
+#define SFS_NEXTENTS      16            /* # of extents in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
@@ -39,16 +39,33 @@ struct sfs_super {
 	u_int32_t reserved[118];
 };
 
+/*
+ * On-disk extent: a run of contiguous disk blocks
+ */
+struct sfs_extent {
+	u_int32_t se_start;        /* First disk block */
+	u_int32_t se_len;          /* Number of blocks (0 if unused) */
+};
+
 /*
  * On-disk inode
+ *
+ * The extents map the start of the file, in order and without holes:
+ * the first extent holds file blocks 0 through se_len-1, the next one
+ * carries on from there, and so on up to the first unused extent.
+ * Blocks past the extents are mapped through the indirect blocks,
+ * whose block 0 is the first block after the extents. The extents
+ * cannot grow while any indirect block is in use.
  */
 struct sfs_inode {
 	u_int32_t sfi_size;        /* Size of this file (bytes) */
 	u_int16_t sfi_type;        /* One of SFS_TYPE_* above */
 	u_int16_t sfi_linkcount;   /* Number of hard links to this file */
-	u_int32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
+	struct sfs_extent sfi_extents[SFS_NEXTENTS];	/* Extents */
 	u_int32_t sfi_indirect;			/* Indirect block */
-	u_int32_t sfi_waste[128-3-SFS_NDIRECT]; /* unused space */
+	u_int32_t sfi_dindirect;		/* Double indirect block */
+	u_int32_t sfi_tindirect;		/* Triple indirect block */
+	u_int32_t sfi_waste[128-5-2*SFS_NEXTENTS]; /* unused space */
 };
 
 /*
@@ -50,6 +50,8 @@
 #define DB_NETFS       0x400
 #define DB_KMALLOC     0x800
 #define DB_TLB         0x1000
+#define DB_CACHE       0x2000
+#define DB_TEST        0x4000
 
 extern u_int32_t dbflags;
 
@@ -92,6 +94,25 @@ void *kmalloc(size_t sz);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * Object caches, for kernel objects of one type and size that come
+ * and go often. kmcache_alloc returns NULL if out of memory.
+ *
+ * CTOR, if not NULL, is run on each object when the cache gets the
+ * memory for it, and DTOR when the memory is given back; objects must
+ * be freed to the cache in their constructed state. CTOR returns an
+ * error code. kmcache_destroy requires all objects to have been freed.
+ *
+ * kfree also works on objects from a cache.
+ */
+struct kmcache;
+
+struct kmcache *kmcache_create(const char *name, size_t size,
+			       int (*ctor)(void *), void (*dtor)(void *));
+void kmcache_destroy(struct kmcache *kc);
+void *kmcache_alloc(struct kmcache *kc);
+void kmcache_free(struct kmcache *kc, void *ptr);
+
 /*
  * C string functions. 
  *
@@ -195,7 +216,8 @@ int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
 /*
  * Simple timing hooks.
  *
- * Threads sleeping on lbolt are woken up once a second.
+ * Threads sleeping on lbolt are woken up once a second, and lbolt
+ * counts the seconds since boot.
  *
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with thread_sleep.)
@@ -8,10 +8,15 @@
  *     make_runnable - add the specified thread to the run queue. If it's
  *                     already on the run queue or sleeping, weird things
  *                     may happen. Returns an error code.
+ *     scheduler_tick - called from hardclock once a tick. Charges the
+ *                     tick to the current thread, and returns nonzero
+ *                     if the thread should give up the cpu.
  *
- *     print_run_queue - dump the run queue to the console for debugging.
+ *     print_run_queue - dump the run queue to the console for debugging,
+ *                     with the time each thread has spent running and
+ *                     waiting to run.
  *
- *     scheduler_bootstrap - initialize scheduler data 
+ *     scheduler_bootstrap - initialize scheduler data
  *                           (must happen early in boot)
  *     scheduler_shutdown -  clean up scheduler data
  *     scheduler_preallocate - ensure space for at least NUMTHREADS threads.
@@ -22,6 +27,7 @@ struct thread;
 
 struct thread *scheduler(void);
 int make_runnable(struct thread *t);
+int scheduler_tick(void);
 
 void print_run_queue(void);
 
@@ -30,4 +36,51 @@ int scheduler_preallocate(int numthreads);
 void scheduler_killall(void);
 void scheduler_shutdown(void);
 
+/*
+ * Length of a time slice, in hardclock ticks. Under MLFQ this is the
+ * slice at the top priority level; each level down gets twice as long.
+ * May be changed at any time; it takes effect from the next tick.
+ */
+#define SCHED_QUANTUM  1
+extern int sched_quantum;
+
+/*
+ * Scheduling policy. The policy in use is chosen when the kernel is
+ * configured: round-robin, unless "options mlfq" is selected. All of
+ * these are called with interrupts off.
+ *
+ *   sp_init        - set up policy state. Returns an error code.
+ *   sp_cleanup     - free policy state. The run queue is empty.
+ *   sp_preallocate - ensure space for NTHREADS runnable threads, so that
+ *                    sp_enqueue cannot fail. Returns an error code.
+ *   sp_enqueue     - thread is runnable. "woke" is true if it has just
+ *                    been woken up from thread_sleep. Returns an error
+ *                    code.
+ *   sp_dequeue     - take the next thread to run off the run queue, or
+ *                    return NULL if there is none.
+ *   sp_tick        - the current thread has run for another tick.
+ *                    Return nonzero to preempt it.
+ *   sp_print       - print the run queue, and anything else of interest.
+ */
+
+struct sched_policy {
+	const char *sp_name;
+	int (*sp_init)(void);
+	void (*sp_cleanup)(void);
+	int (*sp_preallocate)(int nthreads);
+	int (*sp_enqueue)(struct thread *t, int woke);
+	struct thread *(*sp_dequeue)(void);
+	int (*sp_tick)(struct thread *cur);
+	void (*sp_print)(void);
+};
+
+extern const struct sched_policy sched_policy_rr;    /* round-robin */
+extern const struct sched_policy sched_policy_mlfq;  /* feedback queues */
+
+/* Print one thread's scheduling line; for the policies' sp_print */
+void sched_printthread(struct thread *t, int level);
+
+/* Ticks since boot; the unit of the times in struct thread */
+extern u_int32_t sched_ticks;
+
 #endif /* _SCHEDULER_H_ */
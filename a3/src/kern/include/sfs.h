@@ -16,12 +16,82 @@
 
 #include <kern/sfs.h>
 
+/*
+ * Number of buffers in each mounted filesystem's block cache.
+ */
+#define SFS_NBUFS 64
+
+/*
+ * Read-ahead window for sequential file reads, in blocks.  The window
+ * starts at SFS_RA_MIN when a reader first looks sequential and doubles
+ * on each further sequential read, up to SFS_RA_MAX.
+ */
+#define SFS_RA_MIN 2
+#define SFS_RA_MAX 16
+
+/*
+ * Loaded vnodes are hashed by inode number into SFS_VNHASH_SIZE
+ * chains (a power of two). When the last reference to a vnode goes
+ * away it stays loaded, on an LRU list, so that opening the file
+ * again doesn't have to read the inode back in; there are at most
+ * SFS_VNLRU_MAX of these per filesystem.
+ */
+#define SFS_VNHASH_SIZE 64
+#define SFS_VNLRU_MAX   32
+
+#define SFS_VNHASH(ino) ((ino) & (SFS_VNHASH_SIZE-1))
+
+/*
+ * Blocks for a file are allocated near the last one it got, and in
+ * runs: a run that isn't used up yet stays with the file, marked in
+ * use in the free block map, so that files written at the same time
+ * don't end up interleaved on disk. A file's first run is
+ * SFS_PREALLOC_MIN blocks; each one after that is twice as long as
+ * the last, up to SFS_PREALLOC_MAX. Whatever is left of the run is
+ * given back when the file is truncated or no longer referenced.
+ */
+#define SFS_PREALLOC_MIN 8
+#define SFS_PREALLOC_MAX 64
+
+/*
+ * Data written to a part of a file that has no block yet is held in
+ * memory, and blocks are only allocated for it when the file is
+ * synced or released, or when it has SFS_DELAY_MAX such blocks.
+ */
+#define SFS_DELAY_MAX 16
+
+/*
+ * A read of at least SFS_DIRECT_MIN whole blocks goes straight from
+ * the device into the caller's buffer, for the blocks that aren't in
+ * the buffer cache, instead of being copied through the cache. Such
+ * reads don't read ahead.
+ */
+#define SFS_DIRECT_MIN 8
+
+struct sfs_dirindex;	/* in-core directory index; see sfs_vnode.c */
+struct sfs_freetree;	/* free space summary; see sfs_alloc.c */
+struct sfs_dblock;	/* delayed block; see sfs_vnode.c */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	u_int32_t sv_ino;               /* inode number */
 	int sv_dirty;                   /* true if sv_i modified */
-	struct lock *sv_lock;		/* lock for vnode */
+	int sv_loading;                 /* being read in; not usable yet */
+	struct rwlock *sv_lock;		/* lock for vnode */
+	struct readahead sv_ra;         /* for reads that bring no state */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+	int sv_onlru;                   /* unreferenced, on the LRU list */
+	struct sfs_vnode *sv_lrunext;   /* LRU links, if sv_onlru */
+	struct sfs_vnode *sv_lruprev;
+	struct sfs_dirindex *sv_dirindex; /* directories: name index */
+	u_int32_t sv_goal;              /* where the next block should go */
+	u_int32_t sv_pastart;           /* blocks allocated ahead of need */
+	u_int32_t sv_palen;
+	u_int32_t sv_pawant;            /* size of the next such run */
+	struct sfs_dblock *sv_delayed;  /* data not yet given blocks */
+	unsigned sv_ndelayed;
+	u_int32_t sv_nresv;             /* ... blocks in reserve for them */
 };
 
 struct sfs_fs {
@@ -29,8 +99,16 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	int sfs_superdirty;             /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct array *sfs_vnodes;       /* vnodes loaded into memory */
+	struct cache *sfs_cache;        /* buffer cache in front of device */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* number of loaded vnodes */
+	struct sfs_vnode *sfs_lruhead;  /* least recently unreferenced */
+	struct sfs_vnode *sfs_lrutail;  /* most recently unreferenced */
+	unsigned sfs_nlru;              /* number of vnodes on the LRU */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
+	struct sfs_freetree *sfs_freetree; /* summary of sfs_freemap */
+	u_int32_t sfs_nfree;            /* free blocks */
+	u_int32_t sfs_nreserved;        /* ... promised to delayed blocks */
 	int sfs_freemapdirty;           /* true if freemap modified */
 	struct lock *sfs_vnlock;	/* lock for vnode table */
 	struct lock *sfs_bitlock;	/* lock for bitmap/superblock */
@@ -52,7 +130,9 @@ int sfs_mount(const char *device);
     mk_kuio(uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 /* Convenience functions for block I/O */
+/* sfs_rwblock goes straight to the device; the others use sfs_cache */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+int sfs_cacheio(void *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, u_int32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, u_int32_t block);
 
@@ -61,6 +141,34 @@ int sfs_readbuf(struct fs *df, off_t block, void *data);
 int sfs_writebuf(struct fs *df, off_t block, void *data);
 /* END A3 SETUP */
 
+/* Set up the sfs_vnode allocator; called at mount time */
+int sfs_vnode_cacheinit(void);
+
+/*
+ * True if SV still has data or an inode to write. Only a vnode that
+ * sfs_reclaim couldn't write out is on the LRU list like this.
+ */
+#define SFS_UNWRITTEN(sv) ((sv)->sv_delayed != NULL || (sv)->sv_dirty)
+
+/* Take a vnode off the LRU list; the list's reference becomes the
+ * caller's. Call with sfs_vnlock held */
+void sfs_lru_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+
+/* Unload all the unreferenced vnodes that have nothing left to write;
+ * call with sfs_vnlock held */
+void sfs_lru_flush(struct sfs_fs *sfs);
+
+/* Free space summary; call with sfs_bitlock held */
+struct sfs_freetree *sfs_freetree_create(struct bitmap *map,
+					 u_int32_t nblocks);
+void sfs_freetree_destroy(struct sfs_freetree *ft);
+void sfs_freetree_update(struct sfs_freetree *ft, u_int32_t block);
+int sfs_freetree_find(struct sfs_freetree *ft, u_int32_t goal,
+		      u_int32_t want, u_int32_t *start, u_int32_t *len);
+
+/* Print how much file data was copied on its way to or from disk */
+void sfs_printstats(void);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -66,6 +66,52 @@ int          lock_do_i_hold(struct lock *);
 void         lock_destroy(struct lock *);
 
 
+/*
+ * Readers-writer lock.
+ * Operations:
+ *    rwlock_acquire_read - Get the lock shared. Any number of threads
+ *                   can hold it shared at once, but not while anyone
+ *                   holds it exclusive.
+ *    rwlock_release_read - Give up a shared hold.
+ *    rwlock_acquire_write - Get the lock exclusive. Only one thread can
+ *                   hold it exclusive, and then nobody holds it shared.
+ *    rwlock_release_write - Give up an exclusive hold.
+ *    rwlock_do_i_hold - Return true if the current thread holds the
+ *                   lock exclusive; false otherwise.
+ *    rwlock_is_held - Return true if anyone holds the lock, in either
+ *                   mode. Shared holders aren't recorded, so this is
+ *                   as much as code that runs in both modes can check.
+ *
+ * Writers go first: once a writer is waiting, new readers wait too, so
+ * a steady stream of readers can't keep writers out for ever. Nor can
+ * writers starve readers: when a writer lets go, all the readers
+ * waiting at that moment get the lock before the next writer does.
+ *
+ * Neither mode may be acquired recursively.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+
+struct rwlock {
+	char *name;
+	struct thread * volatile rw_writer; /* exclusive holder, or NULL */
+	volatile int rw_readers;            /* shared holders */
+	volatile int rw_readwait;           /* readers waiting */
+	volatile int rw_writewait;          /* writers waiting */
+	volatile unsigned rw_readgen;       /* bumped when readers let in */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void           rwlock_acquire_read(struct rwlock *);
+void           rwlock_release_read(struct rwlock *);
+void           rwlock_acquire_write(struct rwlock *);
+void           rwlock_release_write(struct rwlock *);
+int            rwlock_do_i_hold(struct rwlock *);
+int            rwlock_is_held(struct rwlock *);
+void           rwlock_destroy(struct rwlock *);
+
+
 /*
  * Condition variable.
  *
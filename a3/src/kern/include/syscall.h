@@ -11,6 +11,7 @@ int sys_reboot(int code);
 int sys_helloworld(int *retval);
 int sys_printchar(char c);
 int sys__exit(int exitcode);
+int sys___time(userptr_t seconds, userptr_t nanoseconds, int *retval);
 
 // END A0 SOLUTION 
 
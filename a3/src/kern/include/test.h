@@ -25,6 +25,8 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int wakeuptest(int, char **);
+int rwtest(int, char **);
 int jointest1(int, char **); // ASST1 test for thread_join
 int jointest2(int, char **); // ASST1 test for thread_join
 
@@ -39,10 +41,22 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
 int nettest(int, char **);
 
 int coremaptest(int, char **);   // ASST2 basic coremap test
 int coremapstress(int, char **); // ASST2 tougher coremap test
+int tlbtest(int, char **);       // TLB refills with and without ASIDs
+int tlbtest2(int, char **);      // TLB refills with and without the hpt
+
+/* buffer cache tests */
+int buffertest1(int, char **);
+int buffertest2(int, char **);
+int buffertest3(int, char **);
+int buffertest4(int, char **);
+
+/* disk driver tests */
+int disktest(int, char **);
 
 /* Kernel menu system */
 void menu(char *argstr);
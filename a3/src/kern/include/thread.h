@@ -20,7 +20,16 @@ struct thread {
 	char *t_name;
         pid_t t_pid; // DEMKE: ASST1
 	const void *t_sleepaddr;
+	struct thread *t_sleepnext;	/* next on the same sleep queue */
 	char *t_stack;
+
+	/* Scheduler state; belongs to scheduler.c and the policy */
+	int t_priority;			/* MLFQ level, 0 highest */
+	int t_sliceused;		/* ticks of time slice used */
+	unsigned t_boostgen;		/* last MLFQ boost applied */
+	u_int32_t t_runticks;		/* ticks spent running */
+	u_int32_t t_waitticks;		/* ticks spent waiting to run */
+	u_int32_t t_readysince;		/* when last made runnable */
 	
 	/**********************************************************/
 	/* Public thread members - can be used by other code      */
@@ -107,7 +116,8 @@ void thread_wakeup(const void *addr);
 
 /*
  * ASST1: for use by cv_signal - wake at most one thread sleeping
- * on the specified address.
+ * on the specified address. The one woken is the one that has been
+ * sleeping longest.
  * Interrupts must be disabled.
  */
 void thread_wakeone(const void *addr);
@@ -27,6 +27,16 @@ struct iovec {
 #define iov_kbase  iov_un.un_kbase
 #define iov_ubase  iov_un.un_ubase
 
+/*
+ * Sequential read-ahead state, kept per open file and passed down to
+ * the file system through the uio.  All zeros is the initial state.
+ */
+struct readahead {
+	u_int32_t ra_next;      /* block a sequential reader reads next */
+	u_int32_t ra_window;    /* blocks to read ahead; 0 if not sequential */
+	u_int32_t ra_issued;    /* read ahead has been queued up to here */
+};
+
 struct uio {
 	struct iovec      uio_iovec;       /* Data block */
 	off_t             uio_offset;      /* desired offset into object */
@@ -34,6 +44,7 @@ struct uio {
 	enum uio_seg      uio_segflg;      /* what kind of pointer we have */
 	enum uio_rw       uio_rw;          /* whether op is a read or write */
 	struct addrspace *uio_space;       /* address space for user pointer */
+	struct readahead *uio_ra;          /* read-ahead state, or NULL */
 };
 
 
@@ -83,4 +94,13 @@ int uiomovezeros(size_t len, struct uio *uio);
  */
 void mk_kuio(struct uio *, void *kbuf, size_t len, off_t pos, enum uio_rw rw);
 
+/*
+ * Initialize uio for I/O to or from physical memory at PA, which the
+ * caller has pinned (see as_pin), through its kernel address. Nothing
+ * done through it can fault, and devices transfer to and from it
+ * directly, without pinning anything themselves.
+ */
+void mk_physuio(struct uio *, paddr_t pa, size_t len, off_t pos,
+		enum uio_rw rw);
+
 #endif /* _UIO_H_ */
@@ -48,6 +48,23 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name cache. vfs_lookup and vfs_lookparent walk paths one name at a
+ * time and remember what each name in each directory turned out to be,
+ * including names that weren't there.
+ *
+ *    vfs_dcache_invalidate - forget NAME in DIR. Must be called after
+ *                            anything that changes what NAME is.
+ *    vfs_dcache_purgedir   - forget everything in DIR (after rmdir).
+ *    vfs_dcache_purgefs    - forget everything on FS (before unmount).
+ *    vfs_dcache_printstats - print hit rates.
+ */
+
+void vfs_dcache_invalidate(struct vnode *dir, const char *name);
+void vfs_dcache_purgedir(struct vnode *dir);
+void vfs_dcache_purgefs(struct fs *fs);
+void vfs_dcache_printstats(void);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because namei may destroy pathnames, these all may too.
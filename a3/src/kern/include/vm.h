@@ -26,6 +26,10 @@ void swap_bootstrap(size_t physmemsize);
 /* Shutdown function for swapfile; closes swap vnode. */
 void swap_shutdown(void);
 
+/* Returns true if the swapfile is VN, which nobody else may then write. */
+struct vnode;
+int swap_usesvnode(struct vnode *vn);
+
 /* Print VM counters */
 void vm_printstats(void);
 
@@ -14,6 +14,8 @@
 #define _VMPVT_H_
 
 struct addrspace;
+struct vnode;
+struct vm_file;
 
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
@@ -49,13 +51,24 @@ struct addrspace;
  * A vm_object contains an array of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the A3 vm that lpages are never shared between
- * processes.
+ * After fork, lpages are shared copy-on-write between the parent and
+ * child: lp_refcount counts the vm_objects that hold the lpage, and
+ * a shared lpage is only ever mapped read-only. The first write to it
+ * from any of them gets that one a private copy (lpage_unshare). The
+ * refcount is covered by the lpage lock.
+ *
+ * A page of a program's text is not kept in swap but read in from
+ * the executable again when it is needed. For such a page lp_file is
+ * the vm_file it belongs to and lp_swapaddr is its offset in there
+ * rather than in swap. It is never dirty, and never mapped writable,
+ * because the vm_file holds a reference to it as well.
  */
 
 struct lpage {
 	paddr_t lp_paddr;
 	off_t lp_swapaddr;
+	unsigned lp_refcount;
+	struct vm_file *lp_file;
 };
 
 /* lpage flags */
@@ -65,32 +78,61 @@ struct lpage {
 
 #define LP_ISDIRTY(lp)		((lp)->lp_paddr & LPF_DIRTY)
 #define LP_ISLOCKED(lp)		((lp)->lp_paddr & LPF_LOCKED)
+#define LP_ISFILE(lp)		((lp)->lp_file != NULL)
 
-#define LP_SET(am, bit)		((lp)->lp_paddr |= (bit))
-#define LP_CLEAR(am, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
+#define LP_SET(lp, bit)		((lp)->lp_paddr |= (bit))
+#define LP_CLEAR(lp, bit)	((lp)->lp_paddr &= ~(paddr_t)(bit))
 
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - set up the zero page. Called from vm_bootstrap.
  *    lpage_create - create a blank, non-materialized lpage structure.
- *    lpage_destroy - destroy an lpage
+ *    lpage_destroy - drop a reference to an lpage; destroy it if that
+ *                    was the last
  *    lpage_lock/unlock - for exclusive access to an lpage
+ *    lpage_share - add a reference to an lpage, for fork
+ *    lpage_unshare - replace a shared lpage with a private copy
  *
  *    lpage_copy - clone an lpage, including the contents
  *    lpage_zerofill - materialize an lpage and zero-fill it
+ *    lpage_zeromap - map the shared zero page, for a read of a page
+ *                    that would be zerofilled
+ *    lpage_zeropage - the physical address of the zero page
+ *    lpage_fileload - materialize an lpage and read it from a file
  *    lpage_fault - handle a fault on an lpage
+ *    lpage_pin - pin an lpage's physical page, if it is resident
  *    lpage_evict - evict an lpage
+ *    lpage_clean - write dirty lpages to swap, leaving them in memory
+ *
+ * lpage_copy, lpage_unshare, lpage_zerofill and lpage_fileload take
+ * a hint for where to put the new page in swap (see
+ * vm_object_swaphint). lpage_fault also reads in whichever of the
+ * AROUND pages follow on from the faulting page in swap, in the same
+ * request. lpage_clean writes out N pages at
+ * consecutive swap addresses.
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
+void              lpage_share(struct lpage *lp);
+int               lpage_unshare(struct lpage **lpp, off_t swahint);
 
-int		  lpage_copy(struct lpage *from, struct lpage **toret);
-int               lpage_zerofill(struct lpage **lpret);
+int		  lpage_copy(struct lpage *from, struct lpage **toret,
+			     off_t swahint);
+int               lpage_zerofill(struct lpage **lpret, off_t swahint);
+void              lpage_zeromap(struct addrspace *as, vaddr_t va);
+paddr_t           lpage_zeropage(void);
+int               lpage_fileload(struct vm_file *vf, unsigned index,
+				 struct lpage **lpret, off_t swahint);
 int               lpage_fault(struct lpage *lp, struct addrspace *,
-			      int faulttype, vaddr_t va);
+			      int faulttype, vaddr_t va,
+			      struct lpage **around, int naround);
+paddr_t           lpage_pin(struct lpage *lp, int dirty);
 void		  lpage_evict(struct lpage *victim);
+void		  lpage_clean(struct lpage **lps, int n);
 
 ////////////////////////////////////////////////////////////
 //
@@ -101,25 +143,49 @@ void		  lpage_evict(struct lpage *victim);
  * vm_object - data structure associated with a mapped (that is, valid)
  * block of process virtual memory.
  *
- * Each vm object contains an array of lpages and a base address. It
+ * Each vm object contains a table of lpages and a base address. It
  * also allows a redzone on the lower end in which other vm_objects are
  * not allowed to fall. This is used to implement a guard band under the
  * stack.
+ *
+ * The lpage table has two levels: vmo_dir points to up to vmo_ndir
+ * leaf tables of VMO_LEAFPAGES lpage pointers, or NULL for a leaf with
+ * no pages in it yet. See vmobj.c.
+ *
+ * A page with no lpage yet is zerofill, unless the object is loaded
+ * from an executable (vmo_file) and the page is within the part of
+ * it that comes from the file.
  */
+#define VMO_LEAFPAGES	128
+
 struct vm_object {
-	struct array *vmo_lpages;
+	struct lpage ***vmo_dir;
+	unsigned vmo_ndir;
+	unsigned vmo_npages;
 	vaddr_t vmo_base;
 	size_t vmo_lower_redzone;
+	struct vm_file *vmo_file;
 };
 
+/* Top of a vm_object (the address after its last page) */
+#define VMO_TOP(vmo)	((vmo)->vmo_base + PAGE_SIZE*(vmo)->vmo_npages)
+
 /*
  * vm_object operations in vmobj.c:
  * 
  * vm_object_create:  allocates a blank vm_object with the requested
  *                    number of struct lpage's set for zero-fill.
- * vm_object_copy:    clone a vm_object, as at fork time.
+ * vm_object_copy:    clone a vm_object, as at fork time. The lpages
+ *                    are shared, not copied.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
  * vm_object_destroy: frees all the mapping entries and swap space.
+ * vm_object_swaphint: where in swap page INDEX should go, so as to be
+ *                    next to its neighbours; or INVALID_SWAPADDR.
+ * vm_object_getpage: the lpage for page INDEX, or NULL for zerofill.
+ * vm_object_getslot: where the lpage for page INDEX is kept, to read
+ *                    or set; allocates its leaf table if need be.
+ * vm_object_setfile: have the object's pages loaded from VF. It takes
+ *                    over the caller's reference.
  *
  */
 struct vm_object 	*vm_object_create(size_t npages);
@@ -131,6 +197,78 @@ int                      vm_object_setsize(struct addrspace *as,
 					   int newnpages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					   struct vm_object *vmo);
+off_t			 vm_object_swaphint(struct vm_object *vmo,
+					    int index);
+struct lpage		*vm_object_getpage(struct vm_object *vmo,
+					   unsigned index);
+int			 vm_object_getslot(struct vm_object *vmo,
+					   unsigned index,
+					   struct lpage ***slotret);
+void			 vm_object_setfile(struct vm_object *vmo,
+					   struct vm_file *vf);
+
+////////////////////////////////////////////////////////////
+//
+// vm_file - executable backing for vm_objects
+//
+
+/*
+ * vm_file - the part of an executable that a vm_object is loaded
+ * from, on demand.
+ *
+ * Page I of the object holds bytes vf_offset + I*PAGE_SIZE onwards of
+ * the file, up to vf_filesize; past that it is zerofill.
+ *
+ * A read-only segment (text) is shared by everything running the same
+ * program. vf_pages has an lpage for each page once it has been
+ * touched, which the vm_objects share with it; when evicted these are
+ * just dropped, and read in from the file again. A writable segment
+ * (data) is private: vf_pages is NULL, and each page is copied out of
+ * the file into an ordinary lpage the first time it is touched.
+ *
+ * vf_refcount counts the vm_objects using the vm_file. The shared
+ * ones are kept on a list, covered by a lock, so that the next exec
+ * of the program can find them.
+ */
+struct vm_file {
+	struct vnode *vf_vnode;
+	off_t vf_offset;
+	size_t vf_filesize;
+	unsigned vf_npages;
+	struct lpage **vf_pages;
+	unsigned vf_refcount;
+	struct vm_file *vf_next;
+};
+
+/*
+ * vm_file operations in vmfile.c:
+ *
+ * vm_file_bootstrap:  set up. Called from vm_bootstrap.
+ * vm_file_get:        get a reference to the vm_file for a segment of
+ *                     executable V, creating it if need be. SHARED is
+ *                     true for a read-only segment.
+ * vm_file_ref:        add a reference, for a vm_object being copied.
+ * vm_file_release:    drop a reference.
+ * vm_file_getpage:    get the lpage for page INDEX, which must be
+ *                     within the file part. The caller gets its own
+ *                     reference to a shared one.
+ * vm_file_read:       read page INDEX of the file part into physical
+ *                     page PA, zero-filling the end of the last one.
+ * vm_file_printstats: print text sharing counters.
+ */
+void		vm_file_bootstrap(void);
+int		vm_file_get(struct vnode *v, off_t offset, size_t filesize,
+			    unsigned npages, int shared,
+			    struct vm_file **ret);
+void		vm_file_ref(struct vm_file *vf);
+void		vm_file_release(struct vm_file *vf);
+int		vm_file_getpage(struct vm_file *vf, unsigned index,
+				off_t swahint, struct lpage **ret);
+int		vm_file_read(struct vm_file *vf, unsigned index, paddr_t pa);
+void		vm_file_printstats(void);
+
+/* True if page INDEX is (partly) in the file part */
+#define VF_INFILE(vf, index)	((size_t)(index)*PAGE_SIZE < (vf)->vf_filesize)
 
 ////////////////////////////////////////////////////////////
 //
@@ -145,7 +283,8 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_shutdown:    closes the swapfile vnode. Declared in vm.h.
  * 
- * swap_alloc:       finds a free swap page and marks it as used.
+ * swap_alloc:       finds a free swap page and marks it as used,
+ *                   preferably at the hinted address.
  *                   A page should have been previously reserved.
  *
  * swap_free:        unmarks a swap page.
@@ -159,9 +298,18 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_pageout:     Writes a page to the requested swap address 
  *                   from the requested physical page.
+ *
+ * swap_pagein_cluster/swap_pageout_cluster:
+ *                   The same for up to SWAP_CLUSTER pages at
+ *                   consecutive swap addresses, in one disk request.
+ *
+ * swap_printstats:  Prints swap I/O counters.
  */
 
-off_t	 	swap_alloc(void);
+/* Most pages moved to or from swap in one request */
+#define SWAP_CLUSTER	8
+
+off_t	 	swap_alloc(off_t hint);
 void 		swap_free(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
@@ -169,6 +317,11 @@ void		swap_unreserve(unsigned long npages);
 
 void 		swap_pagein(paddr_t paddr, off_t swapaddr);
 void 		swap_pageout(paddr_t paddr, off_t swapaddr);
+void		swap_pagein_cluster(const paddr_t *pas, unsigned npages,
+				    off_t swapaddr);
+void		swap_pageout_cluster(const paddr_t *pas, unsigned npages,
+				     off_t swapaddr);
+void		swap_printstats(void);
 
 /*
  * Special disk address:
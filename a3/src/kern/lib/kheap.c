@@ -19,33 +19,47 @@ fill_deadbeef(void *vptr, size_t len)
 
 ////////////////////////////////////////////////////////////
 //
-// Pool-based subpage allocator.
+// Slab allocator.
 //
 // It works like this:
 //
-//    We allocate one page at a time and fill it with objects of size k,
-//    for various k. Each page has its own freelist, maintained by a
-//    linked list in the first word of each object. Each page also has a
-//    freecount, so we know when the page is completely free and can 
-//    release it.
+//    Objects of one kind come from an object cache (struct kmcache),
+//    which gets one page at a time (a "slab") and cuts it up into
+//    objects of its size. Each slab has its own freelist, kept in a
+//    word of each free object, and a count of the objects in use.
+//    A cache keeps its slabs on three lists: partly used, all used,
+//    and unused. Allocations come from a partly used slab if there is
+//    one, so that the others have a chance to empty out. One unused
+//    slab is kept in case it's wanted again soon; any more are given
+//    back as soon as they empty.
 //
-//    No assumptions are made about the sizes k; they need not be
-//    powers of two. Note, however, that malloc must always return
-//    pointers aligned to the maximum alignment requirements of the
-//    platform; thus block sizes must at least be multiples of 4,
-//    preferably 8. They must also be at least sizeof(struct
-//    freelist). It is only worth defining an additional block size if
-//    more blocks would fit on a page than with the existing block
-//    sizes, and large numbers of items of the new size are allocated.
+//    A cache can have a constructor, which is run on each object when
+//    its slab is made, and a destructor, which is run when the slab is
+//    given back. In between, objects are expected to be freed in their
+//    constructed state, so the constructor's work is not redone on
+//    every allocation. For these caches the freelist word goes after
+//    the object instead of over its start, and freed objects are not
+//    filled with 0xdeadbeef.
 //
-//    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    The slab descriptor (struct slab) goes at the end of the page for
+//    small objects, where it takes less than one object's space.
+//    For big objects it comes from a cache of its own, so that the
+//    whole page is objects.
+//
+//    kfree and kmcache_free have to find the slab from an object's
+//    address. A table indexed by physical page number, in two levels,
+//    maps each slab page to its slab; pages not in the table were
+//    allocated whole by kmalloc. There is no limit on the number of
+//    slabs other than memory.
+//
+//    kmalloc uses a cache for each of a set of sizes. No assumptions
+//    are made about the sizes; they need not be powers of two. Note,
+//    however, that malloc must always return pointers aligned to the
+//    maximum alignment requirements of the platform; thus object sizes
+//    are rounded up to multiples of 8.
 //
 
 #undef  SLOW	/* consistency checks */
-#undef SLOWER	/* lots of consistency checks */
 
 ////////////////////////////////////////
 
@@ -53,8 +67,11 @@ fill_deadbeef(void *vptr, size_t len)
 
 #define NSIZES 8
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+static const char *const sizenames[NSIZES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
 
-#define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
 
 #elif PAGE_SIZE == 8192
@@ -63,481 +80,590 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #error "Odd page size"
 #endif
 
+/* Objects this small or smaller have the slab descriptor on the page */
+#define SLAB_ONPAGE_MAX  128
+
+/* Unused slabs a cache hangs on to */
+#define KMCACHE_MAXEMPTY 1
+
 ////////////////////////////////////////
 
-struct freelist {
-	struct freelist *next;
+struct slab {
+	struct kmcache *sl_cache;
+	struct slab *sl_next;
+	struct slab *sl_prev;
+	vaddr_t sl_page;
+	void *sl_free;		/* first free object */
+	unsigned sl_inuse;	/* objects allocated */
 };
 
-struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
-	vaddr_t pageaddr_and_blocktype;
-	u_int16_t freelist_offset;
-	u_int16_t nfree;
+struct kmcache {
+	const char *kc_name;
+	size_t kc_size;		/* object size, with the link if separate */
+	size_t kc_linkoff;	/* offset of freelist link in an object */
+	unsigned kc_perslab;	/* objects in one slab */
+	int kc_onpage;		/* slab descriptor is at the end of the page */
+	int (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct slab *kc_partial;
+	struct slab *kc_full;
+	struct slab *kc_empty;
+
+	unsigned kc_nslabs;
+	unsigned kc_nempty;
+	unsigned kc_inuse;
+	u_int32_t kc_allocs;
+	u_int32_t kc_frees;
+	u_int32_t kc_grows;
+	u_int32_t kc_shrinks;
+
+	struct kmcache *kc_nextcache;
 };
 
-#define INVALID_OFFSET   (0xffff)
+#define OBJ_NEXT(kc, obj) (*(void **)((char *)(obj) + (kc)->kc_linkoff))
+
+/*
+ * The kmalloc caches, and the cache for off-page slab descriptors,
+ * can't be allocated with kmalloc; they live here and are set up the
+ * first time anything is allocated.
+ */
+static struct kmcache sizecaches[NSIZES];
+static struct kmcache slabcache;
+static int kheap_ready;
 
-#define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
-#define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
-#define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
+/* All caches, for kheap_printstats */
+static struct kmcache *allcaches;
 
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Page to slab table. This has one leaf page for each 4M of physical
+ * memory that has slabs in it (1024 entries); the directory covers
+ * 512M, which is more memory than System/161 will give us.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define SLABTAB_LEAFSIZE (PAGE_SIZE / sizeof(struct slab *))
+#define SLABTAB_DIRSIZE  128
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static u_int32_t pagerefs_inuse[INUSE_WORDS];
+static struct slab **slabtable[SLABTAB_DIRSIZE];
 
+/*
+ * Find the table entry for the page at kernel address VA. If the leaf
+ * it would be in doesn't exist, make it if CREATE is set and return
+ * NULL otherwise (or if out of memory).
+ *
+ * Called at splhigh if CREATE is set, and may block. Lookups of a
+ * page that is known to be a slab need no locking, since its entry
+ * can't change until the slab is freed.
+ */
 static
-struct pageref *
-allocpageref(void)
+struct slab **
+slabtable_entry(vaddr_t va, int create)
 {
-	unsigned i,j;
-	u_int32_t k;
+	u_int32_t pn;
+	unsigned dirix;
+	vaddr_t leaf;
+
+	pn = KVADDR_TO_PADDR(va) / PAGE_SIZE;
+	dirix = pn / SLABTAB_LEAFSIZE;
+	if (dirix >= SLABTAB_DIRSIZE) {
+		panic("kmalloc: page at 0x%lx is past the slab table\n",
+		      (unsigned long) va);
+	}
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
+	if (slabtable[dirix] == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		assert(curspl>0);
+		leaf = alloc_kpages(1);
+		if (leaf == 0) {
+			return NULL;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
+		if (slabtable[dirix] == NULL) {
+			bzero((void *)leaf, PAGE_SIZE);
+			slabtable[dirix] = (struct slab **)leaf;
+		}
+		else {
+			/* Someone else made it while we slept */
+			free_kpages(leaf);
 		}
-		assert(0);
 	}
 
-	/* ran out */
-	return NULL;
+	return &slabtable[dirix][pn % SLABTAB_LEAFSIZE];
 }
 
 static
-void
-freepageref(struct pageref *p)
+inline
+struct slab *
+slabtable_lookup(vaddr_t va)
 {
-	size_t i, j;
-	u_int32_t k;
-
-	j = p-pagerefs;
-	assert(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((u_int32_t)1) << (j%32);
-	assert((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	struct slab **entry;
+
+	entry = slabtable_entry(va, 0);
+	return entry ? *entry : NULL;
 }
 
 ////////////////////////////////////////
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
-
-////////////////////////////////////////
+static
+void
+slab_link(struct slab **head, struct slab *sl)
+{
+	sl->sl_prev = NULL;
+	sl->sl_next = *head;
+	if (*head != NULL) {
+		(*head)->sl_prev = sl;
+	}
+	*head = sl;
+}
 
-/* SLOWER implies SLOW */
-#ifdef SLOWER
-#ifndef SLOW
-#define SLOW
-#endif
-#endif
+static
+void
+slab_unlink(struct slab **head, struct slab *sl)
+{
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		assert(*head == sl);
+		*head = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
 
 #ifdef SLOW
 static
 void
-checksubpage(struct pageref *pr)
+checkslab(struct slab *sl)
 {
-	vaddr_t prpage, fla;
-	struct freelist *fl;
-	int blktype;
-	int nfree=0;
-
-	assert(curspl>0);
-
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		assert(pr->nfree==0);
-		return;
+	struct kmcache *kc = sl->sl_cache;
+	vaddr_t obj;
+	unsigned nfree = 0;
+
+	assert(sl->sl_page % PAGE_SIZE == 0);
+	assert(sl->sl_inuse <= kc->kc_perslab);
+	for (obj = (vaddr_t)sl->sl_free; obj != 0;
+	     obj = (vaddr_t)OBJ_NEXT(kc, obj)) {
+		assert(obj >= sl->sl_page && obj < sl->sl_page + PAGE_SIZE);
+		assert((obj - sl->sl_page) % kc->kc_size == 0);
+		nfree++;
+		assert(nfree <= kc->kc_perslab);
 	}
+	assert(nfree + sl->sl_inuse == kc->kc_perslab);
+}
+#else
+#define checkslab(sl) ((void)(sl))
+#endif
 
-	prpage = PR_PAGEADDR(pr);
-	blktype = PR_BLOCKTYPE(pr);
+////////////////////////////////////////
 
-	assert(pr->freelist_offset < PAGE_SIZE);
-	assert(pr->freelist_offset % sizes[blktype] == 0);
+/*
+ * Fill in a cache. Doesn't allocate anything.
+ */
+static
+void
+kmcache_init(struct kmcache *kc, const char *name, size_t size,
+	     int (*ctor)(void *), void (*dtor)(void *))
+{
+	assert(size > 0);
+
+	kc->kc_name = name;
+	kc->kc_size = (size + 7) & ~(size_t)7;
+	kc->kc_linkoff = 0;
+	if (ctor != NULL) {
+		kc->kc_linkoff = kc->kc_size;
+		kc->kc_size += 8;
+	}
+	kc->kc_onpage = kc->kc_size <= SLAB_ONPAGE_MAX ||
+		PAGE_SIZE % kc->kc_size >= sizeof(struct slab);
+	kc->kc_perslab = (PAGE_SIZE -
+		(kc->kc_onpage ? sizeof(struct slab) : 0)) / kc->kc_size;
+	if (kc->kc_perslab == 0) {
+		panic("kmcache_init: %s: size %lu is too big for a slab\n",
+		      name, (unsigned long) size);
+	}
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
 
-	fla = prpage + pr->freelist_offset;
-	fl = (struct freelist *)fla;
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nslabs = kc->kc_nempty = kc->kc_inuse = 0;
+	kc->kc_allocs = kc->kc_frees = 0;
+	kc->kc_grows = kc->kc_shrinks = 0;
 
-	for (; fl != NULL; fl = fl->next) {
-		fla = (vaddr_t)fl;
-		assert(fla >= prpage && fla < prpage + PAGE_SIZE);
-		assert((fla-prpage) % sizes[blktype] == 0);
-		assert(fla >= MIPS_KSEG0);
-		assert(fla < MIPS_KSEG1);
-		nfree++;
-	}
-	assert(nfree==pr->nfree);
+	kc->kc_nextcache = allcaches;
+	allcaches = kc;
 }
-#else
-#define checksubpage(pr) ((void)(pr))
-#endif
 
-#ifdef SLOWER
+/*
+ * Set up the caches that live in this file. Called at splhigh.
+ */
 static
 void
-checksubpages(void)
+kheap_setup(void)
 {
-	struct pageref *pr;
 	int i;
-	unsigned sc=0, ac=0;
 
 	assert(curspl>0);
-
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			assert(sc < NPAGEREFS);
-			sc++;
-		}
+	if (kheap_ready) {
+		return;
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		assert(ac < NPAGEREFS);
-		ac++;
+	kmcache_init(&slabcache, "slab", sizeof(struct slab), NULL, NULL);
+	assert(slabcache.kc_onpage);
+	for (i=NSIZES-1; i>=0; i--) {
+		kmcache_init(&sizecaches[i], sizenames[i], sizes[i],
+			     NULL, NULL);
 	}
-
-	assert(sc==ac);
+	kheap_ready = 1;
 }
-#else
-#define checksubpages() 
-#endif
 
-////////////////////////////////////////
+static void *kmcache_doalloc(struct kmcache *kc);
+static void slab_free(struct slab *sl, void *ptr);
 
+/*
+ * Destroy the first N objects of a slab, from the end back.
+ */
 static
 void
-dumpsubpage(struct pageref *pr)
+slab_destruct(struct kmcache *kc, vaddr_t page, unsigned n)
+{
+	if (kc->kc_dtor == NULL) {
+		return;
+	}
+	while (n-- > 0) {
+		kc->kc_dtor((void *)(page + n*kc->kc_size));
+	}
+}
+
+/*
+ * Make a new slab for KC, construct its objects, and put it on the
+ * unused list. Called at splhigh; blocks.
+ */
+static
+struct slab *
+kmcache_grow(struct kmcache *kc)
 {
-	vaddr_t prpage, fla;
-	struct freelist *fl;
-	int blktype;
-	unsigned i, n, index;
-	u_int32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
+	struct slab *sl, **entry;
+	vaddr_t page, obj;
+	unsigned i;
 
-	checksubpage(pr);
 	assert(curspl>0);
 
-	/* clear freemap[] */
-	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
-		freemap[i] = 0;
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
 	}
 
-	prpage = PR_PAGEADDR(pr);
-	blktype = PR_BLOCKTYPE(pr);
-
-	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
-	assert(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
+	if (kc->kc_onpage) {
+		sl = (struct slab *)(page + PAGE_SIZE - sizeof(struct slab));
+	}
+	else {
+		sl = kmcache_doalloc(&slabcache);
+		if (sl == NULL) {
+			free_kpages(page);
+			return NULL;
+		}
+	}
 
-	if (pr->freelist_offset != INVALID_OFFSET) {
-		fla = prpage + pr->freelist_offset;
-		fl = (struct freelist *)fla;
+	entry = slabtable_entry(page, 1);
+	if (entry == NULL) {
+		goto fail;
+	}
 
-		for (; fl != NULL; fl = fl->next) {
-			fla = (vaddr_t)fl;
-			index = (fla-prpage) / sizes[blktype];
-			assert(index<n);
-			freemap[index/32] |= (1<<(index%32));
+	for (i=0; i<kc->kc_perslab; i++) {
+		obj = page + i*kc->kc_size;
+		if (kc->kc_ctor != NULL && kc->kc_ctor((void *)obj)) {
+			slab_destruct(kc, page, i);
+			goto fail;
 		}
 	}
 
-	kprintf("at 0x%08lx: size %-4lu  %u/%u free\n", 
-		(unsigned long)prpage, (unsigned long) sizes[blktype],
-		(unsigned) pr->nfree, n);
-	kprintf("   ");
-	for (i=0; i<n; i++) {
-		int val = (freemap[i/32] & (1<<(i%32)))!=0;
-		kprintf("%c", val ? '.' : '*');
-		if (i%64==63 && i<n-1) {
-			kprintf("\n   ");
-		}
+	/* Freelist in address order */
+	sl->sl_cache = kc;
+	sl->sl_page = page;
+	sl->sl_inuse = 0;
+	sl->sl_free = NULL;
+	for (i=kc->kc_perslab; i-- > 0; ) {
+		obj = page + i*kc->kc_size;
+		OBJ_NEXT(kc, obj) = sl->sl_free;
+		sl->sl_free = (void *)obj;
+	}
+
+	*entry = sl;
+	slab_link(&kc->kc_empty, sl);
+	kc->kc_nempty++;
+	kc->kc_nslabs++;
+	kc->kc_grows++;
+	checkslab(sl);
+	return sl;
+
+ fail:
+	if (!kc->kc_onpage) {
+		slab_free(slabtable_lookup((vaddr_t)sl), sl);
 	}
-	kprintf("\n");
+	free_kpages(page);
+	return NULL;
 }
 
+/*
+ * Give back an unused slab that has already been taken off its list.
+ * Called at splhigh.
+ */
+static
 void
-kheap_printstats(void)
+kmcache_release(struct kmcache *kc, struct slab *sl)
 {
-	struct pageref *pr;
+	struct slab **entry;
+	vaddr_t page = sl->sl_page;
 
-	/* print the whole thing with interrupts off */
-	int spl = splhigh();
+	assert(sl->sl_inuse == 0);
+	checkslab(sl);
 
-	kprintf("Subpage allocator status:\n");
+	entry = slabtable_entry(page, 0);
+	assert(entry != NULL && *entry == sl);
+	*entry = NULL;
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
-	}
+	kc->kc_nslabs--;
+	kc->kc_shrinks++;
 
-	splx(spl);
+	slab_destruct(kc, page, kc->kc_perslab);
+	if (!kc->kc_onpage) {
+		slab_free(slabtable_lookup((vaddr_t)sl), sl);
+	}
+	free_kpages(page);
 }
 
-////////////////////////////////////////
-
 static
-void
-remove_lists(struct pageref *pr, int blktype)
+void *
+kmcache_doalloc(struct kmcache *kc)
 {
-	struct pageref **guy;
+	struct slab *sl;
+	void *ptr;
+	int spl;
 
-	assert(blktype>=0 && blktype<NSIZES);
+	spl = splhigh();
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
+	sl = kc->kc_partial;
+	if (sl == NULL) {
+		if (kc->kc_empty == NULL && kmcache_grow(kc) == NULL) {
+			splx(spl);
+			return NULL;
 		}
-	}
-
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+		/* Growing may have slept; take whatever's there now */
+		sl = kc->kc_partial;
+		if (sl == NULL) {
+			sl = kc->kc_empty;
+			slab_unlink(&kc->kc_empty, sl);
+			kc->kc_nempty--;
+			slab_link(&kc->kc_partial, sl);
 		}
 	}
-}
 
-static
-inline
-int blocktype(size_t sz)
-{
-	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (sz <= sizes[i]) {
-			return i;
-		}
+	assert(sl->sl_free != NULL);
+	ptr = sl->sl_free;
+	sl->sl_free = OBJ_NEXT(kc, ptr);
+	sl->sl_inuse++;
+	if (sl->sl_inuse == kc->kc_perslab) {
+		slab_unlink(&kc->kc_partial, sl);
+		slab_link(&kc->kc_full, sl);
 	}
 
-	panic("Subpage allocator cannot handle allocation of size %lu\n", 
-	      (unsigned long)sz);
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	checkslab(sl);
 
-	// keep compiler happy
-	return 0;
+	splx(spl);
+	return ptr;
 }
 
 static
-void *
-subpage_kmalloc(size_t sz)
+void
+slab_free(struct slab *sl, void *ptr)
 {
-	int spl;		// saved interrupt level
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	struct kmcache *kc;
+	vaddr_t offset;
+	int spl;
 
-	volatile int i;
+	if (sl == NULL) {
+		panic("kfree: free of %p, which is not on a slab\n", ptr);
+	}
+	kc = sl->sl_cache;
 
+	/* Check for proper positioning and alignment */
+	offset = (vaddr_t)ptr - sl->sl_page;
+	if (offset % kc->kc_size != 0 || offset / kc->kc_size >= kc->kc_perslab) {
+		panic("kfree: %s: free of invalid addr %p\n", kc->kc_name, ptr);
+	}
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers - unless it's been constructed.
+	 */
+	if (kc->kc_ctor == NULL) {
+		fill_deadbeef(ptr, kc->kc_size);
+	}
 
 	spl = splhigh();
 
-	checksubpages();
-
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
-
-		/* check for corruption */
-		assert(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
-
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			assert(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				assert(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				assert(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				assert(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	assert(sl->sl_inuse > 0);
+	OBJ_NEXT(kc, ptr) = sl->sl_free;
+	sl->sl_free = ptr;
+	if (sl->sl_inuse == kc->kc_perslab) {
+		slab_unlink(&kc->kc_full, sl);
+		slab_link(&kc->kc_partial, sl);
+	}
+	sl->sl_inuse--;
 
-			checksubpages();
+	kc->kc_inuse--;
+	kc->kc_frees++;
 
-			splx(spl);
-			return retptr;
+	if (sl->sl_inuse == 0) {
+		slab_unlink(&kc->kc_partial, sl);
+		if (kc->kc_nempty < KMCACHE_MAXEMPTY) {
+			slab_link(&kc->kc_empty, sl);
+			kc->kc_nempty++;
+		}
+		else {
+			kmcache_release(kc, sl);
 		}
 	}
-
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 */
-
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
-		splx(spl);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+	else {
+		checkslab(sl);
 	}
 
-	prpage = alloc_kpages(1);
-	if (prpage==0) {
-		/* Out of memory. */
-		freepageref(pr);
-		splx(spl);
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
-	}
+	splx(spl);
+}
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+////////////////////////////////////////
 
-	/*
-	 * Note: fl is volatile because the MIPS toolchain we were
-	 * using in spring 2001 attempted to optimize this loop and
-	 * blew it. Making fl volatile inhibits the optimization.
-	 */
+struct kmcache *
+kmcache_create(const char *name, size_t size,
+	       int (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmcache *kc;
+	int spl;
 
-	fla = prpage;
-	fl = (struct freelist *)fla;
-	fl->next = NULL;
-	for (i=1; i<pr->nfree; i++) {
-		fl = (struct freelist *)(fla + i*sizes[blktype]);
-		fl->next = (struct freelist *)(fla + (i-1)*sizes[blktype]);
-		assert(fl != fl->next);
+	kc = kmalloc(sizeof(struct kmcache));
+	if (kc == NULL) {
+		return NULL;
 	}
-	fla = (vaddr_t) fl;
-	pr->freelist_offset = fla - prpage;
-	assert(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
-
-	pr->next_all = allbase;
-	allbase = pr;
+	spl = splhigh();
+	kmcache_init(kc, name, size, ctor, dtor);
+	splx(spl);
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	return kc;
 }
 
-static
-int
-subpage_kfree(void *ptr)
+void
+kmcache_destroy(struct kmcache *kc)
 {
-	int spl;		// saved interrupt level
-	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
-	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
-	vaddr_t offset;		// offset into page
-
-	ptraddr = (vaddr_t)ptr;
+	struct kmcache **kcp;
+	struct slab *sl;
+	int spl;
 
 	spl = splhigh();
 
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	if (kc->kc_inuse > 0) {
+		panic("kmcache_destroy: %s: %u objects still in use\n",
+		      kc->kc_name, kc->kc_inuse);
+	}
+	assert(kc->kc_partial == NULL && kc->kc_full == NULL);
 
-		/* check for corruption */
-		assert(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	while ((sl = kc->kc_empty) != NULL) {
+		slab_unlink(&kc->kc_empty, sl);
+		kc->kc_nempty--;
+		kmcache_release(kc, sl);
+	}
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+	for (kcp = &allcaches; *kcp != NULL; kcp = &(*kcp)->kc_nextcache) {
+		if (*kcp == kc) {
+			*kcp = kc->kc_nextcache;
 			break;
 		}
 	}
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		splx(spl);
-		return -1;
-	}
+	splx(spl);
 
-	offset = ptraddr - prpage;
+	kfree(kc);
+}
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+void *
+kmcache_alloc(struct kmcache *kc)
+{
+	return kmcache_doalloc(kc);
+}
+
+void
+kmcache_free(struct kmcache *kc, void *ptr)
+{
+	struct slab *sl;
+
+	if (ptr == NULL) {
+		return;
 	}
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	sl = slabtable_lookup((vaddr_t)ptr);
+	if (sl == NULL || sl->sl_cache != kc) {
+		panic("kmcache_free: %s: %p is not from this cache\n",
+		      kc->kc_name, ptr);
+	}
+	slab_free(sl, ptr);
+}
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+void
+kheap_printstats(void)
+{
+	struct kmcache *kc;
+	unsigned total, slabs = 0;
+
+	/* print the whole thing with interrupts off */
+	int spl = splhigh();
+
+	kprintf("Slab allocator status:\n");
+	kprintf("  %-16s %5s %4s %6s %13s %5s %8s %8s\n",
+		"cache", "size", "per", "slabs",
+		"inuse/total", "util", "allocs", "frees");
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	for (kc = allcaches; kc != NULL; kc = kc->kc_nextcache) {
+		if (kc->kc_nslabs == 0 && kc->kc_allocs == 0) {
+			continue;
+		}
+		total = kc->kc_nslabs * kc->kc_perslab;
+		slabs += kc->kc_nslabs;
+		kprintf("  %-16s %5lu %4u %6u %6u/%-6u %4u%% %8lu %8lu\n",
+			kc->kc_name,
+			(unsigned long) kc->kc_size, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_inuse, total,
+			total ? kc->kc_inuse * 100 / total : 0,
+			(unsigned long) kc->kc_allocs,
+			(unsigned long) kc->kc_frees);
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	kprintf("  %u pages in slabs\n", slabs);
+
+	splx(spl);
+}
 
-	assert(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		free_kpages(prpage);
-		freepageref(pr);
+static
+inline
+int blocktype(size_t sz)
+{
+	unsigned i;
+	for (i=0; i<NSIZES; i++) {
+		if (sz <= sizes[i]) {
+			return i;
+		}
 	}
 
-	checksubpages();
+	panic("Slab allocator cannot handle allocation of size %lu\n", 
+	      (unsigned long)sz);
 
-	splx(spl);
+	// keep compiler happy
 	return 0;
 }
 
@@ -547,6 +673,8 @@ subpage_kfree(void *ptr)
 void *
 kmalloc(size_t sz)
 {
+	int spl;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -572,20 +700,34 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	if (!kheap_ready) {
+		spl = splhigh();
+		kheap_setup();
+		splx(spl);
+	}
+
+	return kmcache_doalloc(&sizecaches[blocktype(sz)]);
 }
 
 void
 kfree(void *ptr)
 {
+	struct slab *sl;
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Objects on a slab go back to their cache; anything else is a
+	 * big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	sl = slabtable_lookup((vaddr_t)ptr);
+	if (sl != NULL) {
+		slab_free(sl, ptr);
+	}
+	else {
 		assert((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
@@ -14,6 +14,8 @@
 #include <dev.h>
 #include <vfs.h>
 #include <vm.h>
+#include <file.h>
+#include <cache.h>
 #include <syscall.h>
 #include <version.h>
 
@@ -88,6 +90,8 @@ boot(void)
 	pid_bootstrap(); /* ASST1: initialize pid management before threads */
 	thread_bootstrap();
 	vfs_bootstrap();
+	file_bootstrap();
+	cache_bootstrap();
 	dev_bootstrap();
 #if !OPT_DUMBVM /* only initialize swap if not using dumbvm */
         swap_bootstrap(memsize); /* ASST2: initialize swap file after devices */
@@ -121,6 +125,7 @@ shutdown(void)
 	vfs_clearbootfs();
 	vfs_clearcurdir();
 	vfs_unmountall();
+	cache_shutdown();
 
 	splhigh();
 
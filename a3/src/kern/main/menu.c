@@ -18,6 +18,9 @@
 #include "opt-net.h"
 #include "opt-dumbvm.h"
 #include <vm.h> /* ASST2: for vm_printstats function */
+#include <machine/coremap.h>
+#include <cache.h>
+#include <scheduler.h>
 
 #if OPT_SYNCHPROBS
 #include <lunchcounter.h>
@@ -364,8 +367,66 @@ cmd_vmstats(int nargs, char **args)
 
         return 0;
 }
+
+static
+int
+cmd_coremap(int nargs, char **args)
+{
+	if (nargs == 1) {
+		coremap_print_short();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "-l")) {
+		coremap_print_long();
+	}
+	else {
+		kprintf("Usage: cm [-l]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	int quantum;
+
+	if (nargs == 2) {
+		quantum = atoi(args[1]);
+		if (quantum < 1) {
+			kprintf("Usage: sched [quantum in ticks]\n");
+			return EINVAL;
+		}
+		sched_quantum = quantum;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sched [quantum in ticks]\n");
+		return EINVAL;
+	}
+
+	print_run_queue();
+
+	return 0;
+}
+
+static
+int
+cmd_cachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cache_printstats();
+	vfs_dcache_printstats();
+#if OPT_SFS
+	sfs_printstats();
 #endif
 
+	return 0;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -440,10 +501,13 @@ static const char *testmenu[] = {
 	"[qt]  Queue test                    ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km5] kmalloc benchmark             ",
 #if !OPT_DUMBVM
 	/* New tests for ASST2 */
 	"[km3] Coremap alloc test            ",
 	"[km4] Coremap alloc stress test     ",
+	"[tlb1] TLB ASID refill test         ",
+	"[tlb2] TLB fast refill test         ",
 	/* End new tests for ASST2 */
 #endif
 	"[tt1] Thread test 1                 ",
@@ -457,11 +521,18 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Wakeup latency test   (1)     ",
+	"[sy5] Rwlock throughput     (1)     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[buftest1] Buffer cache test 1      ",
+	"[buftest2] Buffer cache test 2      ",
+	"[buftest3] Buffer cache hit scaling ",
+	"[buftest4] Buffer cache write-back  ",
+	"[disk1] Disk queue throughput       ",
 	NULL
 };
 
@@ -492,6 +563,8 @@ static const char *mainmenu[] = {
 #endif
         "[vm] Virtual memory stats           ", /* ASST2 */
 	"[kh] Kernel heap stats              ",
+	"[cs] Buffer cache stats             ",
+	"[sched] Scheduler state / quantum   ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -546,8 +619,11 @@ static struct {
 	/* stats */
 #if !OPT_DUMBVM
         { "vm",         cmd_vmstats },    /* ASST2 */
+	{ "cm",		cmd_coremap },
 #endif
 	{ "kh",         cmd_kheapstats },
+	{ "cs",         cmd_cachestats },
+	{ "sched",	cmd_sched },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -555,10 +631,13 @@ static struct {
 	{ "qt",		queuetest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km5",	mallocbench },
 #if !OPT_DUMBVM
 	/* ASST2 tests */
 	{ "km3",        coremaptest },
 	{ "km4",        coremapstress },
+	{ "tlb1",	tlbtest },
+	{ "tlb2",	tlbtest2 },
 #endif
 #if OPT_NET
 	{ "net",	nettest },
@@ -575,6 +654,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	wakeuptest },
+	{ "sy5",	rwtest },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
@@ -583,6 +664,15 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
 
+	/* buffer cache tests */
+	{ "buftest1",	buffertest1 },
+	{ "buftest2",	buffertest2 },
+	{ "buftest3",	buffertest3 },
+	{ "buftest4",	buffertest4 },
+
+	/* disk driver tests */
+	{ "disk1",	disktest },
+
 	{ NULL, NULL }
 };
 
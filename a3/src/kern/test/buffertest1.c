@@ -145,11 +145,19 @@ runthreads(int nthreads)
 
 int buffertest1(int nargs, char **args)
 {
+  int result;
+
   (void)nargs;
   (void)args;
 
   init_sem();
 
+  result = cache_init();
+  if (result) {
+    kprintf("buftest1: cache_init failed: %s\n", strerror(result));
+    return result;
+  }
+
   kprintf("Starting buffer test 1. ");
 
   if (nargs==1) {
@@ -180,11 +180,19 @@ runthreads(int nthreads)
 
 int buffertest2(int nargs, char **args)
 {
+  int result;
+
   (void)nargs;
   (void)args;
 
   init_sem();
 
+  result = cache_init();
+  if (result) {
+    kprintf("buftest2: cache_init failed: %s\n", strerror(result));
+    return result;
+  }
+
   kprintf("Starting buffer test 2...\n");
 
   if (nargs==1) {
@@ -0,0 +1,196 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/unistd.h>
+#include <kern/errno.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <cache.h>
+
+/* A scaling variant of buffertest2.  A set of blocks small enough
+ * to stay resident in the cache is written and read in once.  Then,
+ * for 1, 2, 4, ... up to the requested number of reader threads, each
+ * thread reads all of those blocks NTRIES times over, starting at a
+ * different block than the other threads, and checks what it reads.
+ *
+ * Every read is a cache hit, so the time taken is all cache overhead.
+ * The hits per second reported for each thread count should stay
+ * roughly flat as readers are added; if they fall off, readers are
+ * queueing up behind each other inside the cache.
+ */
+
+#define NHOT NBUFS
+#define NTRIES 200
+
+static struct semaphore *tsem = NULL;
+static volatile int errors;
+
+static
+void
+init_sem(void)
+{
+	if (tsem==NULL) {
+		tsem = sem_create("buffer test sem", 0);
+		if (tsem == NULL) {
+			panic("buffertest3: sem_create failed\n");
+		}
+	}
+}
+
+static void
+read_hot_blocks(void *junk, unsigned long me)
+{
+  int i,j,k;
+  int blk;
+  int *my_buf = (int *)kmalloc(BUFSIZE);
+  int ints_per_buf = BUFSIZE/sizeof(int);
+
+  (void)junk;
+
+  if (my_buf == NULL) {
+    kprintf("buftest3: thread %ld out of memory\n", me);
+    errors++;
+    V(tsem);
+    return;
+  }
+
+  for (i = 0; i < NTRIES; i++) {
+    for (j = 0; j < NHOT; j++) {
+      blk = (j + me) % NHOT;
+      cache_read(blk, (void *)my_buf);
+      for (k = 0; k < ints_per_buf; k++) {
+	if (my_buf[k] != blk) {
+	  kprintf("ERROR in buftest3: thread %ld sees block %d value %d\n",
+		  me, blk, my_buf[k]);
+	  errors++;
+	  break;
+	}
+      }
+    }
+  }
+
+  kfree(my_buf);
+  V(tsem);
+}
+
+static
+int
+load_hot_blocks(void)
+{
+  int j,k;
+  int result;
+  int *my_buf = (int *)kmalloc(BUFSIZE);
+  int ints_per_buf = BUFSIZE/sizeof(int);
+
+  if (my_buf == NULL) {
+    return ENOMEM;
+  }
+
+  for (j = 0; j < NHOT; j++) {
+    for (k = 0; k < ints_per_buf; k++) {
+      my_buf[k] = j;
+    }
+    result = cache_write(j, (void *)my_buf);
+    if (result) {
+      kfree(my_buf);
+      return result;
+    }
+    result = cache_read(j, (void *)my_buf);
+    if (result) {
+      kfree(my_buf);
+      return result;
+    }
+  }
+
+  kfree(my_buf);
+  return 0;
+}
+
+static
+void
+runthreads(int nthreads)
+{
+	char name[16];
+	int i, result;
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs;
+	u_int32_t msecs;
+
+	gettime(&beforesecs, &beforensecs);
+
+	for (i=0; i<nthreads; i++) {
+		snprintf(name, sizeof(name), "buffertest3_%d", i);
+		result = thread_fork(name, NULL, i, read_hot_blocks, NULL);
+		if (result) {
+			panic("buffertest3: thread_fork failed %s)\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(tsem);
+	}
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+
+	msecs = secs*1000 + nsecs/1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+
+	kprintf("buftest3: %3d readers: %7d hits in %lu.%03lu s, %7lu hits/s\n",
+		nthreads, nthreads*NTRIES*NHOT,
+		(unsigned long) secs, (unsigned long) nsecs/1000000,
+		(unsigned long) nthreads*NTRIES*NHOT*1000/msecs);
+}
+
+int buffertest3(int nargs, char **args)
+{
+  int maxthreads;
+  int n;
+  int result;
+
+  init_sem();
+
+  if (nargs==1) {
+    maxthreads = 8;
+  }
+  else if (nargs==2) {
+    maxthreads = atoi(args[1]);
+  }
+  else {
+    kprintf("Usage: buftest3 [max num reader threads]\n");
+    kprintf("If max threads is not specified, runs with 1, 2, 4 and 8 readers\n");
+    return 1;
+  }
+
+  result = cache_init();
+  if (result) {
+    kprintf("buftest3: cache_init failed: %s\n", strerror(result));
+    return result;
+  }
+
+  kprintf("Starting buffer test 3...\n");
+
+  result = load_hot_blocks();
+  if (result) {
+    kprintf("buftest3: loading blocks failed: %s\n", strerror(result));
+    return result;
+  }
+
+  errors = 0;
+  for (n = 1; n <= maxthreads; n *= 2) {
+    runthreads(n);
+  }
+
+  if (errors) {
+    kprintf("buftest3: %d errors\n", errors);
+  }
+
+  kprintf("Done buffer test 3.\n");
+
+  return 0;
+
+}
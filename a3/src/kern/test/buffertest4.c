@@ -0,0 +1,202 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/unistd.h>
+#include <kern/errno.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <cache.h>
+
+/* Write-back test.  Writes a burst of blocks, timing the writes, then
+ * times a cache_sync, then reads the blocks back and checks them.
+ * Then checks that cache_syncowner only writes the blocks it is asked
+ * for.
+ *
+ * With a write-back cache, a burst that fits in the cache should
+ * cost no disk io at all while it is being written: all of the io
+ * time shows up in the sync instead.  A burst larger than the cache
+ * makes writers evict dirty blocks themselves, and the time per
+ * write goes up to about one disk write.
+ */
+
+extern struct cache *the_cache;
+
+#define FIRST_BLOCK 100
+
+static
+u_int32_t
+elapsed_usecs(time_t beforesecs, u_int32_t beforensecs)
+{
+	time_t aftersecs, secs;
+	u_int32_t afternsecs, nsecs;
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	return secs*1000000 + nsecs/1000;
+}
+
+static
+int
+write_burst(int nblocks, int pass)
+{
+  int i,k;
+  int result;
+  int errors = 0;
+  int *my_buf = (int *)kmalloc(BUFSIZE);
+  int ints_per_buf = BUFSIZE/sizeof(int);
+  time_t beforesecs;
+  u_int32_t beforensecs;
+  u_int32_t wusecs, susecs;
+
+  if (my_buf == NULL) {
+    return ENOMEM;
+  }
+
+  gettime(&beforesecs, &beforensecs);
+  for (i = 0; i < nblocks; i++) {
+    for (k = 0; k < ints_per_buf; k++) {
+      my_buf[k] = pass*10000 + i;
+    }
+    result = cache_write(FIRST_BLOCK+i, (void *)my_buf);
+    if (result) {
+      kfree(my_buf);
+      return result;
+    }
+  }
+  wusecs = elapsed_usecs(beforesecs, beforensecs);
+
+  gettime(&beforesecs, &beforensecs);
+  result = cache_sync(the_cache);
+  susecs = elapsed_usecs(beforesecs, beforensecs);
+  if (result) {
+    kfree(my_buf);
+    return result;
+  }
+
+  for (i = 0; i < nblocks; i++) {
+    result = cache_read(FIRST_BLOCK+i, (void *)my_buf);
+    if (result) {
+      kfree(my_buf);
+      return result;
+    }
+    for (k = 0; k < ints_per_buf; k++) {
+      if (my_buf[k] != pass*10000 + i) {
+	kprintf("ERROR in buftest4: block %d value %d\n",
+		FIRST_BLOCK+i, my_buf[k]);
+	errors++;
+	break;
+      }
+    }
+  }
+
+  kprintf("buftest4: %4d blocks: %6lu us/write, sync took %lu us%s\n",
+	  nblocks, (unsigned long) wusecs/nblocks, (unsigned long) susecs,
+	  errors ? " (ERRORS)" : "");
+
+  kfree(my_buf);
+  return 0;
+}
+
+/* Write a few blocks for two owners, sync one owner, and check that
+ * only its blocks came clean.
+ */
+#define NOWNED 4
+
+static
+int
+sync_owned(void)
+{
+  struct buf_hdr *buf;
+  int i, owner, dirty;
+  int result;
+  int errors = 0;
+  char *my_buf = kmalloc(BUFSIZE);
+
+  if (my_buf == NULL) {
+    return ENOMEM;
+  }
+  bzero(my_buf, BUFSIZE);
+
+  for (i = 0; i < NOWNED; i++) {
+    result = cache_bwrite_owned(the_cache, FIRST_BLOCK+i, my_buf, 1 + i%2);
+    if (result) {
+      kfree(my_buf);
+      return result;
+    }
+  }
+  kfree(my_buf);
+
+  result = cache_syncowner(the_cache, 1);
+  if (result) {
+    return result;
+  }
+
+  for (i = 0; i < NOWNED; i++) {
+    owner = 1 + i%2;
+    result = cache_get(the_cache, FIRST_BLOCK+i, 0, &buf);
+    if (result) {
+      return result;
+    }
+    dirty = buf->dirty || buf->flushing;
+    cache_put(the_cache, buf, FALSE);
+    if (dirty != (owner != 1)) {
+      kprintf("ERROR in buftest4: block %d (owner %d) is %s\n",
+	      FIRST_BLOCK+i, owner, dirty ? "dirty" : "clean");
+      errors++;
+    }
+  }
+
+  kprintf("buftest4: syncing one owner's blocks%s\n",
+	  errors ? " (ERRORS)" : ": ok");
+
+  return cache_sync(the_cache);
+}
+
+int buffertest4(int nargs, char **args)
+{
+  int result;
+  int big;
+
+  if (nargs==1) {
+    big = 4*NBUFS;
+  }
+  else if (nargs==2) {
+    big = atoi(args[1]);
+  }
+  else {
+    kprintf("Usage: buftest4 [num blocks in large burst]\n");
+    return 1;
+  }
+
+  result = cache_init();
+  if (result) {
+    kprintf("buftest4: cache_init failed: %s\n", strerror(result));
+    return result;
+  }
+
+  if (big < 1 || FIRST_BLOCK + big > max_block_id) {
+    kprintf("buftest4: burst must be between 1 and %d blocks\n",
+	    max_block_id - FIRST_BLOCK);
+    return 1;
+  }
+
+  kprintf("Starting buffer test 4...\n");
+
+  /* Small enough that the flusher shouldn't even be woken */
+  result = write_burst(NBUFS * CACHE_DIRTY_HIGH / 100, 1);
+  if (result == 0) {
+    result = write_burst(big, 2);
+  }
+  if (result == 0) {
+    result = sync_owned();
+  }
+  if (result) {
+    kprintf("buftest4: %s\n", strerror(result));
+    return result;
+  }
+
+  kprintf("Done buffer test 4.\n");
+
+  return 0;
+}
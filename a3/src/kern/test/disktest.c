@@ -0,0 +1,199 @@
+/*
+ * Disk throughput test.
+ *
+ * Several threads read from a raw disk device at once, first with the
+ * driver's request queue turned off (one sector at a time, first come
+ * first served) and then with it on (sorted and merged). It is run
+ * twice over: once with each thread reading chunks at random, which
+ * the elevator can only reorder, and once with the threads reading
+ * interleaved chunks of one region, which it can also merge.
+ *
+ * Only reads are done, so it is safe on a disk with a file system.
+ */
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <kern/ioctl.h>
+#include <kern/stat.h>
+#include <kern/unistd.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define NTHREADS   4
+#define NREADS     32       /* reads per thread */
+#define CHUNKSECTS 8        /* sectors per read */
+#define SECTSIZE   512
+
+#define PAT_RANDOM       0
+#define PAT_INTERLEAVED  1
+
+static struct semaphore *dsem = NULL;
+static struct vnode *dvn;
+static u_int32_t dsects;
+static int dpattern;
+static volatile int derrors;
+
+static
+void
+init_sem(void)
+{
+	if (dsem==NULL) {
+		dsem = sem_create("disktest sem", 0);
+		if (dsem == NULL) {
+			panic("disktest: sem_create failed\n");
+		}
+	}
+}
+
+static
+void
+diskreader(void *junk, unsigned long num)
+{
+	struct uio ku;
+	char *buf;
+	u_int32_t chunk;
+	int i, result;
+
+	(void)junk;
+
+	buf = kmalloc(CHUNKSECTS*SECTSIZE);
+	if (buf == NULL) {
+		kprintf("disktest: thread %lu out of memory\n", num);
+		derrors++;
+		V(dsem);
+		return;
+	}
+
+	for (i=0; i<NREADS; i++) {
+		if (dpattern == PAT_RANDOM) {
+			chunk = random() % (dsects / CHUNKSECTS);
+		}
+		else {
+			chunk = i*NTHREADS + num;
+		}
+
+		mk_kuio(&ku, buf, CHUNKSECTS*SECTSIZE,
+			(off_t)chunk*CHUNKSECTS*SECTSIZE, UIO_READ);
+		result = VOP_READ(dvn, &ku);
+		if (result) {
+			kprintf("disktest: thread %lu: sector %u: %s\n",
+				num, chunk*CHUNKSECTS, strerror(result));
+			derrors++;
+			break;
+		}
+	}
+
+	kfree(buf);
+	V(dsem);
+}
+
+static
+int
+runreaders(const char *device, int queueop)
+{
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs;
+	u_int32_t usecs, kbytes;
+	int i, result;
+
+	result = VOP_IOCTL(dvn, queueop, NULL);
+	if (result) {
+		kprintf("disktest: %s: cannot switch queueing: %s\n",
+			device, strerror(result));
+		return result;
+	}
+
+	derrors = 0;
+	gettime(&beforesecs, &beforensecs);
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("disktest", NULL, i, diskreader, NULL);
+		if (result) {
+			panic("disktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(dsem);
+	}
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	usecs = secs*1000000 + nsecs/1000;
+	kbytes = NTHREADS*NREADS*CHUNKSECTS*SECTSIZE/1024;
+
+	kprintf("disktest: %s, queueing %s: %lu us, %lu KB/s%s\n",
+		dpattern == PAT_RANDOM ? "random     " : "interleaved",
+		queueop == DIOC_QUEUE_ON ? "on " : "off",
+		(unsigned long) usecs,
+		(unsigned long) (kbytes*1000000 / (usecs > 0 ? usecs : 1)),
+		derrors ? " (ERRORS)" : "");
+	VOP_IOCTL(dvn, DIOC_PRINTSTATS, NULL);
+
+	return derrors ? EIO : 0;
+}
+
+int
+disktest(int nargs, char **args)
+{
+	char device[32];
+	struct stat st;
+	int result;
+
+	if (nargs==1) {
+		strcpy(device, "lhd0raw:");
+	}
+	else if (nargs==2) {
+		snprintf(device, sizeof(device), "%s", args[1]);
+	}
+	else {
+		kprintf("Usage: disk1 [raw disk device]\n");
+		return 1;
+	}
+
+	init_sem();
+
+	result = vfs_open(device, O_RDONLY, &dvn);
+	if (result) {
+		kprintf("disktest: %s: %s\n", device, strerror(result));
+		return result;
+	}
+
+	result = VOP_STAT(dvn, &st);
+	if (result == 0 && st.st_blocks < NTHREADS*NREADS*CHUNKSECTS) {
+		kprintf("disktest: %s is too small\n", device);
+		result = EINVAL;
+	}
+	if (result) {
+		vfs_close(dvn);
+		return result;
+	}
+	dsects = st.st_blocks;
+
+	kprintf("Starting disk test...\n");
+
+	for (dpattern = PAT_RANDOM; dpattern <= PAT_INTERLEAVED; dpattern++) {
+		result = runreaders(device, DIOC_QUEUE_OFF);
+		if (result == 0) {
+			result = runreaders(device, DIOC_QUEUE_ON);
+		}
+		if (result) {
+			break;
+		}
+	}
+
+	/* Leave the queue on, whatever happened */
+	VOP_IOCTL(dvn, DIOC_QUEUE_ON, NULL);
+	vfs_close(dvn);
+
+	if (result == 0) {
+		kprintf("Disk test done.\n");
+	}
+	return result;
+}
@@ -3,6 +3,8 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <kern/errno.h>
+#include <clock.h>
 #include <synch.h>
 #include <thread.h>
 #include <test.h>
@@ -108,3 +110,151 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * kmalloc microbenchmark. For each of several sizes, allocate
+ * BENCHBATCH objects and then free them all, BENCHROUNDS times over,
+ * and report the time for each allocate/free pair. Each object is
+ * written and checked before it is freed.
+ *
+ * Then compare objects that need a semaphore made for them: first
+ * kmalloc plus sem_create every time, then an object cache whose
+ * constructor keeps the semaphore around between uses.
+ */
+
+#define BENCHBATCH   256
+#define BENCHROUNDS  16
+#define NBENCHSIZES  5
+
+static const size_t benchsizes[NBENCHSIZES] = { 16, 40, 128, 500, 1500 };
+
+struct benchobj {
+	struct semaphore *bo_sem;
+	int bo_data[6];
+};
+
+static void *benchptrs[BENCHBATCH];
+
+static
+int
+benchobj_ctor(void *obj)
+{
+	struct benchobj *bo = obj;
+
+	bo->bo_sem = sem_create("benchobj", 0);
+	return bo->bo_sem == NULL ? ENOMEM : 0;
+}
+
+static
+void
+benchobj_dtor(void *obj)
+{
+	struct benchobj *bo = obj;
+
+	sem_destroy(bo->bo_sem);
+}
+
+/*
+ * Print nanoseconds per allocate/free pair since START.
+ */
+static
+void
+benchreport(const char *what, size_t size, time_t startsecs,
+	    u_int32_t startnsecs)
+{
+	time_t endsecs, secs;
+	u_int32_t endnsecs, nsecs, usecs;
+
+	gettime(&endsecs, &endnsecs);
+	getinterval(startsecs, startnsecs, endsecs, endnsecs, &secs, &nsecs);
+	usecs = secs*1000000 + nsecs/1000;
+	kprintf("  %-22s %5lu bytes: %6lu ns per alloc/free\n", what,
+		(unsigned long) size,
+		(unsigned long) (usecs*1000 / (BENCHBATCH*BENCHROUNDS)));
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct kmcache *kc;
+	struct benchobj *bo;
+	time_t secs;
+	u_int32_t nsecs;
+	unsigned i, j, k;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc benchmark...\n");
+
+	for (k=0; k<NBENCHSIZES; k++) {
+		gettime(&secs, &nsecs);
+		for (j=0; j<BENCHROUNDS; j++) {
+			for (i=0; i<BENCHBATCH; i++) {
+				benchptrs[i] = kmalloc(benchsizes[k]);
+				if (benchptrs[i] == NULL) {
+					panic("mallocbench: out of memory\n");
+				}
+				*(unsigned *)benchptrs[i] = i;
+			}
+			for (i=0; i<BENCHBATCH; i++) {
+				if (*(unsigned *)benchptrs[i] != i) {
+					panic("mallocbench: object %u at %p "
+					      "was overwritten\n", i,
+					      benchptrs[i]);
+				}
+				kfree(benchptrs[i]);
+			}
+		}
+		benchreport("kmalloc", benchsizes[k], secs, nsecs);
+	}
+
+	gettime(&secs, &nsecs);
+	for (j=0; j<BENCHROUNDS; j++) {
+		for (i=0; i<BENCHBATCH; i++) {
+			bo = kmalloc(sizeof(struct benchobj));
+			if (bo == NULL) {
+				panic("mallocbench: out of memory\n");
+			}
+			bo->bo_sem = sem_create("benchobj", 0);
+			if (bo->bo_sem == NULL) {
+				panic("mallocbench: out of memory\n");
+			}
+			benchptrs[i] = bo;
+		}
+		for (i=0; i<BENCHBATCH; i++) {
+			bo = benchptrs[i];
+			sem_destroy(bo->bo_sem);
+			kfree(bo);
+		}
+	}
+	benchreport("kmalloc+sem_create", sizeof(struct benchobj), secs, nsecs);
+
+	kc = kmcache_create("benchobj", sizeof(struct benchobj),
+			    benchobj_ctor, benchobj_dtor);
+	if (kc == NULL) {
+		panic("mallocbench: kmcache_create failed\n");
+	}
+
+	gettime(&secs, &nsecs);
+	for (j=0; j<BENCHROUNDS; j++) {
+		for (i=0; i<BENCHBATCH; i++) {
+			bo = kmcache_alloc(kc);
+			if (bo == NULL) {
+				panic("mallocbench: out of memory\n");
+			}
+			assert(bo->bo_sem != NULL && bo->bo_sem->count == 0);
+			benchptrs[i] = bo;
+		}
+		for (i=0; i<BENCHBATCH; i++) {
+			kmcache_free(kc, benchptrs[i]);
+		}
+	}
+	benchreport("kmcache with ctor", sizeof(struct benchobj), secs, nsecs);
+
+	kmcache_destroy(kc);
+	kheap_printstats();
+
+	kprintf("kmalloc benchmark done\n");
+	return 0;
+}
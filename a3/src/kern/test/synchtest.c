@@ -8,6 +8,7 @@
 #include <thread.h>
 #include <test.h>
 #include <clock.h>
+#include <machine/spl.h>
 
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
@@ -273,3 +274,340 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Wakeup latency test. Two threads hand a semaphore back and forth
+ * NPINGS times, first on their own and then with a crowd of other
+ * threads asleep on addresses of their own. The time per handoff
+ * should hardly change with the crowd: waking a thread shouldn't
+ * involve looking at threads sleeping on something else.
+ */
+
+#define NPINGS        500
+#define NPARKED       256
+
+static struct semaphore *pingsem;
+static struct semaphore *pongsem;
+static char *parkaddrs;
+static volatile int nparked;
+static volatile int parkdone;
+
+static
+void
+parkthread(void *junk, unsigned long num)
+{
+	int spl;
+
+	(void)junk;
+
+	spl = splhigh();
+	nparked++;
+	while (!parkdone) {
+		thread_sleep(&parkaddrs[num]);
+	}
+	splx(spl);
+
+	V(donesem);
+}
+
+static
+void
+pingthread(void *junk, unsigned long num)
+{
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<NPINGS; i++) {
+		if (num == 0) {
+			V(pingsem);
+			P(pongsem);
+		}
+		else {
+			P(pingsem);
+			V(pongsem);
+		}
+	}
+	V(donesem);
+}
+
+static
+u_int32_t
+pingpong(void)
+{
+	time_t secs1, secs2, secs;
+	u_int32_t nsecs1, nsecs2, nsecs;
+	u_int32_t usecs;
+	int i, result;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<2; i++) {
+		result = thread_fork("synchtest", NULL, i, pingthread, NULL);
+		if (result) {
+			panic("wakeuptest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<2; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	usecs = secs*1000000 + nsecs/1000;
+
+	/* nanoseconds per handoff, without overflowing */
+	return (usecs / (2*NPINGS)) * 1000
+		+ (usecs % (2*NPINGS)) * 1000 / (2*NPINGS);
+}
+
+int
+wakeuptest(int nargs, char **args)
+{
+	int i, n, spl, result;
+	u_int32_t alone, crowded;
+
+	if (nargs == 1) {
+		n = NPARKED;
+	}
+	else if (nargs == 2) {
+		n = atoi(args[1]);
+	}
+	else {
+		kprintf("Usage: sy4 [number of sleeping threads]\n");
+		return 1;
+	}
+	if (n < 1) {
+		kprintf("wakeuptest: need at least one sleeping thread\n");
+		return 1;
+	}
+
+	inititems();
+	if (pingsem==NULL) {
+		pingsem = sem_create("pingsem", 0);
+		pongsem = sem_create("pongsem", 0);
+		if (pingsem == NULL || pongsem == NULL) {
+			panic("wakeuptest: sem_create failed\n");
+		}
+	}
+	parkaddrs = kmalloc(n);
+	if (parkaddrs == NULL) {
+		kprintf("wakeuptest: out of memory\n");
+		return 1;
+	}
+
+	kprintf("Starting wakeup latency test...\n");
+
+	alone = pingpong();
+
+	nparked = 0;
+	parkdone = 0;
+	for (i=0; i<n; i++) {
+		result = thread_fork("synchtest", NULL, i, parkthread, NULL);
+		if (result) {
+			/* Out of memory for stacks, probably; make do */
+			kprintf("wakeuptest: thread_fork failed: %s\n",
+				strerror(result));
+			n = i;
+			break;
+		}
+	}
+	while (nparked < n) {
+		thread_yield();
+	}
+
+	crowded = pingpong();
+
+	spl = splhigh();
+	parkdone = 1;
+	for (i=0; i<n; i++) {
+		thread_wakeup(&parkaddrs[i]);
+	}
+	splx(spl);
+	for (i=0; i<n; i++) {
+		P(donesem);
+	}
+	kfree(parkaddrs);
+	parkaddrs = NULL;
+
+	kprintf("wakeuptest: %lu ns per wakeup alone, "
+		"%lu ns with %d threads asleep\n",
+		(unsigned long) alone, (unsigned long) crowded, n);
+	kprintf("Wakeup latency test done.\n");
+
+	return 0;
+}
+
+/*
+ * Readers-writer lock test. NRWREADERS readers and NRWWRITERS writers
+ * each get the lock NRWLOOPS times, and hold it until the next clock
+ * second, the way a file system holds a vnode lock across a disk
+ * read. Writers check that nobody else is in; readers check that no
+ * writer is. The same run is then done with a plain lock for
+ * comparison: readers holding the rwlock wait out their seconds
+ * together, so it should get through a good deal more acquisitions
+ * per second.
+ */
+
+#define NRWREADERS    8
+#define NRWWRITERS    2
+#define NRWLOOPS      2
+
+static struct rwlock *testrw;
+static volatile int rwuselock;
+static volatile int rwreaders;
+static volatile int rwwriters;
+static volatile int rwmaxreaders;
+static volatile int rwfailed;
+
+static
+void
+rwhold(void)
+{
+	int spl, then;
+
+	spl = splhigh();
+	then = lbolt;
+	while (lbolt == then) {
+		thread_sleep(&lbolt);
+	}
+	splx(spl);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i, spl, writer;
+
+	(void)junk;
+
+	writer = num < NRWWRITERS;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (rwuselock) {
+			lock_acquire(testlock);
+		}
+		else if (writer) {
+			rwlock_acquire_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+		}
+
+		spl = splhigh();
+		if (writer && (rwwriters > 0 || rwreaders > 0)) {
+			kprintf("thread %lu: writer got in with others\n",
+				num);
+			rwfailed = 1;
+		}
+		if (!writer && rwwriters > 0) {
+			kprintf("thread %lu: reader got in with a writer\n",
+				num);
+			rwfailed = 1;
+		}
+		if (writer) {
+			rwwriters++;
+		}
+		else {
+			rwreaders++;
+			if (rwreaders > rwmaxreaders) {
+				rwmaxreaders = rwreaders;
+			}
+		}
+		splx(spl);
+
+		rwhold();
+
+		spl = splhigh();
+		if (writer) {
+			rwwriters--;
+		}
+		else {
+			rwreaders--;
+		}
+		splx(spl);
+
+		if (rwuselock) {
+			lock_release(testlock);
+		}
+		else if (writer) {
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+/*
+ * Do one run, and return how long it took in milliseconds.
+ */
+static
+u_int32_t
+rwrun(int uselock)
+{
+	time_t secs1, secs2, secs;
+	u_int32_t nsecs1, nsecs2, nsecs;
+	int i, result;
+
+	rwuselock = uselock;
+	rwreaders = rwwriters = rwmaxreaders = 0;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NRWREADERS+NRWWRITERS; i++) {
+		result = thread_fork("synchtest", NULL, i, rwtestthread, NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWREADERS+NRWWRITERS; i++) {
+		P(donesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	return secs*1000 + nsecs/1000000;
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	u_int32_t rwms, lockms, nacquires;
+	int maxreaders;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (testrw==NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	rwfailed = 0;
+
+	kprintf("Starting rwlock test...\n");
+	nacquires = (NRWREADERS+NRWWRITERS)*NRWLOOPS;
+
+	rwms = rwrun(0);
+	maxreaders = rwmaxreaders;
+	lockms = rwrun(1);
+
+	if (rwfailed) {
+		kprintf("Test failed\n");
+		return 1;
+	}
+
+	kprintf("rwtest: %u acquisitions, %d readers in at once: "
+		"%u per minute with the rwlock, %u with a plain lock\n",
+		nacquires, maxreaders,
+		rwms ? nacquires*60000/rwms : 0,
+		lockms ? nacquires*60000/lockms : 0);
+	kprintf("Rwlock test done.\n");
+
+	return 0;
+}
@@ -0,0 +1,131 @@
+/*
+ * TLB tests: run a user program twice, first with some TLB feature off
+ * and then with it on, and print how many translations had to be
+ * entered into the TLB each time, by vm_fault and by the refill
+ * handler.
+ *
+ * tlb1 turns address space IDs on and off. Its default program,
+ * ctxbench, switches between several small processes a lot, which is
+ * where ASIDs ought to help.
+ *
+ * tlb2 turns the hashed page table the refill handler looks in on and
+ * off. Its default program, matmult, takes a lot of TLB misses on
+ * pages that are in memory.
+ */
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <clock.h>
+#include <thread.h>
+#include <test.h>
+#include <machine/coremap.h>
+
+static
+void
+tlbprogthread(void *ptr, unsigned long junk)
+{
+	const char *prog = ptr;
+	char progname[128];
+	int result;
+
+	(void)junk;
+
+	/* runprogram destroys the name it is given */
+	strcpy(progname, prog);
+	result = runprogram(progname);
+	kprintf("tlbtest: %s: %s\n", prog, strerror(result));
+}
+
+static
+int
+runprog(const char *prog, const char *what, void (*setfunc)(int), int on)
+{
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs;
+	u_int32_t refills0, fast0, switches0, flushes0;
+	u_int32_t refills, fast, switches, flushes;
+	pid_t pid;
+	int result, status;
+
+	setfunc(on);
+	mmu_getstats(&refills0, &fast0, &switches0, &flushes0);
+	gettime(&beforesecs, &beforensecs);
+
+	result = thread_fork(prog, (void *)prog, 0, tlbprogthread, &pid);
+	if (result) {
+		kprintf("tlbtest: thread_fork failed: %s\n", strerror(result));
+		return result;
+	}
+	result = thread_join(pid, &status);
+	if (result) {
+		kprintf("tlbtest: thread_join failed: %s\n", strerror(result));
+		return result;
+	}
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	mmu_getstats(&refills, &fast, &switches, &flushes);
+
+	kprintf("tlbtest: %s %s: %lu us, %lu tlb refills by vm_fault, "
+		"%lu by the refill handler, %lu switches, %lu flushes\n",
+		what, on ? "on " : "off",
+		(unsigned long) (secs*1000000 + nsecs/1000),
+		(unsigned long) (refills - refills0),
+		(unsigned long) (fast - fast0),
+		(unsigned long) (switches - switches0),
+		(unsigned long) (flushes - flushes0));
+	return 0;
+}
+
+static
+int
+common_tlbtest(int nargs, char **args, const char *defprog,
+	       const char *what, void (*setfunc)(int))
+{
+	const char *prog;
+	int result;
+
+	if (nargs==1) {
+		prog = defprog;
+	}
+	else if (nargs==2) {
+		prog = args[1];
+	}
+	else {
+		kprintf("Usage: %s [program]\n", args[0]);
+		return EINVAL;
+	}
+
+	if (strlen(prog) >= 128) {
+		return ENAMETOOLONG;
+	}
+
+	kprintf("Starting tlb test...\n");
+	result = runprog(prog, what, setfunc, 0);
+	if (result == 0) {
+		result = runprog(prog, what, setfunc, 1);
+	}
+
+	/* Leave it on, whatever happened */
+	setfunc(1);
+
+	if (result == 0) {
+		kprintf("TLB test done.\n");
+	}
+	return result;
+}
+
+int
+tlbtest(int nargs, char **args)
+{
+	return common_tlbtest(nargs, args, "/testbin/ctxbench", "asids",
+			      mmu_setasids);
+}
+
+int
+tlbtest2(int nargs, char **args)
+{
+	return common_tlbtest(nargs, args, "/testbin/matmult", "page table",
+			      mmu_setfastrefill);
+}
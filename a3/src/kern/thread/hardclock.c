@@ -2,15 +2,20 @@
 #include <lib.h>
 #include <machine/spl.h>
 #include <thread.h>
+#include <scheduler.h>
 #include <clock.h>
 
 /* 
  * The address of lbolt has thread_wakeup called on it once a second.
+ * Its value counts the seconds since boot.
  */
 int lbolt;
 
 static int lbolt_counter;
 
+/* Channels to wake along with lbolt (see clock_addtick) */
+static struct clock_tick *ticks;
+
 /*
  * This is called HZ times a second by the timer device setup.
  */
@@ -18,6 +23,8 @@ static int lbolt_counter;
 void
 hardclock(void)
 {
+	struct clock_tick *ct;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
@@ -26,10 +33,47 @@ hardclock(void)
 	lbolt_counter++;
 	if (lbolt_counter >= HZ) {
 		lbolt_counter = 0;
+		lbolt++;
 		thread_wakeup(&lbolt);
+		for (ct = ticks; ct != NULL; ct = ct->ct_next) {
+			thread_wakeup(ct->ct_chan);
+		}
+	}
+
+	/* Switch threads if the scheduler says this one's time is up */
+	if (scheduler_tick()) {
+		thread_yield();
 	}
+}
+
+/*
+ * Have CHAN woken up once a second until clock_removetick.
+ */
+void
+clock_addtick(struct clock_tick *ct, const void *chan)
+{
+	int s;
+
+	ct->ct_chan = chan;
 
-	thread_yield();
+	s = splhigh();
+	ct->ct_next = ticks;
+	ticks = ct;
+	splx(s);
+}
+
+void
+clock_removetick(struct clock_tick *ct)
+{
+	struct clock_tick **pp;
+	int s;
+
+	s = splhigh();
+	for (pp = &ticks; *pp != ct; pp = &(*pp)->ct_next) {
+		assert(*pp != NULL);
+	}
+	*pp = ct->ct_next;
+	splx(s);
 }
 
 /*
@@ -39,11 +83,12 @@ void
 clocksleep(int num_secs)
 {
 	int s;
+	int until;
 
 	s = splhigh();
-	while (num_secs > 0) {
+	until = lbolt + num_secs;
+	while (lbolt < until) {
 		thread_sleep(&lbolt);
-		num_secs--;
 	}
 	splx(s);
 }
@@ -45,6 +45,34 @@ static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
 
+static struct kmcache *pi_cache;	// where pidinfos come from
+
+/*
+ * Constructor and destructor for the pidinfo cache. The condition
+ * variable stays with the pidinfo while it is free in the cache, so
+ * creating a pid doesn't have to make a new one every time.
+ */
+static
+int
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	pi->pi_cv = cv_create("pid cv");
+	if (pi->pi_cv == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_destroy(pi->pi_cv);
+}
 
 /*
  * Create a pidinfo structure for the specified pid.
@@ -57,20 +85,12 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	assert(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	/* The cache's constructor has already made pi_cv for us */
+	pi = kmcache_alloc(pi_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	/* ASST1: Create a condition var for this pid's parent
-	 * to wait for it to exit.
-	 */
-	pi->pi_cv = cv_create("pid cv");
-	if (pi->pi_cv == NULL) {
-	  kfree(pi);
-	  return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = FALSE;
@@ -88,8 +108,7 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	assert(pi->pi_exited==TRUE);
 	assert(pi->pi_ppid==INVALID_PID);
-	cv_destroy(pi->pi_cv);  /* ASST1: destroy cv we created for this pid */
-	kfree(pi);
+	kmcache_free(pi_cache, pi);  /* pi_cv goes back with it */
 }
 
 ////////////////////////////////////////////////////////////
@@ -107,6 +126,12 @@ pid_bootstrap(void)
 	  panic("Failed to create lock for pidinfo table");
 	}
 
+	pi_cache = kmcache_create("pidinfo", sizeof(struct pidinfo),
+				  pidinfo_ctor, pidinfo_dtor);
+	if (pi_cache == NULL) {
+	  panic("Failed to create pidinfo cache");
+	}
+
 	/* not really necessary - should start zeroed */
 	for (i=0; i<PROCS_MAX; i++) {
 		pidinfo[i] = NULL;
@@ -0,0 +1,226 @@
+/*
+ * Multi-level feedback queue scheduling.
+ *
+ * There are MLFQ_LEVELS run queues, and the scheduler always takes
+ * the first thread off the highest-priority queue that isn't empty.
+ * A level's time slice is sched_quantum ticks at the top, doubling at
+ * each level down. A thread starts at the top; once it has used up a
+ * whole slice at a level, whether in one go or across several yields,
+ * it drops a level. A thread woken up from thread_sleep has been
+ * waiting for something rather than computing, so it moves up a level
+ * with a fresh slice. Threads that mostly wait for i/o or for the
+ * user end up near the top, ahead of the cpu hogs.
+ *
+ * So that threads at the bottom don't starve, and so that a thread
+ * that stops hogging the cpu can get back up, every MLFQ_BOOST ticks
+ * all threads go back to the top. Runnable threads are moved then;
+ * threads that are asleep or running notice the next time they come
+ * through here, by comparing t_boostgen with boostgen.
+ *
+ * A running thread is preempted at the end of its slice, or at the
+ * next tick after a thread of higher priority becomes runnable.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <clock.h>
+#include <scheduler.h>
+#include <thread.h>
+#include <queue.h>
+
+#define MLFQ_LEVELS  4
+#define MLFQ_BOOST   HZ		/* ticks between boosts: 1 second */
+
+static struct queue *runqueues[MLFQ_LEVELS];
+static unsigned boostgen;
+static u_int32_t lastboost;
+
+static unsigned nboosts;	/* times everything went back to the top */
+static unsigned ndemotions;	/* threads dropped after a full slice */
+static unsigned npromotions;	/* threads moved up on waking */
+
+/* Length of a time slice at LEVEL */
+static
+int
+mlfq_slice(int level)
+{
+	return sched_quantum << level;
+}
+
+/* Catch up with any boost that happened while T wasn't runnable */
+static
+void
+mlfq_checkboost(struct thread *t)
+{
+	if (t->t_boostgen != boostgen) {
+		t->t_boostgen = boostgen;
+		t->t_priority = 0;
+		t->t_sliceused = 0;
+	}
+}
+
+/* Move every runnable thread back to the top level */
+static
+void
+mlfq_boost(void)
+{
+	struct thread *t;
+	int level;
+
+	boostgen++;
+	lastboost = sched_ticks;
+	nboosts++;
+
+	for (level=1; level<MLFQ_LEVELS; level++) {
+		while (!q_empty(runqueues[level])) {
+			t = q_remhead(runqueues[level]);
+			mlfq_checkboost(t);
+			/* preallocated, so this can't fail */
+			if (q_addtail(runqueues[0], t)) {
+				panic("mlfq: run queue overflow\n");
+			}
+		}
+	}
+}
+
+static
+void
+mlfq_cleanup(void)
+{
+	int level;
+
+	for (level=0; level<MLFQ_LEVELS; level++) {
+		if (runqueues[level] != NULL) {
+			q_destroy(runqueues[level]);
+			runqueues[level] = NULL;
+		}
+	}
+}
+
+static
+int
+mlfq_init(void)
+{
+	int level;
+
+	for (level=0; level<MLFQ_LEVELS; level++) {
+		runqueues[level] = q_create(32);
+		if (runqueues[level] == NULL) {
+			mlfq_cleanup();
+			return ENOMEM;
+		}
+	}
+	boostgen = 0;
+	lastboost = sched_ticks;
+	return 0;
+}
+
+static
+int
+mlfq_preallocate(int nthreads)
+{
+	int level, result;
+
+	/* Every thread could end up on the same level */
+	for (level=0; level<MLFQ_LEVELS; level++) {
+		result = q_preallocate(runqueues[level], nthreads);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+int
+mlfq_enqueue(struct thread *t, int woke)
+{
+	mlfq_checkboost(t);
+
+	if (woke) {
+		if (t->t_priority > 0) {
+			t->t_priority--;
+			npromotions++;
+		}
+		t->t_sliceused = 0;
+	}
+
+	return q_addtail(runqueues[t->t_priority], t);
+}
+
+static
+struct thread *
+mlfq_dequeue(void)
+{
+	int level;
+
+	for (level=0; level<MLFQ_LEVELS; level++) {
+		if (!q_empty(runqueues[level])) {
+			return q_remhead(runqueues[level]);
+		}
+	}
+	return NULL;
+}
+
+static
+int
+mlfq_tick(struct thread *cur)
+{
+	int level;
+
+	if (sched_ticks - lastboost >= MLFQ_BOOST) {
+		mlfq_boost();
+	}
+	mlfq_checkboost(cur);
+
+	cur->t_sliceused++;
+	if (cur->t_sliceused >= mlfq_slice(cur->t_priority)) {
+		if (cur->t_priority < MLFQ_LEVELS-1) {
+			cur->t_priority++;
+			ndemotions++;
+		}
+		cur->t_sliceused = 0;
+		return 1;
+	}
+
+	/* Has anything more important become runnable? */
+	for (level=0; level<cur->t_priority; level++) {
+		if (!q_empty(runqueues[level])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static
+void
+mlfq_print(void)
+{
+	struct queue *q;
+	int i, level;
+
+	for (level=0; level<MLFQ_LEVELS; level++) {
+		q = runqueues[level];
+		for (i=q_getstart(q); i!=q_getend(q); i=(i+1)%q_getsize(q)) {
+			sched_printthread(q_getguy(q, i), level);
+		}
+	}
+	kprintf("MLFQ: slices");
+	for (level=0; level<MLFQ_LEVELS; level++) {
+		kprintf(" %d", mlfq_slice(level));
+	}
+	kprintf(" ticks; %u boosts, %u demotions, %u promotions on wakeup\n",
+		nboosts, ndemotions, npromotions);
+}
+
+const struct sched_policy sched_policy_mlfq = {
+	"MLFQ",
+	mlfq_init,
+	mlfq_cleanup,
+	mlfq_preallocate,
+	mlfq_enqueue,
+	mlfq_dequeue,
+	mlfq_tick,
+	mlfq_print,
+};
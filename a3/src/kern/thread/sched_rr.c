@@ -0,0 +1,96 @@
+/*
+ * Round-robin scheduling.
+ *
+ * One run queue, first come first served. A thread runs until it
+ * blocks, yields, or has used up sched_quantum ticks, and then goes
+ * to the back of the queue. Nothing distinguishes a thread that
+ * computes all the time from one that mostly waits for i/o, so the
+ * latter may wait a long time behind the former.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <scheduler.h>
+#include <thread.h>
+#include <queue.h>
+
+// Queue of runnable threads
+static struct queue *runqueue;
+
+static
+int
+rr_init(void)
+{
+	runqueue = q_create(32);
+	if (runqueue == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+rr_cleanup(void)
+{
+	q_destroy(runqueue);
+	runqueue = NULL;
+}
+
+static
+int
+rr_preallocate(int nthreads)
+{
+	return q_preallocate(runqueue, nthreads);
+}
+
+static
+int
+rr_enqueue(struct thread *t, int woke)
+{
+	(void)woke;
+
+	t->t_sliceused = 0;
+	return q_addtail(runqueue, t);
+}
+
+static
+struct thread *
+rr_dequeue(void)
+{
+	if (q_empty(runqueue)) {
+		return NULL;
+	}
+	return q_remhead(runqueue);
+}
+
+static
+int
+rr_tick(struct thread *cur)
+{
+	cur->t_sliceused++;
+	return cur->t_sliceused >= sched_quantum;
+}
+
+static
+void
+rr_print(void)
+{
+	int i;
+
+	for (i=q_getstart(runqueue); i!=q_getend(runqueue);
+	     i=(i+1)%q_getsize(runqueue)) {
+		sched_printthread(q_getguy(runqueue, i), -1);
+	}
+}
+
+const struct sched_policy sched_policy_rr = {
+	"round-robin",
+	rr_init,
+	rr_cleanup,
+	rr_preallocate,
+	rr_enqueue,
+	rr_dequeue,
+	rr_tick,
+	rr_print,
+};
@@ -1,23 +1,31 @@
 /*
  * Scheduler.
  *
- * The default scheduler is very simple, just a round-robin run queue.
- * You'll want to improve it.
+ * The run queue itself belongs to a scheduling policy (see
+ * scheduler.h); this file hands off to it, and keeps track of how
+ * long each thread spends running and waiting to run.
  */
 
 #include <types.h>
 #include <lib.h>
 #include <scheduler.h>
 #include <thread.h>
+#include <curthread.h>
 #include <machine/spl.h>
-#include <queue.h>
+#include "opt-mlfq.h"
 
 /*
  *  Scheduler data
  */
 
-// Queue of runnable threads
-static struct queue *runqueue;
+#if OPT_MLFQ
+static const struct sched_policy *policy = &sched_policy_mlfq;
+#else
+static const struct sched_policy *policy = &sched_policy_rr;
+#endif
+
+int sched_quantum = SCHED_QUANTUM;
+u_int32_t sched_ticks;
 
 /*
  * Setup function
@@ -25,24 +33,20 @@ static struct queue *runqueue;
 void
 scheduler_bootstrap(void)
 {
-	runqueue = q_create(32);
-	if (runqueue == NULL) {
+	if (policy->sp_init()) {
 		panic("scheduler: Could not create run queue\n");
 	}
 }
 
 /*
  * Ensure space for handling at least NTHREADS threads.
- * This is done only to ensure that make_runnable() does not fail -
- * if you change the scheduler to not require space outside the 
- * thread structure, for instance, this function can reasonably
- * do nothing.
+ * This is done only to ensure that make_runnable() does not fail.
  */
 int
 scheduler_preallocate(int nthreads)
 {
 	assert(curspl>0);
-	return q_preallocate(runqueue, nthreads);
+	return policy->sp_preallocate(nthreads);
 }
 
 /*
@@ -54,9 +58,10 @@ scheduler_preallocate(int nthreads)
 void
 scheduler_killall(void)
 {
+	struct thread *t;
+
 	assert(curspl>0);
-	while (!q_empty(runqueue)) {
-		struct thread *t = q_remhead(runqueue);
+	while ((t = policy->sp_dequeue()) != NULL) {
 		kprintf("scheduler: Dropping thread %s.\n", t->t_name);
 	}
 }
@@ -64,7 +69,7 @@ scheduler_killall(void)
 /*
  * Cleanup function.
  *
- * The queue objects to being destroyed if it's got stuff in it.
+ * The policy objects to being cleaned up if it's got threads queued.
  * Use scheduler_killall to make sure this is the case. During
  * ordinary shutdown, normally it should be.
  */
@@ -74,23 +79,24 @@ scheduler_shutdown(void)
 	scheduler_killall();
 
 	assert(curspl>0);
-	q_destroy(runqueue);
-	runqueue = NULL;
+	policy->sp_cleanup();
 }
 
 /*
  * Actual scheduler. Returns the next thread to run.  Calls cpu_idle()
  * if there's nothing ready. (Note: cpu_idle must be called in a loop
  * until something's ready - it doesn't know whether the things that
- * wake it up are going to make a thread runnable or not.) 
+ * wake it up are going to make a thread runnable or not.)
  */
 struct thread *
 scheduler(void)
 {
+	struct thread *t;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
-	
-	while (q_empty(runqueue)) {
+
+	while ((t = policy->sp_dequeue()) == NULL) {
 		cpu_idle();
 	}
 
@@ -98,15 +104,19 @@ scheduler(void)
 	// doing - even this deep inside thread code, the console
 	// still works. However, the amount of text printed is
 	// prohibitive.
-	// 
+	//
 	//print_run_queue();
-	
-	return q_remhead(runqueue);
+
+	t->t_waitticks += sched_ticks - t->t_readysince;
+	return t;
 }
 
-/* 
+/*
  * Make a thread runnable.
- * With the base scheduler, just add it to the end of the run queue.
+ *
+ * A thread being woken up still has its sleep address set (thread_sleep
+ * clears it once the thread runs again); a new thread or one that is
+ * yielding does not.
  */
 int
 make_runnable(struct thread *t)
@@ -114,7 +124,44 @@ make_runnable(struct thread *t)
 	// meant to be called with interrupts off
 	assert(curspl>0);
 
-	return q_addtail(runqueue, t);
+	t->t_readysince = sched_ticks;
+	return policy->sp_enqueue(t, t->t_sleepaddr != NULL);
+}
+
+/*
+ * Clock tick. Returns nonzero if the current thread should yield.
+ * There is no current thread while the scheduler is idling.
+ */
+int
+scheduler_tick(void)
+{
+	assert(curspl>0);
+
+	sched_ticks++;
+	if (curthread == NULL) {
+		return 0;
+	}
+
+	curthread->t_runticks++;
+	return policy->sp_tick(curthread);
+}
+
+/*
+ * Print the scheduling line for one thread. LEVEL is the run queue
+ * it is on, or -1 if the policy has only one.
+ */
+void
+sched_printthread(struct thread *t, int level)
+{
+	if (level >= 0) {
+		kprintf("  [%d] ", level);
+	}
+	else {
+		kprintf("  ");
+	}
+	kprintf("%-16s run %6lu  wait %6lu  slice %d\n", t->t_name,
+		(unsigned long) t->t_runticks, (unsigned long) t->t_waitticks,
+		t->t_sliceused);
 }
 
 /*
@@ -126,15 +173,14 @@ print_run_queue(void)
 	/* Turn interrupts off so the whole list prints atomically. */
 	int spl = splhigh();
 
-	int i,k=0;
-	i = q_getstart(runqueue);
-	
-	while (i!=q_getend(runqueue)) {
-		struct thread *t = q_getguy(runqueue, i);
-		kprintf("  %2d: %s %p\n", k, t->t_name, t->t_sleepaddr);
-		i=(i+1)%q_getsize(runqueue);
-		k++;
+	kprintf("Scheduler: %s, quantum %d ticks, %lu ticks since boot\n",
+		policy->sp_name, sched_quantum, (unsigned long) sched_ticks);
+	if (curthread != NULL) {
+		kprintf("Running:\n");
+		sched_printthread(curthread, -1);
 	}
-	
+	kprintf("Runnable:\n");
+	policy->sp_print();
+
 	splx(spl);
 }
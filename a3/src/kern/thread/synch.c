@@ -90,7 +90,8 @@ V(struct semaphore *sem)
 	spl = splhigh();
 	sem->count++;
 	assert(sem->count>0);
-	thread_wakeup(sem);
+	/* One more P can go through, so one sleeper is enough */
+	thread_wakeone(sem);
 	splx(spl);
 }
 
@@ -165,7 +166,8 @@ lock_release(struct lock *lock)
 
 	spl = splhigh();
 	lock->owner = NULL;
-	thread_wakeup(lock);
+	/* Only one of the waiters can get it */
+	thread_wakeone(lock);
 	splx(spl);
 
 }
@@ -176,6 +178,152 @@ lock_do_i_hold(struct lock *lock)
   return (lock->owner == curthread);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Readers-writer lock.
+//
+// Readers sleep on &rw_readers, writers on &rw_writer. A reader that
+// has to wait doesn't take the lock itself when it wakes up: the
+// writer letting go counts all the waiting readers in at once and
+// bumps rw_readgen to tell them so. That way a writer that comes
+// along meanwhile can't get in ahead of them.
+
+#define RW_READERS(rw)  ((const void *)&(rw)->rw_readers)
+#define RW_WRITERS(rw)  ((const void *)&(rw)->rw_writer)
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->name = kstrdup(name);
+	if (rw->name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writer = NULL;
+	rw->rw_readers = 0;
+	rw->rw_readwait = 0;
+	rw->rw_writewait = 0;
+	rw->rw_readgen = 0;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	assert(rw != NULL);
+	assert(rw->rw_writer == NULL && rw->rw_readers == 0);
+	assert(rw->rw_readwait == 0 && rw->rw_writewait == 0);
+
+	kfree(rw->name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	int spl;
+	unsigned gen;
+
+	assert(rw != NULL);
+	assert(in_interrupt==0);
+	assert(!rwlock_do_i_hold(rw));
+
+	spl = splhigh();
+	if (rw->rw_writer == NULL && rw->rw_writewait == 0) {
+		rw->rw_readers++;
+	}
+	else {
+		/* Wait for the next writer to let us in */
+		gen = rw->rw_readgen;
+		rw->rw_readwait++;
+		while (rw->rw_readgen == gen) {
+			thread_sleep(RW_READERS(rw));
+		}
+	}
+	assert(rw->rw_writer == NULL);
+	splx(spl);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	int spl;
+
+	assert(rw != NULL);
+
+	spl = splhigh();
+	assert(rw->rw_writer == NULL);
+	assert(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_writewait > 0) {
+		thread_wakeone(RW_WRITERS(rw));
+	}
+	splx(spl);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	int spl;
+
+	assert(rw != NULL);
+	assert(in_interrupt==0);
+	assert(!rwlock_do_i_hold(rw));
+
+	spl = splhigh();
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rw->rw_writewait++;
+		thread_sleep(RW_WRITERS(rw));
+		rw->rw_writewait--;
+	}
+	rw->rw_writer = curthread;
+	splx(spl);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	int spl;
+
+	assert(rw != NULL);
+	assert(rwlock_do_i_hold(rw));
+
+	spl = splhigh();
+	rw->rw_writer = NULL;
+	if (rw->rw_readwait > 0) {
+		/* Everyone who waited to read goes before the next writer */
+		rw->rw_readers += rw->rw_readwait;
+		rw->rw_readwait = 0;
+		rw->rw_readgen++;
+		thread_wakeup(RW_READERS(rw));
+	}
+	else if (rw->rw_writewait > 0) {
+		thread_wakeone(RW_WRITERS(rw));
+	}
+	splx(spl);
+}
+
+int
+rwlock_do_i_hold(struct rwlock *rw)
+{
+	return (rw->rw_writer == curthread);
+}
+
+int
+rwlock_is_held(struct rwlock *rw)
+{
+	return (rw->rw_writer != NULL || rw->rw_readers > 0);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
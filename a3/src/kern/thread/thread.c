@@ -27,12 +27,28 @@ typedef enum {
 /* Global variable for the thread currently executing at any given time. */
 struct thread *curthread;
 
-/* Table of sleeping threads. */
-static struct array *sleepers;
+/*
+ * Sleeping threads, hashed by sleep address. Each queue is kept in
+ * the order threads went to sleep, so wakeups are first come first
+ * served, and a wakeup only looks at the threads whose addresses hash
+ * to the same queue, not at every sleeping thread.
+ */
+#define SLEEPQ_BITS  6
+#define SLEEPQ_SIZE  (1 << SLEEPQ_BITS)
+
+struct sleepq {
+	struct thread *sq_head;
+	struct thread *sq_tail;
+};
+
+static struct sleepq *sleepqs;
 
 /* List of dead threads to be disposed of. */
 static struct array *zombies;
 
+/* Cache that thread structures come from. */
+static struct kmcache *thread_cache;
+
 /* Total number of outstanding threads. Does not count zombies[]. */
 static int numthreads;
 
@@ -45,17 +61,25 @@ static
 struct thread *
 thread_create(const char *name)
 {
-	struct thread *thread = kmalloc(sizeof(struct thread));
+	struct thread *thread = kmcache_alloc(thread_cache);
 	if (thread==NULL) {
 		return NULL;
 	}
 	thread->t_name = kstrdup(name);
 	if (thread->t_name==NULL) {
-		kfree(thread);
+		kmcache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_sleepaddr = NULL;
+	thread->t_sleepnext = NULL;
 	thread->t_stack = NULL;
+
+	thread->t_priority = 0;
+	thread->t_sliceused = 0;
+	thread->t_boostgen = 0;
+	thread->t_runticks = 0;
+	thread->t_waitticks = 0;
+	thread->t_readysince = 0;
 	
 	thread->t_vmspace = NULL;
 
@@ -92,9 +116,78 @@ thread_destroy(struct thread *thread)
 	}
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmcache_free(thread_cache, thread);
+}
+
+
+/*
+ * Find the sleep queue for sleep address ADDR. Sleep addresses are
+ * mostly kmalloc'd objects, whose low bits tell little apart, so use
+ * the high bits of a multiplicative hash.
+ */
+static
+struct sleepq *
+sleepq_get(const void *addr)
+{
+	u_int32_t k = (u_int32_t)addr;
+
+	return &sleepqs[(k * 2654435761U) >> (32 - SLEEPQ_BITS)];
+}
+
+/*
+ * Put thread T at the end of the queue for its sleep address.
+ */
+static
+void
+sleepq_add(struct thread *t)
+{
+	struct sleepq *sq = sleepq_get(t->t_sleepaddr);
+
+	assert(curspl>0);
+
+	t->t_sleepnext = NULL;
+	if (sq->sq_tail != NULL) {
+		sq->sq_tail->t_sleepnext = t;
+	}
+	else {
+		sq->sq_head = t;
+	}
+	sq->sq_tail = t;
 }
 
+/*
+ * Take thread T, which comes after PREV (or first, if PREV is NULL),
+ * off sleep queue SQ, and make it runnable.
+ */
+static
+void
+sleepq_wake(struct sleepq *sq, struct thread *prev, struct thread *t)
+{
+	int result;
+
+	assert(curspl>0);
+
+	if (prev != NULL) {
+		prev->t_sleepnext = t->t_sleepnext;
+	}
+	else {
+		sq->sq_head = t->t_sleepnext;
+	}
+	if (sq->sq_tail == t) {
+		sq->sq_tail = prev;
+	}
+	t->t_sleepnext = NULL;
+
+	/*
+	 * The sleep queues are a fixed table made in thread_bootstrap
+	 * and linked through the threads, so nothing was allocated to
+	 * sleep and nothing is freed here. Run queue space for every
+	 * thread is preallocated in thread_fork, so this should never
+	 * fail.
+	 */
+	result = make_runnable(t);
+	assert(result==0);
+}
 
 /*
  * Remove zombies. (Zombies are threads/processes that have exited but not
@@ -126,7 +219,8 @@ static
 void
 thread_killall(void)
 {
-	int i, result;
+	struct thread *t;
+	int i;
 
 	assert(curspl>0);
 
@@ -135,23 +229,21 @@ thread_killall(void)
 	 * wake up while we're shutting down.
 	 */
 
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		kprintf("sleep: Dropping thread %s\n", t->t_name);
+	for (i=0; i<SLEEPQ_SIZE; i++) {
+		for (t = sleepqs[i].sq_head; t != NULL; t = t->t_sleepnext) {
+			kprintf("sleep: Dropping thread %s\n", t->t_name);
 
-		/*
-		 * Don't do this: because these threads haven't
-		 * been through thread_exit, thread_destroy will
-		 * get upset. Just drop the threads on the floor,
-		 * which is safer anyway during panic.
-		 *
-		 * array_add(zombies, t);
-		 */
+			/*
+			 * Don't do this: because these threads haven't
+			 * been through thread_exit, thread_destroy will
+			 * get upset. Just drop the threads on the floor,
+			 * which is safer anyway during panic.
+			 *
+			 * array_add(zombies, t);
+			 */
+		}
+		sleepqs[i].sq_head = sleepqs[i].sq_tail = NULL;
 	}
-
-	result = array_setsize(sleepers, 0);
-	/* shrinking array: not supposed to fail */
-	assert(result==0);
 }
 
 /*
@@ -175,9 +267,16 @@ thread_bootstrap(void)
 	struct thread *me;
 
 	/* Create the data structures we need. */
-	sleepers = array_create();
-	if (sleepers==NULL) {
-		panic("Cannot create sleepers array\n");
+	sleepqs = kmalloc(SLEEPQ_SIZE * sizeof(struct sleepq));
+	if (sleepqs==NULL) {
+		panic("Cannot create sleep queues\n");
+	}
+	bzero(sleepqs, SLEEPQ_SIZE * sizeof(struct sleepq));
+
+	thread_cache = kmcache_create("thread", sizeof(struct thread),
+				      NULL, NULL);
+	if (thread_cache==NULL) {
+		panic("Cannot create thread cache\n");
 	}
 
 	zombies = array_create();
@@ -223,8 +322,8 @@ thread_bootstrap(void)
 void
 thread_shutdown(void)
 {
-	array_destroy(sleepers);
-	sleepers = NULL;
+	kfree(sleepqs);
+	sleepqs = NULL;
 	array_destroy(zombies);
 	zombies = NULL;
 	// Don't do this - it frees our stack and we blow up
@@ -255,7 +354,7 @@ thread_fork(const char *name,
 	result = pid_alloc(&newguy->t_pid);
 	if (result != 0) {
 	  kfree(newguy->t_name);
-	  kfree(newguy);
+	  kmcache_free(thread_cache, newguy);
 	  return result;
 	}
 
@@ -264,7 +363,7 @@ thread_fork(const char *name,
 	if (newguy->t_stack==NULL) {
 		pid_unalloc(newguy->t_pid); /* ASST1: cleanup pid on fail */
 		kfree(newguy->t_name);
-		kfree(newguy);
+		kmcache_free(thread_cache, newguy);
 		return ENOMEM;
 	}
 
@@ -287,7 +386,7 @@ thread_fork(const char *name,
 			pid_unalloc(newguy->t_pid); 
 			kfree(newguy->t_name);
 			kfree(newguy->t_stack);
-			kfree(newguy);			
+			kmcache_free(thread_cache, newguy);			
 			return ENOMEM;
 		}
 	}
@@ -303,10 +402,6 @@ thread_fork(const char *name,
 	 * Make sure our data structures have enough space, so we won't
 	 * run out later at an inconvenient time.
 	 */
-	result = array_preallocate(sleepers, numthreads+1);
-	if (result) {
-		goto fail;
-	}
 	result = array_preallocate(zombies, numthreads+1);
 	if (result) {
 		goto fail;
@@ -366,7 +461,7 @@ thread_fork(const char *name,
 	}
 	kfree(newguy->t_stack);
 	kfree(newguy->t_name);
-	kfree(newguy);
+	kmcache_free(thread_cache, newguy);
 
 	return result;
 }
@@ -411,18 +506,17 @@ mi_switch(threadstate_t nextstate)
 
 	/*
 	 * Stash the current thread on whatever list it's supposed to go on.
-	 * Because we preallocate during thread_fork, this should not fail.
+	 * The run queue and zombie array are preallocated in thread_fork,
+	 * and the sleep queues need no allocation, so this should not fail.
 	 */
 
 	if (nextstate==S_READY) {
 		result = make_runnable(cur);
 	}
 	else if (nextstate==S_SLEEP) {
-		/*
-		 * Because we preallocate sleepers[] during thread_fork,
-		 * this should never fail.
-		 */
-		result = array_add(sleepers, cur);
+		/* The sleep queues are linked through the threads */
+		sleepq_add(cur);
+		result = 0;
 	}
 	else {
 		assert(nextstate==S_ZOMB);
@@ -531,8 +625,8 @@ thread_yield(void)
 {
 	int spl = splhigh();
 
-	/* Check sleepers just in case we get here after shutdown */
-	assert(sleepers != NULL);
+	/* Check sleepqs just in case we get here after shutdown */
+	assert(sleepqs != NULL);
 
 	mi_switch(S_READY);
 	splx(spl);
@@ -567,29 +661,21 @@ thread_sleep(const void *addr)
 void
 thread_wakeup(const void *addr)
 {
-	int i, result;
-	
+	struct sleepq *sq;
+	struct thread *t, *prev, *next;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
-	
-	// This is inefficient. Feel free to improve it.
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
-		if (t->t_sleepaddr == addr) {
-			
-			// Remove from list
-			array_remove(sleepers, i);
-			
-			// must look at the same sleepers[i] again
-			i--;
 
-			/*
-			 * Because we preallocate during thread_fork,
-			 * this should never fail.
-			 */
-			result = make_runnable(t);
-			assert(result==0);
+	sq = sleepq_get(addr);
+	prev = NULL;
+	for (t = sq->sq_head; t != NULL; t = next) {
+		next = t->t_sleepnext;
+		if (t->t_sleepaddr == addr) {
+			sleepq_wake(sq, prev, t);
+		}
+		else {
+			prev = t;
 		}
 	}
 }
@@ -597,33 +683,26 @@ thread_wakeup(const void *addr)
 
 /*
  * ASST1: Like thread_wakeup, but wake up at most one thread 
- * sleeping on "sleep address" ADDR.
+ * sleeping on "sleep address" ADDR: the one that has been asleep
+ * longest.
  */
 void
 thread_wakeone(const void *addr)
 {
-	int i, result;
-	
+	struct sleepq *sq;
+	struct thread *t, *prev;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
-	
-	// This is inefficient. Feel free to improve it.
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
+
+	sq = sleepq_get(addr);
+	prev = NULL;
+	for (t = sq->sq_head; t != NULL; t = t->t_sleepnext) {
 		if (t->t_sleepaddr == addr) {
-			
-			// Remove from list
-			array_remove(sleepers, i);
-			
-			/*
-			 * Because we preallocate during thread_fork,
-			 * this should never fail.
-			 */
-			result = make_runnable(t);
-			assert(result==0);
-			break;
+			sleepq_wake(sq, prev, t);
+			return;
 		}
+		prev = t;
 	}
 }
 
@@ -634,13 +713,12 @@ thread_wakeone(const void *addr)
 int
 thread_hassleepers(const void *addr)
 {
-	int i;
-	
+	struct thread *t;
+
 	// meant to be called with interrupts off
 	assert(curspl>0);
-	
-	for (i=0; i<array_getnum(sleepers); i++) {
-		struct thread *t = array_getguy(sleepers, i);
+
+	for (t = sleepq_get(addr)->sq_head; t != NULL; t = t->t_sleepnext) {
 		if (t->t_sleepaddr == addr) {
 			return 1;
 		}
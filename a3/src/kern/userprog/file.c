@@ -18,6 +18,9 @@
 #include <file.h>
 #include <syscall.h>
 
+/* Cache that openfile structs come from; see file_bootstrap */
+static struct kmcache *openfile_cache;
+
 /* ASST3: custom functions*/
 
 /* Get a empty file descriptor on each call, else return FOPEN_MAX */
@@ -56,7 +59,7 @@ file_open(char *filename, int flags, int mode, int *retfd)
   }
 
   /* Allocate a new file structure */
-  struct openfile *of = kmalloc(sizeof (struct openfile));
+  struct openfile *of = kmcache_alloc(openfile_cache);
   if(of == NULL){
     return ENOMEM;
   }
@@ -65,11 +68,12 @@ file_open(char *filename, int flags, int mode, int *retfd)
   of->of_accmode = flags;
   of->of_offset = 0;
   of->of_refcount = 1;
+  bzero(&of->of_ra, sizeof(of->of_ra));
 
   int result = vfs_open(filename, flags, &(of->of_vnode));
   if(result){
-    kfree(of->of_vnode);
-    kfree(of);
+    /* vfs_open doesn't set of_vnode when it fails */
+    kmcache_free(openfile_cache, of);
     return result;
   }
 
@@ -99,7 +103,7 @@ file_close(int fd)
   /* If refcount hits zero, free up struct */
   if(of->of_refcount == 0){
     vfs_close(of->of_vnode);
-    kfree(of);
+    kmcache_free(openfile_cache, of);
     /* mark file descriptor as empty */
     curthread->t_filetable->ft_openfiles[fd] = NULL;
   }
@@ -107,6 +111,20 @@ file_close(int fd)
   return 0;
 }
 
+/*
+ * file_bootstrap
+ * set up the openfile cache. Called once at boot.
+ */
+void
+file_bootstrap(void)
+{
+  openfile_cache = kmcache_create("openfile", sizeof (struct openfile),
+                                  NULL, NULL);
+  if(openfile_cache == NULL){
+    panic("file_bootstrap: could not create openfile cache\n");
+  }
+}
+
 /*** filetable functions ***/
 
 /* 
@@ -90,6 +90,7 @@ mk_useruio(struct uio *u, userptr_t buf, size_t len, off_t offset,
   u->uio_segflg = UIO_USERSPACE;
   u->uio_rw = rw;
   u->uio_space = curthread->t_vmspace;
+  u->uio_ra = NULL;
 }
 
 /*
@@ -150,6 +151,7 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 
   /* set up a uio with the buffer, its size, and the current offset */
   mk_useruio(&useruio, buf, size, offset, UIO_READ);
+  useruio.uio_ra = &of->of_ra;
 
   /* does the read */
   result = VOP_READ(of->of_vnode, &useruio);
@@ -1,11 +1,10 @@
 /*
  * Code to load an ELF-format executable into the current address space.
  *
- * Right now it just copies into userspace and hopes the addresses are
- * mappable to real memory. This works with dumbvm; however, when you
- * write a real VM system, you will need to either (1) add code that 
- * makes the address range used for load valid, or (2) if you implement
- * memory-mapped files, map each segment instead of copying it into RAM.
+ * With dumbvm it just copies into userspace and hopes the addresses
+ * are mappable to real memory. With the real VM system, each segment
+ * is mapped from the file instead (as_define_file), and its pages are
+ * read in when the program first touches them.
  */
 
 #include <types.h>
@@ -17,8 +16,38 @@
 #include <thread.h>
 #include <curthread.h>
 #include <vnode.h>
+#include <clock.h>
+#include <machine/spl.h>
 #include "opt-dumbvm.h"
 
+/* Exec statistics */
+static u_int32_t ct_execs;		/* successful load_elf calls */
+static u_int32_t ct_execusecs;		/* total time in them */
+static u_int32_t ct_execmaxusecs;	/* longest */
+
+/*
+ * load_elf_printstats: print the exec counters, for vm_printstats.
+ */
+void
+load_elf_printstats(void)
+{
+	u_int32_t execs, usecs, maxusecs;
+	int spl;
+
+	spl = splhigh();
+	execs = ct_execs;
+	usecs = ct_execusecs;
+	maxusecs = ct_execmaxusecs;
+	splx(spl);
+
+	kprintf("vm: %lu execs, load time %lu us average, %lu us max\n",
+		(unsigned long) execs,
+		(unsigned long) (execs > 0 ? usecs / execs : 0),
+		(unsigned long) maxusecs);
+}
+
+#if OPT_DUMBVM
+
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -41,9 +70,6 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 {
 	struct uio u;
 	int result;
-#if !OPT_DUMBVM
-	vaddr_t fillbase, pageboundary;
-#endif
 	size_t fillamt;
 
 	if (filesize > memsize) {
@@ -61,6 +87,7 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
 	u.uio_rw = UIO_READ;
 	u.uio_space = curthread->t_vmspace;
+	u.uio_ra = NULL;
 
 	result = VOP_READ(v, &u);
 	if (result) {
@@ -76,18 +103,6 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	/* Fill the rest of the memory space (if any) with zeros */
 	fillamt = memsize - filesize;
 
-#if !OPT_DUMBVM
-	/*
-	 * optimization: skip pages we haven't already touched;
-	 * let the VM system zerofill them for us on demand.
-	 */
-	fillbase = vaddr + filesize;
-	pageboundary = (fillbase + PAGE_SIZE - 1) & PAGE_FRAME;
-	if (fillbase + fillamt > pageboundary) {
-		fillamt = pageboundary - fillbase;
-	}
-#endif
-
 	if (fillamt > 0) {
 		DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n", 
 		      (unsigned long) fillamt);
@@ -97,14 +112,16 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
  *
  * Returns the entry point (initial PC) for the program in ENTRYPOINT.
  */
+static
 int
-load_elf(struct vnode *v, vaddr_t *entrypoint)
+do_load_elf(struct vnode *v, vaddr_t *entrypoint)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
@@ -198,11 +215,17 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
 #else
-		result = as_define_region(curthread->t_vmspace,
-					  ph.p_vaddr, ph.p_memsz, 0,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > "
+				"segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_file(curthread->t_vmspace,
+					ph.p_vaddr, ph.p_memsz,
+					v, ph.p_offset, ph.p_filesz,
+					ph.p_flags & PF_R,
+					ph.p_flags & PF_W,
+					ph.p_flags & PF_X);
 #endif
 		if (result) {
 			return result;
@@ -214,6 +237,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
+
 	/*
 	 * Now actually load each segment.
 	 */
@@ -251,6 +276,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif /* OPT_DUMBVM */
 
 	result = as_complete_load(curthread->t_vmspace);
 	if (result) {
@@ -261,3 +287,35 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 
 	return 0;
 }
+
+/*
+ * load_elf: do_load_elf, timed.
+ */
+int
+load_elf(struct vnode *v, vaddr_t *entrypoint)
+{
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs, usecs;
+	int result, spl;
+
+	gettime(&beforesecs, &beforensecs);
+	result = do_load_elf(v, entrypoint);
+	if (result) {
+		return result;
+	}
+	gettime(&aftersecs, &afternsecs);
+
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	usecs = secs*1000000 + nsecs/1000;
+
+	spl = splhigh();
+	ct_execs++;
+	ct_execusecs += usecs;
+	if (usecs > ct_execmaxusecs) {
+		ct_execmaxusecs = usecs;
+	}
+	splx(spl);
+
+	return 0;
+}
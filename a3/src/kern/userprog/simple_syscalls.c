@@ -6,6 +6,7 @@
 #include <kern/limits.h>
 #include <kern/errno.h>
 #include <thread.h>
+#include <clock.h>
 
 
 // Simplest possible system call.  Technically, it should just return 
@@ -51,3 +52,35 @@ int sys__exit(int exitcode) {
 }
 
 // END A0 SOLUTION
+
+/*
+ * sys___time: get the time of day. Either pointer may be NULL.
+ */
+int
+sys___time(userptr_t user_seconds, userptr_t user_nanoseconds, int *retval)
+{
+	time_t seconds;
+	u_int32_t nanoseconds;
+	unsigned long lnanoseconds;
+	int result;
+
+	gettime(&seconds, &nanoseconds);
+
+	if (user_seconds != NULL) {
+		result = copyout(&seconds, user_seconds, sizeof(time_t));
+		if (result) {
+			return result;
+		}
+	}
+	if (user_nanoseconds != NULL) {
+		lnanoseconds = nanoseconds;
+		result = copyout(&lnanoseconds, user_nanoseconds,
+				 sizeof(unsigned long));
+		if (result) {
+			return result;
+		}
+	}
+
+	*retval = seconds;
+	return 0;
+}
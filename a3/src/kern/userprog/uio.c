@@ -3,6 +3,7 @@
 #include <uio.h>
 #include <thread.h>
 #include <curthread.h>
+#include <machine/vm.h>
 
 /*
  * See uio.h for a description.
@@ -120,4 +121,15 @@ mk_kuio(struct uio *uio, void *kbuf, size_t len, off_t pos, enum uio_rw rw)
 	uio->uio_segflg = UIO_SYSSPACE;
 	uio->uio_rw = rw;
 	uio->uio_space = NULL;
+	uio->uio_ra = NULL;
+}
+
+/*
+ * Same, for pinned physical memory.
+ */
+void
+mk_physuio(struct uio *uio, paddr_t pa, size_t len, off_t pos,
+	   enum uio_rw rw)
+{
+	mk_kuio(uio, (void *)PADDR_TO_KVADDR(pa), len, pos, rw);
 }
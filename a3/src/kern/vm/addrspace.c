@@ -15,6 +15,8 @@
 #include <machine/vm.h>   /* for USERSTACKSIZE and USERSTACKBASE */
 #include <machine/coremap.h>   /* for mmu_setas() */
 #include <array.h>
+#include <clock.h>
+#include "opt-vmstats.h"
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -22,6 +24,51 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/* Fault path statistics */
+static u_int32_t ct_faults;		/* calls to as_fault */
+static u_int32_t ct_lookuphits;		/* found in as_lastobj */
+static u_int32_t ct_lookupprobes;	/* objects looked at otherwise */
+#if OPT_VMSTATS
+static u_int32_t ct_faultusecs;		/* total time in as_fault */
+static u_int32_t ct_faultmaxusecs;	/* longest time in as_fault */
+#endif
+static u_int32_t ct_zerocows;		/* writes after a zero page read */
+
+/*
+ * as_printstats: print the fault path counters, for vm_printstats.
+ */
+void
+as_printstats(void)
+{
+	u_int32_t faults, hits, probes, zerocows;
+#if OPT_VMSTATS
+	u_int32_t usecs, maxusecs;
+#endif
+	int spl;
+
+	spl = splhigh();
+	faults = ct_faults;
+	hits = ct_lookuphits;
+	probes = ct_lookupprobes;
+#if OPT_VMSTATS
+	usecs = ct_faultusecs;
+	maxusecs = ct_faultmaxusecs;
+#endif
+	zerocows = ct_zerocows;
+	splx(spl);
+
+	kprintf("vm: %lu faults, %lu region cache hits, %lu region probes\n",
+		(unsigned long) faults, (unsigned long) hits,
+		(unsigned long) probes);
+#if OPT_VMSTATS
+	kprintf("vm: fault time %lu us average, %lu us max\n",
+		(unsigned long) (faults > 0 ? usecs / faults : 0),
+		(unsigned long) maxusecs);
+#endif
+	kprintf("vm: %lu zerofills were writes to the zero page\n",
+		(unsigned long) zerocows);
+}
+
 /*
  * as_create - create an address space structure.
  * Synchronization: none.
@@ -39,6 +86,9 @@ as_create(void)
 		kfree(as);
 		return NULL;
 	}
+	as->as_lastobj = NULL;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
 
 	return as;
 }
@@ -90,6 +140,9 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 		}
 	}
 
+	/* Our pages are copy-on-write now; drop any writable mappings */
+	mmu_unmapall(as);
+
 	*ret = newas;
 	return 0;
 
@@ -99,53 +152,245 @@ fail:
 }
 
 /*
- * as_fault: fault handling. Handle a fault on an address space, of
- * specified type, at specified address.
+ * as_findobj: find the vm_object containing VA, or return NULL.
  *
- * Synchronization: none. We assume the address space is not shared,
- * so we don't lock it.
+ * Faults tend to come in runs in the same object, so try the one the
+ * last fault was in first. Otherwise binary search as_objects, which
+ * is sorted by base address.
  */
-int
-as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+static
+struct vm_object *
+as_findobj(struct addrspace *as, vaddr_t va)
 {
-	struct vm_object *faultobj = NULL;
-	struct lpage *lp;
-	vaddr_t bot=0, top;
-	int i, index, result;
-
-	/* Find the vm_object concerned */
-	for (i=0; i<array_getnum(as->as_objects); i++) {
-		struct vm_object *vmo;
+	struct vm_object *vmo;
+	int lo, hi, mid, probes, spl;
+
+	vmo = as->as_lastobj;
+	if (vmo != NULL && va >= vmo->vmo_base && va < VMO_TOP(vmo)) {
+		spl = splhigh();
+		ct_lookuphits++;
+		splx(spl);
+		return vmo;
+	}
 
-		vmo = array_getguy(as->as_objects, i);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE*array_getnum(vmo->vmo_lpages);
-		if (va >= bot && va < top) {
-			faultobj = vmo;
-			break;
+	/* Find the last object with base <= va */
+	probes = 0;
+	lo = 0;
+	hi = array_getnum(as->as_objects) - 1;
+	vmo = NULL;
+	while (lo <= hi) {
+		struct vm_object *guy;
+
+		mid = (lo + hi) / 2;
+		guy = array_getguy(as->as_objects, mid);
+		probes++;
+		if (guy->vmo_base <= va) {
+			vmo = guy;
+			lo = mid + 1;
+		}
+		else {
+			hi = mid - 1;
 		}
 	}
 
+	spl = splhigh();
+	ct_lookupprobes += probes;
+	splx(spl);
+
+	if (vmo == NULL || va >= VMO_TOP(vmo)) {
+		return NULL;
+	}
+	as->as_lastobj = vmo;
+	return vmo;
+}
+
+/*
+ * as_dofault: the body of as_fault.
+ */
+static
+int
+as_dofault(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	struct vm_object *faultobj;
+	struct lpage *lp, **slot, *around[SWAP_CLUSTER-1];
+	unsigned index;
+	int naround, result, spl;
+
+	/* Find the vm_object concerned */
+	faultobj = as_findobj(as, va);
 	if (faultobj==NULL) {
 		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
 		return EFAULT;
 	}
 
 	/* Now get the logical page */
-	index = (va - bot) / PAGE_SIZE;
-	lp = array_getguy(faultobj->vmo_lpages, index);
-
-	if (lp == NULL) {
-		/* zerofill page */
-		result = lpage_zerofill(&lp);
+	index = (va - faultobj->vmo_base) / PAGE_SIZE;
+	result = vm_object_getslot(faultobj, index, &slot);
+	if (result) {
+		return result;
+	}
+	lp = *slot;
+
+	if (lp == NULL && faultobj->vmo_file != NULL &&
+	    VF_INFILE(faultobj->vmo_file, index)) {
+		/* page of the executable, not yet touched */
+		result = vm_file_getpage(faultobj->vmo_file, index,
+					 vm_object_swaphint(faultobj, index),
+					 &lp);
+		if (result) {
+			kprintf("vm: executable page fault at 0x%x failed\n",
+				va);
+			return result;
+		}
+		*slot = lp;
+	}
+	else if (lp == NULL && faulttype == VM_FAULT_READ) {
+		/* zerofill page, only read so far: share the zero page */
+		lpage_zeromap(as, va);
+		return 0;
+	}
+	else if (lp == NULL) {
+		/* zerofill page; READONLY means the zero page was mapped */
+		if (faulttype == VM_FAULT_READONLY) {
+			spl = splhigh();
+			ct_zerocows++;
+			splx(spl);
+		}
+		result = lpage_zerofill(&lp,
+					vm_object_swaphint(faultobj, index));
 		if (result) {
 			kprintf("vm: zerofill fault at 0x%x failed\n", va);
 			return result;
 		}
-		array_setguy(faultobj->vmo_lpages, index, lp);
+		*slot = lp;
+	}
+
+	if (faulttype != VM_FAULT_READ) {
+		/* copy-on-write; does nothing if the page isn't shared */
+		result = lpage_unshare(&lp,
+				       vm_object_swaphint(faultobj, index));
+		if (result) {
+			kprintf("vm: copy-on-write fault at 0x%x failed\n",
+				va);
+			return result;
+		}
+		*slot = lp;
+	}
+
+	/* The pages after it, in case they can be read in at the same time */
+	for (naround = 0; naround < SWAP_CLUSTER-1; naround++) {
+		if (index+1+naround >= faultobj->vmo_npages) {
+			break;
+		}
+		around[naround] = vm_object_getpage(faultobj,
+						    index+1+naround);
+		if (around[naround] == NULL) {
+			break;
+		}
 	}
 	
-	return lpage_fault(lp, as, faulttype, va);
+	return lpage_fault(lp, as, faulttype, va, around, naround);
+}
+
+/*
+ * as_fault: fault handling. Handle a fault on an address space, of
+ * specified type, at specified address.
+ *
+ * The time each fault takes is only measured with options vmstats, as
+ * reading the clock twice costs more than many faults do.
+ *
+ * Synchronization: none. We assume the address space is not shared,
+ * so we don't lock it.
+ */
+#if OPT_VMSTATS
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	time_t beforesecs, aftersecs, secs;
+	u_int32_t beforensecs, afternsecs, nsecs, usecs;
+	int result, spl;
+
+	gettime(&beforesecs, &beforensecs);
+	result = as_dofault(as, faulttype, va);
+	gettime(&aftersecs, &afternsecs);
+
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	usecs = secs*1000000 + nsecs/1000;
+
+	spl = splhigh();
+	ct_faults++;
+	ct_faultusecs += usecs;
+	if (usecs > ct_faultmaxusecs) {
+		ct_faultmaxusecs = usecs;
+	}
+	splx(spl);
+
+	return result;
+}
+#else
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	int spl;
+
+	spl = splhigh();
+	ct_faults++;
+	splx(spl);
+
+	return as_dofault(as, faulttype, va);
+}
+#endif
+
+/*
+ * as_pin: fault in the page holding VA, as a read or a write, and pin
+ * it. Between the fault and the pin the page may be paged out again;
+ * if so, fault it in again. A page that has only been read and would
+ * be zero-filled has no page of its own; it reads as the zero page,
+ * which is never evicted, so that is handed back without a pin.
+ *
+ * Synchronization: none, like as_fault.
+ */
+int
+as_pin(struct addrspace *as, vaddr_t va, int writing, paddr_t *ret)
+{
+	struct vm_object *vmo;
+	struct lpage *lp;
+	paddr_t pa;
+	int result;
+
+	do {
+		result = as_dofault(as, writing ? VM_FAULT_WRITE :
+				    VM_FAULT_READ, va);
+		if (result) {
+			return result;
+		}
+
+		vmo = as_findobj(as, va);
+		assert(vmo != NULL);
+		lp = vm_object_getpage(vmo, (va - vmo->vmo_base) / PAGE_SIZE);
+		if (lp == NULL) {
+			assert(!writing);
+			*ret = lpage_zeropage() | (va & ~PAGE_FRAME);
+			return 0;
+		}
+
+		pa = lpage_pin(lp, writing);
+	} while (pa == INVALID_PADDR);
+
+	*ret = pa | (va & ~PAGE_FRAME);
+	return 0;
+}
+
+/*
+ * as_unpin: unpin a page pinned by as_pin.
+ */
+void
+as_unpin(paddr_t pa)
+{
+	if ((pa & PAGE_FRAME) != lpage_zeropage()) {
+		coremap_unpin(pa & PAGE_FRAME);
+	}
 }
 
 /*
@@ -157,6 +402,10 @@ as_destroy(struct addrspace *as)
 {
 	struct vm_object *vmo;
 	int i;
+
+	/* drop its TLB entries, which would outlive it under its ASID */
+	mmu_unmapall(as);
+
 	for (i = 0; i < array_getnum(as->as_objects); i++) {
 		vmo = array_getguy(as->as_objects, i);
 		vm_object_destroy(as, vmo);
@@ -226,7 +475,7 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		vmo = array_getguy(as->as_objects, i);
 		assert(vmo != NULL);
 		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE*array_getnum(vmo->vmo_lpages);
+		top = VMO_TOP(vmo);
 
 		/* Check guard band, if any */
 		assert(bot >= vmo->vmo_lower_redzone);
@@ -247,17 +496,75 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	vmo->vmo_base = vaddr;
 	vmo->vmo_lower_redzone = lower_redzone;
 
-	/* Add it to the parent address space. */
+	/* Add it to the parent address space, keeping them sorted. */
 	result = array_add(as->as_objects, vmo);
 	if (result) {
 		vm_object_destroy(as, vmo);
 		return result;
 	}
+	for (i = array_getnum(as->as_objects) - 1; i > 0; i--) {
+		struct vm_object *prev;
+
+		prev = array_getguy(as->as_objects, i-1);
+		if (prev->vmo_base < vaddr) {
+			break;
+		}
+		array_setguy(as->as_objects, i, prev);
+		array_setguy(as->as_objects, i-1, vmo);
+	}
 
 	/* Done */
 	return 0;
 }
 
+/*
+ * as_define_file: set up a region like as_define_region, whose first
+ * FILESIZE bytes come from file V at OFFSET rather than being zero.
+ * Nothing is read now; each page is read in when it is first touched.
+ * A read-only region shares its pages with any other process running
+ * the same program.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	       struct vnode *v, off_t offset, size_t filesize,
+	       int readable, int writeable, int executable)
+{
+	struct vm_object *vmo;
+	struct vm_file *vf;
+	int i, result;
+
+	assert(filesize <= sz);
+
+	result = as_define_region(as, vaddr, sz, 0,
+				  readable, writeable, executable);
+	if (result) {
+		return result;
+	}
+
+	vmo = NULL;
+	for (i = 0; i < array_getnum(as->as_objects); i++) {
+		vmo = array_getguy(as->as_objects, i);
+		if (vmo->vmo_base == vaddr) {
+			break;
+		}
+	}
+	assert(vmo != NULL && vmo->vmo_base == vaddr);
+
+	if (filesize == 0) {
+		/* all bss */
+		return 0;
+	}
+
+	result = vm_file_get(v, offset, filesize, vmo->vmo_npages,
+			     !writeable, &vf);
+	if (result) {
+		/* the region stays, zerofilled, until as_destroy */
+		return result;
+	}
+	vm_object_setfile(vmo, vf);
+	return 0;
+}
+
 /*
  * as_prepare_load: called before loading executable segments.
  */
@@ -16,31 +16,107 @@
 
 /* Stats counters */
 static volatile u_int32_t ct_zerofills;
+static volatile u_int32_t ct_zeromaps;
 static volatile u_int32_t ct_minfaults;
 static volatile u_int32_t ct_majfaults;
 static volatile u_int32_t ct_discard_evictions;
 static volatile u_int32_t ct_write_evictions;
+static volatile u_int32_t ct_cleanings;
+static volatile u_int32_t ct_faultarounds;
+static volatile u_int32_t ct_cowfaults;
+static volatile u_int32_t ct_filereads;
+static volatile u_int32_t ct_fileloads;
+
+/*
+ * The zero page: a kernel page of zeros, mapped read-only wherever a
+ * zerofill page is read before it is written.
+ */
+static paddr_t zero_paddr = INVALID_PADDR;
+
+/* Object cache lpages come from */
+static struct kmcache *lpage_cache;
+
+/* Major fault count and time at the last vm_printstats, for the PFF */
+static u_int32_t pff_lastfaults;
+static int pff_lastlbolt;
 
 void
 vm_printstats(void)
 {
-	int spl;
-	u_int32_t zf, mn, mj, de, we, te;
+	int spl, now;
+	u_int32_t zf, zm, mn, mj, de, we, te, cl, fa, cw, fr, fl;
 	
 	spl = splhigh();
 	zf = ct_zerofills;
+	zm = ct_zeromaps;
 	mn = ct_minfaults;
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cl = ct_cleanings;
+	fa = ct_faultarounds;
+	cw = ct_cowfaults;
+	fr = ct_filereads;
+	fl = ct_fileloads;
+	now = lbolt;
 	splx(spl);
 
 	te = de+we;
 
-	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
-		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
+	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults "
+		"%lu copy-on-write faults\n", (unsigned long) zf,
+		(unsigned long) mn, (unsigned long) mj, (unsigned long) cw);
+	kprintf("vm: %lu reads mapped the zero page\n", (unsigned long) zm);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu pages cleaned ahead of eviction, "
+		"%lu read in around faults\n",
+		(unsigned long) cl, (unsigned long) fa);
+	kprintf("vm: %lu text pages read from executables, "
+		"%lu data pages loaded from them\n",
+		(unsigned long) fr, (unsigned long) fl);
+
+	/*
+	 * Page fault frequency: major faults per second since the last
+	 * time we were called (or since boot).
+	 */
+	if (now > pff_lastlbolt) {
+		kprintf("vm: page fault frequency %lu/sec over %d sec\n",
+			(unsigned long) ((mj - pff_lastfaults) /
+					 (now - pff_lastlbolt)),
+			now - pff_lastlbolt);
+	}
+	pff_lastfaults = mj;
+	pff_lastlbolt = now;
+
+	as_printstats();
+	load_elf_printstats();
+	vm_file_printstats();
+	coremap_printstats();
+	swap_printstats();
+}
+
+/*
+ * lpage_bootstrap: set up the zero page and the cache lpages come
+ * from. Called from vm_bootstrap.
+ */
+void
+lpage_bootstrap(void)
+{
+	vaddr_t va;
+
+	lpage_cache = kmcache_create("lpage", sizeof(struct lpage),
+				     NULL, NULL);
+	if (lpage_cache == NULL) {
+		panic("lpage_bootstrap: Could not create lpage cache\n");
+	}
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		panic("lpage_bootstrap: Could not allocate zero page\n");
+	}
+	zero_paddr = KVADDR_TO_PADDR(va);
+	coremap_zero_page(zero_paddr);
 }
 
 /*
@@ -52,20 +128,27 @@ lpage_create(void)
 {
 	struct lpage *lp;
 
-	lp = kmalloc(sizeof(struct lpage));
+	lp = kmcache_alloc(lpage_cache);
 	if (lp==NULL) {
 		return NULL;
 	}
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
+	lp->lp_refcount = 1;
+	lp->lp_file = NULL;
 
 	return lp;
 }
 
 /*
- * lpage_destroy: deallocates a logical page. Releases any RAM or swap
- * pages involved.
+ * lpage_destroy: drops a reference to a logical page, and deallocates
+ * it if that was the last one. Releases any RAM or swap pages involved.
+ *
+ * Each vm_object slot accounts for one page of swap. For a shared
+ * lpage, one of the slots holding it has the swap page it uses and the
+ * others have reservations, so dropping a reference that isn't the
+ * last releases a reservation.
  *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. If so, wait for it
@@ -84,6 +167,13 @@ lpage_destroy(struct lpage *lp)
 	assert(lp != NULL);
 
 	lpage_lock(lp);
+	assert(lp->lp_refcount > 0);
+	if (--lp->lp_refcount > 0) {
+		lpage_unlock(lp);
+		swap_unreserve(1);
+		return;
+	}
+
 	spl = splhigh();
 
 	pa = lp->lp_paddr & PAGE_FRAME;
@@ -106,13 +196,13 @@ lpage_destroy(struct lpage *lp)
 	lpage_unlock(lp);
 
 	/* assert(lp->lp_dpage!=INVALID_DPAGE); -- probably not true */
-	if (lp->lp_swapaddr != INVALID_SWAPADDR) {
+	if (lp->lp_swapaddr != INVALID_SWAPADDR && !LP_ISFILE(lp)) {
 		DEBUG(DB_VM, "lpage_destroy: freeing swap addr 0x%x\n", 
 		      lp->lp_swapaddr);
 		swap_free(lp->lp_swapaddr);
 	}
 
-	kfree(lp);
+	kmcache_free(lpage_cache, lp);
 }
 
 
@@ -160,15 +250,157 @@ lpage_unlock(struct lpage *lp)
 	splx(spl);
 }
 
+/*
+ * lpage_share: add a reference to an lpage, for a vm_object being
+ * cloned at fork time. The lpage is copy-on-write from now on, so the
+ * caller must see to it that the old address space's writable
+ * mappings are gone. The new slot's swap reservation stays unused
+ * while the lpage is shared (see lpage_destroy).
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	lpage_lock(lp);
+	assert(lp->lp_refcount > 0);
+	lp->lp_refcount++;
+	lpage_unlock(lp);
+}
+
+/*
+ * lpage_unshare: called on a write fault. If *LPP is shared, make a
+ * private copy of it, drop the reference to the original, and hand
+ * back the copy in *LPP. If it isn't, leave it alone.
+ *
+ * The other sharers may drop out at any time (but nobody else can
+ * share it any further), so once the lpage is seen unshared it stays
+ * that way. If it is seen shared, reserve a page of swap for the copy
+ * before anything else, so that the accounting in lpage_destroy works
+ * out whichever reference is dropped last.
+ */
+int
+lpage_unshare(struct lpage **lpp, off_t swahint)
+{
+	struct lpage *lp = *lpp, *newlp;
+	int shared, result, spl;
+
+	lpage_lock(lp);
+	shared = lp->lp_refcount > 1;
+	lpage_unlock(lp);
+
+	if (!shared) {
+		return 0;
+	}
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+
+	result = lpage_copy(lp, &newlp, swahint);
+	if (result) {
+		swap_unreserve(1);
+		return result;
+	}
+
+	lpage_destroy(lp);
+	*lpp = newlp;
+
+	spl = splhigh();
+	ct_cowfaults++;
+	splx(spl);
+	return 0;
+}
+
+/*
+ * lpage_lock_and_pin: lock an lpage and, if it is resident, pin its
+ * physical page. Returns the physical page, or INVALID_PADDR.
+ *
+ * The page must be pinned before the lpage is locked, because the
+ * eviction code pins the page first and then locks the lpage. So
+ * look, pin, and then check that the page didn't move meanwhile.
+ */
+static
+paddr_t
+lpage_lock_and_pin(struct lpage *lp)
+{
+	paddr_t pa, pa2;
+
+	lpage_lock(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	while (pa != INVALID_PADDR) {
+		lpage_unlock(lp);
+		coremap_pin(pa);
+		lpage_lock(lp);
+		pa2 = lp->lp_paddr & PAGE_FRAME;
+		if (pa2 == pa) {
+			break;
+		}
+		coremap_unpin(pa);
+		pa = pa2;
+	}
+	return pa;
+}
+
+/*
+ * lpage_filein: page in a text page that is not resident, by reading
+ * it from its file. Unlike swap pages, text pages are shared between
+ * address spaces, so someone else may read the same page in while we
+ * are at it; if so, ours is thrown away and theirs is used.
+ *
+ * Synchronization: called with LP locked. Returns with it locked and
+ * its page pinned, or on error unlocked.
+ */
+static
+int
+lpage_filein(struct lpage *lp, paddr_t *paret)
+{
+	paddr_t pa, otherpa;
+	unsigned index;
+	int result, spl;
+
+	assert(LP_ISFILE(lp));
+	index = lp->lp_swapaddr / PAGE_SIZE;
+	lpage_unlock(lp);
+
+	pa = coremap_allocuser(lp);
+	if (pa == INVALID_PADDR) {
+		return ENOMEM;
+	}
+	assert(coremap_pageispinned(pa));
+
+	result = vm_file_read(lp->lp_file, index, pa);
+	if (result) {
+		coremap_free(pa, 0 /* iskern */);
+		coremap_unpin(pa);
+		return result;
+	}
+
+	otherpa = lpage_lock_and_pin(lp);
+	if (otherpa != INVALID_PADDR) {
+		coremap_free(pa, 0 /* iskern */);
+		coremap_unpin(pa);
+		*paret = otherpa;
+		return 0;
+	}
+	lp->lp_paddr = pa | LPF_LOCKED;
+
+	spl = splhigh();
+	ct_filereads++;
+	splx(spl);
+
+	*paret = pa;
+	return 0;
+}
+
 /*
  * lpage_materialize: create a new lpage and allocate swap and RAM for it.
  * Mark it pinned. Do not do anything with the page contents though. 
- * Returns the lpage locked.
+ * Returns the lpage locked. SWAHINT is passed to swap_alloc.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(struct lpage **lpret, paddr_t *paret, off_t swahint)
 {
 	struct lpage *lp;
 	paddr_t pa;
@@ -179,7 +411,7 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 		return ENOMEM;
 	}
 
-	swa = swap_alloc();
+	swa = swap_alloc(swahint);
 	if (swa == INVALID_SWAPADDR) {
 		lpage_destroy(lp);
 		return ENOSPC;
@@ -218,12 +450,12 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
  * The synchronization for this is kind of unpleasant. We do it like
  * this:
  *
- *      1. Lock oldlp.
+ *      1. Lock oldlp, pinning its page if it is present
+ *         (lpage_lock_and_pin).
  *      2. Check if oldlp is present.
  *      2a.    If it isn't, unlock oldlp and page in.
  *      2b.    This pins the page in the coremap.
  *      2c.    Leave the page pinned and relock oldlp.
- *      2d.    Otherwise, pin the page in the coremap.
  *      3. Now create newlp.
  *      4. Lock newlp *before* getting physical space for it.
  *         (This prevents deadlock; nobody can hold its lock.)
@@ -233,17 +465,22 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
  *      
  */
 int
-lpage_copy(struct lpage *oldlp, struct lpage **lpret)
+lpage_copy(struct lpage *oldlp, struct lpage **lpret, off_t swahint)
 {
 	struct lpage *newlp;
 	paddr_t newpa, oldpa;
 	off_t swa;
 	int result;
 
-	lpage_lock(oldlp);
-
-	oldpa = oldlp->lp_paddr & PAGE_FRAME;
-	if (oldpa == INVALID_PADDR) {
+ retry:
+	oldpa = lpage_lock_and_pin(oldlp);
+	if (oldpa == INVALID_PADDR && LP_ISFILE(oldlp)) {
+		result = lpage_filein(oldlp, &oldpa);
+		if (result) {
+			return result;
+		}
+	}
+	else if (oldpa == INVALID_PADDR) {
 		swa = oldlp->lp_swapaddr;
 		lpage_unlock(oldlp);
 
@@ -256,15 +493,18 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 		swap_pagein(oldpa, swa);
 		lpage_lock(oldlp);
 		lock_release(global_paging_lock);
-		assert((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
+		if ((oldlp->lp_paddr & PAGE_FRAME) != INVALID_PADDR) {
+			/* Paged in by someone else sharing it; use theirs */
+			lpage_unlock(oldlp);
+			coremap_free(oldpa, 0 /* iskern */);
+			coremap_unpin(oldpa);
+			goto retry;
+		}
 		oldlp->lp_paddr = oldpa | LPF_LOCKED;
 	}
-	else {
-		coremap_pin(oldpa);
-	}
 	assert(coremap_pageispinned(oldpa));
 
-	result = lpage_materialize(&newlp, &newpa);
+	result = lpage_materialize(&newlp, &newpa, swahint);
 	if (result) {
 		coremap_unpin(oldpa);
 		lpage_unlock(oldlp);
@@ -300,13 +540,13 @@ lpage_copy(struct lpage *oldlp, struct lpage **lpret)
  * contents and the necessary lpage fields.
  */
 int
-lpage_zerofill(struct lpage **lpret)
+lpage_zerofill(struct lpage **lpret, off_t swahint)
 {
 	struct lpage *lp;
 	paddr_t pa;
 	int result, spl;
 
-	result = lpage_materialize(&lp, &pa);
+	result = lpage_materialize(&lp, &pa, swahint);
 	if (result) {
 		return result;
 	}
@@ -327,28 +567,324 @@ lpage_zerofill(struct lpage **lpret)
 	return 0;
 }
 
+/*
+ * lpage_zeromap: map the zero page read-only at VA, for a read of a
+ * zerofill page. Nothing is allocated for the page until it is
+ * written; that write faults and gets a zerofilled page as usual.
+ *
+ * Synchronization: none; the zero page is never evicted.
+ */
+void
+lpage_zeromap(struct addrspace *as, vaddr_t va)
+{
+	int spl;
+
+	assert(zero_paddr != INVALID_PADDR);
+	mmu_map(as, va, zero_paddr, 0 /* writable */);
+
+	spl = splhigh();
+	ct_zeromaps++;
+	splx(spl);
+}
+
+/*
+ * lpage_zeropage: the physical address of the zero page.
+ */
+paddr_t
+lpage_zeropage(void)
+{
+	assert(zero_paddr != INVALID_PADDR);
+	return zero_paddr;
+}
+
+/*
+ * lpage_fileload: create a new lpage holding page INDEX of VF, read
+ * in from the file now. This is for pages of a writable segment,
+ * which each process needs its own copy of; it is done when the page
+ * is first touched, as with zerofill pages.
+ *
+ * Synchronization: nobody else can see the new lpage, so it is not
+ * kept locked during the read; the physical page stays pinned.
+ */
+int
+lpage_fileload(struct vm_file *vf, unsigned index, struct lpage **lpret,
+	       off_t swahint)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	int result, spl;
+
+	result = lpage_materialize(&lp, &pa, swahint);
+	if (result) {
+		return result;
+	}
+	assert(LP_ISLOCKED(lp));
+	lpage_unlock(lp);
+
+	result = vm_file_read(vf, index, pa);
+	coremap_unpin(pa);
+	if (result) {
+		lpage_destroy(lp);
+		/* as in lpage_materialize, give back the reservation */
+		if (swap_reserve(1) != 0) {
+			kprintf("WARNING: failed to restore swap reservation.  Expect assertion failure in swap_unreserve during vm_object_destroy.\n");
+		}
+		return result;
+	}
+
+	spl = splhigh();
+	ct_fileloads++;
+	splx(spl);
+
+	*lpret = lp;
+	return 0;
+}
+
 /*
  * lpage_fault - handle a fault on a specific lpage. If the page is
  * not resident, get a physical page from coremap and swap it in.
+ * Any of the AROUND pages that aren't resident either and come right
+ * after it in swap are read in too, in the same request, but not
+ * mapped; if they are used they take a minor fault.
+ *
+ * The page is mapped writable only once it is dirty, so the first
+ * write to a clean page comes back as a VM_FAULT_READONLY and marks
+ * it dirty. A shared page is never mapped writable; the caller must
+ * have called lpage_unshare before a write.
+ *
+ * Text pages are read from their file instead, one at a time.
+ *
+ * Synchronization: locks the lpage and pins its physical page while
+ * updating the MMU.
  */
 int
-lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
+lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va,
+	    struct lpage **around, int naround)
 {
-	// ADD CODE HERE FOR ASST2
-	(void)lp;	// suppress compiler warning until code gets written
-	(void)as;	// suppress compiler warning until code gets written
-	(void)faulttype;// suppress compiler warning until code gets written
-	(void)va;	// suppress compiler warning until code gets written
-	return 1;	// suppress compiler warning until code gets written
+	paddr_t pa, pas[SWAP_CLUSTER];
+	off_t swa;
+	int i, n, writable, spl, result;
+
+ retry:
+	pa = lpage_lock_and_pin(lp);
+	if (pa == INVALID_PADDR && LP_ISFILE(lp)) {
+		result = lpage_filein(lp, &pa);
+		if (result) {
+			return result;
+		}
+		spl = splhigh();
+		ct_majfaults++;
+		splx(spl);
+	}
+	else if (pa == INVALID_PADDR) {
+		swa = lp->lp_swapaddr;
+		assert(swa != INVALID_SWAPADDR);
+		lpage_unlock(lp);
+
+		pa = coremap_allocuser(lp);
+		if (pa == INVALID_PADDR) {
+			return ENOMEM;
+		}
+		assert(coremap_pageispinned(pa));
+
+		/*
+		 * A page shared copy-on-write may be paged in by
+		 * another address space while we do the same; that is
+		 * checked for once we have read them.
+		 */
+		pas[0] = pa;
+		for (n = 1; n < SWAP_CLUSTER && n <= naround; n++) {
+			lpage_lock(around[n-1]);
+			if ((around[n-1]->lp_paddr & PAGE_FRAME) != INVALID_PADDR
+			    || LP_ISFILE(around[n-1])
+			    || around[n-1]->lp_swapaddr != swa + n*PAGE_SIZE) {
+				lpage_unlock(around[n-1]);
+				break;
+			}
+			lpage_unlock(around[n-1]);
+
+			pas[n] = coremap_allocuser(around[n-1]);
+			if (pas[n] == INVALID_PADDR) {
+				break;
+			}
+		}
+
+		lock_acquire(global_paging_lock);
+		swap_pagein_cluster(pas, n, swa);
+		lpage_lock(lp);
+		lock_release(global_paging_lock);
+
+		/* Put the neighbours in, unless they got there first */
+		for (i = 1; i < n; i++) {
+			lpage_lock(around[i-1]);
+			if ((around[i-1]->lp_paddr & PAGE_FRAME)
+			    == INVALID_PADDR) {
+				around[i-1]->lp_paddr = pas[i] | LPF_LOCKED;
+			}
+			else {
+				coremap_free(pas[i], 0 /* iskern */);
+			}
+			coremap_unpin(pas[i]);
+			lpage_unlock(around[i-1]);
+		}
+
+		if ((lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR) {
+			/*
+			 * Another address space sharing the page paged
+			 * it in meanwhile. Throw ours away and start
+			 * over; the page has to be pinned before the
+			 * lpage is locked.
+			 */
+			lpage_unlock(lp);
+			coremap_free(pa, 0 /* iskern */);
+			coremap_unpin(pa);
+			goto retry;
+		}
+		lp->lp_paddr = pa | LPF_LOCKED;
+
+		spl = splhigh();
+		ct_majfaults++;
+		ct_faultarounds += n-1;
+		splx(spl);
+	}
+	else {
+		spl = splhigh();
+		ct_minfaults++;
+		splx(spl);
+	}
+	assert(coremap_pageispinned(pa));
+
+	switch (faulttype) {
+	    case VM_FAULT_READ:
+		writable = LP_ISDIRTY(lp) && lp->lp_refcount == 1;
+		break;
+	    case VM_FAULT_WRITE:
+	    case VM_FAULT_READONLY:
+		assert(lp->lp_refcount == 1);
+		LP_SET(lp, LPF_DIRTY);
+		writable = 1;
+		break;
+	    default:
+		panic("lpage_fault: bad faulttype %d\n", faulttype);
+	}
+
+	mmu_map(as, va, pa, writable);
+
+	coremap_unpin(pa);
+	lpage_unlock(lp);
+	return 0;
+}
+
+/*
+ * lpage_pin: pin LP's physical page, if it is resident, and return it;
+ * otherwise return INVALID_PADDR. If DIRTY, the caller is about to
+ * change the contents behind the MMU's back, so the page is marked
+ * dirty now.
+ *
+ * Synchronization: locks the lpage while looking. The caller unpins
+ * the page with coremap_unpin.
+ */
+paddr_t
+lpage_pin(struct lpage *lp, int dirty)
+{
+	paddr_t pa;
+
+	pa = lpage_lock_and_pin(lp);
+	if (pa != INVALID_PADDR && dirty) {
+		LP_SET(lp, LPF_DIRTY);
+	}
+	lpage_unlock(lp);
+	return pa;
 }
 
 /*
  * lpage_evict: Evict an lpage from physical memory.
  *
+ * The page is written to swap if it is dirty; otherwise the copy in
+ * swap (or, for text, in the file) is still good and the page is just
+ * dropped. Text pages are never dirty.
+ *
+ * Synchronization: called from the coremap with the physical page
+ * pinned and its TLB entry gone, holding global_paging_lock. Locks
+ * the lpage; the lock is dropped during the write so the owner isn't
+ * held up, but it can't touch the page while it's pinned.
  */
 void
 lpage_evict(struct lpage *lp)
 {
-	// ADD CODE HERE FOR ASST2
-	(void)lp;	// suppress compiler warning until code gets written
+	paddr_t pa;
+	off_t swa;
+
+	assert(lp != NULL);
+	lpage_lock(lp);
+
+	pa = lp->lp_paddr & PAGE_FRAME;
+	swa = lp->lp_swapaddr;
+
+	assert(pa != INVALID_PADDR);
+	assert(swa != INVALID_SWAPADDR);
+	assert(coremap_pageispinned(pa));
+
+	if (LP_ISDIRTY(lp)) {
+		assert(!LP_ISFILE(lp));
+		lpage_unlock(lp);
+		swap_pageout(pa, swa);
+		lpage_lock(lp);
+		assert((lp->lp_paddr & PAGE_FRAME) == pa);
+		LP_CLEAR(lp, LPF_DIRTY);
+		ct_write_evictions++;
+	}
+	else {
+		ct_discard_evictions++;
+	}
+
+	/* now it's not in memory any more (but keep it locked) */
+	lp->lp_paddr = INVALID_PADDR | LPF_LOCKED;
+	lpage_unlock(lp);
+}
+
+/*
+ * lpage_clean: Write the dirty pages among LPS[0..N-1] out to swap,
+ * leaving them in memory and clean. Their swap pages are consecutive;
+ * the run written is cut short at the first one found clean. Used by
+ * the pageout daemon, and to write a victim's neighbours along with it.
+ *
+ * Synchronization: as for lpage_evict, for each page.
+ */
+void
+lpage_clean(struct lpage **lps, int n)
+{
+	paddr_t pas[SWAP_CLUSTER];
+	off_t swa;
+	int i;
+
+	assert(n > 0 && n <= SWAP_CLUSTER);
+
+	swa = lps[0]->lp_swapaddr;
+	for (i=0; i<n; i++) {
+		lpage_lock(lps[i]);
+		pas[i] = lps[i]->lp_paddr & PAGE_FRAME;
+		assert(pas[i] != INVALID_PADDR);
+		assert(lps[i]->lp_swapaddr == swa + i*PAGE_SIZE);
+		assert(coremap_pageispinned(pas[i]));
+		if (!LP_ISDIRTY(lps[i])) {
+			lpage_unlock(lps[i]);
+			break;
+		}
+		lpage_unlock(lps[i]);
+	}
+	n = i;
+	if (n == 0) {
+		return;
+	}
+
+	swap_pageout_cluster(pas, n, swa);
+
+	for (i=0; i<n; i++) {
+		lpage_lock(lps[i]);
+		assert((lps[i]->lp_paddr & PAGE_FRAME) == pas[i]);
+		LP_CLEAR(lps[i], LPF_DIRTY);
+		lpage_unlock(lps[i]);
+	}
+	ct_cleanings += n;
 }
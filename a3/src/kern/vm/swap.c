@@ -39,6 +39,21 @@ static unsigned long swap_reserved_pages;
 
 static struct vnode *swapstore;	// swap file
 
+/*
+ * Clustering. A page that isn't placed next to a neighbour in its
+ * vm_object gets the middle of a free extent of SWAP_EXTENT pages, so
+ * that the object can grow into it in either direction. Clustered I/O
+ * goes through swapbuf, which holds SWAP_CLUSTER pages and is covered
+ * by global_paging_lock.
+ */
+#define SWAP_EXTENT	32
+static u_int32_t swaprotor;	// where to look for the next extent
+static char *swapbuf;		// bounce buffer for clustered I/O
+
+/* I/O statistics; covered by global_paging_lock */
+static u_int32_t ct_swapreads, ct_swapwrites;
+static u_int32_t ct_pagesin, ct_pagesout;
+
 /*
  * Only one page can be in transit to/from disk at once (at least under
  * present circumstances.) While the disk device will queue up multiple
@@ -111,9 +126,18 @@ swap_bootstrap(size_t pmemsize)
 		panic("swap: No memory for swap lock\n");
 	}
 
+	swapbuf = kmalloc(SWAP_CLUSTER*PAGE_SIZE);
+	if (swapbuf == NULL) {
+		panic("swap: No memory for cluster buffer\n");
+	}
+	swaprotor = 0;
+
 	/* mark the first page of swap used so we can check for errors */
 	bitmap_mark(swapmap, 0);
 	swap_free_pages--;
+
+	/* now pages can be written out ahead of time */
+	coremap_start_pageout();
 }
 
 /*
@@ -124,21 +148,73 @@ swap_bootstrap(size_t pmemsize)
 void
 swap_shutdown(void)
 {
+	kfree(swapbuf);
 	lock_destroy(swaplock);
 	bitmap_destroy(swapmap);
 	vfs_close(swapstore);
 }
 
+/*
+ * swap_usesvnode
+ *
+ * Returns true if VN is the swapfile. Device vnodes are shared by
+ * everyone who opens the device, so this also tells whether a raw
+ * disk is the swap disk.
+ */
+int
+swap_usesvnode(struct vnode *vn)
+{
+	return swapstore != NULL && swapstore == vn;
+}
+
+/*
+ * swap_findextent: look for SWAP_EXTENT free swap pages in a row,
+ * starting at the rotor. Returns the index of the middle one, or -1.
+ *
+ * Synchronization: called holding swaplock.
+ */
+static
+int
+swap_findextent(void)
+{
+	u_int32_t i, index, run;
+
+	assert(lock_do_i_hold(swaplock));
+
+	run = 0;
+	index = swaprotor;
+	for (i=0; i<swap_total_pages; i++) {
+		if (index == 0) {
+			/* runs don't wrap around */
+			run = 0;
+		}
+		if (bitmap_isset(swapmap, index)) {
+			run = 0;
+		}
+		else if (++run == SWAP_EXTENT) {
+			swaprotor = (index + 1) % swap_total_pages;
+			return index + 1 - SWAP_EXTENT/2;
+		}
+		index = (index + 1) % swap_total_pages;
+	}
+	return -1;
+}
+
 /*
  * swap_alloc: allocates a page in the swapfile.
  * The page should have already been reserved with swap_reserve.
  *
+ * HINT is the swap address that would put the page next to its
+ * neighbours, or INVALID_SWAPADDR. If that isn't free, the page goes
+ * in the middle of a free extent, or failing that anywhere.
+ *
  * Synchronization: uses swaplock.
  */
 off_t
-swap_alloc(void)
+swap_alloc(off_t hint)
 {
 	u_int32_t rv, index;
+	int ext;
 	
 	lock_acquire(swaplock);
 
@@ -148,9 +224,21 @@ swap_alloc(void)
 	assert(swap_reserved_pages>0);
 	assert(swap_free_pages>0);
 
-	rv = bitmap_alloc(swapmap, &index);
-	/* If this blows up, our counters are wrong */
-	assert(rv==0);
+	if (hint != INVALID_SWAPADDR && hint > 0 && hint % PAGE_SIZE == 0 &&
+	    (unsigned long)(hint / PAGE_SIZE) < swap_total_pages &&
+	    !bitmap_isset(swapmap, hint / PAGE_SIZE)) {
+		index = hint / PAGE_SIZE;
+		bitmap_mark(swapmap, index);
+	}
+	else if ((ext = swap_findextent()) >= 0) {
+		index = ext;
+		bitmap_mark(swapmap, index);
+	}
+	else {
+		rv = bitmap_alloc(swapmap, &index);
+		/* If this blows up, our counters are wrong */
+		assert(rv==0);
+	}
 
 	swap_reserved_pages--;
 	swap_free_pages--;
@@ -230,37 +318,73 @@ swap_unreserve(unsigned long npages)
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_io: Does one swap I/O, of NPAGES pages at consecutive swap
+ * addresses starting at SWAPADDR, to or from the physical pages in
+ * PAS. Panics on failure.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * A single page is transferred directly. A cluster goes through
+ * swapbuf, so that it takes only one disk request.
+ *
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
  */
 static
 void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr,
+	enum uio_rw rw)
 {
 	struct uio u;
 	vaddr_t va;
+	unsigned i;
 	int result;
 
 	assert(lock_do_i_hold(global_paging_lock));
 
-	assert(pa != INVALID_PADDR);
+	assert(npages > 0 && npages <= SWAP_CLUSTER);
 	assert(swapaddr % PAGE_SIZE == 0);
-	assert(coremap_pageispinned(pa));
-	assert(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
+	for (i=0; i<npages; i++) {
+		assert(pas[i] != INVALID_PADDR);
+		assert(coremap_pageispinned(pas[i]));
+		assert(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
+	}
 
-	va = coremap_map_swap_page(pa);
+	if (npages == 1) {
+		va = coremap_map_swap_page(pas[0]);
+		mk_kuio(&u, (char *)va, PAGE_SIZE, swapaddr, rw);
+	}
+	else {
+		if (rw==UIO_WRITE) {
+			for (i=0; i<npages; i++) {
+				va = coremap_map_swap_page(pas[i]);
+				memcpy(swapbuf + i*PAGE_SIZE, (char *)va,
+				       PAGE_SIZE);
+				coremap_unmap_swap_page(va, pas[i]);
+			}
+		}
+		mk_kuio(&u, swapbuf, npages*PAGE_SIZE, swapaddr, rw);
+	}
 
-	mk_kuio(&u, (char *)va, PAGE_SIZE, swapaddr, rw);
 	if (rw==UIO_READ) {
 		result = VOP_READ(swapstore, &u);
+		ct_swapreads++;
+		ct_pagesin += npages;
 	}
 	else {
 		result = VOP_WRITE(swapstore, &u);
+		ct_swapwrites++;
+		ct_pagesout += npages;
 	}
 
-	coremap_unmap_swap_page(va, pa);
+	if (npages == 1) {
+		coremap_unmap_swap_page(va, pas[0]);
+	}
+	else if (result==0 && rw==UIO_READ) {
+		for (i=0; i<npages; i++) {
+			va = coremap_map_swap_page(pas[i]);
+			memcpy((char *)va, swapbuf + i*PAGE_SIZE, PAGE_SIZE);
+			coremap_unmap_swap_page(va, pas[i]);
+		}
+	}
 
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
@@ -283,7 +407,7 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 void
 swap_pagein(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	swap_io(&pa, 1, swapaddr, UIO_READ);
 }
 
 
@@ -294,5 +418,33 @@ swap_pagein(paddr_t pa, off_t swapaddr)
 void
 swap_pageout(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	swap_io(&pa, 1, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_pagein_cluster/swap_pageout_cluster: the same, for NPAGES
+ * pages at consecutive swap addresses.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pagein_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_READ);
+}
+
+void
+swap_pageout_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	swap_io(pas, npages, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_printstats: print swap I/O counters, for vm_printstats.
+ */
+void
+swap_printstats(void)
+{
+	kprintf("swap: %lu reads (%lu pages), %lu writes (%lu pages)\n",
+		(unsigned long) ct_swapreads, (unsigned long) ct_pagesin,
+		(unsigned long) ct_swapwrites, (unsigned long) ct_pagesout);
 }
@@ -0,0 +1,290 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <machine/spl.h>
+#include <machine/coremap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <vmpvt.h>
+
+/*
+ * vm_file operations: loading vm_objects from executables on demand,
+ * and sharing program text.
+ */
+
+/* Shared (read-only) vm_files, and the lock for the list and them */
+static struct vm_file *vm_files;
+static struct lock *vm_file_lock;
+
+/* Stats counters */
+static u_int32_t ct_textshares;		/* execs that found text shared */
+static u_int32_t ct_textpageshares;	/* text pages found already in */
+
+/*
+ * vm_file_bootstrap: create the lock.
+ */
+void
+vm_file_bootstrap(void)
+{
+	vm_file_lock = lock_create("vm_file_lock");
+	if (vm_file_lock == NULL) {
+		panic("vm_file_bootstrap: Could not create lock\n");
+	}
+}
+
+/*
+ * vm_file_create: make a new vm_file with one reference.
+ */
+static
+struct vm_file *
+vm_file_create(struct vnode *v, off_t offset, size_t filesize,
+	       unsigned npages, int shared)
+{
+	struct vm_file *vf;
+	unsigned i;
+
+	vf = kmalloc(sizeof(struct vm_file));
+	if (vf == NULL) {
+		return NULL;
+	}
+
+	vf->vf_pages = NULL;
+	if (shared) {
+		vf->vf_pages = kmalloc(npages * sizeof(struct lpage *));
+		if (vf->vf_pages == NULL) {
+			kfree(vf);
+			return NULL;
+		}
+		for (i=0; i<npages; i++) {
+			vf->vf_pages[i] = NULL;
+		}
+	}
+
+	/* hold the file open, as if we had vfs_open'd it */
+	VOP_INCOPEN(v);
+	VOP_INCREF(v);
+	vf->vf_vnode = v;
+	vf->vf_offset = offset;
+	vf->vf_filesize = filesize;
+	vf->vf_npages = npages;
+	vf->vf_refcount = 1;
+	vf->vf_next = NULL;
+	return vf;
+}
+
+/*
+ * vm_file_get: get the vm_file for a segment of executable V.
+ *
+ * A writable segment always gets a new one. A read-only one shares
+ * the one already in use by another process running the program, if
+ * there is one. (The file system hands out one vnode per file, so the
+ * vnode identifies the program. Text already in memory is not
+ * noticed if the file is rewritten meanwhile.)
+ */
+int
+vm_file_get(struct vnode *v, off_t offset, size_t filesize,
+	    unsigned npages, int shared, struct vm_file **ret)
+{
+	struct vm_file *vf;
+
+	if (!shared) {
+		vf = vm_file_create(v, offset, filesize, npages, 0);
+		if (vf == NULL) {
+			return ENOMEM;
+		}
+		*ret = vf;
+		return 0;
+	}
+
+	lock_acquire(vm_file_lock);
+	for (vf = vm_files; vf != NULL; vf = vf->vf_next) {
+		if (vf->vf_vnode == v && vf->vf_offset == offset &&
+		    vf->vf_filesize == filesize && vf->vf_npages == npages) {
+			vf->vf_refcount++;
+			ct_textshares++;
+			lock_release(vm_file_lock);
+			*ret = vf;
+			return 0;
+		}
+	}
+
+	vf = vm_file_create(v, offset, filesize, npages, 1);
+	if (vf == NULL) {
+		lock_release(vm_file_lock);
+		return ENOMEM;
+	}
+	vf->vf_next = vm_files;
+	vm_files = vf;
+	lock_release(vm_file_lock);
+
+	*ret = vf;
+	return 0;
+}
+
+/*
+ * vm_file_ref: add a reference.
+ */
+void
+vm_file_ref(struct vm_file *vf)
+{
+	lock_acquire(vm_file_lock);
+	assert(vf->vf_refcount > 0);
+	vf->vf_refcount++;
+	lock_release(vm_file_lock);
+}
+
+/*
+ * vm_file_release: drop a reference, and destroy the vm_file if that
+ * was the last. Nobody else has its lpages by then, so this frees
+ * them.
+ */
+void
+vm_file_release(struct vm_file *vf)
+{
+	struct vm_file **pp;
+	unsigned i;
+
+	lock_acquire(vm_file_lock);
+	assert(vf->vf_refcount > 0);
+	if (--vf->vf_refcount > 0) {
+		lock_release(vm_file_lock);
+		return;
+	}
+	if (vf->vf_pages != NULL) {
+		for (pp = &vm_files; *pp != vf; pp = &(*pp)->vf_next) {
+			assert(*pp != NULL);
+		}
+		*pp = vf->vf_next;
+	}
+	lock_release(vm_file_lock);
+
+	if (vf->vf_pages != NULL) {
+		for (i=0; i<vf->vf_npages; i++) {
+			if (vf->vf_pages[i] != NULL) {
+				lpage_destroy(vf->vf_pages[i]);
+			}
+		}
+		kfree(vf->vf_pages);
+	}
+	vfs_close(vf->vf_vnode);
+	kfree(vf);
+}
+
+/*
+ * vm_file_getpage: get the lpage for page INDEX.
+ *
+ * For a shared vm_file, this is the text lpage, made the first time
+ * anyone asks for it; it is not read in until it's faulted on. For a
+ * private one it is a new lpage with a copy of the page in it.
+ */
+int
+vm_file_getpage(struct vm_file *vf, unsigned index, off_t swahint,
+		struct lpage **ret)
+{
+	struct lpage *lp;
+
+	assert(index < vf->vf_npages);
+	assert(VF_INFILE(vf, index));
+
+	if (vf->vf_pages == NULL) {
+		return lpage_fileload(vf, index, ret, swahint);
+	}
+
+	lock_acquire(vm_file_lock);
+	lp = vf->vf_pages[index];
+	if (lp == NULL) {
+		lp = lpage_create();
+		if (lp == NULL) {
+			lock_release(vm_file_lock);
+			return ENOMEM;
+		}
+		lp->lp_file = vf;
+		lp->lp_swapaddr = index*PAGE_SIZE;
+		vf->vf_pages[index] = lp;
+	}
+	else {
+		ct_textpageshares++;
+	}
+	lpage_share(lp);
+	lock_release(vm_file_lock);
+
+	*ret = lp;
+	return 0;
+}
+
+/*
+ * vm_file_read: read page INDEX from the file into physical page PA.
+ * The page is zero-filled past the end of the file part.
+ *
+ * Synchronization: the page should be pinned. Blocks for the I/O.
+ */
+int
+vm_file_read(struct vm_file *vf, unsigned index, paddr_t pa)
+{
+	struct uio ku;
+	size_t len;
+	int result;
+
+	assert(coremap_pageispinned(pa));
+	assert(VF_INFILE(vf, index));
+
+	len = vf->vf_filesize - index*PAGE_SIZE;
+	if (len < PAGE_SIZE) {
+		coremap_zero_page(pa);
+	}
+	else {
+		len = PAGE_SIZE;
+	}
+
+	mk_kuio(&ku, (void *)PADDR_TO_KVADDR(pa), len,
+		vf->vf_offset + index*PAGE_SIZE, UIO_READ);
+	result = VOP_READ(vf->vf_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("vm: short read on executable - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * vm_file_printstats: print how much text is shared and resident, for
+ * vm_printstats.
+ */
+void
+vm_file_printstats(void)
+{
+	struct vm_file *vf;
+	struct lpage *lp;
+	u_int32_t nfiles, npages, nresident, nrefs;
+	unsigned i;
+
+	nfiles = npages = nresident = nrefs = 0;
+
+	lock_acquire(vm_file_lock);
+	for (vf = vm_files; vf != NULL; vf = vf->vf_next) {
+		nfiles++;
+		nrefs += vf->vf_refcount;
+		npages += vf->vf_npages;
+		for (i=0; i<vf->vf_npages; i++) {
+			lp = vf->vf_pages[i];
+			if (lp != NULL &&
+			    (lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR) {
+				nresident++;
+			}
+		}
+	}
+	kprintf("vm: text: %lu segments in use by %lu processes, "
+		"%lu of %lu pages resident\n", (unsigned long) nfiles,
+		(unsigned long) nrefs, (unsigned long) nresident,
+		(unsigned long) npages);
+	kprintf("vm: text: %lu execs found it shared, %lu pages already "
+		"there\n", (unsigned long) ct_textshares,
+		(unsigned long) ct_textpageshares);
+	lock_release(vm_file_lock);
+}
@@ -1,7 +1,6 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <machine/spl.h>
 #include <machine/coremap.h>
 #include <addrspace.h>
@@ -13,6 +12,97 @@
  * NEW FILE FOR ASST2
  */
 
+/*
+ * The lpages of a vm_object are kept in a two-level table: a directory
+ * of pointers to leaf tables of VMO_LEAFPAGES lpage pointers each.
+ * Leaves are allocated the first time a page in them is used, so a
+ * large object that is mostly zerofill (such as the stack) costs only
+ * its directory. Every slot at or beyond vmo_npages is NULL.
+ */
+#define VMO_LEAF(index)		((index) / VMO_LEAFPAGES)
+#define VMO_LEAFOFF(index)	((index) % VMO_LEAFPAGES)
+#define VMO_NLEAVES(npages)	DIVROUNDUP(npages, VMO_LEAFPAGES)
+#define VMO_LEAFBYTES		(VMO_LEAFPAGES * sizeof(struct lpage *))
+
+/*
+ * vmo_growdir: make the directory big enough for NPAGES pages.
+ * Returns an error code.
+ */
+static
+int
+vmo_growdir(struct vm_object *vmo, unsigned npages)
+{
+	struct lpage ***newdir;
+	unsigned i, nleaves;
+
+	nleaves = VMO_NLEAVES(npages);
+	if (nleaves <= vmo->vmo_ndir) {
+		return 0;
+	}
+
+	newdir = kmalloc(nleaves * sizeof(struct lpage **));
+	if (newdir == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<vmo->vmo_ndir; i++) {
+		newdir[i] = vmo->vmo_dir[i];
+	}
+	for (; i<nleaves; i++) {
+		newdir[i] = NULL;
+	}
+
+	if (vmo->vmo_dir != NULL) {
+		kfree(vmo->vmo_dir);
+	}
+	vmo->vmo_dir = newdir;
+	vmo->vmo_ndir = nleaves;
+	return 0;
+}
+
+/*
+ * vm_object_getpage: return the lpage for page INDEX, or NULL if it
+ * is zerofill.
+ */
+struct lpage *
+vm_object_getpage(struct vm_object *vmo, unsigned index)
+{
+	struct lpage **leaf;
+
+	assert(index < vmo->vmo_npages);
+	leaf = vmo->vmo_dir[VMO_LEAF(index)];
+	if (leaf == NULL) {
+		return NULL;
+	}
+	return leaf[VMO_LEAFOFF(index)];
+}
+
+/*
+ * vm_object_getslot: return where the lpage pointer for page INDEX is
+ * kept, allocating its leaf table if need be. Returns an error code.
+ */
+int
+vm_object_getslot(struct vm_object *vmo, unsigned index,
+		  struct lpage ***slotret)
+{
+	struct lpage **leaf;
+	unsigned i;
+
+	assert(index < vmo->vmo_npages);
+	leaf = vmo->vmo_dir[VMO_LEAF(index)];
+	if (leaf == NULL) {
+		leaf = kmalloc(VMO_LEAFBYTES);
+		if (leaf == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<VMO_LEAFPAGES; i++) {
+			leaf[i] = NULL;
+		}
+		vmo->vmo_dir[VMO_LEAF(index)] = leaf;
+	}
+
+	*slotret = &leaf[VMO_LEAFOFF(index)];
+	return 0;
+}
 
 /*
  * vm_object_create: Allocate a new vm_object with nothing in it.
@@ -22,7 +112,6 @@ struct vm_object *
 vm_object_create(size_t npages)
 {
 	struct vm_object *vmo;
-	unsigned i;
 	int result;
 
 	result = swap_reserve(npages);
@@ -36,131 +125,167 @@ vm_object_create(size_t npages)
 		return NULL;
 	}
 
-	vmo->vmo_lpages = array_create();
-	if (vmo->vmo_lpages == NULL) {
-		kfree(vmo);
-		swap_unreserve(npages);
-		return NULL;
-	}
+	vmo->vmo_dir = NULL;
+	vmo->vmo_ndir = 0;
+	vmo->vmo_npages = 0;
+	vmo->vmo_file = NULL;
 
 	vmo->vmo_base = 0xdeadbeef;		/* make sure these */
 	vmo->vmo_lower_redzone = 0xdeafbeef;	/* get filled in later */
 
 	/* add the requested number of zerofilled pages */
-	result = array_setsize(vmo->vmo_lpages, npages);
+	result = vmo_growdir(vmo, npages);
 	if (result) {
-		array_destroy(vmo->vmo_lpages);
 		kfree(vmo);
 		swap_unreserve(npages);
 		return NULL;
 	}
-
-	for (i=0; i<npages; i++) {
-		array_setguy(vmo->vmo_lpages, i, NULL);
-	}
+	vmo->vmo_npages = npages;
 
 	return vmo;
 }
 
 /*
- * vm_object_copy: clone a vm_object.
+ * vm_object_copy: clone a vm_object. The lpages are not copied but
+ * shared copy-on-write, so this takes time proportional to the size
+ * of the object but doesn't touch any pages. Leaf tables that are
+ * empty in the old object are left out of the new one.
  *
- * Synchronization: None; lpage_copy does the hard stuff.
+ * Synchronization: None; lpage_share does the hard stuff.
  */
 int
 vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 	       struct vm_object **ret)
 {
 	struct vm_object *newvmo;
+	struct lpage *lp, **slot;
+	unsigned j;
+	int result;
 
-	struct lpage *newlp, *lp;
-	int j, result;
-
-	newvmo = vm_object_create(array_getnum(vmo->vmo_lpages));
+	newvmo = vm_object_create(vmo->vmo_npages);
 	if (newvmo == NULL) {
 		return ENOMEM;
 	}
 
 	newvmo->vmo_base = vmo->vmo_base;
 	newvmo->vmo_lower_redzone = vmo->vmo_lower_redzone;
+	if (vmo->vmo_file != NULL) {
+		vm_file_ref(vmo->vmo_file);
+		newvmo->vmo_file = vmo->vmo_file;
+	}
 
-	for (j = 0; j < array_getnum(vmo->vmo_lpages); j++) {
-		lp = array_getguy(vmo->vmo_lpages, j);
-		newlp = array_getguy(newvmo->vmo_lpages, j);
-
-		/* new guy should be initialized to all zerofill */
-		assert(newlp == NULL);
+	for (j = 0; j < vmo->vmo_npages; j++) {
+		if (vmo->vmo_dir[VMO_LEAF(j)] == NULL) {
+			/* whole leaf is zerofill; skip to the next */
+			j += VMO_LEAFPAGES - 1 - VMO_LEAFOFF(j);
+			continue;
+		}
 
+		lp = vm_object_getpage(vmo, j);
 		if (lp == NULL) {
-			/* old guy is zerofill too, don't do anything */
+			/* old guy is zerofill, new guy is too */
 			continue;
 		}
 
-		result = lpage_copy(lp, &newlp);
+		result = vm_object_getslot(newvmo, j, &slot);
 		if (result) {
-			goto fail;
+			vm_object_destroy(newas, newvmo);
+			return result;
 		}
-		array_setguy(newvmo->vmo_lpages, j, newlp);
+
+		/* new guy should be initialized to all zerofill */
+		assert(*slot == NULL);
+
+		lpage_share(lp);
+		*slot = lp;
 	}
 
 	*ret = newvmo;
 	return 0;
-
- fail:
-	vm_object_destroy(newas, newvmo);
-	return result;
 }
 
 /*
  * vm_object_setsize: change the size of a vm_object.
  *
+ * Growing only takes a bigger directory, if that; the new pages are
+ * zerofill. Shrinking frees the pages cut off, and any leaf tables
+ * left empty.
+ *
+ * Any of the zerofill pages cut off may have the zero page mapped (see
+ * lpage_zeromap). Rather than look for them, all of AS's mappings are
+ * dropped; the pages still there just take a fault to get them back.
+ *
  * Synchronization: raise spl while freeing pages, so we can call mmu_unmap.
  */
 int
 vm_object_setsize(struct addrspace *as, struct vm_object *vmo, int npages)
 {
-	int i, spl, result;
+	unsigned i, leaf, zerofill, end;
+	int spl, result;
 	struct lpage *lp;
 
 	assert(vmo != NULL);
-	assert(vmo->vmo_lpages != NULL);
+	assert(npages >= 0);
 
-	if (npages < array_getnum(vmo->vmo_lpages)) {
+	if ((unsigned)npages < vmo->vmo_npages) {
 		spl = splhigh();
-		for (i=npages; i<array_getnum(vmo->vmo_lpages); i++) {
-			lp = array_getguy(vmo->vmo_lpages, i);
+		zerofill = 0;
+		for (i=npages; i<vmo->vmo_npages; i++) {
+			leaf = VMO_LEAF(i);
+			if (vmo->vmo_dir[leaf] == NULL) {
+				/* count the rest of the leaf as zerofill */
+				end = (leaf+1) * VMO_LEAFPAGES;
+				if (end > vmo->vmo_npages) {
+					end = vmo->vmo_npages;
+				}
+				zerofill += end - i;
+				i = end - 1;
+				continue;
+			}
+
+			lp = vmo->vmo_dir[leaf][VMO_LEAFOFF(i)];
 			if (lp != NULL) {
 				assert(as != NULL);
 				/* remove any tlb entry for this mapping */
 				mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
 				lpage_destroy(lp);
+				vmo->vmo_dir[leaf][VMO_LEAFOFF(i)] = NULL;
 			}
 			else {
-				swap_unreserve(1);
+				zerofill++;
+			}
+		}
+		if (zerofill > 0) {
+			swap_unreserve(zerofill);
+			if (as != NULL) {
+				mmu_unmapall(as);
+			}
+		}
+
+		/* free leaves that are now entirely past the end */
+		for (leaf = VMO_NLEAVES(npages); leaf < vmo->vmo_ndir; leaf++) {
+			if (vmo->vmo_dir[leaf] != NULL) {
+				kfree(vmo->vmo_dir[leaf]);
+				vmo->vmo_dir[leaf] = NULL;
 			}
 		}
+		vmo->vmo_npages = npages;
 		splx(spl);
-		result = array_setsize(vmo->vmo_lpages, npages);
-		/* shrinking an array shouldn't fail */
-		assert(result==0);
 	}
-	else if (npages > array_getnum(vmo->vmo_lpages)) {
-		int oldsize = array_getnum(vmo->vmo_lpages);
-		unsigned newpages = npages - oldsize;
+	else if ((unsigned)npages > vmo->vmo_npages) {
+		unsigned newpages = npages - vmo->vmo_npages;
 
 		result = swap_reserve(newpages);
 		if (result) {
 			return result;
 		}
 
-		result = array_setsize(vmo->vmo_lpages, npages);
+		result = vmo_growdir(vmo, npages);
 		if (result) {
 			swap_unreserve(newpages);
 			return result;
 		}
-		for (i=oldsize; i<npages; i++) {
-			array_setguy(vmo->vmo_lpages, i, NULL);
-		}
+		vmo->vmo_npages = npages;
 	}
 	return 0;
 }
@@ -177,7 +302,59 @@ vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 
 	result = vm_object_setsize(as, vmo, 0);
 	assert(result==0);
+
+	/* after the lpages, so the vm_file's references go last */
+	if (vmo->vmo_file != NULL) {
+		vm_file_release(vmo->vmo_file);
+	}
 	
-	array_destroy(vmo->vmo_lpages);
+	if (vmo->vmo_dir != NULL) {
+		kfree(vmo->vmo_dir);
+	}
 	kfree(vmo);
 }
+
+/*
+ * vm_object_setfile: make VMO's pages come from VF when first touched,
+ * instead of being zerofilled, for the pages VF has. Takes over the
+ * caller's reference to VF.
+ */
+void
+vm_object_setfile(struct vm_object *vmo, struct vm_file *vf)
+{
+	assert(vmo->vmo_file == NULL);
+	assert(vf->vf_npages == vmo->vmo_npages);
+	vmo->vmo_file = vf;
+}
+
+/*
+ * vm_object_swaphint: suggest a swap address for page INDEX, right
+ * after the page before it or right before the page after it, so that
+ * neighbouring pages can be moved to and from swap together.
+ *
+ * Text pages have no swap, and are skipped.
+ *
+ * Synchronization: none. An lpage's swap address doesn't change once
+ * it has one.
+ */
+off_t
+vm_object_swaphint(struct vm_object *vmo, int index)
+{
+	struct lpage *lp;
+
+	if (index > 0) {
+		lp = vm_object_getpage(vmo, index-1);
+		if (lp != NULL && !LP_ISFILE(lp) &&
+		    lp->lp_swapaddr != INVALID_SWAPADDR) {
+			return lp->lp_swapaddr + PAGE_SIZE;
+		}
+	}
+	if ((unsigned)index+1 < vmo->vmo_npages) {
+		lp = vm_object_getpage(vmo, index+1);
+		if (lp != NULL && !LP_ISFILE(lp) &&
+		    lp->lp_swapaddr != INVALID_SWAPADDR) {
+			return lp->lp_swapaddr - PAGE_SIZE;
+		}
+	}
+	return INVALID_SWAPADDR;
+}
@@ -65,14 +65,42 @@ dodirblock(u_int32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IDBLOCK, which is
+ * LEVELS levels above them.
+ */
+static
+u_int32_t
+doindirect(u_int32_t idblock, int levels)
+{
+	u_int32_t ib[SFS_DBPERIDB];
+	u_int32_t block, nblocks=0;
+	int i;
+
+	diskread(&ib, idblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block==0) {
+			continue;
+		}
+		if (levels > 1) {
+			nblocks += doindirect(block, levels-1);
+		}
+		else {
+			dodirblock(block);
+			nblocks++;
+		}
+	}
+	return nblocks;
+}
+
 static
 void
 dumpdir(u_int32_t ino)
 {
 	struct sfs_inode sfi;
-	u_int32_t ib[SFS_DBPERIDB];
 	int nentries, i;
-	u_int32_t block, nblocks=0;
+	u_int32_t block, len, j, nblocks=0;
 
 	diskread(&sfi, ino);
 
@@ -82,22 +110,26 @@ dumpdir(u_int32_t ino)
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
 
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = SWAPL(sfi.sfi_direct[i]);
-		if (block) {
-			dodirblock(block);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		block = SWAPL(sfi.sfi_extents[i].se_start);
+		len = SWAPL(sfi.sfi_extents[i].se_len);
+		if (len==0) {
+			break;
+		}
+		printf("    extent %d: blocks %u-%u\n", i, block, block+len-1);
+		for (j=0; j<len; j++) {
+			dodirblock(block+j);
 			nblocks++;
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		nblocks += doindirect(SWAPL(sfi.sfi_indirect), 1);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		nblocks += doindirect(SWAPL(sfi.sfi_dindirect), 2);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		nblocks += doindirect(SWAPL(sfi.sfi_tindirect), 3);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
@@ -74,7 +74,8 @@ writerootdir(void)
 	sfi.sfi_size = SWAPL(sizeof(struct sfs_dir) * 2);
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(2);
-	sfi.sfi_direct[0] = SWAPL(rootdir_data_block);
+	sfi.sfi_extents[0].se_start = SWAPL(rootdir_data_block);
+	sfi.sfi_extents[0].se_len = SWAPL(1);
 
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 
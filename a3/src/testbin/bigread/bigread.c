@@ -0,0 +1,149 @@
+/*
+ * Read a file back in large, block-aligned pieces.
+ *
+ * Writes a file several times the size of the buffer cache, then
+ * reads it back from the start, 32k at a time, into a page-aligned
+ * buffer that hasn't been touched yet. By then the blocks written
+ * first have left the cache, so SFS should read them straight from
+ * the disk into the program's pages. Then checks what came back.
+ *
+ * The start of the file is written from a buffer that has never been
+ * touched either, and should read back as zeros.
+ *
+ * Needs SFS; run it on a mounted SFS volume.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGESIZE  4096
+#define FILESIZE  (256*1024)
+#define IOSIZE    (32*1024)
+#define ZEROSIZE  (16*1024)
+
+static char zerobuf[ZEROSIZE];			/* never touched */
+static int writebuf[IOSIZE/sizeof(int)];
+static char readspace[FILESIZE+PAGESIZE];	/* not touched until read */
+
+static
+void
+writefile(const char *filename)
+{
+	int fd, pos, len, i, r;
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+
+	r = write(fd, zerobuf, ZEROSIZE);
+	if (r < 0) {
+		err(1, "%s: write", filename);
+	}
+	if (r != ZEROSIZE) {
+		errx(1, "%s: short write of zeros (%d bytes)", filename, r);
+	}
+
+	for (pos = ZEROSIZE; pos < FILESIZE; pos += len) {
+		len = FILESIZE - pos;
+		if (len > IOSIZE) {
+			len = IOSIZE;
+		}
+		for (i=0; i < len/(int)sizeof(int); i++) {
+			writebuf[i] = pos/sizeof(int) + i;
+		}
+		r = write(fd, writebuf, len);
+		if (r < 0) {
+			err(1, "%s: write", filename);
+		}
+		if (r != len) {
+			errx(1, "%s: short write at %d (%d bytes)",
+			     filename, pos, r);
+		}
+	}
+
+	close(fd);
+}
+
+static
+void
+readfile(const char *filename, char *buf)
+{
+	int fd, pos, r;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", filename);
+	}
+
+	for (pos = 0; pos < FILESIZE; pos += r) {
+		r = read(fd, buf+pos, IOSIZE);
+		if (r < 0) {
+			err(1, "%s: read at %d", filename, pos);
+		}
+		if (r == 0) {
+			errx(1, "%s: unexpected EOF at %d", filename, pos);
+		}
+	}
+
+	r = read(fd, buf, IOSIZE);
+	if (r < 0) {
+		err(1, "%s: read at EOF", filename);
+	}
+	if (r != 0) {
+		errx(1, "%s: read %d bytes past EOF", filename, r);
+	}
+
+	close(fd);
+}
+
+static
+void
+checkfile(const char *buf)
+{
+	const int *words;
+	int i;
+
+	for (i=0; i<ZEROSIZE; i++) {
+		if (buf[i] != 0) {
+			errx(1, "byte %d: %d, should be 0", i, buf[i]);
+		}
+	}
+
+	words = (const int *)buf;
+	for (i = ZEROSIZE/sizeof(int); i < FILESIZE/(int)sizeof(int); i++) {
+		if (words[i] != i) {
+			errx(1, "word %d: %d, should be %d", i, words[i], i);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename;
+	char *buf;
+
+	if (argc > 2) {
+		errx(1, "Usage: bigread [filename]");
+	}
+	filename = argc == 2 ? argv[1] : "bigread.dat";
+
+	buf = (char *)(((unsigned long)readspace + PAGESIZE - 1) &
+		       ~(unsigned long)(PAGESIZE - 1));
+
+	printf("Writing %d bytes to %s\n", FILESIZE, filename);
+	writefile(filename);
+
+	printf("Reading them back %d at a time\n", IOSIZE);
+	readfile(filename, buf);
+	checkfile(buf);
+
+	remove(filename);
+
+	printf("Passed bigread.\n");
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * ctxbench - lots of context switches between small processes.
+ *
+ * Forks several children that each multiply two small matrices over
+ * and over, yielding the processor to each other on every clock tick.
+ * Each one only touches a few pages, so together they fit in the TLB;
+ * how often those pages have to be entered again depends on whether
+ * the TLB is flushed on every switch. Run it from the kernel menu's
+ * tlb1 command to see the TLB refill counts.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define NPROCS	8
+#define NROUNDS	40
+#define Dim	24	/* each matrix is a bit over half a page */
+
+static int A[Dim][Dim];
+static int B[Dim][Dim];
+static int C[Dim][Dim];
+
+static
+unsigned long
+now_usecs(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return secs*1000000 + nsecs/1000;
+}
+
+/*
+ * Multiply A by the identity NROUNDS times; C should come out as A.
+ */
+static
+int
+multiply(void)
+{
+	int i, j, k, r;
+
+	for (i=0; i<Dim; i++) {
+		for (j=0; j<Dim; j++) {
+			A[i][j] = i + j;
+			B[i][j] = (i == j);
+		}
+	}
+
+	for (r=0; r<NROUNDS; r++) {
+		for (i=0; i<Dim; i++) {
+			for (j=0; j<Dim; j++) {
+				C[i][j] = 0;
+				for (k=0; k<Dim; k++) {
+					C[i][j] += A[i][k] * B[k][j];
+				}
+			}
+		}
+	}
+
+	for (i=0; i<Dim; i++) {
+		for (j=0; j<Dim; j++) {
+			if (C[i][j] != i + j) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+int
+main(void)
+{
+	unsigned long before, after;
+	int pids[NPROCS];
+	int i, status, failures = 0;
+
+	before = now_usecs();
+	for (i=0; i<NPROCS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			_exit(multiply());
+		}
+	}
+
+	for (i=0; i<NPROCS; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (status != 0) {
+			failures++;
+		}
+	}
+	after = now_usecs();
+
+	if (failures) {
+		errx(1, "%d of %d processes got the wrong answer",
+		     failures, NPROCS);
+	}
+	printf("ctxbench: %d processes, %lu us\n", NPROCS, after - before);
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * forkbench - measure how long fork takes.
+ *
+ * For each of several sizes, the parent first writes to that much of
+ * a big array, so that much of its memory is resident and dirty, and
+ * then times a series of fork/_exit/waitpid round trips. With
+ * copy-on-write fork the time per fork should hardly depend on the
+ * size; with fork copying the address space it grows with it.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#define NFORKS	20
+#define PAGE	4096
+#define MAXSIZE	(256*1024)
+
+static char bigarray[MAXSIZE];
+
+static const unsigned sizes[] = {
+	0,
+	16*1024,
+	64*1024,
+	MAXSIZE,
+};
+#define NSIZES (sizeof(sizes)/sizeof(sizes[0]))
+
+static
+unsigned long
+now_usecs(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return secs*1000000 + nsecs/1000;
+}
+
+static
+void
+touch(unsigned size)
+{
+	unsigned i;
+
+	for (i=0; i<size; i+=PAGE) {
+		bigarray[i] = i/PAGE;
+	}
+}
+
+static
+unsigned long
+timeforks(void)
+{
+	unsigned long before, after;
+	int i, pid, status;
+
+	before = now_usecs();
+	for (i=0; i<NFORKS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	after = now_usecs();
+
+	return (after - before) / NFORKS;
+}
+
+int
+main(void)
+{
+	unsigned i;
+
+	for (i=0; i<NSIZES; i++) {
+		touch(sizes[i]);
+		printf("forkbench: %6u bytes touched: %lu us per fork\n",
+		       sizes[i], timeforks());
+	}
+
+	/* Check that the array survived all the forking */
+	for (i=0; i<MAXSIZE; i+=PAGE) {
+		if (bigarray[i] != (char)(i/PAGE)) {
+			errx(1, "bigarray[%u] is wrong", i);
+		}
+	}
+
+	printf("forkbench: done\n");
+	return 0;
+}